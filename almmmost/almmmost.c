@@ -25,10 +25,13 @@
  *
  */
 
+#define _GNU_SOURCE		// struct ucred
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -38,6 +41,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
+#include <stdarg.h>
 
 #include <ini.h>
 
@@ -48,6 +52,14 @@
 #include "almmmost_device.h"
 #include "almmmost_osload.h"
 #include "almmmost_file.h"
+#include "almmmost_cache.h"
+#include "almmmost_cluster.h"
+#include "almmmost_repl.h"
+#include "almmmost_control.h"
+#include "almmmost_dirindex.h"
+#include "almmmost_spool.h"
+#include "almmmost_fetch.h"
+#include "almmmost_urlcache.h"
 #include "almmmost_misc.h"
 #include "almmmost_special.h"
 #include "almmmost_cmdline.h"
@@ -58,26 +70,28 @@ int mmm_numdisks;
 int mmm_maxdirs;
 int alm_do_abort = 0;
 int alm_do_locate = 0;
+volatile int alm_do_quit = 0;
+volatile int alm_do_reload = 0;
+int alm_reloading = 0;
+const char *alm_config_file = NULL;
+int alm_print_fd = 1;
+unsigned long alm_request_serial = 0;
 
-struct user_port_data_t userinfo[MAXUSER];
+struct user_port_data_t *userinfo = NULL;
+static struct user_port_data_t *reload_ports = NULL;	// [Port n] settings being reloaded
 
 int main(int argc, char **argv) {
 
-	int retval, i, j, lastport, reqport=-1;
+	int retval, i, lastport, reqport=-1;
 	unsigned char reqbuf[BUFFER_SIZE];
 	struct timeval curtime;
-	unsigned long request_serial = 0;
 
 	struct INI *ini;
 
 	memset(reqbuf, 0, BUFFER_SIZE);
 
-	for (i=0; i<MAXUSER; i++) {
-		for (j=0; j<MAXDISK; j++) {
-			userinfo[i].drive_dir[j] = -1;
-		}
-			userinfo[i].defdrive = -1;
-	}
+	// Lines go out as they're printed, in order with safe_print()'s
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
 	if (argc != 2) {
 		printf("Usage: %s <config.ini>\n", argv[0]);
@@ -87,11 +101,20 @@ int main(int argc, char **argv) {
 	/* Initialize variables in modules */
 	alm_dev_init();
 	alm_img_init();
+	alm_cache_init();
 	alm_osl_init();
 	alm_file_init();
 	alm_special_init();
+	alm_urlcache_init();
+	alm_fetch_init();
+	alm_cluster_init();
+	alm_repl_init();
+	alm_ctl_init();
+	alm_dix_init();
+	alm_spool_init();
 
 	/* Process config file */
+	alm_config_file = argv[1];
 	ini = ini_open(argv[1]);
 	parse_args(ini);
 	ini_close(ini);
@@ -99,23 +122,47 @@ int main(int argc, char **argv) {
 	/* Modify OS images to have appropriate drive info */
 	alm_osl_tailor_images();
 
-	/* Load block allocation maps for public drives */
+	/* Check and rebuild block maps off to the side */
+	alm_dix_start();
+
+	/* Print spooled jobs off to the side */
+	alm_spool_start();
+
+	/* Load block allocation maps for public drives, unless the cluster
+	 * coordinator has them, or we're a standby and they'll change under us */
 	for (i=0; i<mmm_numdisks; i++) {
-		if (drvparam[i].public_private == PUBLDIR)
+		if (drvparam[i].public_private == PUBLDIR && alm_cluster_role != CLUSTER_NODE
+				&& alm_repl_role != REPL_STANDBY)
 			alm_file_loadbam(i);
 	}
 
+	/* Listen for cluster nodes, or find the coordinator */
+	alm_cluster_start();
+
+	/* Set up the log for a standby, or wait for a primary */
+	alm_repl_start();
+
 	/* Print generated values for debugging fun and excitement */
 	//alm_osl_print_imginfo();
 	//alm_osl_savemodifiedos(4,"/tmp/USERCPM4.out");
 	
-	/* Add ^C handler */
+	/* Listen for control connections */
+	alm_ctl_start();
+
+	/* Add ^C handler. With a control socket ^C just shuts down cleanly,
+	 * otherwise it brings up the command line */
 	struct sigaction sa_int;
-	sa_int.sa_handler = alm_cmd_sigint;
+	sa_int.sa_handler = alm_ctl_running() ? alm_cmd_sigquit : alm_cmd_sigint;
 	sa_int.sa_flags = 0;
 	sigemptyset(&sa_int.sa_mask);
 	sigaction(SIGINT, &sa_int, NULL);
 
+	/* SIGHUP re-reads the config file */
+	struct sigaction sa_hup;
+	sa_hup.sa_handler = alm_cmd_sighup;
+	sa_hup.sa_flags = 0;
+	sigemptyset(&sa_hup.sa_mask);
+	sigaction(SIGHUP, &sa_hup, NULL);
 
 	do { /* Main loop */
 
@@ -125,7 +172,7 @@ int main(int argc, char **argv) {
 		// Do a small delay to fix ghost CTS
 		usleep(45);
 		//gettimeofday(&curtime, NULL);
-		//printf("%s.%03ld (%lu): waiting for CTS...", ctime(&curtime.tv_sec), curtime.tv_usec/1000, request_serial);
+		//printf("%s.%03ld (%lu): waiting for CTS...", ctime(&curtime.tv_sec), curtime.tv_usec/1000, alm_request_serial);
 		do {
 			for (i=0; i<alm_dev_ports; i++) {
 				// Start with port # after the last one serviced
@@ -140,7 +187,29 @@ int main(int argc, char **argv) {
 					alm_do_abort = 0;
 				}
 			}
-		} while (reqport < 0);
+			// Keep booting ports' OS images going
+			alm_osl_send_pending();
+			// Answer reads that were waiting on special file data
+			alm_file_poll();
+			// Write out delayed image writes while nothing else is happening
+			alm_cache_flush_idle();
+			// Serve other cluster nodes, or send them what's queued
+			alm_cluster_poll();
+			// Stream public drive writes to the standby, or apply them
+			alm_repl_poll();
+			// Run commands from the control socket
+			alm_ctl_poll();
+			// Put block maps built in the background in place
+			alm_dix_poll();
+			// Swap in a new config between requests
+			if (alm_do_reload) {
+				alm_do_reload = 0;
+				alm_reload();
+			}
+		} while (reqport < 0 && !alm_do_quit);
+
+		if (reqport < 0)
+			break;
 
 
 		errno = 0;
@@ -159,6 +228,10 @@ int main(int argc, char **argv) {
 			alm_dev_reset(reqport);
 			continue;
 		} 	
+		// A port asking for something isn't waiting for the rest of its OS any more
+		alm_osl_stop(reqport);
+		// Or for a held read
+		alm_file_unhold(reqport);
 		if (reqbuf[0] == TVSP_SOR1) {
 			// SOR1 = OS request
 			switch (reqbuf[1]) {
@@ -208,15 +281,28 @@ int main(int argc, char **argv) {
 				print_hex(reqbuf, TVSP_REQ_SZ);
 			}
 		}
-		request_serial++;
+		alm_request_serial++;
 
-	} while (1);
+	} while (!alm_do_quit);
+
+	/* Save open files before the modules close */
+	alm_file_sync();
 
 
+	alm_ctl_exit();
+	alm_cluster_exit();
+	alm_repl_exit();
+	alm_fetch_exit();
+	alm_urlcache_exit();
+	alm_spool_exit();
 	alm_file_exit();
+	alm_cache_exit();
+	alm_dix_exit();
 	alm_img_exit();
 	alm_osl_exit();
 	alm_dev_exit();
+	free(userinfo);
+	userinfo = NULL;
 
 	return 0;
 }
@@ -265,8 +351,17 @@ void print_cpm_filename(uint8_t *fname, uint8_t *ext) {
 
 }
 
+/* Sections a reload reads again. The rest size tables, open images or start
+ * threads and sockets, and need a restart.
+ */
+static int alm_reloadable(const char *buf) {
+
+	return !strncasecmp(buf, "General", 7) || !strncasecmp(buf, "Client", 6)
+		|| !strncasecmp(buf, "Port", 4) || !strncasecmp(buf, "Special", 7);
+}
+
 /* Main function to handle sections in INI file */
-void parse_args(struct INI *ini) {
+int parse_args(struct INI *ini) {
 
 	const char *buf;
 	size_t sectlen;
@@ -274,28 +369,53 @@ void parse_args(struct INI *ini) {
 
 	if (!ini) {
 		printf("Error opening configuration file.\n");
+		if (alm_reloading)
+			return -1;
 		exit(1);
 	}
 
 	do {
 		retval = ini_next_section(ini, &buf, &sectlen);
 		if (!retval)
-			return;
+			return 0;
 		if (retval < 0) {
 			printf("Reading INI error: %d\n", retval);
+			if (alm_reloading)
+				return -1;
 			exit(1);
 		}
 
-		if (!strncasecmp(buf, "General", 7)) {
+		if (alm_reloading && !alm_reloadable(buf)) {
+			continue;
+		} else if (!strncasecmp(buf, "General", 7)) {
 			alm_gen_ini(ini, buf, sectlen); /* Parse general parameters */
 		} else if (!strncasecmp(buf, "Device", 6)) {
 			alm_dev_ini(ini, buf, sectlen); /* Parse device info */
+			alm_port_alloc(); /* Size per-port tables to match */
 		} else if (!strncasecmp(buf, "Client", 6)) {
 			alm_osl_ini(ini, buf, sectlen); /* Parse client section */
 		} else if (!strncasecmp(buf, "Disk", 4)) {
 			alm_img_ini(ini, buf, sectlen); /* Parse image info */
 		} else if (!strncasecmp(buf, "Port", 4)) {
 			alm_port_ini(ini, buf, sectlen); /* Parse user port config info */
+		} else if (!strncasecmp(buf, "Cache", 5)) {
+			alm_cache_ini(ini, buf, sectlen); /* Parse buffer cache settings */
+		} else if (!strncasecmp(buf, "Special", 7)) {
+			alm_special_ini(ini, buf, sectlen); /* Parse special file settings */
+		} else if (!strncasecmp(buf, "Fetch", 5)) {
+			alm_fetch_ini(ini, buf, sectlen); /* Parse URL fetch settings */
+		} else if (!strncasecmp(buf, "URL Cache", 9)) {
+			alm_urlcache_ini(ini, buf, sectlen); /* Parse URL cache settings */
+		} else if (!strncasecmp(buf, "Cluster", 7)) {
+			alm_cluster_ini(ini, buf, sectlen); /* Parse cluster settings */
+		} else if (!strncasecmp(buf, "Replication", 11)) {
+			alm_repl_ini(ini, buf, sectlen); /* Parse standby settings */
+		} else if (!strncasecmp(buf, "Control", 7)) {
+			alm_ctl_ini(ini, buf, sectlen); /* Parse control socket settings */
+		} else if (!strncasecmp(buf, "Dir Index", 9)) {
+			alm_dix_ini(ini, buf, sectlen); /* Parse sidecar file settings */
+		} else if (!strncasecmp(buf, "Spool", 5)) {
+			alm_spool_ini(ini, buf, sectlen); /* Parse print spooler settings */
 		}
 	} while (1);
 
@@ -334,22 +454,53 @@ void alm_gen_ini(struct INI *ini, const char *buf, size_t sectlen) {
 	} while (1);
 }
 
+/* Allocate the per-port tables, once [Device] has set the number of ports */
+void alm_port_alloc() {
+
+	int i, j;
+
+	if (userinfo || alm_dev_ports <= 0)
+		return;
+
+	userinfo = calloc(alm_dev_ports, sizeof(struct user_port_data_t));
+	if (!userinfo) {
+		perror("Allocating port info");
+		exit(1);
+	}
+	for (i=0; i<alm_dev_ports; i++) {
+		for (j=0; j<MAXDISK; j++) {
+			userinfo[i].drive_dir[j] = -1;
+		}
+		userinfo[i].defdrive = -1;
+		userinfo[i].priv_dir = -1;
+		userinfo[i].spooldrv = -1;
+	}
+
+	alm_file_setports(alm_dev_ports);
+	alm_osl_setports(alm_dev_ports);
+	alm_special_setports(alm_dev_ports);
+	alm_spool_setports(alm_dev_ports);
+}
+
 /* Parse Port INI section */
 void alm_port_ini(struct INI *ini, const char *buf, size_t sectlen) {
 
 	char *section;
 	int retval;
 	int portnum;
+	struct user_port_data_t *ui;
 
 	section=alloca(sectlen + 1);
 	string_copy(section, buf, sectlen);
 
 	//printf("Evaluating section %s:\n", section);
 	portnum = strtol(section + 5, NULL, 0);
-	if (portnum > MAXUSER) {
-		printf("Port # greater than max user: %d", MAXUSER);
+	if (portnum < 0 || portnum >= alm_dev_ports) {
+		printf("Port %d >= Ports in [Device] %d, check config file.\n", portnum, alm_dev_ports);
 		return;
 	}
+	// A reload sets these aside, alm_reload() puts them in place
+	ui = alm_reloading ? &reload_ports[portnum] : &userinfo[portnum];
 
 	do {
 		const char *kbuf, *vbuf;
@@ -364,18 +515,113 @@ void alm_port_ini(struct INI *ini, const char *buf, size_t sectlen) {
 		}
 
 		if (!strncasecmp(kbuf, "Autologon", 9)) {
-			userinfo[portnum].autologon = !strncasecmp(vbuf,"y",1);
-			//printf("Autologon = %d\n", userinfo[portnum].autologon);
+			ui->autologon = !strncasecmp(vbuf,"y",1);
+			//printf("Autologon = %d\n", ui->autologon);
 		} else if (!strncasecmp(kbuf, "Private Dir", 11)) {
 			int i;
 			int pdir = strtol(vbuf, NULL,0);
 			//printf("Private Dir = %d\n", pdir);
-			for (i=0;i<MAXDISK;i++)
-				userinfo[portnum].drive_dir[i] = pdir;
+			ui->priv_dir = pdir;
+			for (i=0;i<MAXDISK && !alm_reloading;i++)
+				ui->drive_dir[i] = pdir;
+		} else if (!strncasecmp(kbuf, "Spool Drive", 11)) {
+			ui->spooldrv = strtol(vbuf, NULL,0);
+		} else if (!strncasecmp(kbuf, "Disks", 5)) {
+			// Only the first n drives show up on this port
+			ui->numdisks = strtol(vbuf, NULL,0);
+			if (ui->numdisks < 0)
+				ui->numdisks = 0;
+		} else if (!strncasecmp(kbuf, "Search Data", 11)) {
+			// Only for clients whose BDOS takes the directory record back
+			ui->searchdata = !strncasecmp(vbuf,"y",1);
 		}
 	} while (1);
 }
 
+/* Re-read the config file and swap in new OS images and port settings,
+ * returns -1 and keeps the old ones if something's wrong with it. Disk
+ * geometry and the number of ports stay as they are, so open files and
+ * logged in ports carry on.
+ */
+int alm_reload() {
+
+	struct INI *ini;
+	int old_genrev = mmm_genrev;
+	int old_spooldrv = mmm_spooldrv;
+	int retval, i, j;
+
+	alm_printf("Reloading %s\n", alm_config_file);
+	ini = ini_open(alm_config_file);
+	if (!ini) {
+		alm_printf("Error opening configuration file, keeping the old one.\n");
+		return -1;
+	}
+
+	reload_ports = calloc(alm_dev_ports ? alm_dev_ports : 1, sizeof(struct user_port_data_t));
+	if (!reload_ports) {
+		perror("Allocating port info");
+		exit(1);
+	}
+	for (i=0; i<alm_dev_ports; i++) {
+		reload_ports[i].priv_dir = -1;
+		reload_ports[i].spooldrv = -1;
+	}
+
+	alm_osl_reload_begin();
+	alm_special_reload_begin();
+
+	alm_reloading = 1;
+	retval = parse_args(ini);
+	alm_reloading = 0;
+	ini_close(ini);
+
+	if (!retval) {
+		alm_osl_tailor_images();
+		retval = alm_osl_reload_check();
+	}
+
+	if (retval < 0) {
+		alm_printf("Reload failed, keeping the old configuration.\n");
+		mmm_genrev = old_genrev;
+		mmm_spooldrv = old_spooldrv;
+		alm_osl_reload_end(0);
+		alm_special_reload_end(0);
+		free(reload_ports);
+		reload_ports = NULL;
+		return -1;
+	}
+
+	alm_osl_reload_end(1);
+	alm_special_reload_end(1);
+
+	// Ports that logged on to another directory stay there
+	for (i=0; i<alm_dev_ports; i++) {
+		struct user_port_data_t *ui = &userinfo[i];
+
+		if (ui->autologon != reload_ports[i].autologon)
+			alm_printf("Port %d Autologon %s\n", i, reload_ports[i].autologon ? "on" : "off");
+		ui->autologon = reload_ports[i].autologon;
+		ui->spooldrv = reload_ports[i].spooldrv;
+		ui->numdisks = reload_ports[i].numdisks;
+		ui->searchdata = reload_ports[i].searchdata;
+
+		if (ui->priv_dir == reload_ports[i].priv_dir)
+			continue;
+		alm_printf("Port %d Private Dir %d -> %d\n", i, ui->priv_dir, reload_ports[i].priv_dir);
+		for (j=0; j<MAXDISK; j++) {
+			if (ui->drive_dir[j] == (unsigned int)ui->priv_dir)
+				ui->drive_dir[j] = reload_ports[i].priv_dir;
+		}
+		ui->priv_dir = reload_ports[i].priv_dir;
+	}
+	free(reload_ports);
+	reload_ports = NULL;
+
+	alm_printf("Reloaded %s\n", alm_config_file);
+
+	return 0;
+}
+
 /* Copy a string for a max len, and ensure it's null terminated */
 void string_copy(char *dest, const char *src, size_t len) {
 	
@@ -384,6 +630,86 @@ void string_copy(char *dest, const char *src, size_t len) {
 
 }
 
+/* Listen on a Unix socket at path, non-blocking. A missing directory for it
+ * is made private to us, and what's already at path is only replaced if it's
+ * a socket nothing is listening on any more.
+ */
+int alm_sock_listen(const char *path, int backlog) {
+
+	struct sockaddr_un addr;
+	struct stat st;
+	char dir[sizeof(addr.sun_path)], *slash;
+	int fd, retval;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Socket name %s too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	if (slash && slash != dir) {
+		*slash = 0;
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			printf("Can't make %s: %s\n", dir, strerror(errno));
+			return -1;
+		}
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Socket");
+		return -1;
+	}
+
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printf("%s is in the way, it isn't a socket\n", path);
+			close(fd);
+			return -1;
+		}
+		retval = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		if (!retval || errno != ECONNREFUSED) {
+			printf("%s is in use\n", path);
+			close(fd);
+			return -1;
+		}
+		// Left over from a server that died, and connect() used up fd
+		close(fd);
+		unlink(path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("Socket");
+			return -1;
+		}
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 ||
+			listen(fd, backlog) < 0) {
+		printf("Can't listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+/* 1 if the other end of a Unix socket is root or our own user */
+int alm_sock_peerok(int fd) {
+
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+
+	return (cred.uid == 0 || cred.uid == geteuid());
+}
+
 /* Convert endianness between Z80 and server as necessary */
 /* Can be called from signal handler */
 void set_zint16(uint8_t *dest, uint16_t value) {
@@ -442,14 +768,13 @@ int print_direntry(void *direntry, int disk) {
 	return 0;
 }
 
-#define STDOUT (1)
 #define STDIN (0)
 
 /* Can be called from signal handler */
 int safe_print(char *buffer) {
 
 	int len = strlen(buffer);
-	write(STDOUT, buffer, len);
+	write(alm_print_fd, buffer, len);
 	return 0;
 }
 
@@ -460,7 +785,7 @@ int safe_print_num(int i) {
 
 	if ((i/10) != 0)
 		safe_print_num(i/10);
-	write(STDOUT, &digit, 1);
+	write(alm_print_fd, &digit, 1);
 	return 0;
 }
 
@@ -473,11 +798,32 @@ int safe_print_hex(int i) {
 		digit += 7; // Convert to letters
 
 	if ((i>>4) != 0)
-		safe_print_num(i>>4);
-	write(STDOUT, &digit, 1);
+		safe_print_hex(i>>4);
+	write(alm_print_fd, &digit, 1);
 	return 0;
 }
 
+/* printf() for command output, which goes to alm_print_fd along with
+ * safe_print()'s. Not for signal handlers.
+ */
+int alm_printf(const char *fmt, ...) {
+
+	char buffer[INPBUFSIZE * 2];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return len;
+	if (len >= (int)sizeof(buffer))
+		len = sizeof(buffer) - 1;
+	fflush(stdout);
+	write(alm_print_fd, buffer, len);
+	return len;
+}
+
 /* Can be called from signal handler */
 int safe_get_buf(char *buffer, int len) {
 
@@ -486,7 +832,7 @@ int safe_get_buf(char *buffer, int len) {
 	if (!len || !buffer)
 		return 0;
 	do {
-		if (!read(STDOUT, buffer + i, 1)) {
+		if (!read(STDIN, buffer + i, 1)) {
 			break;
 		}
 		i++;
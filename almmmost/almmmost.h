@@ -169,9 +169,15 @@ struct cpm_direntry_t {
 
 #define DIRENTRYSIZE (32)
 
-#define MAXDISK (6)
-#define MAXDIRS (32)
-#define MAXUSER (16)
+/* Upper limits, the tables themselves are sized from the config file:
+ * ports by Ports in [Device], disks by Num Disks and directories by
+ * Max Priv Dirs in [Disks]. One server only drives the TVI_SDLC_NUM_PORTS
+ * of its board stack; MAXUSER is port numbers across a [Cluster].
+ */
+#define MAXDISK (16)	// CP/M drives A: to P:
+#define MAXDIRS (256)
+#define MAXUSER (64)	// Processor IDs sent to clients are 6 bits
+#define DEFDIRS (32)	// Private directories if Max Priv Dirs isn't set
 #define MAXBLKS (65536)
 #define MAXFILES (65024)
 #define RECSIZE (128)
@@ -185,17 +191,28 @@ struct cpm_direntry_t {
 #define NUMFILES (1024)
 #define WRITEDELAY (1000)
 #define INPBUFSIZE (1024)
+#define RUNDIR "/run/almmmost"	// Default home of the server's sockets, made 0700
 
 struct user_port_data_t {
 	unsigned int drive_dir[MAXDISK];
 	int autologon;
 	int defdrive;
+	int priv_dir;		// Private Dir from the config file, -1 if none
+	int spooldrv;		// Spool Drive for this port, -1 for the [General] one
+	int numdisks;		// Drives this port's OS image has, 0 for all of them
+	int searchdata;		// Client takes Search First/Next directory records in a data phase
 };
 
-extern struct user_port_data_t userinfo[];
+extern struct user_port_data_t *userinfo;
 
 extern int alm_do_abort; // Set to 1 if we should abort waiting on the client, and reset to 0 after abort
 extern int alm_do_locate; // Set to 1 to locate what do/while loop we are spinning in
+extern volatile int alm_do_quit; // Set to 1 to leave the main loop and shut down cleanly
+extern volatile int alm_do_reload; // Set to 1 to re-read the config file from the main loop
+extern int alm_reloading; // Set while the config file is being re-read
+extern const char *alm_config_file;
+extern int alm_print_fd; // Where safe_print() output goes, stdout or a control command's output file
+extern unsigned long alm_request_serial; // Requests served
 extern int mmm_genrev;
 extern int mmm_spooldrv;
 extern int mmm_numdisks;// Number of remote disks
@@ -210,18 +227,34 @@ void print_safe_ascii(unsigned char *buffer, int count);
 /* Print a filename from an FCB, directory entry, etc in 8.3 format */
 void print_cpm_filename(uint8_t *fname, uint8_t *ext);
 
-/* Main function to handle sections in INI file */
-void parse_args(struct INI *ini);
+/* Main function to handle sections in INI file, returns -1 on an error
+ * when reloading
+ */
+int parse_args(struct INI *ini);
+
+/* Re-read the config file and swap in new OS images and port settings,
+ * returns -1 and keeps the old ones if something's wrong with it
+ */
+int alm_reload();
 
 /* Parse General INI section */
 void alm_gen_ini(struct INI *ini, const char *buf, size_t sectlen);
 
+/* Allocate the per-port tables, once [Device] has set the number of ports */
+void alm_port_alloc();
+
 /* Parse Port INI section */
 void alm_port_ini(struct INI *ini, const char *buf, size_t sectlen);
 
 /* Copy a string for a max len, and ensure it's null terminated */
 void string_copy(char *dest, const char *src, size_t len);
 
+/* Listen on a Unix socket, replacing one left by a server that died */
+int alm_sock_listen(const char *path, int backlog);
+
+/* Whether who's connected to a socket is root or the server's own user */
+int alm_sock_peerok(int fd);
+
 /* Convert endianness between Z80 and server as necessary */
 uint16_t get_zint16(uint8_t *src);
 void set_zint16(uint8_t *dest, uint16_t value);
@@ -240,6 +273,9 @@ int safe_print_hex(int i);
 
 int safe_get_buf(char *buffer, int len);
 
+/* printf() to where safe_print() output goes, not for signal handlers */
+int alm_printf(const char *fmt, ...);
+
 /* Convert file name from FCB/directory entry to 8.3 string */
 int get_pretty_filename(char *dest, uint8_t *fname, uint8_t *fext);
 
@@ -0,0 +1,550 @@
+/* almmmost_cache.c: The shared image buffer cache module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_image.h"
+#include "almmmost_cache.h"
+#include "almmmost_repl.h"
+#include "almmmost_dirindex.h"
+
+/* Every image read and write, from the BIOS sector path and the BDOS file
+ * path, comes through here so they share one copy of hot records (public
+ * directories especially) and always see each other's writes.
+ *
+ * Entries are replaced with the CLOCK algorithm: each access sets the
+ * entry's reference bit, and the hand clears bits until it finds an entry
+ * that hasn't been used since the last pass. In write back mode dirty
+ * records are written out in contiguous runs on eviction, sync, close, or
+ * once they have waited alm_cache_flush_secs.
+ */
+
+int alm_cache_size = CACHE_DEFAULT_SIZE * 1024;
+int alm_cache_writeback = 1;
+int alm_cache_flush_secs = CACHE_DEFAULT_FLUSH;
+int alm_cache_dirtyents = 0;
+struct cache_stats_t alm_cache_stats;
+
+struct cache_ent_t **alm_cache_ents = NULL;	// All entries, in CLOCK order
+int alm_cache_nents = 0;
+int alm_cache_maxents = 0;
+int alm_cache_hand = 0;
+int alm_cache_used = 0;				// Bytes of entry data allocated
+struct cache_ent_t *alm_cache_hashtbl[CACHE_HASHSIZE];
+
+int alm_cache_init() {
+
+	memset(alm_cache_hashtbl, 0, sizeof(alm_cache_hashtbl));
+	memset(&alm_cache_stats, 0, sizeof(alm_cache_stats));
+	alm_cache_ents = NULL;
+	alm_cache_nents = alm_cache_maxents = 0;
+	alm_cache_hand = 0;
+	alm_cache_used = 0;
+	alm_cache_dirtyents = 0;
+
+	return 0;
+}
+
+int alm_cache_exit() {
+
+	int i;
+
+	alm_cache_flush(-1, -1);
+	for (i=0; i<alm_cache_nents; i++) {
+		free(alm_cache_ents[i]->data);
+		free(alm_cache_ents[i]);
+	}
+	if (alm_cache_ents)
+		free(alm_cache_ents);
+
+	return alm_cache_init();
+}
+
+int alm_cache_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Size", 4)) {
+			// Memory budget in KB, 0 turns the cache off
+			alm_cache_size = strtol(vbuf, NULL, 0) * 1024;
+			if (alm_cache_size < 0)
+				alm_cache_size = 0;
+		} else if (!strncasecmp(kbuf, "Write Back", 10)) {
+			alm_cache_writeback = ((vbuf[0] & 0x5F) == 'Y');
+		} else if (!strncasecmp(kbuf, "Flush Delay", 11)) {
+			alm_cache_flush_secs = strtol(vbuf, NULL, 0);
+		}
+	} while (1);
+
+	return 0;
+}
+
+int alm_cache_hash(int disk, int dir, int blk) {
+
+	return ((unsigned)((disk * MAXDIRS + dir) * 8191 + blk)) % CACHE_HASHSIZE;
+}
+
+// Find the entry holding blk, or NULL
+struct cache_ent_t *alm_cache_lookup(int disk, int dir, int blk) {
+
+	struct cache_ent_t *ent;
+
+	for (ent = alm_cache_hashtbl[alm_cache_hash(disk, dir, blk)]; ent; ent = ent->hnext)
+		if (ent->blk == blk && ent->disk == disk && ent->dir == dir)
+			return ent;
+
+	return NULL;
+}
+
+// Find the entry holding blk, making one if needed. NULL if we can't.
+struct cache_ent_t *alm_cache_get(int disk, int dir, int blk) {
+
+	struct cache_ent_t *ent, **newents;
+	int size = drvparam[disk].blk_size;
+	int h, pass;
+
+	ent = alm_cache_lookup(disk, dir, blk);
+	if (ent)
+		return ent;
+
+	if (alm_cache_used + size <= alm_cache_size || !alm_cache_nents) {
+		// Still under budget, add a new entry
+		if (alm_cache_nents == alm_cache_maxents) {
+			newents = realloc(alm_cache_ents, sizeof(struct cache_ent_t *) * (alm_cache_maxents ? alm_cache_maxents * 2 : 64));
+			if (!newents)
+				return NULL;
+			alm_cache_ents = newents;
+			alm_cache_maxents = alm_cache_maxents ? alm_cache_maxents * 2 : 64;
+		}
+		ent = calloc(sizeof(struct cache_ent_t), 1);
+		if (!ent)
+			return NULL;
+		ent->data = malloc(size);
+		if (!ent->data) {
+			free(ent);
+			return NULL;
+		}
+		ent->size = size;
+		alm_cache_used += size;
+		alm_cache_ents[alm_cache_nents++] = ent;
+	} else {
+		// Sweep the clock hand for an entry that hasn't been used lately
+		ent = NULL;
+		for (pass = 0; pass < 2 * alm_cache_nents && !ent; pass++) {
+			struct cache_ent_t *cand = alm_cache_ents[alm_cache_hand];
+			alm_cache_hand = (alm_cache_hand + 1) % alm_cache_nents;
+			if (cand->blk >= 0 && cand->ref) {
+				cand->ref = 0;
+				continue;
+			}
+			if (cand->dirty_time && alm_cache_writeout(cand) < 0)
+				continue;
+			ent = cand;
+		}
+		if (!ent)
+			return NULL;
+		if (ent->blk >= 0) {
+			alm_cache_drop(ent);
+			alm_cache_stats.evictions++;
+		}
+		if (ent->size != size) {
+			uint8_t *newdata = realloc(ent->data, size);
+			if (!newdata)
+				return NULL;
+			alm_cache_used += size - ent->size;
+			ent->data = newdata;
+			ent->size = size;
+		}
+	}
+
+	ent->disk = disk;
+	ent->dir = dir;
+	ent->blk = blk;
+	memset(ent->valid, 0, sizeof(ent->valid));
+	memset(ent->dirty, 0, sizeof(ent->dirty));
+	ent->dirty_time = 0;
+	ent->ref = 1;
+	h = alm_cache_hash(disk, dir, blk);
+	ent->hnext = alm_cache_hashtbl[h];
+	alm_cache_hashtbl[h] = ent;
+
+	return ent;
+}
+
+// Read the entry's block from the image into every record that isn't dirty
+int alm_cache_load(struct cache_ent_t *ent) {
+
+	int disk = ent->disk;
+	int recs = 1 << drvparam[disk].BSF;
+	int i, retval, dirty = 0;
+	uint8_t *rdbuf;
+
+	for (i=0; i<CACHE_MAPWORDS; i++)
+		dirty |= (ent->dirty[i] != 0);
+	rdbuf = dirty ? alloca(ent->size) : ent->data;
+
+	retval = lseek(drvparam[disk].image_fd[ent->dir],
+			((ent->blk << drvparam[disk].BSF) + drvparam[disk].dir_rec_min) * RECSIZE,
+			SEEK_SET);
+	if (retval < 0)
+		return -4;
+	retval = read(drvparam[disk].image_fd[ent->dir], rdbuf, ent->size);
+	alm_cache_stats.imgreads++;
+	if (retval < 0)
+		return -5;
+
+	for (i=0; i<recs && (i+1)*RECSIZE <= retval; i++) {
+		if (CACHE_MAP_TST(ent->dirty, i))
+			continue;
+		if (dirty)
+			memcpy(ent->data + i*RECSIZE, rdbuf + i*RECSIZE, RECSIZE);
+		CACHE_MAP_SET(ent->valid, i);
+	}
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+// Write the entry's dirty records to the image, in contiguous runs
+int alm_cache_writeout(struct cache_ent_t *ent) {
+
+	int disk = ent->disk;
+	int recs, start, end, retval;
+
+	if (!ent->dirty_time)
+		return 0;
+
+	recs = 1 << drvparam[disk].BSF;
+	for (start=0; start<recs; start=end) {
+		if (!CACHE_MAP_TST(ent->dirty, start)) {
+			end = start+1;
+			continue;
+		}
+		for (end=start+1; end<recs && CACHE_MAP_TST(ent->dirty, end); end++)
+			;
+		retval = lseek(drvparam[disk].image_fd[ent->dir],
+				((ent->blk << drvparam[disk].BSF) + drvparam[disk].dir_rec_min + start) * RECSIZE,
+				SEEK_SET);
+		if (retval < 0)
+			return -1;
+		retval = write(drvparam[disk].image_fd[ent->dir], ent->data + start*RECSIZE, (end-start)*RECSIZE);
+		alm_cache_stats.imgwrites++;
+		if (retval < 0)
+			return -2;
+	}
+
+	memset(ent->dirty, 0, sizeof(ent->dirty));
+	ent->dirty_time = 0;
+	alm_cache_dirtyents--;
+
+	return 0;
+}
+
+// Take the entry out of the hash table and mark it unused, without writing it
+int alm_cache_drop(struct cache_ent_t *ent) {
+
+	struct cache_ent_t **entptr;
+
+	for (entptr = &alm_cache_hashtbl[alm_cache_hash(ent->disk, ent->dir, ent->blk)]; *entptr; entptr = &((*entptr)->hnext)) {
+		if (*entptr == ent) {
+			*entptr = ent->hnext;
+			break;
+		}
+	}
+	if (ent->dirty_time)
+		alm_cache_dirtyents--;
+	ent->hnext = NULL;
+	ent->blk = -1;
+	ent->dirty_time = 0;
+	ent->ref = 0;
+
+	return 0;
+}
+
+int alm_cache_readrec(int disk, int dir, int rec, void *buf) {
+
+	struct cache_ent_t *ent = NULL;
+	int fd, drec, off;
+
+	if (disk >= mmm_numdisks || dir < 0 || dir >= mmm_maxdirs)
+		return -3;
+	fd = drvparam[disk].image_fd[dir];
+	if (fd < 0)
+		return -5;
+
+	if (alm_cache_size && drvparam[disk].blk_size && rec >= drvparam[disk].dir_rec_min) {
+		drec = rec - drvparam[disk].dir_rec_min;
+		off = drec & drvparam[disk].BLM;
+		ent = alm_cache_get(disk, dir, drec >> drvparam[disk].BSF);
+	}
+
+	if (!ent) {
+		alm_cache_stats.bypass++;
+		alm_cache_stats.imgreads++;
+		lseek(fd, rec*RECSIZE, SEEK_SET);
+		return read(fd, buf, RECSIZE);
+	}
+
+	ent->ref = 1;
+	if (CACHE_MAP_TST(ent->valid, off)) {
+		alm_cache_stats.hits++;
+	} else {
+		alm_cache_stats.misses++;
+		if (alm_cache_load(ent) < 0)
+			return -6;
+		if (!CACHE_MAP_TST(ent->valid, off))
+			return 0;	// Past the end of the image
+	}
+	memcpy(buf, ent->data + off*RECSIZE, RECSIZE);
+
+	return RECSIZE;
+}
+
+int alm_cache_writerecs(int disk, int dir, int rec, const void *buf, int nrecs) {
+
+	struct cache_ent_t *ent;
+	const uint8_t *recbuf = buf;
+	int fd, drec, off, i, retval;
+
+	if (disk >= mmm_numdisks || dir < 0 || dir >= mmm_maxdirs)
+		return -3;
+	fd = drvparam[disk].image_fd[dir];
+	if (fd < 0)
+		return -5;
+
+	// Public drive writes also go in the log for a standby server
+	alm_repl_log(disk, rec, buf, nrecs);
+	// And keep the directory index in step
+	alm_dix_written(disk, dir, rec, buf, nrecs);
+
+	if (!alm_cache_size || !drvparam[disk].blk_size || rec < drvparam[disk].dir_rec_min || !alm_cache_writeback) {
+		// Write through, and keep any cached copies current
+		lseek(fd, rec*RECSIZE, SEEK_SET);
+		retval = write(fd, buf, nrecs*RECSIZE);
+		alm_cache_stats.imgwrites++;
+		if (!alm_cache_writeback)
+			alm_cache_stats.bypass += nrecs;
+		if (retval <= 0 || !alm_cache_size || !drvparam[disk].blk_size)
+			return retval;
+		for (i=0; i<nrecs; i++, rec++) {
+			if (rec < drvparam[disk].dir_rec_min)
+				continue;
+			drec = rec - drvparam[disk].dir_rec_min;
+			ent = alm_cache_lookup(disk, dir, drec >> drvparam[disk].BSF);
+			if (!ent)
+				continue;
+			off = drec & drvparam[disk].BLM;
+			memcpy(ent->data + off*RECSIZE, recbuf + i*RECSIZE, RECSIZE);
+			CACHE_MAP_SET(ent->valid, off);
+		}
+		return retval;
+	}
+
+	for (i=0; i<nrecs; i++, rec++) {
+		drec = rec - drvparam[disk].dir_rec_min;
+		off = drec & drvparam[disk].BLM;
+		ent = alm_cache_get(disk, dir, drec >> drvparam[disk].BSF);
+		if (!ent) {
+			// Out of memory, write this one straight out
+			lseek(fd, rec*RECSIZE, SEEK_SET);
+			retval = write(fd, recbuf + i*RECSIZE, RECSIZE);
+			alm_cache_stats.imgwrites++;
+			alm_cache_stats.bypass++;
+			if (retval < 0)
+				return retval;
+			continue;
+		}
+		ent->ref = 1;
+		memcpy(ent->data + off*RECSIZE, recbuf + i*RECSIZE, RECSIZE);
+		CACHE_MAP_SET(ent->valid, off);
+		CACHE_MAP_SET(ent->dirty, off);
+		if (!ent->dirty_time) {
+			ent->dirty_time = time(NULL);
+			alm_cache_dirtyents++;
+		}
+	}
+
+	return nrecs*RECSIZE;
+}
+
+int alm_cache_writerec(int disk, int dir, int rec, const void *buf) {
+
+	return alm_cache_writerecs(disk, dir, rec, buf, 1);
+}
+
+int alm_cache_zerorecs(int disk, int dir, int rec, int nrecs) {
+
+	static const uint8_t zerorec[RECSIZE];
+	int i, retval;
+
+	// One record at a time, so no block sized buffer of zeroes is needed
+	for (i=0; i<nrecs; i++) {
+		retval = alm_cache_writerec(disk, dir, rec+i, zerorec);
+		if (retval < 0)
+			return retval;
+	}
+
+	return nrecs*RECSIZE;
+}
+
+/* Can be called from signal handler */
+int alm_cache_flush_blk(int disk, int dir, int blk) {
+
+	struct cache_ent_t *ent;
+
+	if (!alm_cache_dirtyents)
+		return 0;
+	ent = alm_cache_lookup(disk, dir, blk);
+	if (!ent)
+		return 0;
+
+	return alm_cache_writeout(ent);
+}
+
+/* Can be called from signal handler */
+int alm_cache_flush_rec(int disk, int dir, int rec) {
+
+	if (!drvparam[disk].blk_size || rec < drvparam[disk].dir_rec_min)
+		return 0;
+
+	return alm_cache_flush_blk(disk, dir, (rec - drvparam[disk].dir_rec_min) >> drvparam[disk].BSF);
+}
+
+/* Can be called from signal handler */
+int alm_cache_flush(int disk, int dir) {
+
+	int i, retval = 0;
+	struct cache_ent_t *ent;
+
+	for (i=0; i<alm_cache_nents && alm_cache_dirtyents; i++) {
+		ent = alm_cache_ents[i];
+		if (ent->blk < 0 || !ent->dirty_time)
+			continue;
+		if ((disk < 0 || ent->disk == disk) && (dir < 0 || ent->dir == dir))
+			if (alm_cache_writeout(ent) < 0)
+				retval = -1;
+	}
+
+	return retval;
+}
+
+/* Can be called from signal handler */
+int alm_cache_invalidate(int disk, int dir) {
+
+	int i, retval = 0;
+	struct cache_ent_t *ent;
+
+	for (i=0; i<alm_cache_nents; i++) {
+		ent = alm_cache_ents[i];
+		if (ent->blk < 0)
+			continue;
+		if ((disk < 0 || ent->disk == disk) && (dir < 0 || ent->dir == dir)) {
+			if (alm_cache_writeout(ent) < 0)
+				retval = -1;
+			alm_cache_drop(ent);
+		}
+	}
+
+	return retval;
+}
+
+int alm_cache_flush_idle() {
+
+	static time_t lastcheck = 0;
+	time_t now;
+	int i;
+
+	if (!alm_cache_dirtyents)
+		return 0;
+	now = time(NULL);
+	if (now == lastcheck)
+		return 0;
+	lastcheck = now;
+
+	for (i=0; i<alm_cache_nents && alm_cache_dirtyents; i++) {
+		if (alm_cache_ents[i]->dirty_time
+				&& (now - alm_cache_ents[i]->dirty_time) >= alm_cache_flush_secs)
+			alm_cache_writeout(alm_cache_ents[i]);
+	}
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_cache_printstats() {
+
+	unsigned long reads = alm_cache_stats.hits + alm_cache_stats.misses;
+
+	safe_print("Cache: ");
+	safe_print_num(alm_cache_used / 1024);
+	safe_print("K used of ");
+	safe_print_num(alm_cache_size / 1024);
+	safe_print("K, ");
+	safe_print_num(alm_cache_nents);
+	safe_print(" entries, ");
+	safe_print_num(alm_cache_dirtyents);
+	safe_print(alm_cache_writeback ? " dirty (write back)\n" : " dirty (write through)\n");
+	safe_print("Hits: "); safe_print_num(alm_cache_stats.hits);
+	safe_print(" Misses: "); safe_print_num(alm_cache_stats.misses);
+	if (reads) {
+		safe_print(" (");
+		safe_print_num((int)(alm_cache_stats.hits * 100 / reads));
+		safe_print("% hit)");
+	}
+	safe_print("\nUncached: "); safe_print_num(alm_cache_stats.bypass);
+	safe_print(" Evictions: "); safe_print_num(alm_cache_stats.evictions);
+	safe_print("\nImage reads: "); safe_print_num(alm_cache_stats.imgreads);
+	safe_print(" Image writes: "); safe_print_num(alm_cache_stats.imgwrites);
+	safe_print("\n");
+
+	return 0;
+}
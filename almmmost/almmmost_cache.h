@@ -0,0 +1,123 @@
+/* almmmost_cache.h: The shared image buffer cache module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _ALMMMOST_CACHE_H
+#define _ALMMMOST_CACHE_H
+
+/* The cache holds image data in allocation block sized entries, keyed by
+ * (disk, private directory, block). Blocks are counted from dir_rec_min so
+ * a file's block is one entry; records below that (system tracks) go
+ * straight to the image.
+ */
+
+#define CACHE_MAXRECS (128)		// Records per entry, up to BSF 7
+#define CACHE_MAPWORDS (CACHE_MAXRECS/32)
+#define CACHE_MAP_SET(map,rec) (map[(rec)>>5] |= (1U << ((rec) & 0x1F)))
+#define CACHE_MAP_TST(map,rec) (map[(rec)>>5] & (1U << ((rec) & 0x1F)))
+
+#define CACHE_HASHSIZE (1024)
+#define CACHE_DEFAULT_SIZE (1024)	// KB
+#define CACHE_DEFAULT_FLUSH (2)		// Seconds a dirty entry can wait
+
+struct cache_ent_t {
+	int disk;
+	int dir;
+	int blk;			// -1 if entry not in use
+	uint8_t *data;
+	int size;			// Bytes allocated for data
+	uint32_t valid[CACHE_MAPWORDS];	// Records holding image data
+	uint32_t dirty[CACHE_MAPWORDS];	// Records not yet written to the image
+	time_t dirty_time;		// When it became dirty, 0 if clean
+	uint8_t ref;			// CLOCK reference bit
+	struct cache_ent_t *hnext;
+};
+
+struct cache_stats_t {
+	unsigned long hits;		// Record reads served from the cache
+	unsigned long misses;		// Record reads that had to load a block
+	unsigned long bypass;		// Record reads/writes outside the cache
+	unsigned long imgreads;		// read() calls on images
+	unsigned long imgwrites;	// write() calls on images
+	unsigned long evictions;
+};
+
+extern int alm_cache_size;		// Memory budget in bytes
+extern int alm_cache_writeback;		// 0 = write through
+extern int alm_cache_flush_secs;
+extern int alm_cache_dirtyents;		// Number of entries holding unwritten records
+extern int alm_cache_used;		// Bytes of entry data allocated
+extern struct cache_stats_t alm_cache_stats;
+
+/* Initialize variables */
+int alm_cache_init();
+
+/* Write out and free everything */
+int alm_cache_exit();
+
+/* Process config file */
+int alm_cache_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Read a record from image dir of disk, returns RECSIZE or <0 */
+int alm_cache_readrec(int disk, int dir, int rec, void *buf);
+
+/* Write nrecs records to image dir of disk, returns bytes written or <0 */
+int alm_cache_writerecs(int disk, int dir, int rec, const void *buf, int nrecs);
+
+/* Write a single record */
+int alm_cache_writerec(int disk, int dir, int rec, const void *buf);
+
+/* Zero nrecs records, in the cache if it's write back */
+int alm_cache_zerorecs(int disk, int dir, int rec, int nrecs);
+
+/* Write out dirty data for one block */
+int alm_cache_flush_blk(int disk, int dir, int blk);
+
+/* Write out dirty data for one record's block */
+int alm_cache_flush_rec(int disk, int dir, int rec);
+
+/* Write out dirty data for disk/dir, -1 matches all */
+int alm_cache_flush(int disk, int dir);
+
+/* Drop cached data for disk/dir after writing it out, -1 matches all */
+int alm_cache_invalidate(int disk, int dir);
+
+/* Called from the main loop: write out entries that have been dirty too long */
+int alm_cache_flush_idle();
+
+/* Print cache statistics */
+int alm_cache_printstats();
+
+/* Internal functions */
+struct cache_ent_t *alm_cache_lookup(int disk, int dir, int blk);
+struct cache_ent_t *alm_cache_get(int disk, int dir, int blk);
+int alm_cache_load(struct cache_ent_t *ent);
+int alm_cache_writeout(struct cache_ent_t *ent);
+int alm_cache_drop(struct cache_ent_t *ent);
+int alm_cache_hash(int disk, int dir, int blk);
+
+#endif /* _ALMMMOST_CACHE_H */
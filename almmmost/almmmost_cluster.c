@@ -0,0 +1,581 @@
+/* almmmost_cluster.c: Module to share public drives between several Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_image.h"
+#include "almmmost_device.h"
+#include "almmmost_file.h"
+#include "almmmost_special.h"
+#include "almmmost_spool.h"
+#include "almmmost_cluster.h"
+
+int alm_cluster_role = CLUSTER_NONE;
+int alm_cluster_portbase = 0;
+char alm_cluster_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+struct cluster_stats_t alm_cluster_stats;
+
+// Coordinator
+int alm_cluster_listenfd = -1;
+struct cluster_node_t alm_cluster_nodes[CLUSTER_MAXNODES];
+
+// Node
+int alm_cluster_fd = -1;
+struct cluster_req_t alm_cluster_queue[CLUSTER_QUEUE];
+volatile int alm_cluster_queued = 0;
+
+static long long alm_cluster_now() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int alm_cluster_init() {
+
+	int i;
+
+	alm_cluster_role = CLUSTER_NONE;
+	alm_cluster_portbase = 0;
+	strcpy(alm_cluster_socket, CLUSTER_DEFAULT_SOCKET);
+	memset(&alm_cluster_stats, 0, sizeof(alm_cluster_stats));
+	alm_cluster_listenfd = -1;
+	for (i=0; i<CLUSTER_MAXNODES; i++)
+		alm_cluster_nodes[i].fd = -1;
+	alm_cluster_fd = -1;
+	alm_cluster_queued = 0;
+
+	return 0;
+}
+
+int alm_cluster_exit() {
+
+	int i;
+
+	if (alm_cluster_role == CLUSTER_NODE)
+		alm_cluster_poll(); // Last notices out
+	if (alm_cluster_fd >= 0)
+		close(alm_cluster_fd);
+	for (i=0; i<CLUSTER_MAXNODES; i++)
+		if (alm_cluster_nodes[i].fd >= 0)
+			close(alm_cluster_nodes[i].fd);
+	if (alm_cluster_listenfd >= 0) {
+		close(alm_cluster_listenfd);
+		unlink(alm_cluster_socket);
+	}
+
+	return alm_cluster_init();
+}
+
+int alm_cluster_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Role", 4)) {
+			if (!strncasecmp(vbuf, "Coordinator", 11))
+				alm_cluster_role = CLUSTER_COORD;
+			else if (!strncasecmp(vbuf, "Node", 4))
+				alm_cluster_role = CLUSTER_NODE;
+			else if (!strncasecmp(vbuf, "None", 4))
+				alm_cluster_role = CLUSTER_NONE;
+			else
+				printf("Unknown cluster role, should be Coordinator, Node or None\n");
+		} else if (!strncasecmp(kbuf, "Socket", 6)) {
+			if (vallen >= sizeof(alm_cluster_socket)) {
+				printf("Cluster socket name too long\n");
+				continue;
+			}
+			string_copy(alm_cluster_socket, vbuf, vallen);
+		} else if (!strncasecmp(kbuf, "Port Base", 9)) {
+			// This node's port 0 as the coordinator numbers it
+			alm_cluster_portbase = strtol(vbuf, NULL, 0);
+			if (alm_cluster_portbase < 0 || alm_cluster_portbase >= MAXUSER) {
+				printf("Port Base %d out of range, 0 - %d\n", alm_cluster_portbase, MAXUSER - 1);
+				alm_cluster_portbase = 0;
+			}
+		}
+	} while (1);
+
+	return 0;
+}
+
+/* Write all of len bytes, waiting out a full socket. 0 if it all went. */
+static int alm_cluster_sendall(int fd, const void *buf, size_t len) {
+
+	const uint8_t *p = buf;
+	ssize_t retval;
+	struct pollfd pfd;
+
+	while (len) {
+		retval = send(fd, p, len, MSG_NOSIGNAL);	// A dead peer is an error, not SIGPIPE
+		if (retval < 0 && errno == EINTR) {
+			continue;
+		} else if (retval < 0 && errno == EAGAIN) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, CLUSTER_TIMEOUT) <= 0)
+				return -1;
+			continue;
+		} else if (retval <= 0) {
+			return -1;
+		}
+		p += retval;
+		len -= retval;
+	}
+
+	return 0;
+}
+
+/* Read all of len bytes, giving up after CLUSTER_TIMEOUT. 0 if it all came. */
+static int alm_cluster_recvall(int fd, void *buf, size_t len) {
+
+	uint8_t *p = buf;
+	ssize_t retval;
+	struct pollfd pfd;
+
+	while (len) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		retval = poll(&pfd, 1, CLUSTER_TIMEOUT);
+		if (retval < 0 && errno == EINTR)
+			continue;
+		else if (retval <= 0)
+			return -1;
+
+		retval = read(fd, p, len);
+		if (retval < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		else if (retval <= 0)
+			return -1;
+		p += retval;
+		len -= retval;
+	}
+
+	return 0;
+}
+
+static int alm_cluster_listen() {
+
+	int fd;
+
+	fd = alm_sock_listen(alm_cluster_socket, CLUSTER_MAXNODES);
+	if (fd < 0)
+		return -1;
+
+	alm_cluster_listenfd = fd;
+	return 0;
+}
+
+static int alm_cluster_connect() {
+
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Cluster socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, alm_cluster_socket);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("Can't reach cluster coordinator at %s: %s\n", alm_cluster_socket, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (!alm_sock_peerok(fd)) {
+		printf("Cluster coordinator at %s isn't root or our user\n", alm_cluster_socket);
+		close(fd);
+		return -1;
+	}
+
+	alm_cluster_fd = fd;
+	return 0;
+}
+
+int alm_cluster_start() {
+
+	if (alm_cluster_role == CLUSTER_COORD) {
+		// Any node's ports can show up here
+		alm_file_setports(MAXUSER);
+		alm_special_setports(MAXUSER);
+		alm_spool_setports(MAXUSER);
+		if (alm_cluster_listen() < 0)
+			return -1;
+		printf("Cluster coordinator on %s\n", alm_cluster_socket);
+	} else if (alm_cluster_role == CLUSTER_NODE) {
+		if (alm_cluster_portbase + alm_dev_ports > MAXUSER) {
+			printf("Port Base %d leaves no room for %d ports, max %d\n", alm_cluster_portbase, alm_dev_ports, MAXUSER);
+			alm_cluster_portbase = MAXUSER - alm_dev_ports;
+		}
+		// Keep going if it isn't up yet, each request tries again
+		if (!alm_cluster_connect())
+			printf("Cluster node, ports %d-%d, coordinator %s\n", alm_cluster_portbase,
+					alm_cluster_portbase + alm_dev_ports - 1, alm_cluster_socket);
+	}
+
+	return 0;
+}
+
+/* Coordinator: carry out one request from a node, and answer it unless it's
+ * a notice. Returns -1 if the node should be dropped.
+ */
+static int alm_cluster_serve(struct cluster_node_t *node) {
+
+	struct cluster_req_t *req = &node->req;
+	struct cluster_reply_t reply;
+	int port = req->port;
+
+	memset(&reply, 0, sizeof(reply));
+	if (port >= alm_file_ports) {
+		printf("Cluster request for port %d out of range\n", port);
+		return -1;
+	}
+
+	switch (req->type) {
+		case CLUSTER_FILEOP:
+			node->ports |= (uint64_t)1 << port;
+			reply.fcb = req->fcb;
+			memcpy(reply.data, req->data, TVSP_DATA_SZ);
+			reply.retval = alm_file_exec(port, &req->freq, &reply.fcb, &reply.resp, reply.data);
+			break;
+
+		case CLUSTER_READREC:
+			reply.retval = alm_img_readrec(req->disk, 0, req->rec, reply.data);
+			break;
+
+		case CLUSTER_WRITEREC:
+			reply.retval = alm_img_writerec(req->disk, 0, req->rec, req->data);
+			break;
+
+		case CLUSTER_CLEARFILES:
+			node->ports &= ~((uint64_t)1 << port);
+			alm_file_clearfiles(port);
+			node->notices++;
+			alm_cluster_stats.notices++;
+			return 0;
+
+		case CLUSTER_SYNC:
+			alm_file_sync();
+			node->notices++;
+			alm_cluster_stats.notices++;
+			return 0;
+
+		default:
+			printf("Unknown cluster request %d\n", req->type);
+			return -1;
+	}
+
+	node->reqs++;
+	alm_cluster_stats.reqs++;
+	return alm_cluster_sendall(node->fd, &reply, sizeof(reply));
+}
+
+/* Coordinator: a node went away, so close what its clients had open */
+static void alm_cluster_drop(struct cluster_node_t *node) {
+
+	int port;
+
+	printf("Cluster node %d disconnected\n", (int)(node - alm_cluster_nodes));
+	close(node->fd);
+	node->fd = -1;
+	for (port=0; port<MAXUSER; port++)
+		if (node->ports & ((uint64_t)1 << port))
+			alm_file_clearfiles(port);
+	node->ports = 0;
+}
+
+static int alm_cluster_poll_coord() {
+
+	struct cluster_node_t *node;
+	ssize_t retval;
+	int fd, i;
+
+	while ((fd = accept(alm_cluster_listenfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (!alm_sock_peerok(fd)) {
+			printf("Cluster node refused, not root or our user\n");
+			close(fd);
+			continue;
+		}
+		for (i=0; i<CLUSTER_MAXNODES && alm_cluster_nodes[i].fd >= 0; i++);
+		if (i == CLUSTER_MAXNODES) {
+			printf("Too many cluster nodes, max %d\n", CLUSTER_MAXNODES);
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		node = &alm_cluster_nodes[i];
+		memset(node, 0, sizeof(*node));
+		node->fd = fd;
+		printf("Cluster node %d connected\n", i);
+	}
+
+	// Everything each node has sent goes through now, in order
+	for (i=0; i<CLUSTER_MAXNODES; i++) {
+		node = &alm_cluster_nodes[i];
+		while (node->fd >= 0) {
+			retval = read(node->fd, (uint8_t *)&node->req + node->got, sizeof(node->req) - node->got);
+			if (retval < 0 && (errno == EAGAIN || errno == EINTR)) {
+				break;
+			} else if (retval <= 0) {
+				alm_cluster_drop(node);
+				break;
+			}
+			node->got += retval;
+			if (node->got < sizeof(node->req))
+				continue;
+			node->got = 0;
+			if (alm_cluster_serve(node) < 0)
+				alm_cluster_drop(node);
+		}
+	}
+
+	return 0;
+}
+
+/* Node: send what's queued, then req if there is one, in one write */
+static int alm_cluster_send(struct cluster_req_t *req) {
+
+	struct cluster_req_t batch[CLUSTER_QUEUE + 1];
+	int n = alm_cluster_queued;
+
+	if (!n && !req)
+		return 0;
+	if (alm_cluster_fd < 0 && alm_cluster_connect() < 0)
+		return -1;
+
+	memcpy(batch, alm_cluster_queue, n * sizeof(struct cluster_req_t));
+	alm_cluster_queued = 0;
+	if (n)
+		alm_cluster_stats.notices += n;
+	if (req) {
+		batch[n++] = *req;
+		if (n > 1)
+			alm_cluster_stats.batches++;
+	}
+
+	if (alm_cluster_sendall(alm_cluster_fd, batch, n * sizeof(struct cluster_req_t)) < 0) {
+		printf("Lost cluster coordinator\n");
+		close(alm_cluster_fd);
+		alm_cluster_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Node: send req and wait for the coordinator's answer */
+static int alm_cluster_call(struct cluster_req_t *req, struct cluster_reply_t *reply) {
+
+	long long start = alm_cluster_now();
+
+	if (alm_cluster_send(req) < 0 || alm_cluster_recvall(alm_cluster_fd, reply, sizeof(*reply)) < 0) {
+		if (alm_cluster_fd >= 0) {
+			printf("No answer from cluster coordinator\n");
+			close(alm_cluster_fd);
+			alm_cluster_fd = -1;
+		}
+		alm_cluster_stats.failures++;
+		return -1;
+	}
+	alm_cluster_stats.reqs++;
+	alm_cluster_stats.waitus += alm_cluster_now() - start;
+
+	return 0;
+}
+
+int alm_cluster_poll() {
+
+	if (alm_cluster_role == CLUSTER_COORD && alm_cluster_listenfd >= 0)
+		return alm_cluster_poll_coord();
+	else if (alm_cluster_role == CLUSTER_NODE && alm_cluster_queued)
+		return alm_cluster_send(NULL);
+
+	return 0;
+}
+
+int alm_cluster_fileop(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf) {
+
+	struct cluster_req_t req;
+	struct cluster_reply_t reply;
+
+	memset(&req, 0, sizeof(req));
+	req.type = CLUSTER_FILEOP;
+	req.port = alm_cluster_portbase + portnum;
+	req.freq = *freq;
+	req.fcb = *fcb;
+	memcpy(req.data, databuf, TVSP_DATA_SZ);
+
+	if (alm_cluster_call(&req, &reply) < 0) {
+		resp->retcode = 0xFF;
+		resp->err = MMMERR_SELECT;
+		return -1;
+	}
+
+	*resp = reply.resp;
+	*fcb = reply.fcb;
+	memcpy(databuf, reply.data, TVSP_DATA_SZ);
+
+	return reply.retval;
+}
+
+int alm_cluster_readrec(int disk, int rec, void *buf) {
+
+	struct cluster_req_t req;
+	struct cluster_reply_t reply;
+
+	memset(&req, 0, sizeof(req));
+	req.type = CLUSTER_READREC;
+	req.disk = disk;
+	req.rec = rec;
+
+	if (alm_cluster_call(&req, &reply) < 0)
+		return -1;
+	if (reply.retval > 0)
+		memcpy(buf, reply.data, TVSP_DATA_SZ);
+
+	return reply.retval;
+}
+
+int alm_cluster_writerec(int disk, int rec, void *buf) {
+
+	struct cluster_req_t req;
+	struct cluster_reply_t reply;
+
+	memset(&req, 0, sizeof(req));
+	req.type = CLUSTER_WRITEREC;
+	req.disk = disk;
+	req.rec = rec;
+	memcpy(req.data, buf, TVSP_DATA_SZ);
+
+	if (alm_cluster_call(&req, &reply) < 0)
+		return -1;
+
+	return reply.retval;
+}
+
+/* Can be called from signal handler */
+int alm_cluster_notify(int type, int portnum) {
+
+	struct cluster_req_t *req;
+
+	if (alm_cluster_queued >= CLUSTER_QUEUE) {
+		safe_print("Cluster notice queue full, dropped\n");
+		return -1;
+	}
+
+	req = &alm_cluster_queue[alm_cluster_queued];
+	memset(req, 0, sizeof(*req));
+	req->type = type;
+	req->port = alm_cluster_portbase + portnum;
+	alm_cluster_queued++;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_cluster_printstats() {
+
+	int i, port;
+
+	if (alm_cluster_role == CLUSTER_NONE) {
+		safe_print("Not clustered\n");
+		return 0;
+	} else if (alm_cluster_role == CLUSTER_COORD) {
+		safe_print("Cluster coordinator on ");
+		safe_print(alm_cluster_socket);
+		safe_print("\nRequests: "); safe_print_num(alm_cluster_stats.reqs);
+		safe_print(" Notices: "); safe_print_num(alm_cluster_stats.notices);
+		safe_print("\n");
+		for (i=0; i<CLUSTER_MAXNODES; i++) {
+			if (alm_cluster_nodes[i].fd < 0)
+				continue;
+			safe_print("Node "); safe_print_num(i);
+			safe_print(": requests "); safe_print_num(alm_cluster_nodes[i].reqs);
+			safe_print(", notices "); safe_print_num(alm_cluster_nodes[i].notices);
+			safe_print(", ports with files:");
+			for (port=0; port<MAXUSER; port++) {
+				if (alm_cluster_nodes[i].ports & ((uint64_t)1 << port)) {
+					safe_print(" ");
+					safe_print_num(port);
+				}
+			}
+			safe_print("\n");
+		}
+		return 0;
+	}
+
+	safe_print("Cluster node, port base ");
+	safe_print_num(alm_cluster_portbase);
+	safe_print(alm_cluster_fd >= 0 ? ", connected to " : ", not connected to ");
+	safe_print(alm_cluster_socket);
+	safe_print("\nRequests: "); safe_print_num(alm_cluster_stats.reqs);
+	safe_print(" Notices: "); safe_print_num(alm_cluster_stats.notices);
+	safe_print(" Batched: "); safe_print_num(alm_cluster_stats.batches);
+	safe_print(" Failed: "); safe_print_num(alm_cluster_stats.failures);
+	if (alm_cluster_stats.reqs) {
+		safe_print("\nAverage wait: ");
+		safe_print_num((int)(alm_cluster_stats.waitus / alm_cluster_stats.reqs));
+		safe_print(" us");
+	}
+	safe_print("\nQueued: "); safe_print_num(alm_cluster_queued);
+	safe_print("\n");
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/* almmmost_cluster.h: Module to share public drives between several Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _ALMMMOST_CLUSTER_H
+#define _ALMMMOST_CLUSTER_H
+
+/* A cluster is one coordinator and any number of nodes, each a separate
+ * almmmost process with its own ports. The coordinator owns the public
+ * drives: the open files, directories, BAMs, record locks and buffer cache
+ * for them only exist there. Nodes keep their private drives, and send
+ * everything else over a unix socket as fixed size messages.
+ *
+ * Ports are numbered across the cluster: a node's port n is Port Base + n
+ * to the coordinator, so locks and open files stay with the right client.
+ */
+
+#define CLUSTER_NONE (0)	// Standalone server
+#define CLUSTER_COORD (1)
+#define CLUSTER_NODE (2)
+
+#define CLUSTER_DEFAULT_SOCKET RUNDIR "/cluster.sock"
+#define CLUSTER_MAXNODES (16)
+#define CLUSTER_QUEUE (32)	// Notices a node holds for the next send
+#define CLUSTER_TIMEOUT (10000)	// ms a node waits on the coordinator
+
+/* Message types. Notices get no reply, so a node batches them up and sends
+ * them ahead of its next request.
+ */
+#define CLUSTER_FILEOP (1)	// File request, replies with resp, fcb, data
+#define CLUSTER_READREC (2)	// Shared drive record read, replies with data
+#define CLUSTER_WRITEREC (3)	// Shared drive record write
+#define CLUSTER_CLEARFILES (4)	// Notice: close port's files and locks
+#define CLUSTER_SYNC (5)	// Notice: write out all open files
+
+/* Both ends are the same binary on the same host, so these go as is */
+struct cluster_req_t {
+	uint8_t type;
+	uint8_t port;		// Cluster port number
+	uint8_t disk;		// READREC/WRITEREC
+	uint8_t x;
+	int32_t rec;		// READREC/WRITEREC
+	struct tvsp_file_request freq;
+	struct cpm_fcb_t fcb;
+	uint8_t data[TVSP_DATA_SZ];
+};
+
+struct cluster_reply_t {
+	int32_t retval;
+	struct tvsp_file_response resp;
+	struct cpm_fcb_t fcb;
+	uint8_t data[TVSP_DATA_SZ];
+};
+
+/* Coordinator's view of a connected node */
+struct cluster_node_t {
+	int fd;			// -1 if not in use
+	int got;		// Bytes of req read so far
+	struct cluster_req_t req;
+	uint64_t ports;		// Ports seen from it, to clean up when it goes
+	unsigned long reqs;
+	unsigned long notices;
+};
+
+struct cluster_stats_t {
+	unsigned long reqs;	// Requests sent/served
+	unsigned long notices;	// Notices sent/applied
+	unsigned long batches;	// Writes carrying queued notices
+	unsigned long failures;	// Requests that got no answer
+	unsigned long long waitus;	// Total time nodes waited for answers
+};
+
+extern int alm_cluster_role;
+extern int alm_cluster_portbase;
+extern char alm_cluster_socket[];
+extern struct cluster_stats_t alm_cluster_stats;
+
+/* Initialize variables */
+int alm_cluster_init();
+
+/* Close the socket(s) */
+int alm_cluster_exit();
+
+/* Parse config file section */
+int alm_cluster_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Once the config is read, listen for nodes or connect to the coordinator */
+int alm_cluster_start();
+
+/* From the main loop: the coordinator serves its nodes, a node sends any
+ * notices it's holding
+ */
+int alm_cluster_poll();
+
+/* Node: have the coordinator carry out a file request */
+int alm_cluster_fileop(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf);
+
+/* Node: read or write a record on a shared drive through the coordinator */
+int alm_cluster_readrec(int disk, int rec, void *buf);
+int alm_cluster_writerec(int disk, int rec, void *buf);
+
+/* Node: queue a notice for the coordinator */
+/* Can be called from signal handler */
+int alm_cluster_notify(int type, int portnum);
+
+/* Print the cluster state */
+/* Can be called from signal handler */
+int alm_cluster_printstats();
+
+#endif /* _ALMMMOST_CLUSTER_H */
@@ -49,6 +49,13 @@
 #include "almmmost_device.h"
 #include "almmmost_osload.h"
 #include "almmmost_file.h"
+#include "almmmost_cache.h"
+#include "almmmost_cluster.h"
+#include "almmmost_repl.h"
+#include "almmmost_control.h"
+#include "almmmost_dirindex.h"
+#include "almmmost_spool.h"
+#include "almmmost_urlcache.h"
 #include "almmmost_misc.h"
 #include "almmmost_special.h"
 #include "almmmost_cmdline.h"
@@ -59,8 +66,6 @@
 void alm_cmd_sigint(int signal) {
 
 	char cmdbuf[CMDBUFSIZE];
-	char *cpretval;
-	int i, retval;
 
 	safe_print("\nAlmmmost> ");
 	if (!safe_get_buf(cmdbuf, CMDBUFSIZE)) {
@@ -69,10 +74,36 @@ void alm_cmd_sigint(int signal) {
 	}
 
 	cmdbuf[CMDBUFSIZE-1] = 0;
+	alm_cmd_exec(cmdbuf, 1);
+}
+
+/* Signal handler for SIGINT when there's a control socket instead */
+void alm_cmd_sigquit(int signal) {
+
+	safe_print("\nShutting down\n");
+	alm_do_quit = 1;
+}
+
+/* Signal handler for SIGHUP, the main loop re-reads the config file */
+void alm_cmd_sighup(int signal) {
+
+	alm_do_reload = 1;
+}
+
+/* Carry out one command, from the SIGINT command line or a control
+ * connection. Output goes to alm_print_fd.
+ */
+int alm_cmd_exec(char *cmdbuf, int insignal) {
+
+	char *cpretval;
+	int i, retval;
+
+	if (!cmdbuf[0])
+		return 0;
 
 	// Trim CR and whitespace off end of command -- so no filename ending in ' '...
 	i=strlen(cmdbuf)-1;
-	while(isspace(cmdbuf[i]))
+	while(i >= 0 && isspace(cmdbuf[i]))
 		i--;
 	// End the string after the last non-space character
 	cmdbuf[i+1] = 0;
@@ -98,20 +129,20 @@ void alm_cmd_sigint(int signal) {
 			char diskstr[] = { cmdbuf[i],'\n',0};
 			safe_print("disk out of range: ");
 			safe_print(diskstr);
-			return;
+			return -1;
 		}
 		i++;
 		if (cmdbuf[i] == ':') {  /* Directory number */
-			dir = strtoul(cmdbuf+i, &cpretval, 0);
+			dir = strtoul(cmdbuf+i+1, &cpretval, 0);
 			if (!cpretval) {
 				safe_print("Error with directory number parsing.\n");
-				return;
+				return -1;
 			}
 			if (dir < 0 || dir > mmm_maxdirs) {
 				safe_print("Directory number ");
 				safe_print_num(dir);
 				safe_print(" out of range.\n");
-				return;
+				return -1;
 			}
 			i = (cpretval - cmdbuf);
 		}
@@ -125,17 +156,19 @@ void alm_cmd_sigint(int signal) {
 				safe_print("Error re-opening file '");
 				safe_print(cmdbuf+i);
 				safe_print("'.\n");
+				return -1;
 			}
 		} else {
 			char pathbuf[INPBUFSIZE * 2];
 			strcpy(pathbuf, disk_image_dir);
 			strcat(pathbuf, "/");
 			strcat(pathbuf, cmdbuf+i);
-			retval = alm_img_reopen(disk, dir, cmdbuf+i);
+			retval = alm_img_reopen(disk, dir, pathbuf);
 			if (retval < 0) {
 				safe_print("Error re-opening file '");
 				safe_print(pathbuf);
 				safe_print("'.\n");
+				return -1;
 			}
 		}
 
@@ -158,11 +191,17 @@ void alm_cmd_sigint(int signal) {
 		int port = strtol(cmdbuf + i, NULL, 0);
 		if (port < 0 || port >= alm_dev_ports) {
 			safe_print("Port number out of range.\n");
-			return;
+			return -1;
 		}
 		alm_file_clearfiles(port);
 	} else if (!strncasecmp(cmdbuf+i, "printfil", 8)) {
 		alm_file_printopen();
+	} else if (!strncasecmp(cmdbuf+i, "printcac", 8)) {
+		alm_cache_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "printurl", 8)) {
+		alm_urlcache_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "printloc", 8)) {
+		alm_file_printlocks();
 	} else if (!strncasecmp(cmdbuf+i, "printspe", 8)) {
 		alm_special_printlist();
 	} else if (!strncasecmp(cmdbuf+i, "printdpb", 8)) {
@@ -170,6 +209,20 @@ void alm_cmd_sigint(int signal) {
 			alm_drv_disp_param_hdrs(i);
 	} else if (!strncasecmp(cmdbuf+i, "printhpb", 8)) {
 		alm_osl_print_imginfo();
+	} else if (!strncasecmp(cmdbuf+i, "printboo", 8)) {
+		alm_osl_printxfers();
+	} else if (!strncasecmp(cmdbuf+i, "printclu", 8)) {
+		alm_cluster_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "printidx", 8)) {
+		alm_dix_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "printspo", 8)) {
+		alm_spool_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "printrep", 8)) {
+		alm_repl_printstats();
+	} else if (!strncasecmp(cmdbuf+i, "promote", 7)) {
+		return alm_repl_promote();
+	} else if (!strncasecmp(cmdbuf+i, "status", 6)) {
+		alm_ctl_printstatus();
 	} else if (!strncasecmp(cmdbuf+i, "saveos ", 7)) {
 		i+= 7;
 
@@ -179,23 +232,42 @@ void alm_cmd_sigint(int signal) {
 		osnum = strtol(cmdbuf+i, &nexttok, 0);
 		if (!nexttok) {
 			safe_print("Error getting OS number\n");
-			return;
+			return -1;
 		}
 		i = (nexttok - cmdbuf);
 		while (cmdbuf[i] && isspace(cmdbuf[i]))
 			i++;
 
 		alm_osl_savemodifiedos(osnum, cmdbuf+i);
+	} else if (!strncasecmp(cmdbuf+i, "reload", 6)) {
+		if (insignal) {
+			// Too much to do in a signal handler, leave it for the main loop
+			alm_do_reload = 1;
+			safe_print("Reloading config file\n");
+			return 0;
+		}
+		if (alm_reload() < 0) {
+			safe_print("Reload failed, see the server output\n");
+			return -1;
+		}
+		safe_print("Reloaded config file\n");
 	} else if (!strncasecmp(cmdbuf+i, "sync", 4)) {
 		alm_file_sync();
 	} else if (!strncasecmp(cmdbuf+i, "exit", 4) || !strncasecmp(cmdbuf+i, "quit", 4)) {
+		if (!insignal) {
+			// The main loop shuts everything down once this returns
+			alm_do_quit = 1;
+			return 0;
+		}
 		alm_file_sync();
+		alm_cluster_exit();
 		raise(SIGQUIT);
 	} else {
 		safe_print("Unknown command: '");
 		safe_print(cmdbuf);
 		safe_print("'.\n");
+		return -1;
 	}
 
-	return;
+	return 0;
 }
@@ -33,6 +33,17 @@
 /* Signal handler for SIGINT, which provides a command line to control the server */
 void alm_cmd_sigint(int signal);
 
+/* Signal handler for SIGINT when commands come from the control socket */
+void alm_cmd_sigquit(int signal);
+
+/* Signal handler for SIGHUP, which has the config file re-read */
+void alm_cmd_sighup(int signal);
+
+/* Run a command, with output to alm_print_fd. insignal is set when it's
+ * from the SIGINT command line. Returns 0, or -1 if it failed.
+ */
+int alm_cmd_exec(char *cmdbuf, int insignal);
+
 
 
 #endif /* _ALMMMOST_CMDLINE_H */
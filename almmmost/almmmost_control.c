@@ -0,0 +1,529 @@
+/* almmmost_control.c: Control socket for administering Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_image.h"
+#include "almmmost_device.h"
+#include "almmmost_osload.h"
+#include "almmmost_file.h"
+#include "almmmost_cache.h"
+#include "almmmost_cluster.h"
+#include "almmmost_repl.h"
+#include "almmmost_cmdline.h"
+#include "almmmost_control.h"
+
+char alm_ctl_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+time_t alm_ctl_started = 0;
+
+int alm_ctl_listenfd = -1;
+pthread_t alm_ctl_tid;
+int alm_ctl_thread_running = 0;
+volatile int alm_ctl_stop = 0;
+int alm_ctl_pipe[2] = { -1, -1 };	// Wakes the thread to stop
+struct ctl_conn_t alm_ctl_conns[CTL_MAXCONN];	// Owned by the thread
+
+// Command handed to the main loop, under ctl_lock
+pthread_mutex_t alm_ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t alm_ctl_cond = PTHREAD_COND_INITIALIZER;
+volatile int alm_ctl_state = CTL_IDLE;
+char alm_ctl_cmd[CTL_LINESIZE];
+int alm_ctl_result = 0;
+FILE *alm_ctl_out = NULL;	// Command output, written by the main loop and sent by the thread
+
+int alm_ctl_init() {
+
+	int i;
+
+	strcpy(alm_ctl_socket, CTL_DEFAULT_SOCKET);
+	alm_ctl_listenfd = -1;
+	alm_ctl_thread_running = 0;
+	alm_ctl_stop = 0;
+	alm_ctl_pipe[0] = alm_ctl_pipe[1] = -1;
+	alm_ctl_state = CTL_IDLE;
+	alm_ctl_out = NULL;
+	for (i=0; i<CTL_MAXCONN; i++) {
+		alm_ctl_conns[i].fd = -1;
+		alm_ctl_conns[i].out = NULL;
+		alm_ctl_conns[i].outpos = alm_ctl_conns[i].outlen = alm_ctl_conns[i].outsize = 0;
+	}
+
+	return 0;
+}
+
+int alm_ctl_exit() {
+
+	int i;
+
+	if (alm_ctl_thread_running) {
+		alm_ctl_stop = 1;
+		write(alm_ctl_pipe[1], "", 1);
+		pthread_join(alm_ctl_tid, NULL);
+		alm_ctl_thread_running = 0;
+	}
+	for (i=0; i<CTL_MAXCONN; i++) {
+		if (alm_ctl_conns[i].fd >= 0)
+			close(alm_ctl_conns[i].fd);
+		free(alm_ctl_conns[i].out);
+	}
+	if (alm_ctl_out)
+		fclose(alm_ctl_out);
+	if (alm_ctl_listenfd >= 0) {
+		close(alm_ctl_listenfd);
+		unlink(alm_ctl_socket);
+	}
+	if (alm_ctl_pipe[0] >= 0) {
+		close(alm_ctl_pipe[0]);
+		close(alm_ctl_pipe[1]);
+	}
+
+	return alm_ctl_init();
+}
+
+int alm_ctl_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Socket", 6)) {
+			// None goes back to the ^C command line
+			if (vallen >= sizeof(alm_ctl_socket)) {
+				printf("Control socket name too long\n");
+				continue;
+			}
+			string_copy(alm_ctl_socket, vbuf, vallen);
+			if (!strcasecmp(alm_ctl_socket, "None"))
+				alm_ctl_socket[0] = 0;
+		}
+	} while (1);
+
+	return 0;
+}
+
+/* Thread: turn away a connection that hasn't got a slot */
+static void alm_ctl_refuse(int fd, const char *msg) {
+
+	send(fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(fd);
+}
+
+static void alm_ctl_close(struct ctl_conn_t *conn) {
+
+	close(conn->fd);
+	conn->fd = -1;
+	free(conn->out);
+	conn->out = NULL;
+	conn->outpos = conn->outlen = conn->outsize = 0;
+}
+
+/* Thread: send as much waiting output as the connection takes right now */
+static void alm_ctl_flush(struct ctl_conn_t *conn) {
+
+	ssize_t sent;
+
+	while (conn->outpos < conn->outlen) {
+		sent = send(conn->fd, conn->out + conn->outpos, conn->outlen - conn->outpos,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (sent <= 0) {
+			alm_ctl_close(conn);
+			return;
+		}
+		conn->outpos += sent;
+	}
+	conn->outpos = conn->outlen = 0;
+}
+
+/* Thread: queue output for a connection. One that has let CTL_MAXOUT back
+ * up isn't reading, and is dropped. Returns -1 if the connection's gone.
+ */
+static int alm_ctl_queue(struct ctl_conn_t *conn, const char *msg, size_t len) {
+
+	size_t newsize;
+	char *newout;
+
+	if (conn->fd < 0)
+		return -1;
+	if (conn->outlen - conn->outpos + len > CTL_MAXOUT) {
+		printf("Control connection isn't reading its output, closing it\n");
+		alm_ctl_close(conn);
+		return -1;
+	}
+	if (conn->outpos) {
+		memmove(conn->out, conn->out + conn->outpos, conn->outlen - conn->outpos);
+		conn->outlen -= conn->outpos;
+		conn->outpos = 0;
+	}
+	if (conn->outlen + len > conn->outsize) {
+		newsize = conn->outsize ? conn->outsize : CTL_LINESIZE;
+		while (newsize < conn->outlen + len)
+			newsize *= 2;
+		newout = realloc(conn->out, newsize);
+		if (!newout) {
+			perror("Allocating control output");
+			exit(1);
+		}
+		conn->out = newout;
+		conn->outsize = newsize;
+	}
+	memcpy(conn->out + conn->outlen, msg, len);
+	conn->outlen += len;
+
+	return 0;
+}
+
+static void alm_ctl_reply(struct ctl_conn_t *conn, const char *msg) {
+
+	if (!alm_ctl_queue(conn, msg, strlen(msg)))
+		alm_ctl_flush(conn);
+}
+
+/* Thread: hand cmd to the main loop, wait for it to be run, and queue its
+ * output for the connection.
+ */
+static int alm_ctl_handoff(struct ctl_conn_t *conn, const char *cmd) {
+
+	struct timespec until;
+	char buf[4096];
+	ssize_t len;
+	off_t pos = 0;
+	int result;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += CTL_TIMEOUT;
+
+	pthread_mutex_lock(&alm_ctl_lock);
+	strcpy(alm_ctl_cmd, cmd);
+	alm_ctl_state = CTL_PENDING;
+	while (alm_ctl_state != CTL_DONE) {
+		if (alm_ctl_state == CTL_RUNNING) {
+			// Once it's started there's no taking it back, so wait it out
+			pthread_cond_wait(&alm_ctl_cond, &alm_ctl_lock);
+		} else if (pthread_cond_timedwait(&alm_ctl_cond, &alm_ctl_lock, &until) == ETIMEDOUT &&
+				alm_ctl_state == CTL_PENDING) {
+			// Main loop is stuck on a client, so take it back
+			alm_ctl_state = CTL_IDLE;
+			pthread_mutex_unlock(&alm_ctl_lock);
+			alm_ctl_reply(conn, "Server busy, try again or use abort\nERR\n");
+			return -1;
+		}
+	}
+	result = alm_ctl_result;
+	pthread_mutex_unlock(&alm_ctl_lock);
+
+	// The main loop won't touch the output file until the next command
+	while ((len = pread(fileno(alm_ctl_out), buf, sizeof(buf), pos)) > 0) {
+		if (alm_ctl_queue(conn, buf, len) < 0)
+			break;
+		pos += len;
+	}
+
+	pthread_mutex_lock(&alm_ctl_lock);
+	alm_ctl_state = CTL_IDLE;
+	pthread_mutex_unlock(&alm_ctl_lock);
+
+	alm_ctl_reply(conn, result < 0 ? "ERR\n" : "OK\n");
+	return result;
+}
+
+/* Thread: one line from a connection */
+static void alm_ctl_line(struct ctl_conn_t *conn, char *line) {
+
+	char *end;
+
+	while (isspace(*line))
+		line++;
+	for (end = line + strlen(line); end > line && isspace(end[-1]); end--)
+		;
+	*end = 0;
+	if (!*line)
+		return;
+
+	// These are for when the main loop isn't getting round to commands
+	if (!strncasecmp(line, "abort", 5)) {
+		alm_do_abort = 1;
+		alm_ctl_reply(conn, "OK\n");
+	} else if (!strncasecmp(line, "locate", 6)) {
+		alm_do_locate = 1;
+		alm_ctl_reply(conn, "OK\n");
+	} else {
+		alm_ctl_handoff(conn, line);
+	}
+}
+
+static void alm_ctl_accept() {
+
+	int fd, i;
+
+	fd = accept(alm_ctl_listenfd, NULL, NULL);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (!alm_sock_peerok(fd)) {
+		alm_ctl_refuse(fd, "Only root or the server's user can send commands\nERR\n");
+		return;
+	}
+	for (i=0; i<CTL_MAXCONN && alm_ctl_conns[i].fd >= 0; i++);
+	if (i == CTL_MAXCONN) {
+		alm_ctl_refuse(fd, "Too many control connections\nERR\n");
+		return;
+	}
+
+	alm_ctl_conns[i].fd = fd;
+	alm_ctl_conns[i].got = 0;
+}
+
+static void alm_ctl_read(struct ctl_conn_t *conn) {
+
+	char *nl, *line;
+	ssize_t retval;
+
+	retval = read(conn->fd, conn->buf + conn->got, CTL_LINESIZE - 1 - conn->got);
+	if (retval < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (retval <= 0) {
+		alm_ctl_close(conn);
+		return;
+	}
+	conn->got += retval;
+	conn->buf[conn->got] = 0;
+
+	line = conn->buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = 0;
+		alm_ctl_line(conn, line);
+		if (conn->fd < 0)
+			return;
+		line = nl + 1;
+	}
+	conn->got -= line - conn->buf;
+	memmove(conn->buf, line, conn->got);
+
+	if (conn->got == CTL_LINESIZE - 1) {
+		alm_ctl_reply(conn, "Command too long\nERR\n");
+		conn->got = 0;
+	}
+}
+
+static void *alm_ctl_thread(void *arg) {
+
+	struct pollfd pfds[CTL_MAXCONN + 2];
+	int i, n;
+
+	while (!alm_ctl_stop) {
+		pfds[0].fd = alm_ctl_pipe[0];
+		pfds[0].events = POLLIN;
+		pfds[1].fd = alm_ctl_listenfd;
+		pfds[1].events = POLLIN;
+		for (i=0; i<CTL_MAXCONN; i++) {
+			pfds[i+2].fd = alm_ctl_conns[i].fd;	// Ignored if -1
+			pfds[i+2].events = POLLIN;
+			if (alm_ctl_conns[i].outpos < alm_ctl_conns[i].outlen)
+				pfds[i+2].events |= POLLOUT;
+		}
+
+		n = poll(pfds, CTL_MAXCONN + 2, -1);
+		if (n < 0 || alm_ctl_stop)
+			continue;
+
+		if (pfds[1].revents & POLLIN)
+			alm_ctl_accept();
+		for (i=0; i<CTL_MAXCONN; i++) {
+			if ((pfds[i+2].revents & POLLOUT) && alm_ctl_conns[i].fd >= 0)
+				alm_ctl_flush(&alm_ctl_conns[i]);
+			if ((pfds[i+2].revents & ~POLLOUT) && alm_ctl_conns[i].fd >= 0)
+				alm_ctl_read(&alm_ctl_conns[i]);
+		}
+	}
+
+	return NULL;
+}
+
+int alm_ctl_start() {
+
+	sigset_t allsigs, oldsigs;
+
+	alm_ctl_started = time(NULL);
+	if (!alm_ctl_socket[0])
+		return 0;
+
+	alm_ctl_listenfd = alm_sock_listen(alm_ctl_socket, CTL_MAXCONN);
+	if (alm_ctl_listenfd < 0)
+		return -1;
+
+	alm_ctl_out = tmpfile();
+	if (!alm_ctl_out) {
+		perror("Control output file");
+		return -1;
+	}
+	fcntl(fileno(alm_ctl_out), F_SETFD, FD_CLOEXEC);
+
+	if (pipe(alm_ctl_pipe) < 0) {
+		perror("Control wakeup pipe");
+		return -1;
+	}
+	fcntl(alm_ctl_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(alm_ctl_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	// A connection closed mid-reply is a write error, not a reason to exit
+	signal(SIGPIPE, SIG_IGN);
+
+	// Keep signals on the main thread
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+	if (pthread_create(&alm_ctl_tid, NULL, alm_ctl_thread, NULL)) {
+		printf("alm_ctl_start: Couldn't start control thread\n");
+	} else {
+		alm_ctl_thread_running = 1;
+		printf("Control socket on %s\n", alm_ctl_socket);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	return alm_ctl_thread_running ? 0 : -1;
+}
+
+int alm_ctl_running() {
+
+	return alm_ctl_thread_running;
+}
+
+int alm_ctl_poll() {
+
+	char cmd[CTL_LINESIZE];
+	int outfd, oldfd, result;
+
+	if (alm_ctl_state != CTL_PENDING)
+		return 0;
+
+	pthread_mutex_lock(&alm_ctl_lock);
+	if (alm_ctl_state != CTL_PENDING) {
+		pthread_mutex_unlock(&alm_ctl_lock);
+		return 0;
+	}
+	alm_ctl_state = CTL_RUNNING;
+	strcpy(cmd, alm_ctl_cmd);
+	pthread_mutex_unlock(&alm_ctl_lock);
+
+	// Output goes to the file, never straight to the connection, so writing
+	// it can't hold up the main loop. The thread sends it on.
+	outfd = fileno(alm_ctl_out);
+	ftruncate(outfd, 0);
+	lseek(outfd, 0, SEEK_SET);
+	oldfd = alm_print_fd;
+	alm_print_fd = outfd;
+	result = alm_cmd_exec(cmd, 0);
+	alm_print_fd = oldfd;
+
+	pthread_mutex_lock(&alm_ctl_lock);
+	alm_ctl_result = result;
+	alm_ctl_state = CTL_DONE;
+	pthread_cond_signal(&alm_ctl_cond);
+	pthread_mutex_unlock(&alm_ctl_lock);
+
+	return 1;
+}
+
+static void alm_ctl_printval(char *name, long long val) {
+
+	safe_print(name);
+	safe_print("=");
+	if (val < 0) {
+		safe_print("-");
+		val = -val;
+	}
+	safe_print_num(val);
+	safe_print("\n");
+}
+
+/* Can be called from signal handler */
+int alm_ctl_printstatus() {
+
+	static char *clusterroles[] = { "none", "coordinator", "node" };
+	static char *replroles[] = { "none", "primary", "standby" };
+	int i, n;
+
+	alm_ctl_printval("uptime", time(NULL) - alm_ctl_started);
+	alm_ctl_printval("requests", alm_request_serial);
+	alm_ctl_printval("ports", alm_dev_ports);
+	alm_ctl_printval("disks", mmm_numdisks);
+
+	for (i=0, n=0; fileinfo && i<MAXFILES; i++)
+		n += fileinfo[i].used && !fileinfo[i].trap;
+	alm_ctl_printval("open_files", n);
+
+	for (i=0, n=0; i<alm_osl_ports; i++)
+		n += alm_osl_xfers[i].active;
+	alm_ctl_printval("booting", n);
+
+	alm_ctl_printval("cache_kb", alm_cache_used / 1024);
+	alm_ctl_printval("cache_dirty", alm_cache_dirtyents);
+	alm_ctl_printval("cache_hits", alm_cache_stats.hits);
+	alm_ctl_printval("cache_misses", alm_cache_stats.misses);
+
+	safe_print("cluster=");
+	safe_print(clusterroles[alm_cluster_role]);
+	safe_print("\nreplication=");
+	safe_print(replroles[alm_repl_role]);
+	safe_print("\n");
+	if (alm_repl_role == REPL_PRIMARY)
+		alm_ctl_printval("repl_lag", alm_repl_lag());
+
+	return 0;
+}
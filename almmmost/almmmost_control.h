@@ -0,0 +1,88 @@
+/* almmmost_control.h: Control socket for administering Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_CONTROL_H
+#define _ALMMMOST_CONTROL_H
+
+/* The control socket takes the same commands as the ^C command line, one
+ * per line, without stopping the server while someone types. A thread
+ * accepts connections and reads commands; abort and locate are done right
+ * away, as they're for when the main loop is stuck. Anything else is handed
+ * to the main loop, which runs it between client requests with its output
+ * going to a scratch file. The thread then queues that for the connection,
+ * and sends it as the other end reads, so a client that stops reading can't
+ * hold up the main loop. Each command's output ends with a line that is
+ * either OK or ERR.
+ */
+
+#define CTL_DEFAULT_SOCKET RUNDIR "/ctl.sock"
+#define CTL_MAXCONN (8)
+#define CTL_LINESIZE (1024)
+#define CTL_TIMEOUT (10)	// Seconds to wait for the main loop to take a command
+#define CTL_MAXOUT (1024*1024)	// Unsent output a connection can have before it's dropped
+
+#define CTL_IDLE (0)
+#define CTL_PENDING (1)		// Waiting for the main loop
+#define CTL_RUNNING (2)
+#define CTL_DONE (3)
+
+struct ctl_conn_t {
+	int fd;			// -1 if not in use
+	int got;
+	char buf[CTL_LINESIZE];
+	char *out;		// Output, out[outpos] to out[outlen] still to be sent
+	size_t outpos;
+	size_t outlen;
+	size_t outsize;
+};
+
+extern char alm_ctl_socket[];
+
+/* Initialize variables */
+int alm_ctl_init();
+
+/* Stop the thread and remove the socket */
+int alm_ctl_exit();
+
+/* Parse config file section */
+int alm_ctl_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Open the socket and start the thread */
+int alm_ctl_start();
+
+/* 1 if the control socket is up */
+int alm_ctl_running();
+
+/* From the main loop: run a command that's waiting */
+int alm_ctl_poll();
+
+/* Print server status as name=value lines */
+/* Can be called from signal handler */
+int alm_ctl_printstatus();
+
+#endif /* _ALMMMOST_CONTROL_H */
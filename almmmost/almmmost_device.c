@@ -41,22 +41,48 @@
 #include "almmmost.h"
 #include "almmmost_device.h"
 
-int alm_dev_fd[MAXUSER];
-int alm_dev_pnum[MAXUSER];
+int *alm_dev_fd = NULL;
+int *alm_dev_pnum = NULL;
 int alm_dev_ports;
 
 int alm_dev_init() {
 
+	alm_dev_fd = NULL;
+	alm_dev_pnum = NULL;
+	alm_dev_ports = 0;
+
+	return 0;
+
+}
+
+/* Size the device tables, all closed */
+static int alm_dev_alloc(int ports) {
+
 	int i;
 
-	for (i=0;i<MAXUSER;i++) {
+	if (alm_dev_fd) {
+		printf("Ports already set to %d\n", alm_dev_ports);
+		return -1;
+	} else if (ports < 0 || ports > TVI_SDLC_NUM_PORTS) {
+		// One tvi_sdlc device, the chip selects of one board stack
+		printf("Ports %d out of range, 0 - %d\n", ports, TVI_SDLC_NUM_PORTS);
+		return -1;
+	}
+
+	// A cluster coordinator can run with no ports of its own
+	alm_dev_fd = malloc((ports ? ports : 1) * sizeof(int));
+	alm_dev_pnum = malloc((ports ? ports : 1) * sizeof(int));
+	if (!alm_dev_fd || !alm_dev_pnum) {
+		perror("Allocating devices");
+		exit(1);
+	}
+	for (i=0; i<ports; i++) {
 		alm_dev_fd[i] = -1;
 		alm_dev_pnum[i] = -1;
 	}
-	alm_dev_ports = 0;
+	alm_dev_ports = ports;
 
 	return 0;
-
 }
 
 int alm_dev_ini(struct INI *ini, const char *buf, size_t sectlen) {
@@ -89,7 +115,7 @@ int alm_dev_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			int dev_fd;
 			unsigned int devnum = strtoul(kbuf+9, NULL, 0);
 
-			if (devnum >= MAXUSER || alm_dev_fd[devnum] >= 0) {
+			if (devnum >= alm_dev_ports || alm_dev_fd[devnum] >= 0) {
 				printf("Bad or opened device number %d\n", devnum);
 				break;
 			}
@@ -97,7 +123,7 @@ int alm_dev_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			dev_fname = alloca(vallen+1);
 			string_copy(dev_fname, vbuf, vallen);
 
-			dev_fd = open(dev_fname, O_RDWR);
+			dev_fd = open(dev_fname, O_RDWR | O_CLOEXEC);
 			if (dev_fd < 0) {
 				perror("Opening device");
 				break;
@@ -111,12 +137,16 @@ int alm_dev_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			unsigned int devnum = strtoul(kbuf+10, NULL, 0);
 			int portnum;
 
-			if (devnum >= MAXUSER || alm_dev_fd[devnum] < 0) {
+			if (devnum >= alm_dev_ports || alm_dev_fd[devnum] < 0) {
 				printf("Bad or unopened device number %d\n", devnum);
 				break;
 			}
 
 			portnum = strtol(vbuf, NULL, 0);
+			if (portnum < 0 || portnum >= TVI_SDLC_NUM_PORTS) {
+				printf("Port number %d out of range for device %d\n", portnum, devnum);
+				break;
+			}
 
 			retval = ioctl(alm_dev_fd[devnum], TVI_SDLC_IOCTL_SET_PORT, TVI_SDLC_IOCTL_DATA(portnum,0));
 			
@@ -128,14 +158,14 @@ int alm_dev_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			//printf("User %d port = %d\n", devnum, portnum);
 
 		} else if (!strncasecmp(kbuf, "Ports", 5)) {
-			// Number of ports
-			alm_dev_ports = strtol(vbuf, NULL,0);
+			// Number of ports, before any User Dev
+			alm_dev_alloc(strtol(vbuf, NULL,0));
 			//printf("Ports = %d\n", alm_dev_ports);
 		}
 	} while (1);
 
 	// Check that we set 8530 port #s for each port
-	for (i=0;i<MAXUSER;i++) {
+	for (i=0;i<alm_dev_ports;i++) {
 		if (alm_dev_fd[i] >= 0 && alm_dev_pnum[i] < 0) {
 			printf("Device %d opened but no port number set; closing.\n", i);
 			close(alm_dev_fd[i]);
@@ -160,13 +190,19 @@ int alm_dev_exit() {
 		}
 	}
 
+	free(alm_dev_fd);
+	free(alm_dev_pnum);
+	alm_dev_fd = NULL;
+	alm_dev_pnum = NULL;
+	alm_dev_ports = 0;
+
 	return 0;
 
 }
 
 int alm_dev_reset(int portnum) {
 	
-	if (portnum < 0 || portnum >= MAXUSER)
+	if (portnum < 0 || portnum >= alm_dev_ports)
 		return -1;
 
 	if (alm_dev_fd[portnum] < 0 || alm_dev_pnum[portnum] < 0)
@@ -175,8 +211,8 @@ int alm_dev_reset(int portnum) {
 	ioctl(alm_dev_fd[portnum], TVI_SDLC_IOCTL_RESET, TVI_SDLC_IOCTL_DATA(alm_dev_pnum[portnum],0));
 
 	// Re-init both requested port and other port on same chip
-	ioctl(alm_dev_fd[portnum], TVI_SDLC_IOCTL_INIT, TVI_SDLC_IOCTL_DATA(alm_dev_pnum[portnum & 0xFE],0));
-	ioctl(alm_dev_fd[portnum], TVI_SDLC_IOCTL_INIT, TVI_SDLC_IOCTL_DATA(alm_dev_pnum[portnum | 0x1],0));
+	ioctl(alm_dev_fd[portnum], TVI_SDLC_IOCTL_INIT, TVI_SDLC_IOCTL_DATA((alm_dev_pnum[portnum] & ~1),0));
+	ioctl(alm_dev_fd[portnum], TVI_SDLC_IOCTL_INIT, TVI_SDLC_IOCTL_DATA((alm_dev_pnum[portnum] | 1),0));
 
 	return 0;
 
@@ -184,7 +220,7 @@ int alm_dev_reset(int portnum) {
 
 int alm_dev_check_cts(int portnum) {
 
-	if (portnum < 0 || portnum >= MAXUSER)
+	if (portnum < 0 || portnum >= alm_dev_ports)
 		return -1;
 
 	if (alm_dev_fd[portnum] < 0 || alm_dev_pnum[portnum] < 0)
@@ -196,7 +232,7 @@ int alm_dev_check_cts(int portnum) {
 
 int alm_dev_read(void *buf, size_t size, int portnum) {
 
-	if (!buf || size < 1 || portnum < 0 || portnum >= MAXUSER)
+	if (!buf || size < 1 || portnum < 0 || portnum >= alm_dev_ports)
 		return -1;
 
 	if (alm_dev_fd[portnum] < 0 || alm_dev_pnum[portnum] < 0)
@@ -207,7 +243,7 @@ int alm_dev_read(void *buf, size_t size, int portnum) {
 
 int alm_dev_write(void *buf, size_t size, int portnum) {
 
-	if (!buf || size < 1 || portnum < 0 || portnum >= MAXUSER)
+	if (!buf || size < 1 || portnum < 0 || portnum >= alm_dev_ports)
 		return -1;
 
 	if (alm_dev_fd[portnum] < 0 || alm_dev_pnum[portnum] < 0)
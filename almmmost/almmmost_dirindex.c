@@ -0,0 +1,682 @@
+/* almmmost_dirindex.c: Directory index and block map sidecar files for Almmmost
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_image.h"
+#include "almmmost_file.h"
+#include "almmmost_cluster.h"
+#include "almmmost_dirindex.h"
+
+/* Reading a public drive's directory an entry at a time to build its block
+ * map is slow on big images, and every open used to look through the whole
+ * directory for the file. Each public image gets a sidecar file, <image>.idx,
+ * with the block map and a 16 bit hash of the user and name of each
+ * directory entry, so opens only read the entries that might match.
+ *
+ * At startup a sidecar that matches the image's size and mtime is loaded
+ * with one read. The thread then checks its checksum against the directory
+ * records, and without a good sidecar the thread builds the map from them
+ * instead. Until then blocks can't be allocated or freed on that drive, so
+ * those wait in alm_dix_wait(). The sidecars are written again at exit,
+ * once everything's on disk.
+ */
+
+int alm_dix_sidecar = 1;
+char alm_dix_dir[INPBUFSIZE];
+
+struct dix_disk_t alm_dix_disks[MAXDISK];
+
+pthread_t alm_dix_tid;
+int alm_dix_running = 0;
+int alm_dix_stop = 0;			// Under alm_dix_lock
+pthread_mutex_t alm_dix_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t alm_dix_cond = PTHREAD_COND_INITIALIZER;
+volatile int alm_dix_results = 0;	// Bumped by the thread when a job's done
+int alm_dix_seen = 0;
+
+static void *alm_dix_thread(void *arg);
+
+int alm_dix_init() {
+
+	memset(alm_dix_disks, 0, sizeof(alm_dix_disks));
+	alm_dix_sidecar = 1;
+	alm_dix_dir[0] = 0;
+	alm_dix_running = 0;
+	alm_dix_stop = 0;
+	alm_dix_results = 0;
+	alm_dix_seen = 0;
+
+	return 0;
+}
+
+int alm_dix_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Sidecar Dir", 11)) {
+			if (vallen >= INPBUFSIZE)
+				vallen = INPBUFSIZE - 1;
+			memcpy(alm_dix_dir, vbuf, vallen);
+			alm_dix_dir[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Sidecar", 7)) {
+			alm_dix_sidecar = ((vbuf[0] & 0x5F) == 'Y');
+		}
+	} while (1);
+
+	return 0;
+}
+
+int alm_dix_setimage(int disk, const char *filename) {
+
+	if (disk < 0 || disk >= MAXDISK)
+		return -1;
+	free(alm_dix_disks[disk].image);
+	alm_dix_disks[disk].image = strdup(filename);
+
+	return 0;
+}
+
+/* Sidecar file name for disk */
+static int alm_dix_path(int disk, char *buf, size_t buflen) {
+
+	const char *image = alm_dix_disks[disk].image;
+	const char *base;
+
+	if (!image)
+		return -1;
+	if (alm_dix_dir[0]) {
+		base = strrchr(image, '/');
+		snprintf(buf, buflen, "%s/%s" DIX_SUFFIX, alm_dix_dir, base ? base+1 : image);
+	} else {
+		snprintf(buf, buflen, "%s" DIX_SUFFIX, image);
+	}
+
+	return 0;
+}
+
+/* 32 bit FNV-1a */
+static uint32_t alm_dix_sum(const uint8_t *buf, size_t len) {
+
+	uint32_t hash = 0x811c9dc5;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		hash ^= buf[i];
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+/* Key of a user code and name, the same way alm_same_file() compares them */
+static uint16_t alm_dix_hash(uint8_t user, const uint8_t *fname, const uint8_t *fext) {
+
+	uint8_t name[12];
+	uint32_t hash;
+	int i;
+
+	name[0] = user;
+	for (i=0; i<8; i++)
+		name[1+i] = fname[i] & 0x7F;
+	for (i=0; i<3; i++)
+		name[9+i] = fext[i] & 0x7F;
+	hash = alm_dix_sum(name, sizeof(name));
+	hash = (hash >> 16) ^ (hash & 0xFFFF);
+
+	return hash != DIX_FREE ? hash : 1;
+}
+
+/* Key of a directory entry, DIX_FREE if it's deleted */
+static uint16_t alm_dix_dekey(const struct cpm_direntry_t *de) {
+
+	if (de->user == 0xe5)
+		return DIX_FREE;
+
+	return alm_dix_hash(de->user, de->fname, de->fext);
+}
+
+int alm_dix_key(int usrcode, const uint8_t *fname, const uint8_t *fext) {
+
+	int i;
+
+	for (i=0; i<8; i++)
+		if (fname[i] == '?')
+			return DIX_ANY;
+	for (i=0; i<3; i++)
+		if (fext[i] == '?')
+			return DIX_ANY;
+
+	return alm_dix_hash(usrcode, fname, fext);
+}
+
+int alm_dix_markde(int disk, int denum, const struct cpm_direntry_t *de, int *bam, uint16_t *keys) {
+
+	int j;
+	uint16_t block;
+
+	if (keys)
+		keys[denum] = alm_dix_dekey(de);
+	if (de->user == 0xe5)
+		return 0;  // Deleted entry
+	for (j=0; j<16; j++) {
+		if (drvparam[disk].DBM<256) {
+			block = de->blknums[j];
+		} else {
+			block = get_zint16((uint8_t *)de->blknums+j);
+			j++;
+		}
+		if (block)
+			bam[block] = denum + 1;	// 0 is free, so entry 0's blocks count too
+	}
+
+	return 0;
+}
+
+int alm_dix_alloc(int disk) {
+
+	struct dix_disk_t *d = &alm_dix_disks[disk];
+
+	free(d->keys);
+	d->keys = calloc(drvparam[disk].DBL + 1, sizeof(uint16_t));
+	if (!d->keys) {
+		perror("Allocating directory index");
+		exit(1);
+	}
+	d->ready = 1;
+	d->fromfile = 0;
+
+	return 0;
+}
+
+/* Build the map and index from the directory records in the image, and fill
+ * in a header for them. Used by the thread, and at exit.
+ */
+static int alm_dix_build(int disk, int **bamp, uint16_t **keysp, struct dix_hdr_t *hdr) {
+
+	struct drive_param_t *dp = &drvparam[disk];
+	size_t dirlen = (dp->DBL + 1) * DIRENTRYSIZE;
+	uint8_t *dirbuf;
+	int *bam;
+	uint16_t *keys;
+	struct stat st;
+	ssize_t len;
+	int denum;
+
+	// Stamp it first, so a write from here on makes it out of date
+	if (fstat(dp->image_fd[0], &st) < 0)
+		return -1;
+
+	dirbuf = malloc(dirlen);
+	bam = calloc(MAXBLKS, sizeof(int));
+	keys = calloc(dp->DBL + 1, sizeof(uint16_t));
+	if (!dirbuf || !bam || !keys) {
+		perror("Allocating directory index");
+		exit(1);
+	}
+	// Past the end of the image is unused entries
+	memset(dirbuf, 0xe5, dirlen);
+	len = pread(dp->image_fd[0], dirbuf, dirlen, (off_t)dp->dir_rec_min * RECSIZE);
+	if (len < 0) {
+		free(dirbuf);
+		free(bam);
+		free(keys);
+		return -1;
+	}
+
+	for (denum=0; denum<=dp->DBL; denum++)
+		alm_dix_markde(disk, denum, (struct cpm_direntry_t *)(dirbuf + denum*DIRENTRYSIZE), bam, keys);
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, DIX_MAGIC, DIX_MAGICLEN);
+	hdr->size = st.st_size;
+	hdr->mtime_sec = st.st_mtim.tv_sec;
+	hdr->mtime_nsec = st.st_mtim.tv_nsec;
+	hdr->dirsum = alm_dix_sum(dirbuf, dirlen);
+	hdr->dir_rec_min = dp->dir_rec_min;
+	hdr->DBM = dp->DBM;
+	hdr->DBL = dp->DBL;
+	hdr->BSF = dp->BSF;
+	hdr->EXM = dp->EXM;
+	free(dirbuf);
+
+	*bamp = bam;
+	*keysp = keys;
+
+	return 0;
+}
+
+/* Write a sidecar, via a temporary file so a crash never leaves half of one */
+static int alm_dix_savefile(int disk, const struct dix_hdr_t *hdr, const int *bam, const uint16_t *keys) {
+
+	char fname[INPBUFSIZE*2], tmpname[INPBUFSIZE*2+8];
+	int32_t *bam32;
+	size_t bamlen = (hdr->DBM + 1) * sizeof(int32_t);
+	size_t keylen = (hdr->DBL + 1) * sizeof(uint16_t);
+	int fd, i, ok;
+
+	if (alm_dix_path(disk, fname, sizeof(fname)) < 0)
+		return -1;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+
+	bam32 = malloc(bamlen);
+	if (!bam32) {
+		perror("Allocating directory index");
+		exit(1);
+	}
+	for (i=0; i<=hdr->DBM; i++)
+		bam32[i] = bam[i];
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		printf("Couldn't write sidecar %s: %d\n", tmpname, errno);
+		free(bam32);
+		return -1;
+	}
+	ok = (write(fd, hdr, sizeof(*hdr)) == sizeof(*hdr))
+		&& (write(fd, bam32, bamlen) == bamlen)
+		&& (write(fd, keys, keylen) == keylen);
+	close(fd);
+	free(bam32);
+
+	if (!ok || rename(tmpname, fname) < 0) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+int alm_dix_load(int disk) {
+
+	struct drive_param_t *dp = &drvparam[disk];
+	struct dix_disk_t *d = &alm_dix_disks[disk];
+	char fname[INPBUFSIZE*2];
+	size_t bamlen = (dp->DBM + 1) * sizeof(int32_t);
+	size_t keylen = (dp->DBL + 1) * sizeof(uint16_t);
+	struct dix_hdr_t *hdr;
+	struct stat st;
+	uint8_t *buf;
+	int32_t *bam32;
+	ssize_t len;
+	int fd, i;
+
+	if (disk >= MAXDISK || !alm_dix_sidecar || !alm_dix_running || !d->image || dp->image_fd[0] < 0)
+		return -1;
+
+	d->ready = 0;
+	d->fromfile = 0;
+	d->dirwrites = 0;
+	d->jobwrites = 0;
+
+	// All of it in one read
+	buf = malloc(sizeof(*hdr) + bamlen + keylen);
+	if (!buf) {
+		perror("Allocating directory index");
+		exit(1);
+	}
+	hdr = (struct dix_hdr_t *)buf;
+	len = -1;
+	if (alm_dix_path(disk, fname, sizeof(fname)) == 0 && (fd = open(fname, O_RDONLY | O_CLOEXEC)) >= 0) {
+		len = read(fd, buf, sizeof(*hdr) + bamlen + keylen);
+		close(fd);
+	}
+
+	if (len != sizeof(*hdr) + bamlen + keylen || fstat(dp->image_fd[0], &st) < 0
+			|| memcmp(hdr->magic, DIX_MAGIC, DIX_MAGICLEN)
+			|| hdr->size != st.st_size || hdr->mtime_sec != st.st_mtim.tv_sec
+			|| hdr->mtime_nsec != st.st_mtim.tv_nsec
+			|| hdr->dir_rec_min != dp->dir_rec_min || hdr->DBM != dp->DBM
+			|| hdr->DBL != dp->DBL || hdr->BSF != dp->BSF || hdr->EXM != dp->EXM) {
+		free(buf);
+		printf("Disk %c: building block map\n", 'A'+disk);
+		free(d->keys);
+		d->keys = NULL;
+		pthread_mutex_lock(&alm_dix_lock);
+		d->jobwrites = d->dirwrites;	// Writes after this one the job may not see
+		d->state = DIX_REBUILD;
+		pthread_cond_signal(&alm_dix_cond);
+		pthread_mutex_unlock(&alm_dix_lock);
+		return 1;
+	}
+
+	memset(dp->bam, 0, sizeof(int) * MAXBLKS);
+	bam32 = (int32_t *)(buf + sizeof(*hdr));
+	for (i=0; i<=dp->DBM; i++)
+		dp->bam[i] = bam32[i];
+	free(d->keys);
+	d->keys = malloc(keylen);
+	if (!d->keys) {
+		perror("Allocating directory index");
+		exit(1);
+	}
+	memcpy(d->keys, buf + sizeof(*hdr) + bamlen, keylen);
+	d->dirsum = hdr->dirsum;
+	d->fromfile = 1;
+	free(buf);
+
+	printf("Disk %c: block map from %s\n", 'A'+disk, fname);
+	pthread_mutex_lock(&alm_dix_lock);
+	d->jobwrites = d->dirwrites;
+	d->state = DIX_VERIFY;
+	pthread_cond_signal(&alm_dix_cond);
+	pthread_mutex_unlock(&alm_dix_lock);
+
+	return 0;
+}
+
+/* Rebuild a map, or check the checksum of a loaded one */
+static void *alm_dix_thread(void *arg) {
+
+	struct dix_disk_t *d;
+	struct dix_hdr_t hdr;
+	int *bam;
+	uint16_t *keys;
+	int disk, state, retval;
+
+	pthread_mutex_lock(&alm_dix_lock);
+	while (!alm_dix_stop) {
+		for (disk=0; disk<mmm_numdisks && disk<MAXDISK; disk++)
+			if (alm_dix_disks[disk].state == DIX_REBUILD || alm_dix_disks[disk].state == DIX_VERIFY)
+				break;
+		if (disk >= mmm_numdisks || disk >= MAXDISK) {
+			pthread_cond_wait(&alm_dix_cond, &alm_dix_lock);
+			continue;
+		}
+		d = &alm_dix_disks[disk];
+		state = d->state;
+		d->state = (state == DIX_REBUILD) ? DIX_REBUILDING : DIX_VERIFYING;
+		pthread_mutex_unlock(&alm_dix_lock);
+
+		retval = alm_dix_build(disk, &bam, &keys, &hdr);
+		if (state == DIX_VERIFY) {
+			d->mismatch = retval < 0 || hdr.dirsum != d->dirsum;
+			if (!retval) {
+				free(bam);
+				free(keys);
+			}
+		} else if (retval < 0) {
+			// The main loop reads the directory itself
+			d->newbam = NULL;
+			d->newkeys = NULL;
+		} else {
+			alm_dix_savefile(disk, &hdr, bam, keys);
+			d->newbam = bam;
+			d->newkeys = keys;
+		}
+
+		pthread_mutex_lock(&alm_dix_lock);
+		d->state = (state == DIX_REBUILD) ? DIX_REBUILT : DIX_VERIFIED;
+		alm_dix_results++;
+		pthread_cond_broadcast(&alm_dix_cond);
+	}
+	pthread_mutex_unlock(&alm_dix_lock);
+
+	return NULL;
+}
+
+int alm_dix_start() {
+
+	sigset_t allsigs, oldsigs;
+
+	if (!alm_dix_sidecar || alm_dix_running)
+		return 0;
+
+	// Keep signals on the main thread
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+	if (pthread_create(&alm_dix_tid, NULL, alm_dix_thread, NULL)) {
+		printf("alm_dix_start: Couldn't start directory index thread\n");
+	} else {
+		alm_dix_running = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	return alm_dix_running ? 0 : -1;
+}
+
+/* Index entries again through the cache, after directory writes the
+ * thread didn't see
+ */
+static int alm_dix_rekey(int disk) {
+
+	struct dix_disk_t *d = &alm_dix_disks[disk];
+	struct cpm_direntry_t de;
+	int denum;
+
+	for (denum=0; denum<=drvparam[disk].DBL; denum++) {
+		if (alm_file_readde(disk, denum, &de) < 0)
+			return -1;
+		d->keys[denum] = alm_dix_dekey(&de);
+	}
+
+	return 0;
+}
+
+/* Take a finished job's result */
+static int alm_dix_finish(int disk) {
+
+	struct dix_disk_t *d = &alm_dix_disks[disk];
+	int state;
+
+	pthread_mutex_lock(&alm_dix_lock);
+	state = d->state;
+	if (state == DIX_REBUILT || state == DIX_VERIFIED)
+		d->state = DIX_IDLE;
+	pthread_mutex_unlock(&alm_dix_lock);
+
+	if (state == DIX_REBUILT) {
+		if (!d->newbam) {
+			printf("Disk %c: couldn't read the directory in the background\n", 'A'+disk);
+			alm_file_scanbam(disk);
+			return 0;
+		}
+		memcpy(drvparam[disk].bam, d->newbam, sizeof(int) * MAXBLKS);
+		free(d->newbam);
+		free(d->keys);
+		d->keys = d->newkeys;
+		d->newbam = NULL;
+		d->newkeys = NULL;
+		if (d->dirwrites != d->jobwrites)
+			alm_dix_rekey(disk);
+		d->ready = 1;
+		printf("Disk %c: block map built\n", 'A'+disk);
+	} else if (state == DIX_VERIFIED) {
+		if (d->mismatch) {
+			// No blocks have moved while it wasn't ready, so the directory has it right
+			printf("Disk %c: sidecar doesn't match the directory, reading it again\n", 'A'+disk);
+			alm_file_scanbam(disk);
+		} else {
+			d->ready = 1;
+		}
+	}
+
+	return 0;
+}
+
+int alm_dix_written(int disk, int dir, int rec, const void *buf, int nrecs) {
+
+	struct dix_disk_t *d;
+	const uint8_t *recbuf = buf;
+	int first, ndirrecs, denum, i, j;
+
+	if (disk < 0 || disk >= MAXDISK || dir || drvparam[disk].public_private != PUBLDIR)
+		return 0;
+	d = &alm_dix_disks[disk];
+	first = drvparam[disk].dir_rec_min;
+	ndirrecs = (drvparam[disk].DBL + 4) / 4;
+
+	for (i=0; i<nrecs; i++) {
+		if (rec+i < first || rec+i >= first + ndirrecs)
+			continue;
+		d->dirwrites++;
+		if (!d->keys)
+			continue;
+		for (j=0; j<4; j++) {
+			denum = (rec+i-first)*4 + j;
+			if (denum <= drvparam[disk].DBL)
+				d->keys[denum] = alm_dix_dekey((const struct cpm_direntry_t *)(recbuf + i*RECSIZE + j*DIRENTRYSIZE));
+		}
+	}
+
+	return 0;
+}
+
+int alm_dix_next(int disk, int denum, int key) {
+
+	struct dix_disk_t *d;
+
+	if (key == DIX_ANY || disk < 0 || disk >= MAXDISK)
+		return denum;
+	d = &alm_dix_disks[disk];
+	if (!d->ready || !d->keys)
+		return denum;
+	while (denum <= drvparam[disk].DBL && d->keys[denum] != key)
+		denum++;
+
+	return denum;
+}
+
+int alm_dix_wait(int disk) {
+
+	struct dix_disk_t *d;
+
+	if (disk < 0 || disk >= MAXDISK)
+		return 0;
+	d = &alm_dix_disks[disk];
+	if (d->ready || !alm_dix_running)
+		return 0;
+
+	pthread_mutex_lock(&alm_dix_lock);
+	while (d->state == DIX_REBUILD || d->state == DIX_REBUILDING
+			|| d->state == DIX_VERIFY || d->state == DIX_VERIFYING)
+		pthread_cond_wait(&alm_dix_cond, &alm_dix_lock);
+	pthread_mutex_unlock(&alm_dix_lock);
+
+	return alm_dix_finish(disk);
+}
+
+int alm_dix_poll() {
+
+	int disk;
+
+	if (alm_dix_seen == alm_dix_results)
+		return 0;
+	alm_dix_seen = alm_dix_results;
+
+	for (disk=0; disk<mmm_numdisks && disk<MAXDISK; disk++)
+		alm_dix_finish(disk);
+
+	return 0;
+}
+
+int alm_dix_exit() {
+
+	struct dix_hdr_t hdr;
+	int *bam;
+	uint16_t *keys;
+	int disk;
+
+	if (alm_dix_running) {
+		pthread_mutex_lock(&alm_dix_lock);
+		alm_dix_stop = 1;
+		pthread_cond_broadcast(&alm_dix_cond);
+		pthread_mutex_unlock(&alm_dix_lock);
+		pthread_join(alm_dix_tid, NULL);
+	}
+
+	for (disk=0; disk<mmm_numdisks && disk<MAXDISK; disk++) {
+		// Everything's written out now, so this is what the next start will see
+		if (alm_dix_running && drvparam[disk].public_private == PUBLDIR
+				&& drvparam[disk].image_fd[0] >= 0 && alm_cluster_role != CLUSTER_NODE
+				&& alm_dix_build(disk, &bam, &keys, &hdr) == 0) {
+			alm_dix_savefile(disk, &hdr, bam, keys);
+			free(bam);
+			free(keys);
+		}
+		free(alm_dix_disks[disk].newbam);
+		free(alm_dix_disks[disk].newkeys);
+	}
+	for (disk=0; disk<MAXDISK; disk++) {
+		free(alm_dix_disks[disk].image);
+		free(alm_dix_disks[disk].keys);
+	}
+
+	return alm_dix_init();
+}
+
+/* Can be called from signal handler */
+int alm_dix_printstats() {
+
+	static const char *states[] = { "idle", "rebuild queued", "rebuilding", "rebuilt",
+		"check queued", "checking", "checked" };
+	struct dix_disk_t *d;
+	int disk;
+
+	safe_print("Sidecars: ");
+	safe_print(alm_dix_sidecar ? (alm_dix_running ? "on\n" : "not running\n") : "off\n");
+	for (disk=0; disk<mmm_numdisks && disk<MAXDISK; disk++) {
+		if (drvparam[disk].public_private != PUBLDIR)
+			continue;
+		d = &alm_dix_disks[disk];
+		safe_print("Disk ");
+		safe_print_num(disk);
+		safe_print(d->ready ? ": ready" : ": not ready");
+		safe_print(d->fromfile ? ", from sidecar, " : ", read from directory, ");
+		safe_print((char *)states[d->state]);
+		safe_print(d->keys ? ", indexed, " : ", not indexed, ");
+		safe_print_num((int)d->dirwrites);
+		safe_print(" directory writes\n");
+	}
+
+	return 0;
+}
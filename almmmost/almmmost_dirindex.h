@@ -0,0 +1,129 @@
+/* almmmost_dirindex.h: Directory index and block map sidecar files for Almmmost
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_DIRINDEX_H
+#define _ALMMMOST_DIRINDEX_H
+
+#define DIX_MAGIC "ALMDIX01"
+#define DIX_MAGICLEN (8)
+#define DIX_SUFFIX ".idx"
+#define DIX_FREE (0)		// Key of a deleted directory entry
+#define DIX_ANY (-1)		// alm_dix_next() key that matches everything
+
+/* Where a disk's block map stands */
+#define DIX_IDLE (0)		// Loaded, or not in use
+#define DIX_REBUILD (1)		// Waiting for the thread to rebuild it
+#define DIX_REBUILDING (2)
+#define DIX_REBUILT (3)		// New map ready for the main loop
+#define DIX_VERIFY (4)		// Loaded from the sidecar, checksum to check
+#define DIX_VERIFYING (5)
+#define DIX_VERIFIED (6)	// Checksum checked, result ready
+
+/* On disk, in <image>.idx: the header, then int32_t bam[DBM+1], then
+ * uint16_t keys[DBL+1]. It's good while the image has the same size and
+ * mtime, and dirsum is a check on the directory records themselves.
+ */
+struct dix_hdr_t {
+	char magic[DIX_MAGICLEN];
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t dirsum;	// FNV-1a of the directory records
+	uint32_t dir_rec_min;
+	uint16_t DBM;
+	uint16_t DBL;
+	uint16_t BSF;
+	uint16_t EXM;
+};
+
+struct dix_disk_t {
+	char *image;		// Image file for dir 0, the sidecar goes with it
+	uint16_t *keys;		// Hash of user and name for each entry, DIX_FREE if deleted
+	int state;		// DIX_*, under alm_dix_lock
+	int ready;		// drvparam[].bam can be used
+	int fromfile;		// Loaded from the sidecar, not built
+	int mismatch;		// Checksum didn't match the directory
+	uint32_t dirsum;	// From the sidecar
+	unsigned long dirwrites;	// Directory record writes seen
+	unsigned long jobwrites;	// dirwrites when the thread's job started
+	int *newbam;		// Thread's rebuilt map and index
+	uint16_t *newkeys;
+};
+
+extern int alm_dix_sidecar;		// Keep sidecar files
+extern char alm_dix_dir[];		// Put them here instead of next to the images
+extern struct dix_disk_t alm_dix_disks[];
+
+/* Initialize variables */
+int alm_dix_init();
+
+/* Stop the thread, write out sidecars for the public drives and free everything.
+ * Call once the cache has been written out.
+ */
+int alm_dix_exit();
+
+/* Process config file */
+int alm_dix_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Note the image file of a disk's dir 0 */
+int alm_dix_setimage(int disk, const char *filename);
+
+/* Start the thread that checks and rebuilds block maps */
+int alm_dix_start();
+
+/* Fill in drvparam[disk].bam and the index from the sidecar. Returns 0 if
+ * that worked, 1 if the thread is rebuilding them, or -1 if the caller has
+ * to read the directory itself.
+ */
+int alm_dix_load(int disk);
+
+/* Set up an empty index, for the caller to fill with alm_dix_markde() */
+int alm_dix_alloc(int disk);
+
+/* Mark directory entry denum's blocks in bam and its key in keys */
+int alm_dix_markde(int disk, int denum, const struct cpm_direntry_t *de, int *bam, uint16_t *keys);
+
+/* Key for a user code and file name, or DIX_ANY if the name has wildcards */
+int alm_dix_key(int usrcode, const uint8_t *fname, const uint8_t *fext);
+
+/* First entry from denum on that may have key, DBL+1 if none do */
+int alm_dix_next(int disk, int denum, int key);
+
+/* Keep the index up to date with directory records being written */
+int alm_dix_written(int disk, int dir, int rec, const void *buf, int nrecs);
+
+/* Wait for a rebuild of disk's block map to finish */
+int alm_dix_wait(int disk);
+
+/* Put rebuilt maps in place and act on checksum results, from the main loop */
+int alm_dix_poll();
+
+/* Print the state of each public drive's map */
+/* Can be called from signal handler */
+int alm_dix_printstats();
+
+#endif /* _ALMMMOST_DIRINDEX_H */
@@ -0,0 +1,950 @@
+/* almmmost_fetch.c: The background URL fetch module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#define _GNU_SOURCE		// posix_spawn_file_actions_addclosefrom_np
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_fetch.h"
+#include "almmmost_urlcache.h"
+
+/* URL fetches for the special files run on their own thread, so a slow web
+ * server only holds up the client that asked for the page instead of every
+ * port. The thread drives all running transfers with one curl multi handle,
+ * and sleeps in curl_multi_wait() on the sockets plus a wakeup pipe.
+ *
+ * Data is handed to the client as it arrives, a record at a time, through
+ * each job's ring buffer. When the ring fills up the write callback pauses
+ * the transfer; the client reading on frees space, and the fetch thread
+ * picks the transfer back up. So memory per fetch is bounded by the window
+ * rather than the size of the page.
+ *
+ * Successful responses small enough to cache are also collected whole and
+ * handed to the URL cache when they finish; a job for a cached response
+ * never touches the network and reads straight from the cache entry.
+ *
+ * imgget.sys converts images itself rather than through a CGI script; its
+ * jobs keep the whole download, and the conversion is run here on the fetch
+ * thread once it's complete, so the main loop never waits on it.
+ *
+ * Special files declared as commands in the config use the same machinery:
+ * the fetch thread starts the command with posix_spawn, and reads its output
+ * into the job's ring alongside the transfers, pausing (by not reading) when
+ * the ring is full.
+ *
+ * Jobs are only ever freed by the fetch thread, after the owner has released
+ * them, so releasing a job is just a flag and a byte down the pipe and is
+ * safe from the ^C handler.
+ */
+
+int alm_fetch_timeout = FETCH_DEFAULT_TIMEOUT;
+int alm_fetch_window = FETCH_DEFAULT_WINDOW * 1024;
+
+CURLM *alm_fetch_multi = NULL;
+pthread_t alm_fetch_tid;
+int alm_fetch_running = 0;
+volatile int alm_fetch_stop = 0;
+int alm_fetch_pipe[2] = { -1, -1 };
+
+pthread_mutex_t alm_fetch_qlock = PTHREAD_MUTEX_INITIALIZER;
+struct fetch_job_t *alm_fetch_newjobs = NULL;	// Queued by alm_fetch_start, under qlock
+struct fetch_job_t *alm_fetch_jobs = NULL;	// Owned by the fetch thread
+
+extern char **environ;
+
+static size_t alm_fetch_fillbuf(void *buf, size_t size, size_t nmemb, void *userp);
+static int alm_fetch_rmfile(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+
+int alm_fetch_init() {
+
+	sigset_t allsigs, oldsigs;
+
+	alm_fetch_stop = 0;
+	alm_fetch_newjobs = alm_fetch_jobs = NULL;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	alm_fetch_multi = curl_multi_init();
+	if (!alm_fetch_multi) {
+		printf("alm_fetch_init: Couldn't create curl multi handle\n");
+		return -1;
+	}
+
+	if (pipe(alm_fetch_pipe) < 0) {
+		printf("alm_fetch_init: Couldn't create wakeup pipe: %d\n", errno);
+		return -1;
+	}
+	fcntl(alm_fetch_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(alm_fetch_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(alm_fetch_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(alm_fetch_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	// Keep signals (especially ^C for the command line) on the main thread
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+	if (pthread_create(&alm_fetch_tid, NULL, alm_fetch_thread, NULL)) {
+		printf("alm_fetch_init: Couldn't start fetch thread\n");
+	} else {
+		alm_fetch_running = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	return alm_fetch_running ? 0 : -1;
+}
+
+int alm_fetch_exit() {
+
+	struct fetch_job_t *job;
+
+	if (alm_fetch_running) {
+		alm_fetch_stop = 1;
+		alm_fetch_wake();
+		pthread_join(alm_fetch_tid, NULL);
+		alm_fetch_running = 0;
+	}
+
+	// Nobody is left to read the results
+	while ((job = alm_fetch_jobs)) {
+		alm_fetch_jobs = job->next;
+		if (job->curlp)
+			curl_multi_remove_handle(alm_fetch_multi, job->curlp);
+		alm_fetch_free(job);
+	}
+	while ((job = alm_fetch_newjobs)) {
+		alm_fetch_newjobs = job->next;
+		alm_fetch_free(job);
+	}
+
+	if (alm_fetch_multi)
+		curl_multi_cleanup(alm_fetch_multi);
+	alm_fetch_multi = NULL;
+	if (alm_fetch_pipe[0] >= 0)
+		close(alm_fetch_pipe[0]);
+	if (alm_fetch_pipe[1] >= 0)
+		close(alm_fetch_pipe[1]);
+	alm_fetch_pipe[0] = alm_fetch_pipe[1] = -1;
+
+	return 0;
+}
+
+int alm_fetch_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Timeout", 7)) {
+			// Seconds without data before a transfer is given up on, 0 = never
+			alm_fetch_timeout = strtol(vbuf, NULL, 0);
+			if (alm_fetch_timeout < 0)
+				alm_fetch_timeout = 0;
+		} else if (!strncasecmp(kbuf, "Window", 6)) {
+			// Buffer per fetch in KB
+			alm_fetch_window = strtol(vbuf, NULL, 0) * 1024;
+		}
+	} while (1);
+
+	return 0;
+}
+
+/* Set up a job, not queued yet */
+static struct fetch_job_t *alm_fetch_newjob(const char *handler, const char *url, const char *postfields) {
+
+	struct fetch_job_t *job;
+
+	job = calloc(sizeof(struct fetch_job_t), 1);
+	if (!job)
+		return NULL;
+	pthread_mutex_init(&job->lock, NULL);
+	job->state = FETCH_PENDING;
+	job->owned = 1;
+	job->inputfd = -1;
+	job->execfd = -1;
+	job->handler = strdup(handler);
+	job->url = strdup(url);
+	if (postfields)
+		job->postfields = strdup(postfields);
+	if (!job->handler || !job->url || (postfields && !job->postfields)) {
+		alm_fetch_free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+/* Give a job its ring */
+static int alm_fetch_newring(struct fetch_job_t *job) {
+
+	// Round the window to whole records
+	job->window = (alm_fetch_window < FETCH_MIN_WINDOW) ? FETCH_MIN_WINDOW : alm_fetch_window;
+	job->window = (job->window + RECSIZE - 1) / RECSIZE * RECSIZE;
+	job->buf = malloc(job->window);
+
+	return job->buf ? 0 : -1;
+}
+
+/* Hand a job to the fetch thread */
+static void alm_fetch_queue(struct fetch_job_t *job) {
+
+	struct fetch_job_t **jpp;
+
+	// Add to the end of the queue, so fetches start in the order asked for
+	pthread_mutex_lock(&alm_fetch_qlock);
+	for (jpp = &alm_fetch_newjobs; *jpp; jpp = &((*jpp)->next))
+		;
+	*jpp = job;
+	pthread_mutex_unlock(&alm_fetch_qlock);
+
+	alm_fetch_wake();
+}
+
+/* Queue a fetch of url, a POST if postfields isn't NULL. Returns right away. */
+struct fetch_job_t *alm_fetch_start(const char *handler, const char *url, const char *postfields,
+		int (*convert)(const uint8_t *in, size_t inlen, uint8_t **out, size_t *outlen)) {
+
+	struct fetch_job_t *job;
+	struct urlcache_ent_t *ent;
+
+	if (!alm_fetch_running)
+		return NULL;
+
+	job = alm_fetch_newjob(handler, url, postfields);
+	if (!job)
+		return NULL;
+
+	// Only GETs are cached, a POST may change something every time
+	ent = postfields ? NULL : alm_urlcache_get(handler, url);
+	if (ent) {
+		// Already have it, the fetch thread only has to free it later
+		job->cached = ent;
+		job->flat = ent->data;
+		job->len = ent->len;
+		job->state = FETCH_DONE;
+	} else if (convert) {
+		// Collected whole, the converted result is cached instead of the download
+		job->convert = convert;
+		job->nocache = 1;
+	} else {
+		if (alm_fetch_newring(job) < 0) {
+			alm_fetch_free(job);
+			return NULL;
+		}
+		job->nocache = postfields || !alm_urlcache_maxent();
+	}
+
+	alm_fetch_queue(job);
+
+	return job;
+}
+
+/* Set up and queue a command job, called name in messages */
+static struct fetch_job_t *alm_fetch_newexec(const char *handler, const char *name, char *const argv[],
+		const char *input, const char *scratch) {
+
+	struct fetch_job_t *job;
+	int i, argc;
+
+	if (!alm_fetch_running)
+		return NULL;
+
+	job = alm_fetch_newjob(handler, name, NULL);
+	if (!job)
+		return NULL;
+	for (argc = 0; argv[argc]; argc++);
+	job->argv = calloc(sizeof(char *), argc + 1);
+	for (i = 0; job->argv && i < argc; i++)
+		if (!(job->argv[i] = strdup(argv[i])))
+			break;
+	job->input = strdup(input ? input : "");
+	if (scratch)
+		job->scratch = strdup(scratch);
+	job->nocache = 1;
+	if (!job->argv || i < argc || !job->input || (scratch && !job->scratch) ||
+			alm_fetch_newring(job) < 0) {
+		alm_fetch_free(job);
+		return NULL;
+	}
+
+	alm_fetch_queue(job);
+
+	return job;
+}
+
+/* Queue running command, with input on its stdin. Returns right away. */
+struct fetch_job_t *alm_fetch_exec(const char *handler, const char *command, const char *input) {
+
+	char *argv[] = { "sh", "-c", (char *)command, NULL };
+
+	return alm_fetch_newexec(handler, command, argv, input, NULL);
+}
+
+/* Queue running argv, with input on its stdin. Returns right away. */
+struct fetch_job_t *alm_fetch_execv(const char *handler, char *const argv[], const char *input,
+		const char *scratch) {
+
+	return alm_fetch_newexec(handler, argv[0], argv, input, scratch);
+}
+
+/* Current FETCH_* state of a job */
+int alm_fetch_state(struct fetch_job_t *job) {
+
+	return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE);
+}
+
+/* Copy record rec of a job into buf, returns RECSIZE, 0 if it hasn't
+ * arrived yet, or -1 if past the end or already dropped from the window
+ */
+int alm_fetch_readrec(struct fetch_job_t *job, int rec, uint8_t *buf) {
+
+	size_t off = (size_t)rec * RECSIZE;
+	int state, retval;
+
+	if (job->flat || job->convert) {
+		// Nothing to read until it's all done, then it never changes
+		if (alm_fetch_state(job) == FETCH_PENDING)
+			return 0;
+		if (!job->flat || off >= job->len)
+			return -1;
+		if (off + RECSIZE <= job->len) {
+			memcpy(buf, job->flat + off, RECSIZE);
+		} else {
+			memcpy(buf, job->flat + off, job->len - off);
+			memset(buf + job->len - off, 0x1a, RECSIZE - (job->len - off));
+		}
+		return RECSIZE;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	state = alm_fetch_state(job);
+	if (off < job->start) {
+		printf("Fetch of %s: record %d already dropped from window\n", job->url, rec);
+		retval = -1;
+	} else if (off + RECSIZE <= job->len || (state == FETCH_DONE && off < job->len)) {
+		// Full record, or the ^Z padded last one
+		memcpy(buf, job->buf + (off % job->window), RECSIZE);
+		// Everything before this record can be let go of
+		if (off > job->consumed)
+			job->consumed = off;
+		retval = RECSIZE;
+	} else if (state == FETCH_PENDING) {
+		retval = 0;
+	} else {
+		retval = -1;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	// Let the transfer carry on now there may be room
+	if (retval == RECSIZE && __atomic_load_n(&job->paused, __ATOMIC_ACQUIRE))
+		alm_fetch_wake();
+
+	return retval;
+}
+
+/* Give up a job, cancelling it if it's still running */
+/* Can be called from signal handler */
+int alm_fetch_release(struct fetch_job_t *job) {
+
+	if (!job)
+		return 0;
+
+	__atomic_store_n(&job->owned, 0, __ATOMIC_RELEASE);
+	alm_fetch_wake();
+
+	return 0;
+}
+
+/* Poke the fetch thread out of curl_multi_wait() */
+/* Can be called from signal handler */
+int alm_fetch_wake() {
+
+	if (alm_fetch_pipe[1] >= 0)
+		write(alm_fetch_pipe[1], "", 1);
+
+	return 0;
+}
+
+// Callback for libcurl to write data recieved into the job's ring
+static size_t alm_fetch_fillbuf(void *buf, size_t size, size_t nmemb, void *userp) {
+	size_t bytes=size*nmemb, pos, chunk;
+	struct fetch_job_t *job = (struct fetch_job_t *)userp;
+
+	// Stop early if nobody wants it any more
+	if (!__atomic_load_n(&job->owned, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->convert) {
+		// Converted as a whole once it's all here
+		if (alm_fetch_keep(job, buf, bytes, FETCH_MAX_CONVERT) < 0) {
+			pthread_mutex_unlock(&job->lock);
+			return 0;
+		}
+		job->len += bytes;
+		pthread_mutex_unlock(&job->lock);
+		return bytes;
+	}
+
+	// Fail if we've read more than CP/M can handle
+	if (job->len + bytes > CPMMAXSIZE) {
+		pthread_mutex_unlock(&job->lock);
+		return 0;
+	}
+
+	// Out of room: drop what the client has read, or wait for it to read more
+	if (job->len + bytes - job->start > job->window) {
+		job->start = job->consumed;
+		if (job->len + bytes - job->start > job->window) {
+			__atomic_store_n(&job->paused, 1, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&job->lock);
+			return CURL_WRITEFUNC_PAUSE;
+		}
+	}
+
+	// Keep the whole response for the URL cache, if it's small enough
+	if (!job->nocache && alm_fetch_keep(job, buf, bytes, alm_urlcache_maxent()) < 0) {
+		free(job->whole);
+		job->whole = NULL;
+		job->nocache = 1;
+	}
+
+	// Copy in, wrapping at the end of the ring
+	pos = job->len % job->window;
+	chunk = (bytes < job->window - pos) ? bytes : job->window - pos;
+	memcpy(job->buf + pos, buf, chunk);
+	memcpy(job->buf, (uint8_t *)buf + chunk, bytes - chunk);
+	job->len += bytes;
+	pthread_mutex_unlock(&job->lock);
+
+	return bytes;
+}
+
+/* Append to the job's copy of the whole response, if it stays within max */
+int alm_fetch_keep(struct fetch_job_t *job, const void *buf, size_t bytes, size_t max) {
+
+	size_t newsize;
+	uint8_t *newbuf;
+
+	if (job->len + bytes > max)
+		return -1;
+	if (job->len + bytes > job->wholesize) {
+		newsize = job->wholesize ? job->wholesize * 2 : RECSIZE * 64;
+		while (newsize < job->len + bytes)
+			newsize *= 2;
+		newbuf = realloc(job->whole, newsize);
+		if (!newbuf)
+			return -1;
+		job->whole = newbuf;
+		job->wholesize = newsize;
+	}
+	memcpy(job->whole + job->len, buf, bytes);
+
+	return 0;
+}
+
+/* Fetch thread main loop */
+void *alm_fetch_thread(void *arg) {
+
+	int running, msgsleft, nfds;
+	char drain[64];
+	CURLMsg *msg;
+	struct curl_waitfd waitfds[FETCH_MAX_WAITFDS + 1];
+	struct fetch_job_t *job;
+
+	while (!alm_fetch_stop) {
+		alm_fetch_addjobs();
+		alm_fetch_reap();
+		alm_fetch_unpause();
+
+		curl_multi_perform(alm_fetch_multi, &running);
+
+		while ((msg = curl_multi_info_read(alm_fetch_multi, &msgsleft))) {
+			struct fetch_job_t *job = NULL;
+			CURLcode result = msg->data.result;
+			CURL *curlp = msg->easy_handle;
+			long httpcode = 0;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(curlp, CURLINFO_PRIVATE, (char **)&job);
+			curl_easy_getinfo(curlp, CURLINFO_RESPONSE_CODE, &httpcode);
+			curl_multi_remove_handle(alm_fetch_multi, curlp);
+			curl_easy_cleanup(curlp);
+			if (!job)
+				continue;
+			job->curlp = NULL;
+			if (result != CURLE_OK && __atomic_load_n(&job->owned, __ATOMIC_ACQUIRE))
+				printf("Fetch of %s: %s\n", job->url, curl_easy_strerror(result));
+			if (job->convert) {
+				alm_fetch_convert(job, (result == CURLE_OK) && (httpcode < 400));
+				continue;
+			}
+			// Only cache complete, successful answers
+			if (result == CURLE_OK && httpcode < 400 && job->whole) {
+				alm_urlcache_put(job->handler, job->url, job->whole, job->len);
+				job->whole = NULL;
+			}
+			// Keep whatever arrived before an error, like the old synchronous fetch did
+			alm_fetch_finish(job, (result == CURLE_OK) || (job->len > 0));
+		}
+
+		// Commands: give them what input they'll take, take what output there
+		// is, and wait for more unless paused
+		waitfds[0].fd = alm_fetch_pipe[0];
+		waitfds[0].events = CURL_WAIT_POLLIN;
+		waitfds[0].revents = 0;
+		nfds = 1;
+		for (job = alm_fetch_jobs; job; job = job->next) {
+			if (job->execfd < 0)
+				continue;
+			alm_fetch_execwrite(job);
+			alm_fetch_execread(job);
+			if (job->inputfd >= 0 && nfds <= FETCH_MAX_WAITFDS) {
+				waitfds[nfds].fd = job->inputfd;
+				waitfds[nfds].events = CURL_WAIT_POLLOUT;
+				waitfds[nfds].revents = 0;
+				nfds++;
+			}
+			if (job->execfd < 0 || job->paused || nfds > FETCH_MAX_WAITFDS)
+				continue;
+			waitfds[nfds].fd = job->execfd;
+			waitfds[nfds].events = CURL_WAIT_POLLIN;
+			waitfds[nfds].revents = 0;
+			nfds++;
+		}
+
+		curl_multi_wait(alm_fetch_multi, waitfds, nfds, 1000, NULL);
+		while (read(alm_fetch_pipe[0], drain, sizeof(drain)) > 0)
+			;
+	}
+
+	return NULL;
+}
+
+/* Move newly queued jobs onto the multi handle */
+int alm_fetch_addjobs() {
+
+	struct fetch_job_t *job, *newjobs;
+	CURL *curlp;
+
+	pthread_mutex_lock(&alm_fetch_qlock);
+	newjobs = alm_fetch_newjobs;
+	alm_fetch_newjobs = NULL;
+	pthread_mutex_unlock(&alm_fetch_qlock);
+
+	while ((job = newjobs)) {
+		newjobs = job->next;
+		job->next = alm_fetch_jobs;
+		alm_fetch_jobs = job;
+		if (job->cached)
+			continue;
+		if (job->input) {
+			if (alm_fetch_spawn(job) < 0)
+				alm_fetch_finish(job, 0);
+			continue;
+		}
+
+		curlp = curl_easy_init();
+		if (!curlp) {
+			alm_fetch_finish(job, 0);
+			continue;
+		}
+		curl_easy_setopt(curlp, CURLOPT_URL, job->url);
+		if (job->postfields) {
+			curl_easy_setopt(curlp, CURLOPT_POST, 1L);
+			curl_easy_setopt(curlp, CURLOPT_POSTFIELDSIZE, (long)strlen(job->postfields));
+			curl_easy_setopt(curlp, CURLOPT_POSTFIELDS, job->postfields);
+		}
+		curl_easy_setopt(curlp, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+		curl_easy_setopt(curlp, CURLOPT_WRITEFUNCTION, alm_fetch_fillbuf);
+		curl_easy_setopt(curlp, CURLOPT_WRITEDATA, (void *)job);
+		curl_easy_setopt(curlp, CURLOPT_PRIVATE, (void *)job);
+		curl_easy_setopt(curlp, CURLOPT_USERAGENT, FETCH_USERAGENT);
+		curl_easy_setopt(curlp, CURLOPT_NOSIGNAL, 1L);
+		// Not CURLOPT_TIMEOUT, a transfer may sit paused while the client reads
+		curl_easy_setopt(curlp, CURLOPT_CONNECTTIMEOUT, (long)alm_fetch_timeout);
+		if (alm_fetch_timeout) {
+			curl_easy_setopt(curlp, CURLOPT_LOW_SPEED_LIMIT, 1L);
+			curl_easy_setopt(curlp, CURLOPT_LOW_SPEED_TIME, (long)alm_fetch_timeout);
+		}
+		if (curl_multi_add_handle(alm_fetch_multi, curlp) != CURLM_OK) {
+			curl_easy_cleanup(curlp);
+			alm_fetch_finish(job, 0);
+			continue;
+		}
+		job->curlp = curlp;
+	}
+
+	return 0;
+}
+
+/* Free jobs that their owners have let go of, stopping any still running */
+int alm_fetch_reap() {
+
+	struct fetch_job_t **jpp = &alm_fetch_jobs, *job;
+
+	while ((job = *jpp)) {
+		if (__atomic_load_n(&job->owned, __ATOMIC_ACQUIRE)) {
+			jpp = &(job->next);
+			continue;
+		}
+		*jpp = job->next;
+		if (job->curlp) {
+			curl_multi_remove_handle(alm_fetch_multi, job->curlp);
+			curl_easy_cleanup(job->curlp);
+			job->curlp = NULL;
+		}
+		alm_fetch_free(job);
+	}
+
+	return 0;
+}
+
+/* Restart paused transfers whose clients have read enough to make room */
+int alm_fetch_unpause() {
+
+	struct fetch_job_t *job;
+	int room;
+
+	for (job = alm_fetch_jobs; job; job = job->next) {
+		if (!job->paused || (!job->curlp && job->execfd < 0))
+			continue;
+		pthread_mutex_lock(&job->lock);
+		room = (job->consumed > job->start);
+		pthread_mutex_unlock(&job->lock);
+		if (room) {
+			__atomic_store_n(&job->paused, 0, __ATOMIC_RELEASE);
+			// This can call alm_fetch_fillbuf() straight away, and pause again
+			if (job->curlp)
+				curl_easy_pause(job->curlp, CURLPAUSE_CONT);
+			else
+				job->lastdata = time(NULL);	// Waiting on the client doesn't count
+		}
+	}
+
+	return 0;
+}
+
+/* Start a job's command, with pipes for its stdin and stdout */
+int alm_fetch_spawn(struct fetch_job_t *job) {
+
+	int in[2], out[2], retval;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t nosigs, defsigs;
+
+	if (pipe(in) < 0)
+		return -1;
+	if (pipe(out) < 0) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+	// Only the ends dup'd onto stdin and stdout go to the command
+	fcntl(in[0], F_SETFD, FD_CLOEXEC);
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	fcntl(out[1], F_SETFD, FD_CLOEXEC);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+	posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+	// Nothing else of ours, whatever a thread opened without close-on-exec
+	posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+	// This thread blocks every signal, don't pass that on
+	posix_spawnattr_init(&attr);
+	sigemptyset(&nosigs);
+	sigemptyset(&defsigs);
+	sigaddset(&defsigs, SIGPIPE);
+	posix_spawnattr_setsigmask(&attr, &nosigs);
+	posix_spawnattr_setsigdefault(&attr, &defsigs);
+	// Own process group, so the whole pipeline can be killed if need be
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+	retval = posix_spawnp(&job->pid, job->argv[0], &fa, &attr, job->argv, environ);
+
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	close(in[0]);
+	close(out[1]);
+	if (retval) {
+		printf("Running '%s': %s\n", job->url, strerror(retval));
+		job->pid = 0;
+		close(in[1]);
+		close(out[0]);
+		return -1;
+	}
+
+	// Whatever input doesn't fit in the pipe now goes as the command takes it
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	job->inputfd = in[1];
+	job->inputpos = 0;
+
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	job->execfd = out[0];
+	job->lastdata = time(NULL);
+	alm_fetch_execwrite(job);
+
+	return 0;
+}
+
+/* Write as much of a job's input as its command will take, closing its stdin
+ * once it has all of it, or has stopped reading.
+ */
+int alm_fetch_execwrite(struct fetch_job_t *job) {
+
+	size_t left;
+	ssize_t bytes;
+
+	if (job->inputfd < 0)
+		return 0;
+
+	left = strlen(job->input) - job->inputpos;
+	while (left > 0) {
+		bytes = write(job->inputfd, job->input + job->inputpos, left);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0 && errno == EAGAIN)
+			return 0;
+		if (bytes <= 0)
+			break;		// Exited, or closed its stdin: the rest's not wanted
+		job->inputpos += bytes;
+		left -= bytes;
+		job->lastdata = time(NULL);
+	}
+
+	close(job->inputfd);
+	job->inputfd = -1;
+
+	return 0;
+}
+
+/* Move whatever a job's command has written into its ring */
+int alm_fetch_execread(struct fetch_job_t *job) {
+
+	size_t pos, room;
+	ssize_t bytes = 0;
+	int status;
+
+	if (!__atomic_load_n(&job->owned, __ATOMIC_ACQUIRE) || job->paused)
+		return 0;
+
+	do {
+		// Only this thread moves start or len, so the free part of the
+		// ring can be filled without holding the lock
+		pthread_mutex_lock(&job->lock);
+		job->start = job->consumed;
+		room = job->window - (job->len - job->start);
+		pthread_mutex_unlock(&job->lock);
+		if (!room) {
+			__atomic_store_n(&job->paused, 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		if (job->len + room > CPMMAXSIZE)
+			room = CPMMAXSIZE - job->len;
+		pos = job->len % job->window;
+		if (room > job->window - pos)
+			room = job->window - pos;
+		if (!room) {
+			printf("Running '%s': output too big for CP/M\n", job->url);
+			break;
+		}
+
+		bytes = read(job->execfd, job->buf + pos, room);
+		if (bytes > 0) {
+			pthread_mutex_lock(&job->lock);
+			job->len += bytes;
+			pthread_mutex_unlock(&job->lock);
+			job->lastdata = time(NULL);
+		}
+	} while (bytes > 0);
+
+	if (bytes < 0 && errno == EAGAIN) {
+		if (!alm_fetch_timeout || time(NULL) - job->lastdata < alm_fetch_timeout)
+			return 0;
+		printf("Running '%s': no output for %d seconds\n", job->url, alm_fetch_timeout);
+	}
+
+	// Finished, one way or another. At the end of its output the command
+	// gets a moment to exit by itself.
+	status = alm_fetch_execstop(job, (bytes == 0) ? FETCH_EXIT_WAIT : 0);
+	alm_fetch_finish(job, (status == 0) || (job->len > 0));
+
+	return 0;
+}
+
+/* Close a job's command input and output, and make sure the command is gone,
+ * killing it if it hasn't exited within wait ms, and then FETCH_TERM_WAIT ms
+ * after a SIGTERM. Returns its exit status, or -1 if it had to be killed.
+ */
+int alm_fetch_execstop(struct fetch_job_t *job, int wait) {
+
+	int status = -1;
+	pid_t retval;
+
+	if (job->inputfd >= 0)
+		close(job->inputfd);
+	job->inputfd = -1;
+	if (job->execfd >= 0)
+		close(job->execfd);
+	job->execfd = -1;
+	if (job->pid > 0) {
+		while ((retval = waitpid(job->pid, &status, WNOHANG)) == 0 && wait > 0) {
+			usleep(1000);
+			wait--;
+		}
+		if (retval != job->pid) {
+			// Ask nicely first, so it can clean up after itself
+			kill(-job->pid, SIGTERM);
+			for (wait = FETCH_TERM_WAIT; wait > 0; wait--) {
+				if ((retval = waitpid(job->pid, NULL, WNOHANG)) != 0)
+					break;
+				usleep(1000);
+			}
+			if (retval != job->pid) {
+				kill(-job->pid, SIGKILL);
+				waitpid(job->pid, NULL, 0);
+			}
+			status = -1;
+		} else if (WIFEXITED(status)) {
+			status = WEXITSTATUS(status);
+		} else {
+			status = -1;
+		}
+	}
+	job->pid = 0;
+	if (job->scratch) {
+		nftw(job->scratch, alm_fetch_rmfile, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+		free(job->scratch);
+		job->scratch = NULL;
+	}
+
+	return status;
+}
+
+/* nftw() callback emptying a job's scratch directory */
+static int alm_fetch_rmfile(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+
+	if (remove(path))
+		printf("Removing %s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+/* Run a finished download through the job's convert function */
+int alm_fetch_convert(struct fetch_job_t *job, int ok) {
+
+	uint8_t *out = NULL, *copy;
+	size_t outlen = 0;
+
+	if (ok && (!job->whole || job->convert(job->whole, job->len, &out, &outlen) < 0)) {
+		printf("Fetch of %s: couldn't convert %lu bytes\n", job->url, (unsigned long)job->len);
+		ok = 0;
+	}
+	free(job->whole);
+	job->whole = NULL;
+	job->wholesize = 0;
+	if (!ok) {
+		job->len = 0;
+		return alm_fetch_finish(job, 0);
+	}
+
+	// The cache gets its own copy, this job keeps reading from out
+	if (!job->postfields && outlen <= alm_urlcache_maxent() && (copy = malloc(outlen ? outlen : 1))) {
+		memcpy(copy, out, outlen);
+		alm_urlcache_put(job->handler, job->url, copy, outlen);
+	}
+	job->flat = out;
+	job->len = outlen;
+
+	return alm_fetch_finish(job, 1);
+}
+
+/* Mark a job finished, padding the last record with ^Z's */
+int alm_fetch_finish(struct fetch_job_t *job, int ok) {
+
+	// The ring is whole records, so the rest of the last one is always free
+	pthread_mutex_lock(&job->lock);
+	if (job->buf && (job->len % RECSIZE))
+		memset(job->buf + (job->len % job->window), 0x1a, RECSIZE - (job->len % RECSIZE));
+	pthread_mutex_unlock(&job->lock);
+
+	__atomic_store_n(&job->state, ok ? FETCH_DONE : FETCH_FAILED, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int alm_fetch_free(struct fetch_job_t *job) {
+
+	int i;
+
+	if (job->curlp)
+		curl_easy_cleanup(job->curlp);
+	alm_fetch_execstop(job, 0);
+	if (!job->cached)
+		free(job->flat);
+	alm_urlcache_release(job->cached);
+	free(job->handler);
+	free(job->url);
+	free(job->postfields);
+	if (job->argv)
+		for (i = 0; job->argv[i]; i++)
+			free(job->argv[i]);
+	free(job->argv);
+	free(job->input);
+	free(job->buf);
+	free(job->whole);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/* almmmost_fetch.h: The background URL fetch module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_FETCH_H
+#define _ALMMMOST_FETCH_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <curl/curl.h>
+
+/* Job states */
+#define FETCH_PENDING (0)
+#define FETCH_DONE (1)
+#define FETCH_FAILED (2)
+
+#define FETCH_DEFAULT_TIMEOUT (60)	// Seconds
+#define FETCH_DEFAULT_WINDOW (64)	// KB
+#define FETCH_MIN_WINDOW (2 * CURL_MAX_WRITE_SIZE)	// curl hands over up to this much at once
+#define FETCH_MAX_CONVERT (16*1024*1024)	// Largest response that will be converted
+#define FETCH_USERAGENT "almmmost/0.1 (CP/M; 2.2)"
+#define FETCH_MAX_WAITFDS (64)		// Command outputs watched at once, others are polled
+#define FETCH_EXIT_WAIT (200)		// ms a command gets to exit after closing its output
+#define FETCH_TERM_WAIT (100)		// ms a command gets to exit after SIGTERM, before SIGKILL
+
+/* Received data goes into a ring of window bytes, a multiple of RECSIZE so a
+ * record never wraps. Byte n of the response lives at buf[n % window] while
+ * start <= n < len. Records the client has read past can be dropped to make
+ * room; until then the transfer is paused.
+ *
+ * A job with a convert function instead collects the whole response, and
+ * once it's finished the client reads the converted result from flat.
+ *
+ * A job for a command (alm_fetch_exec, alm_fetch_execv) has no curl handle;
+ * the fetch thread reads the command's output from execfd into the ring the
+ * same way.
+ */
+struct urlcache_ent_t;
+
+struct fetch_job_t {
+	pthread_mutex_t lock;	// Protects the ring and counters below
+	int state;		// FETCH_*, read with alm_fetch_state()
+	int owned;		// Cleared by alm_fetch_release(), fetch thread frees it after
+	int paused;		// Transfer paused for lack of room, fetch thread only
+	char *handler;		// Special file the fetch is for, part of the cache key
+	char *url;
+	char *postfields;	// NULL for a GET
+	struct urlcache_ent_t *cached;	// Served from the URL cache instead of the ring
+	int (*convert)(const uint8_t *in, size_t inlen, uint8_t **out, size_t *outlen);
+	uint8_t *flat;		// Finished response in one piece: cache entry data or convert output
+	uint8_t *whole;		// Whole response so far, for the URL cache
+	size_t wholesize;
+	int nocache;		// Too big to cache, or caching is off
+	uint8_t *buf;
+	size_t window;		// Bytes in buf
+	size_t start;		// Offset of the oldest byte still held, record aligned
+	size_t len;		// Bytes received
+	size_t consumed;	// Client has read up to here, anything older can go
+	CURL *curlp;
+	char **argv;		// Command to run, found on the PATH
+	char *scratch;		// Directory removed once the command's gone
+	char *input;		// Written to the command's stdin
+	size_t inputpos;	// How much of it the command has taken
+	pid_t pid;		// Command running for the job, 0 if none
+	int inputfd;		// Its stdin until all the input's written, -1 if none
+	int execfd;		// Its stdout, -1 if none
+	time_t lastdata;	// When the command last took input or wrote anything
+	struct fetch_job_t *next;
+};
+
+extern int alm_fetch_timeout;
+extern int alm_fetch_window;
+
+/* Start the fetch thread */
+int alm_fetch_init();
+
+/* Stop the fetch thread and free everything */
+int alm_fetch_exit();
+
+/* Process config file */
+int alm_fetch_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Queue a fetch of url for a special file, a POST if postfields isn't NULL.
+ * If convert isn't NULL, it's run on the whole response on the fetch thread,
+ * and the client reads what it returns. Returns right away, with the job
+ * already done if the URL cache had it.
+ */
+struct fetch_job_t *alm_fetch_start(const char *handler, const char *url, const char *postfields,
+		int (*convert)(const uint8_t *in, size_t inlen, uint8_t **out, size_t *outlen));
+
+/* Queue running command under /bin/sh for a special file, with input on its
+ * stdin, and its output read by the client like a fetched page. Never cached.
+ */
+struct fetch_job_t *alm_fetch_exec(const char *handler, const char *command, const char *input);
+
+/* Same, but running argv directly without a shell. If scratch isn't NULL,
+ * it's a directory the command works in, removed with everything in it once
+ * the command has exited or been killed.
+ */
+struct fetch_job_t *alm_fetch_execv(const char *handler, char *const argv[], const char *input,
+		const char *scratch);
+
+/* Current FETCH_* state of a job */
+int alm_fetch_state(struct fetch_job_t *job);
+
+/* Copy record rec of a job into buf, returns RECSIZE, 0 if it hasn't
+ * arrived yet, or -1 if past the end or already dropped from the window
+ */
+int alm_fetch_readrec(struct fetch_job_t *job, int rec, uint8_t *buf);
+
+/* Give up a job, cancelling it if it's still running */
+/* Can be called from signal handler */
+int alm_fetch_release(struct fetch_job_t *job);
+
+/* Internal functions */
+void *alm_fetch_thread(void *arg);
+int alm_fetch_addjobs();
+int alm_fetch_spawn(struct fetch_job_t *job);
+int alm_fetch_execwrite(struct fetch_job_t *job);
+int alm_fetch_execread(struct fetch_job_t *job);
+int alm_fetch_execstop(struct fetch_job_t *job, int wait);
+int alm_fetch_reap();
+int alm_fetch_unpause();
+int alm_fetch_finish(struct fetch_job_t *job, int ok);
+int alm_fetch_keep(struct fetch_job_t *job, const void *buf, size_t bytes, size_t max);
+int alm_fetch_convert(struct fetch_job_t *job, int ok);
+int alm_fetch_free(struct fetch_job_t *job);
+int alm_fetch_wake();
+
+#endif /* _ALMMMOST_FETCH_H */
@@ -35,17 +35,27 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 
 #include <ini.h>
 
 #include "almmmost.h"
 #include "almmmost_image.h"
 #include "almmmost_file.h"
+#include "almmmost_cluster.h"
+#include "almmmost_repl.h"
 #include "almmmost_special.h"
+#include "almmmost_dirindex.h"
 #include "almmmost_device.h"
+#include "almmmost_cache.h"
 
 
 struct file_status_t *fileinfo;
+struct file_search_t *alm_file_search = NULL;
+int alm_file_ports = 0;
+static struct file_held_t *alm_file_held = NULL;
+static int alm_file_holds = 0;		// Held reads waiting
+struct file_share_t *alm_file_shares = NULL;
 
 int alm_file_init() {
 
@@ -53,15 +63,53 @@ int alm_file_init() {
 	if (!fileinfo)
 		return -1;
 	special_files = NULL;
+	alm_file_search = NULL;
+	alm_file_held = NULL;
+	alm_file_holds = 0;
+	alm_file_ports = 0;
 	return 0;
 }
 
+/* Size the per-port search state */
+int alm_file_setports(int ports) {
+
+	free(alm_file_search);
+	alm_file_search = calloc(ports, sizeof(struct file_search_t));
+	if (!alm_file_search) {
+		perror("Allocating file searches");
+		exit(1);
+	}
+	free(alm_file_held);
+	alm_file_held = calloc(ports, sizeof(struct file_held_t));
+	if (!alm_file_held) {
+		perror("Allocating held reads");
+		exit(1);
+	}
+	alm_file_holds = 0;
+	alm_file_ports = ports;
+	return 0;
+}
+
+static long long alm_file_now() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int alm_file_exit() {
 
 	if (fileinfo) {
 		free(fileinfo);
 		fileinfo = NULL;
 	}
+	free(alm_file_search);
+	alm_file_search = NULL;
+	free(alm_file_held);
+	alm_file_held = NULL;
+	alm_file_holds = 0;
+	alm_file_ports = 0;
 	// FIXME: free special_files LL
 	return 0;
 }
@@ -87,6 +135,7 @@ int alm_do_fileop(int portnum, void *reqbuf) {
 	int drivenum;
 	int fop = freq->bdosfunc;
 	int rpos = 0, spos = 0;
+	struct file_held_t *held;
 
 	memset(databuf, 0, TVSP_DATA_SZ);
 	memset(&fcbin, 0, TVSP_FCB_SZ);
@@ -160,97 +209,255 @@ int alm_do_fileop(int portnum, void *reqbuf) {
 		}
 	}
 
+	// Clients that don't take a directory record back get the old open and close Search First
+	if (!alm_file_searchdata(portnum) && (fop == TVSP_FILE_SEARCH1ST || fop == TVSP_FILE_SEARCHNEXT))
+		alm_file_dosearch_open(portnum, freq, &fcbout, &fresp);
+	else
+		alm_file_route(portnum, freq, &fcbout, &fresp, databuf);
+
+	// Client doesn't read again on not ready, so it waits for the data instead
+	if (fresp.retcode == RETCODE_HOLD) {
+		if (portnum >= 0 && portnum < alm_file_ports) {
+			held = &alm_file_held[portnum];
+			memcpy(&held->freq, freq, TVSP_REQ_SZ);
+			memcpy(&held->fcb, &fcbin, TVSP_FCB_SZ);
+			held->retry = alm_file_now() + FILE_HOLD_RETRY;
+			held->active = 1;
+			alm_file_holds++;
+			return 0;
+		}
+		fresp.retcode = RETCODE_NOT_READY;
+	}
+	
+dofileop_exit:
+	return alm_file_respond(portnum, fop, &fresp, &fcbout, databuf);
+}
+
+/* Send the response to a file request, and the FCB and data that go with it */
+int alm_file_respond(int portnum, int fop, struct tvsp_file_response *resp, struct cpm_fcb_t *fcb, uint8_t *databuf) {
+
+	usleep(100);
+	alm_dev_write(resp, TVSP_RESP_SZ, portnum);
+
+	usleep(100);
+	alm_dev_write(fcb, TVSP_FCB_SZ, portnum);
+
+
+	if (((fop == TVSP_FILE_READSEQ) || (fop == TVSP_FILE_READRAND)) && (resp->retcode == 0)) {
+		// Don't send data if error
+		usleep(100);
+		alm_dev_write(databuf, TVSP_DATA_SZ, portnum);
+	} else if (((fop == TVSP_FILE_SEARCH1ST) || (fop == TVSP_FILE_SEARCHNEXT)) && (resp->retcode <= 3)
+			&& alm_file_searchdata(portnum)) {
+		// Directory record for the client's DMA buffer, retcode is the entry within it
+		usleep(100);
+		alm_dev_write(databuf, TVSP_DATA_SZ, portnum);
+	}
+	return 0;
+}
+
+/* Called from the main loop: answer held reads whose data has come in */
+int alm_file_poll() {
+
+	int port;
+	long long now;
+	struct file_held_t *held;
+	struct cpm_fcb_t fcb;
+	struct tvsp_file_response resp;
+	uint8_t databuf[TVSP_DATA_SZ];
+
+	if (!alm_file_holds)
+		return 0;
+
+	now = alm_file_now();
+	for (port=0; port<alm_file_ports; port++) {
+		held = &alm_file_held[port];
+		if (!held->active || now < held->retry)
+			continue;
+
+		// Run the read again from the FCB it came with
+		memcpy(&fcb, &held->fcb, TVSP_FCB_SZ);
+		memset(databuf, 0, TVSP_DATA_SZ);
+		alm_file_route(port, &held->freq, &fcb, &resp, databuf);
+		if (resp.retcode == RETCODE_HOLD) {
+			held->retry = now + FILE_HOLD_RETRY;
+			continue;
+		}
+		alm_file_unhold(port);
+		alm_file_respond(port, held->freq.bdosfunc, &resp, &fcb, databuf);
+	}
+
+	return 0;
+}
+
+/* Port sent a new request, so it's stopped waiting for a held read */
+int alm_file_unhold(int portnum) {
+
+	if (portnum < 0 || portnum >= alm_file_ports || !alm_file_held[portnum].active)
+		return 0;
+	alm_file_held[portnum].active = 0;
+	alm_file_holds--;
+
+	return 0;
+}
+
+/* Does the client on portnum want Search First/Next directory records in a data phase */
+int alm_file_searchdata(int portnum) {
+
+	if (!userinfo || portnum < 0 || portnum >= alm_dev_ports)
+		return 0;
+
+	return userinfo[portnum].searchdata;
+}
+
+/* Hand a file request to whoever serves the public drives, us or the cluster coordinator */
+int alm_file_route(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf) {
+
+	if (alm_cluster_role == CLUSTER_NODE)
+		return alm_cluster_fileop(portnum, freq, fcb, resp, databuf);
+
+	return alm_file_exec(portnum, freq, fcb, resp, databuf);
+}
+
+/* Search for First, BDOS 17, for clients without Search Data: emulated by an
+ * open and close of the named file, and no directory record goes back.
+ * Search Next isn't supported.
+ */
+int alm_file_dosearch_open(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
+
+	uint8_t retcode = 0;
+	struct tvsp_file_request freq2;
+	uint8_t databuf[TVSP_DATA_SZ];
+
+	if (freq->bdosfunc != TVSP_FILE_SEARCH1ST) {
+		printf("Unknown function %d.\n", freq->bdosfunc);
+		set_zint16(resp->fileno, 0xFFFF);
+		resp->retcode = 0xFF;	// Error
+		resp->err = 1;		// Command fault
+		return -1;
+	}
+	printf("Search for first\n");
+
+	memcpy(&freq2, freq, TVSP_REQ_SZ);
+	freq2.bdosfunc = TVSP_FILE_OPEN;
+
+	// Open returns if the file exists, and the right retcode.
+	alm_file_route(portnum, &freq2, fcb, resp, databuf);
+	retcode = resp->retcode;
+	memcpy(freq2.filenum, resp->fileno, 2);
+
+	if (retcode <= 3) {
+		// Close if we succeeded
+		freq2.bdosfunc = TVSP_FILE_CLOSE;
+		alm_file_route(portnum, &freq2, fcb, resp, databuf);
+	}
+	memcpy(resp->fileno, freq->filenum, 2);
+	resp->err = MMMERR_OK;
+	resp->retcode = RETCODE_OK;
+
+	return 0;
+}
+
+/* Carry out a file request once the FCB and any write data are in, leaving
+ * what goes back to the client in fcb, resp and databuf
+ */
+int alm_file_exec(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf) {
+
+	int fop = freq->bdosfunc;
+
+	// A standby's public drives aren't ours to serve until it's promoted
+	if (alm_repl_role == REPL_STANDBY) {
+		resp->retcode = 0xFF;
+		resp->err = MMMERR_SELECT;
+		return -1;
+	}
+
 	switch (fop) {
 
 		case TVSP_FILE_OPEN:
 		case TVSP_FILE_MAKE:
-			alm_file_doopen(portnum, freq, &fcbout, &fresp);
-			printf("Open/Make %02x / err %02x, file no %d\n", fresp.retcode, fresp.err, get_zint16(fresp.fileno));
+			alm_file_doopen(portnum, freq, fcb, resp);
+			printf("Open/Make %02x / err %02x, file no %d\n", resp->retcode, resp->err, get_zint16(resp->fileno));
 			break;
 
 		case TVSP_FILE_CLOSE:
-			alm_file_doclose(portnum, freq, &fcbout, &fresp);
+			alm_file_doclose(portnum, freq, fcb, resp);
 			break;
 			
 		case TVSP_FILE_WRITESEQ:
 			//printf("Write sequential at %d\n", spos);
-			alm_file_dowrite(portnum, freq, &fcbout, &fresp, databuf);
+			alm_file_dowrite(portnum, freq, fcb, resp, databuf);
 			break;
 
 		case TVSP_FILE_WRITERAND:
 		case TVSP_FILE_WRITERANDZ:
 			//printf("Write random at %d\n", rpos);
-			alm_file_dowrite(portnum, freq, &fcbout, &fresp, databuf);
+			alm_file_dowrite(portnum, freq, fcb, resp, databuf);
 			break;
 
 		case TVSP_FILE_READSEQ:
 			//printf("Read sequential at %d\n", spos);
-			alm_file_doread(portnum, freq, &fcbout, &fresp, databuf);
+			alm_file_doread(portnum, freq, fcb, resp, databuf);
 			break;
 		case TVSP_FILE_READRAND:
 			//printf("Read random at %d\n", rpos);
-			alm_file_doread(portnum, freq, &fcbout, &fresp, databuf);
+			alm_file_doread(portnum, freq, fcb, resp, databuf);
 			break;
 
 		case TVSP_FILE_SETRANDREC:
 			printf("Set random record bytes in FCB\n");
-			alm_file_dosetrandpos(portnum, freq, &fcbout, &fresp);
+			alm_file_dosetrandpos(portnum, freq, fcb, resp);
 			break;
 
 		case TVSP_FILE_DELETE:
 			printf("Delete\n");
-			alm_file_domoddir(portnum, freq, &fcbout, &fresp);
+			alm_file_domoddir(portnum, freq, fcb, resp);
 			break;
 
 		case TVSP_FILE_RENAME:
 			printf("Rename\n");
-			alm_file_domoddir(portnum, freq, &fcbout, &fresp);
+			alm_file_domoddir(portnum, freq, fcb, resp);
 			break;
 
 		case TVSP_FILE_SEARCH1ST:
 			printf("Search for first\n");
-			alm_file_dosearch(portnum, freq, &fcbout, &fresp);
+			alm_file_dosearch(portnum, freq, fcb, resp, databuf);
+			break;
+
+		case TVSP_FILE_SEARCHNEXT:
+			alm_file_dosearch(portnum, freq, fcb, resp, databuf);
 			break;
 
 		case TVSP_FILE_SETATTR:
 			printf("Set attributes\n");
-			alm_file_domoddir(portnum, freq, &fcbout, &fresp);
+			alm_file_domoddir(portnum, freq, fcb, resp);
 			break;
 
 		case TVSP_FILE_GETSIZE:
 			printf("Get file size\n");
-			alm_file_dogetsize(portnum, freq, &fcbout, &fresp);
+			alm_file_dogetsize(portnum, freq, fcb, resp);
+			break;
+
+		case TVSP_FILE_LOCKREC:
+		case TVSP_FILE_UNLOCKREC:
+			alm_file_dolock(portnum, freq, fcb, resp);
 			break;
 
 		default:
 			printf("Unknown function %d.\n", fop);
-			set_zint16(fresp.fileno, 0xFFFF);
-			fresp.retcode = 0xFF;	// Error
-			fresp.err = 1;		// Command fault
+			set_zint16(resp->fileno, 0xFFFF);
+			resp->retcode = 0xFF;	// Error
+			resp->err = 1;		// Command fault
 	
 			break;
 	}
-	
-dofileop_exit:
-	usleep(100);
-	alm_dev_write(&fresp, TVSP_RESP_SZ, portnum);
-
-	usleep(100);
-	alm_dev_write(&fcbout, TVSP_FCB_SZ, portnum);
-
 
-	if (((fop == TVSP_FILE_READSEQ) || (fop == TVSP_FILE_READRAND)) && (fresp.retcode == 0)) {
-		// Don't send data if error
-		usleep(100);
-		retval = alm_dev_write(databuf, TVSP_DATA_SZ, portnum);
-	}
 	return 0;
 }
 
 /* Open / Make, BDOS 15, 22 */
 int alm_file_doopen(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
-	int disk, uc, fd, retval, fnum;
-	// Handle multiple writers elsewhere some other time
+	int disk, uc, fd, retval, fnum, mode;
 	
 	disk = (fcb->drv) ? (fcb->drv - 1) : freq->curbdisk;
 	uc = freq->usrcode;
@@ -287,6 +494,13 @@ int alm_file_doopen(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_
 		goto open_error;
 	}
 
+	// Interface attributes pick the open mode, they don't belong in the directory
+	mode = FCB_MODE(fcb);
+	fcb->fname[4] &= 0x7F;
+	fcb->fname[5] &= 0x7F;
+	fcb->fname[6] &= 0x7F;
+	fcb->fname[7] &= 0x7F;
+
 	if (freq->bdosfunc == TVSP_FILE_MAKE && !fileinfo[fnum].trap) {
 		memcpy(fileinfo[fnum].fname, fcb->fname, 8);
 		memcpy(fileinfo[fnum].fext, fcb->fext, 3);
@@ -302,6 +516,13 @@ int alm_file_doopen(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_
 		}
 	}
 
+	// Check the open mode against other ports that have the file open
+	if (!fileinfo[fnum].trap && alm_file_share_open(fnum, mode) < 0) {
+		printf("Open refused, file in use by another port\n");
+		resp->err = MMMERR_BADFILE;
+		goto open_error;
+	}
+
 	alm_file_blks2fcb(disk, fileinfo[fnum].extent, fcb);
 	set_zint16(resp->fileno, fnum);
 	if (fileinfo[fnum].extent)
@@ -394,17 +615,24 @@ close_error:
 int alm_file_clearfiles(int portnum) {
 	int fnum;
 
+	// The coordinator has the files
+	if (alm_cluster_role == CLUSTER_NODE)
+		return alm_cluster_notify(CLUSTER_CLEARFILES, portnum);
+
 	for (fnum = 0; fnum < MAXFILES; fnum++) {
 		if (fileinfo[fnum].used && fileinfo[fnum].port == portnum) {
 			alm_file_closeentry(fileinfo[fnum].drivenum, fnum);
 		}
 	}
+	alm_file_clear_locks(portnum);
+	if (portnum >= 0 && portnum < alm_file_ports)
+		alm_file_search[portnum].active = 0;
 	return 0;
 }
 
 /* Read seq / Read rand, BDOS 20, 33 */
 int alm_file_doread(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *readbuf) {
-	int disk, uc, fnum, retval, pos, ext, blk, i, blkoff;
+	int disk, uc, fnum, retval, pos, ext, blk, i;
 	struct ext_ll_t *extent;
 	
 	disk = (fcb->drv) ? (fcb->drv-1) : freq->curbdisk;
@@ -430,7 +658,14 @@ int alm_file_doread(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_
 	}
 
 	if (fileinfo[fnum].trap) {
-		if (!fileinfo[fnum].special_buf || (alm_special_trapfileop(fnum, freq->bdosfunc, pos) < 0)) {
+		retval = fileinfo[fnum].special_buf ? alm_special_trapfileop(fnum, freq->bdosfunc, pos) : -1;
+		if (retval == SPECIAL_NOTREADY) {
+			// Data still coming, the client reads this record again or waits for it
+			resp->err = MMMERR_OK;
+			resp->retcode = fileinfo[fnum].trap->notready ? RETCODE_NOT_READY : RETCODE_HOLD;
+			goto doread_error;
+		}
+		if (retval < 0) {
 			// EOF error
 			resp->err = MMMERR_OK;
 			resp->retcode = RETCODE_UNWRITTEN_DATA;
@@ -483,23 +718,12 @@ int alm_file_doread(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_
 		goto doread_error;
 	}
 
-	blkoff = ((pos & drvparam[disk].BLM) + (extent->blocks[blk]<<drvparam[disk].BSF) + drvparam[disk].dir_rec_min) * RECSIZE ;
-	//printf("Read from disk offset %06x\n", blkoff);
-	// Read data from the block
-	retval = lseek(drvparam[disk].image_fd[0], 
-			 blkoff,
-			SEEK_SET);
-	if (retval < 0) {
-		resp->err = MMMERR_OK;
-		resp->retcode = RETCODE_UNWRITTEN_DATA;
-		printf("Read err - seek fail %d errno = %d\n", retval, errno);
-		goto doread_error;
-	}
-	retval = read(drvparam[disk].image_fd[0], readbuf, RECSIZE);
+	// Read data from the block. The first miss loads the whole block into the cache.
+	retval = alm_file_blkbuf_read(fnum, extent->blocks[blk], pos & drvparam[disk].BLM, readbuf);
 	if (retval < RECSIZE) {
 		resp->err = MMMERR_OK;
 		resp->retcode = RETCODE_UNWRITTEN_DATA;
-		printf("Read err - short read %d errno = %d\n", retval, errno);
+		printf("Read err - block read fail %d errno = %d\n", retval, errno);
 		goto doread_error;
 	}
 
@@ -524,9 +748,8 @@ doread_error:
 
 /* Write seq / Write rand / Write rand zero block, BDOS 21, 34, 40 */
 int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *writebuf) {
-	int disk, uc, fnum, retval, pos, ext, blk, i, blkoff;
+	int disk, uc, fnum, retval, pos, ext, blk, i, zeroblk, changed = 0;
 	struct ext_ll_t **extentptr = NULL;
-	uint8_t *blkbuf;
 	
 	disk = (fcb->drv) ? (fcb->drv-1) : freq->curbdisk;
 	uc = freq->usrcode;
@@ -549,8 +772,8 @@ int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb
 		resp->retcode = RETCODE_MISCERR;
 		goto dowrite_error;
 	}
-	if (fileinfo[fnum].fext[0] & 0x80) {
-		// File RO
+	if ((fileinfo[fnum].fext[0] & 0x80) || fileinfo[fnum].is_ro) {
+		// File RO, or opened read-only
 		printf("Attempt to write to R/O file\n");
 		resp->err = MMMERR_RO;
 		resp->retcode = RETCODE_MISCERR;
@@ -576,6 +799,13 @@ int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb
 		goto dowrite_error;
 	}
 
+	// Don't write over a record another port has locked
+	if (alm_file_reclocked(fnum, pos)) {
+		resp->err = MMMERR_OK;
+		resp->retcode = RETCODE_LOCKED;
+		goto dowrite_error;
+	}
+
 	// Handle special file
 	if (fileinfo[fnum].trap) {
 		if (!fileinfo[fnum].special_buf) {
@@ -598,8 +828,10 @@ int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb
 	extentptr = &fileinfo[fnum].extent;
 	for (i=0; i<ext; i++) {
 		extentptr = &((*extentptr)->next);
-		if (*extentptr == NULL)
+		if (*extentptr == NULL) {
 			retval = alm_alloc_dentry(disk, uc, fnum, fcb);
+			changed = 1;
+		}
 		if (*extentptr == NULL) {		// If still null, we failed to allocate one
 			printf("Failed to allocate directory entry: %d\n", retval);
 			resp->err = MMMERR_NOSPACE;
@@ -620,29 +852,15 @@ int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb
 			goto dowrite_error;
 		} else {
 			(*extentptr)->blocks[blk] = retval;
+			changed = 1;
 		}
 
 	}
 
-	blkoff = ((pos & drvparam[disk].BLM) + ((*extentptr)->blocks[blk]<<drvparam[disk].BSF) + drvparam[disk].dir_rec_min) * RECSIZE;
-	// Write data to the block
-	retval = lseek(drvparam[disk].image_fd[0], 
-			blkoff,
-			SEEK_SET);
-	if (retval < 0) {
-		resp->err = MMMERR_OK;
-		resp->retcode = RETCODE_UNWRITTEN_DATA;
-		goto dowrite_error;
-	}
-	if (freq->bdosfunc != TVSP_FILE_WRITERANDZ || (pos & drvparam[disk].BLM)) {
-		retval = write(drvparam[disk].image_fd[0], writebuf, RECSIZE);
-	} else {
-		// Zero block
-		blkbuf = alloca(drvparam[disk].blk_size);
-		memset(blkbuf+RECSIZE, 0, drvparam[disk].blk_size-RECSIZE);
-		memcpy(blkbuf, writebuf, RECSIZE);
-		retval = write(drvparam[disk].image_fd[0], blkbuf, drvparam[disk].blk_size);
-	}
+	// Write data to the block, it gets written to disk on block change, close, sync or timeout.
+	// WRITERANDZ zeroes the rest of the block in the cache when starting a new block.
+	zeroblk = (freq->bdosfunc == TVSP_FILE_WRITERANDZ && !(pos & drvparam[disk].BLM));
+	retval = alm_file_blkbuf_write(fnum, (*extentptr)->blocks[blk], pos & drvparam[disk].BLM, writebuf, zeroblk);
 	if (retval < 0) {
 		resp->err = MMMERR_OK;
 		resp->retcode = RETCODE_UNWRITTEN_DATA;
@@ -652,18 +870,27 @@ int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb
 	// If we are at the end of the extent, allocate a new extent
 	if ((((pos + 1) & ((drvparam[disk].EXM<<7)+0x7F)) == 0) && (*extentptr)->next == NULL) {
 		alm_alloc_dentry(disk, uc, fnum, fcb);
+		changed = 1;
 	}
 
 	// If we're past what the file size says, increase that
-	if ((pos + 1) > fileinfo[fnum].size)
+	if ((pos + 1) > fileinfo[fnum].size) {
 		fileinfo[fnum].size = pos+1;
+		changed = 1;
+	}
 
-	// Same for extent size
-	if (((pos + 1) % ((drvparam[disk].EXM+1)<<7)) > (*extentptr)->extsize)
-		(*extentptr)->extsize++;
+	// Same for extent size, which reaches (EXM+1)*128 when the extent is full
+	if ((pos % ((drvparam[disk].EXM+1)<<7)) + 1 > (*extentptr)->extsize) {
+		(*extentptr)->extsize = (pos % ((drvparam[disk].EXM+1)<<7)) + 1;
+		changed = 1;
+	}
 	
 	alm_file_blks2fcb(disk, *extentptr, fcb);
 
+	// Let other ports with the file open see new blocks and extents
+	if (changed && fileinfo[fnum].share && fileinfo[fnum].share->opens > 1)
+		alm_file_share_extents(fnum);
+
 dowrite_retok:
 	// If we are writing sequentually, increment position in fcb. otherwise if random -> don't change
 	if (freq->bdosfunc == TVSP_FILE_WRITESEQ) {
@@ -682,32 +909,113 @@ dowrite_error:
 }
 
 
-/* Search for First, BDOS 17 -- note drive = ? means search for any user #, including e5's */
-int alm_file_dosearch(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
+/* Search for First / Next, BDOS 17, 18 -- note drive = ? means search for any user #, including e5's */
+int alm_file_dosearch(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *dirbuf) {
 
-	uint8_t retcode = 0;
-	struct tvsp_file_request freq2;
-
-	memcpy(&freq2, freq, TVSP_REQ_SZ);
-	freq2.bdosfunc = TVSP_FILE_OPEN;
+	struct file_search_t *srch;
+	struct cpm_direntry_t *de;
+	int disk, fnum, entry;
 
-	// Open returns if the file exists, and the right retcode.
-	alm_file_doopen(portnum, &freq2, fcb, resp);
-	retcode = resp->retcode;
-	memcpy(freq2.filenum, resp->fileno, 2);
-	
-	if (retcode <= 3) {
-		// Close if we succeeded
-		freq2.bdosfunc = TVSP_FILE_CLOSE;
-		alm_file_doclose(portnum, &freq2, fcb, resp);
-		resp->retcode = retcode;
-		resp->err = MMMERR_OK;
-	}
 	memcpy(resp->fileno, freq->filenum, 2);
 	resp->err = MMMERR_OK;
-	resp->retcode = RETCODE_OK;
+	resp->retcode = RETCODE_MISCERR;
+
+	if (portnum < 0 || portnum >= alm_file_ports)
+		goto dosearch_error;
+	srch = &alm_file_search[portnum];
+
+	if (freq->bdosfunc == TVSP_FILE_SEARCH1ST) {
+		srch->active = 0;
+		disk = (fcb->drv && fcb->drv != '?') ? (fcb->drv - 1) : freq->curbdisk;
+		if (disk >= mmm_numdisks || drvparam[disk].image_fd[0] < 0) {
+			resp->err = MMMERR_SELECT;
+			goto dosearch_error;
+		}
+		if (drvparam[disk].public_private != PUBLDIR) {
+			resp->err = MMMERR_DRVTYPE;
+			goto dosearch_error;
+		}
+
+		// Get extents of files still open on this disk onto the disk so the listing is current
+		for (fnum=1; fnum<MAXFILES; fnum++)
+			if (fileinfo[fnum].used && fileinfo[fnum].drivenum == disk && !fileinfo[fnum].trap)
+				alm_file_rewrite_extents(fnum);
+
+		memcpy(&srch->fcb, fcb, sizeof(struct cpm_fcb_t));
+		srch->drivenum = disk;
+		srch->usrcode = freq->usrcode;
+		srch->allusers = (fcb->drv == '?');
+		srch->denum = 0;
+		srch->rec = -1;
+		srch->sfp = special_files ? special_files->next : NULL;
+		srch->active = 1;
+	} else if (!srch->active) {
+		// Search Next without a Search First
+		goto dosearch_error;
+	}
+	disk = srch->drivenum;
+
+	// Pick up where the last call left off in the directory
+	while (srch->denum <= drvparam[disk].DBL) {
+		entry = srch->denum & 3;
+		if (srch->rec != drvparam[disk].dir_rec_min + (srch->denum >> 2)) {
+			srch->rec = drvparam[disk].dir_rec_min + (srch->denum >> 2);
+			if (alm_img_readrec(disk, 0, srch->rec, srch->des) < RECSIZE) {
+				resp->err = MMMERR_BADSECT;
+				srch->active = 0;
+				goto dosearch_error;
+			}
+		}
+		srch->denum++;
+		if (alm_file_search_match(srch, &srch->des[entry], disk)) {
+			memcpy(dirbuf, srch->des, RECSIZE);
+			resp->retcode = entry;
+			return 0;
+		}
+	}
 
+	// Then any special files, which aren't in the directory
+	if (!srch->allusers && (srch->fcb.curext == '?' || !PHY_EXT(srch->fcb.s2, srch->fcb.curext, drvparam[disk].EXM))) {
+		while (srch->sfp) {
+			struct special_file_t *sfp = srch->sfp;
+			srch->sfp = sfp->next;
+			if (alm_same_file(&srch->fcb, sfp->fname, sfp->fext)) {
+				memset(dirbuf, 0xe5, RECSIZE);
+				de = (struct cpm_direntry_t *)dirbuf;
+				memset(de, 0, DIRENTRYSIZE);
+				de->user = srch->usrcode;
+				memcpy(de->fname, sfp->fname, 8);
+				memcpy(de->fext, sfp->fext, 3);
+				if (sfp->is_ro)
+					de->fext[0] |= 0x80;
+				resp->retcode = 0;
+				return 0;
+			}
+		}
+	}
+
+	// No more matches
+	srch->active = 0;
 	return 0;
+
+dosearch_error:
+	return -1;
+}
+
+// Does directory entry de match the search pattern? Same rules as the BDOS:
+// '?' matches anything, and the extent must match unless it's '?'
+int alm_file_search_match(struct file_search_t *srch, const struct cpm_direntry_t *de, int disk) {
+
+	if (srch->allusers)
+		return 1;
+	if (de->user != srch->usrcode)
+		return 0;
+	if (!alm_same_file(&srch->fcb, de->fname, de->fext))
+		return 0;
+	if (srch->fcb.curext != '?' && PHY_EXT(de->ext_h, de->ext_l, drvparam[disk].EXM) != PHY_EXT(srch->fcb.s2, srch->fcb.curext, drvparam[disk].EXM))
+		return 0;
+
+	return 1;
 }
 
 /* Delete file BDOS 19 / Rename file BDOS 23 / Set attributes BDOS 30 */
@@ -716,7 +1024,74 @@ int alm_file_domoddir(int portnum, struct tvsp_file_request *freq, struct cpm_fc
 
 	disk = (fcb->drv) ? (fcb->drv-1) : freq->curbdisk;
 
-	return alm_modify_dir(freq->bdosfunc, disk, freq->usrcode, fcb, resp);
+	return alm_modify_dir(portnum, freq->bdosfunc, disk, freq->usrcode, fcb, resp);
+}
+
+/* Lock / unlock record, BDOS 42, 43 */
+int alm_file_dolock(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
+
+	int disk, uc, fnum, rec;
+	struct file_share_t *share;
+	struct file_reclock_t *lock, **lockptr;
+
+	disk = (fcb->drv) ? (fcb->drv - 1) : freq->curbdisk;
+	uc = freq->usrcode;
+	fnum = get_zint16(freq->filenum);
+	memcpy(resp->fileno, freq->filenum, 2);
+
+	// Verify filenumber
+	fnum = alm_file_getfnum(fnum, fcb, portnum, disk, uc);
+	if (fnum < 0) {
+		resp->err = MMMERR_BADFILE;
+		resp->retcode = RETCODE_MISCERR;
+		goto dolock_error;
+	}
+
+	resp->err = MMMERR_OK;
+	resp->retcode = RETCODE_OK;
+
+	// Nothing to coordinate on special files
+	share = fileinfo[fnum].share;
+	if (!share)
+		return 0;
+
+	rec = (fcb->rrec[2] << 16) + get_zint16(&fcb->rrec[0]);
+
+	if (freq->bdosfunc == TVSP_FILE_LOCKREC) {
+		for (lock = share->locks; lock; lock = lock->next) {
+			if (lock->rec != rec)
+				continue;
+			if (lock->port != portnum) {
+				resp->retcode = RETCODE_LOCKED;
+				goto dolock_error;
+			}
+			return 0;	// Already ours
+		}
+		lock = calloc(sizeof(struct file_reclock_t), 1);
+		if (!lock) {
+			resp->retcode = RETCODE_MISCERR;
+			goto dolock_error;
+		}
+		lock->rec = rec;
+		lock->fnum = fnum;
+		lock->port = portnum;
+		lock->next = share->locks;
+		share->locks = lock;
+	} else {
+		for (lockptr = &share->locks; *lockptr; lockptr = &((*lockptr)->next)) {
+			if ((*lockptr)->rec == rec && (*lockptr)->port == portnum) {
+				lock = *lockptr;
+				*lockptr = lock->next;
+				free(lock);
+				break;
+			}
+		}
+	}
+
+	return 0;
+
+dolock_error:
+	return -1;
 }
 
 /* Get file size (set rrec to EOF), BDOS 35 */
@@ -757,39 +1132,161 @@ dogetsz_error:
 	return -1;
 }
 
+/* Copy a file between public drives for a port, without the data going
+ * through the client. It's done with the same calls a client's PIP would
+ * make: the source is read into name.$$$ on the destination drive, which
+ * then replaces the destination, so a failed copy leaves that alone.
+ * Drive 0 in an FCB means curdisk. Returns the records copied, or COPYERR_*.
+ */
+int alm_file_copy(int portnum, int uc, int curdisk, const struct cpm_fcb_t *src, const struct cpm_fcb_t *dst) {
+
+	struct tvsp_file_request freq;
+	struct tvsp_file_response resp;
+	struct cpm_fcb_t sfcb, tfcb, dfcb, rfcb[2];
+	uint8_t buf[RECSIZE];
+	int sdisk, ddisk, sfnum, tfnum, i, recs = 0, retval = 0;
+
+	memset(&freq, 0, sizeof(freq));
+	freq.usrcode = uc;
+	freq.curbdisk = curdisk;
+
+	memset(&sfcb, 0, sizeof(sfcb));
+	memcpy(&sfcb, src, 12);
+	memset(&dfcb, 0, sizeof(dfcb));
+	memcpy(&dfcb, dst, 12);
+	sdisk = (sfcb.drv) ? (sfcb.drv - 1) : curdisk;
+	ddisk = (dfcb.drv) ? (dfcb.drv - 1) : curdisk;
+	for (i=0; i<8; i++) {
+		sfcb.fname[i] &= 0x7F;
+		dfcb.fname[i] &= 0x7F;
+	}
+	for (i=0; i<3; i++) {
+		sfcb.fext[i] &= 0x7F;
+		dfcb.fext[i] &= 0x7F;
+	}
+	if (memchr(&sfcb, '?', 12) || memchr(&dfcb, '?', 12))
+		return COPYERR_NAME;
+	if (sdisk >= mmm_numdisks || ddisk >= mmm_numdisks ||
+			drvparam[sdisk].public_private != PUBLDIR || drvparam[ddisk].public_private != PUBLDIR)
+		return COPYERR_DRIVE;
+	if (drvparam[ddisk].is_ro[0])
+		return COPYERR_RO;
+
+	// The temporary copy is name.$$$
+	memcpy(&tfcb, &dfcb, sizeof(tfcb));
+	tfcb.drv = ddisk + 1;
+	memset(tfcb.fext, '$', 3);
+
+	// Look at the destination first, PIP would ask before replacing a R/O file
+	dfcb.drv = ddisk + 1;
+	tfnum = alm_file_finddentry(portnum, ddisk, uc, &dfcb);
+	if (tfnum < 0)
+		return COPYERR_IO;
+	if (fileinfo[tfnum].trap)
+		retval = COPYERR_SPECIAL;
+	else if (fileinfo[tfnum].extent && (fileinfo[tfnum].fext[0] & 0x80))
+		retval = COPYERR_RO;
+	alm_file_closeentry(ddisk, tfnum);
+	if (retval < 0)
+		return retval;
+
+	// Open the source read only, so nobody can be writing it meanwhile
+	sfcb.drv = sdisk + 1;
+	sfcb.fname[5] |= 0x80;
+	freq.bdosfunc = TVSP_FILE_OPEN;
+	alm_file_doopen(portnum, &freq, &sfcb, &resp);
+	sfnum = get_zint16(resp.fileno);
+	if (resp.retcode == RETCODE_MISCERR)
+		return (resp.err == MMMERR_BADFILE) ? COPYERR_INUSE : COPYERR_NOSRC;
+	if (fileinfo[sfnum].trap) {
+		alm_file_closeentry(sdisk, sfnum);
+		return COPYERR_SPECIAL;
+	}
+
+	// Make the temporary file, throwing away any left from before
+	alm_modify_dir(portnum, TVSP_FILE_DELETE, ddisk, uc, &tfcb, &resp);
+	tfcb.fname[7] |= 0x80;
+	freq.bdosfunc = TVSP_FILE_MAKE;
+	alm_file_doopen(portnum, &freq, &tfcb, &resp);
+	tfnum = get_zint16(resp.fileno);
+	if (resp.retcode == RETCODE_MISCERR) {
+		alm_file_closeentry(sdisk, sfnum);
+		return (resp.err == MMMERR_NOSPACE) ? COPYERR_NOSPACE : COPYERR_IO;
+	}
+
+	// Copy every record, a read and write each like PIP, but local
+	while (recs < fileinfo[sfnum].size) {
+		freq.bdosfunc = TVSP_FILE_READSEQ;
+		set_zint16(freq.filenum, sfnum);
+		alm_file_doread(portnum, &freq, &sfcb, &resp, buf);
+		if (resp.retcode != RETCODE_OK) {
+			retval = COPYERR_IO;
+			break;
+		}
+		freq.bdosfunc = TVSP_FILE_WRITESEQ;
+		set_zint16(freq.filenum, tfnum);
+		alm_file_dowrite(portnum, &freq, &tfcb, &resp, buf);
+		if (resp.retcode != RETCODE_OK) {
+			retval = (resp.err == MMMERR_NOSPACE) ? COPYERR_NOSPACE : COPYERR_IO;
+			break;
+		}
+		recs++;
+	}
+
+	alm_file_closeentry(sdisk, sfnum);
+	alm_file_closeentry(ddisk, tfnum);
+	tfcb.fname[7] &= 0x7F;
+	if (retval < 0) {
+		alm_modify_dir(portnum, TVSP_FILE_DELETE, ddisk, uc, &tfcb, &resp);
+		return retval;
+	}
+
+	// Swap the copy in for the destination
+	memset(rfcb, 0, sizeof(rfcb));
+	memcpy(rfcb, &tfcb, 12);
+	memcpy((uint8_t *)rfcb + 16, &dfcb, 12);
+	if (alm_modify_dir(portnum, TVSP_FILE_DELETE, ddisk, uc, &dfcb, &resp) < 0 ||
+			alm_modify_dir(portnum, TVSP_FILE_RENAME, ddisk, uc, rfcb, &resp) < 0 || resp.retcode == RETCODE_MISCERR) {
+		alm_modify_dir(portnum, TVSP_FILE_DELETE, ddisk, uc, &tfcb, &resp);
+		return COPYERR_INUSE;
+	}
+
+	return recs;
+}
+
 int alm_file_loadbam(int disk) {
 
-	int i, j, fd, DBM;
-	uint16_t block;
+	if (disk < 0 || disk >= mmm_numdisks)
+		return -1;
+	// Fail on not public disk
+	if (drvparam[disk].public_private != PUBLDIR) 
+		return -1;
+
+	// From the sidecar file, or the directory index thread builds it
+	if (alm_dix_load(disk) >= 0)
+		return 0;
+
+	return alm_file_scanbam(disk);
+}
+
+int alm_file_scanbam(int disk) {
+
+	int i;
 	struct cpm_direntry_t de;
 
 	// Read directory listing off disk and re-init bam
-	if (disk >= MAXDISK)
+	if (disk < 0 || disk >= mmm_numdisks)
 		return -1;
 	// Fail on not public disk
 	if (drvparam[disk].public_private != PUBLDIR) 
 		return -1;
 
-	fd = drvparam[disk].image_fd[0];
-	DBM = drvparam[disk].DBM;
-
 	memset(drvparam[disk].bam, 0, sizeof(int) * MAXBLKS);
-	lseek(fd, drvparam[disk].dir_rec_min * RECSIZE, SEEK_SET);
+	alm_dix_alloc(disk);
 	for (i=0; i<=drvparam[disk].DBL; i++) {
-		if (read(fd, &de, DIRENTRYSIZE)<DIRENTRYSIZE)
+		if (alm_file_readde(disk, i, &de) < 0)
 			return -1; // Error reading -> abort
-		if (de.user == 0xe5)
-			continue;  // Deleted entry
-		for (j=0; j<16; j++) {
-			if (DBM<256) {
-				block = de.blknums[j];
-			} else {
-				block = get_zint16(de.blknums+j);
-				j++;
-			}
-			if (block)
-				drvparam[disk].bam[block] = i;
-		}
+		alm_dix_markde(disk, i, &de, drvparam[disk].bam, alm_dix_disks[disk].keys);
 	}
 
 	return 0;
@@ -799,16 +1296,17 @@ int alm_file_allocblk(int disk, int dentry) {
 
 	int i;
 
-	if (disk >= MAXDISK)
+	if (disk < 0 || disk >= mmm_numdisks)
 		return -1;
 	// Fail on not public disk
 	if (drvparam[disk].public_private != PUBLDIR) 
 		return -2;
+	alm_dix_wait(disk);
 
 	// Find the first free (data) block
 	for (i=((drvparam[disk].DBL/4)>>drvparam[disk].BSF) + 1; i<=drvparam[disk].DBM; i++)
 		if (drvparam[disk].bam[i] < 1) {
-			drvparam[disk].bam[i] = dentry;
+			drvparam[disk].bam[i] = dentry + 1;
 			return i;
 		}
 
@@ -820,7 +1318,7 @@ int alm_file_allocblk(int disk, int dentry) {
 int alm_file_deallocblk(int disk, uint16_t block) {
 
 
-	if (disk >= MAXDISK)
+	if (disk < 0 || disk >= mmm_numdisks)
 		return -1;
 	// Fail on not public disk
 	if (drvparam[disk].public_private != PUBLDIR) 
@@ -829,6 +1327,7 @@ int alm_file_deallocblk(int disk, uint16_t block) {
 	// Fail if block number is too big
 	if (block > drvparam[disk].DBM)
 		return -2;
+	alm_dix_wait(disk);
 
 	drvparam[disk].bam[block] = 0;
 	return 0;
@@ -837,8 +1336,8 @@ int alm_file_deallocblk(int disk, uint16_t block) {
 
 int alm_file_finddentry(int port, int disk, int usrcode, struct cpm_fcb_t *fcb) {
 
-	int denum, fnum, extnum, blk, extsz;
-	int retval, fd;
+	int denum, fnum, extnum, blk, extsz, key;
+	int fd;
 	struct file_status_t *thisfile;
 	struct ext_ll_t **thisextptr;
 	struct cpm_direntry_t de;
@@ -860,6 +1359,8 @@ int alm_file_finddentry(int port, int disk, int usrcode, struct cpm_fcb_t *fcb)
 	thisfile->drivenum = disk;
 	thisfile->size = 0;
 	thisfile->port = port;
+	thisfile->blkbuf_blk = 0;
+	thisfile->blkbuf_dirty = 0;
 
 	// First see if it's special
 	if (alm_special_trapopen(fnum, fcb)) {
@@ -868,14 +1369,12 @@ int alm_file_finddentry(int port, int disk, int usrcode, struct cpm_fcb_t *fcb)
 
 	thisextptr = &(thisfile->extent);
 	
+	// Only look at entries the directory index says might be it
+	key = alm_dix_key(usrcode, fcb->fname, fcb->fext);
 	extnum=0;
 	do { 
-		retval = lseek(fd, drvparam[disk].dir_rec_min * RECSIZE, SEEK_SET);
-		if (retval < 0)
-			goto findentry_err;
-		for (denum=0; denum<=drvparam[disk].DBL; denum++) {
-			retval = read(fd, &de, DIRENTRYSIZE);
-			if (retval < DIRENTRYSIZE)
+		for (denum=alm_dix_next(disk, 0, key); denum<=drvparam[disk].DBL; denum=alm_dix_next(disk, denum+1, key)) {
+			if (alm_file_readde(disk, denum, &de) < 0)
 				goto findentry_err;
 			// Check user code, file name and extent number matches
 			if ((de.user == usrcode) && (alm_same_file(fcb, de.fname, de.fext)) 
@@ -942,12 +1441,16 @@ int alm_file_closeentry(int disk, int fnum) {
 	alm_special_trapclose(fnum);
 	// Re-write extents so things are saved..
 	alm_file_rewrite_extents(fnum);
+	// And get the file's data and directory entries out of the cache
+	alm_file_flushcache(fnum);
 	extptr = fileinfo[fnum].extent;
 	while (extptr) {
 		nextextptr = extptr->next;
 		free(extptr);
 		extptr = nextextptr;
 	}
+	// Drop this file's locks and its hold on the shared state
+	alm_file_share_close(fnum);
 
 	memset(&fileinfo[fnum], 0, sizeof(struct file_status_t));
 
@@ -956,10 +1459,13 @@ int alm_file_closeentry(int disk, int fnum) {
 
 int alm_file_closeallondisk(int disk) {
 
-	int fnum;
+	int fnum, port;
 
 	for (fnum=1; fnum < MAXFILES; fnum++)
 		alm_file_closeentry(disk, fnum);	// This checks we are doing the right disk/file is open
+	for (port=0; port < alm_file_ports; port++)
+		if (alm_file_search[port].drivenum == disk)
+			alm_file_search[port].active = 0;
 
 	return 0;
 }
@@ -969,9 +1475,9 @@ int alm_alloc_dentry(int disk, int usrcode, int fnum, struct cpm_fcb_t *fcb) {
 
 	struct ext_ll_t **extptr;
 	struct cpm_direntry_t de;
-	int fd, retval, denum, extnum;
+	int fd, denum, extnum;
 
-	if (disk >= MAXDISK)
+	if (disk < 0 || disk >= mmm_numdisks)
 		return -1;		// Bad disk #
 	fd = drvparam[disk].image_fd[0];
 	if (fd < 0)
@@ -979,14 +1485,9 @@ int alm_alloc_dentry(int disk, int usrcode, int fnum, struct cpm_fcb_t *fcb) {
 	if (fnum >= MAXFILES)
 		return -3;		// No more file numbers
 
-	retval = lseek(fd, drvparam[disk].dir_rec_min * RECSIZE, SEEK_SET);
-	if (retval < 0)
-		return -4;		// -ENOSPACE
-
 	// Find empty directory entry (user = 0xe5)
-	for (denum=0; denum <= drvparam[disk].DBL; denum++) {
-		retval = read(fd, &de, DIRENTRYSIZE);
-		if (retval < DIRENTRYSIZE)
+	for (denum=alm_dix_next(disk, 0, DIX_FREE); denum <= drvparam[disk].DBL; denum=alm_dix_next(disk, denum+1, DIX_FREE)) {
+		if (alm_file_readde(disk, denum, &de) < 0)
 			return -4;	// -ENOSPACE
 		if (de.user == 0xe5) 
 			break;
@@ -1021,9 +1522,7 @@ int alm_alloc_dentry(int disk, int usrcode, int fnum, struct cpm_fcb_t *fcb) {
 	printf("(a)Writing extent (entry %d) %d, s2 %d, uc %d, filename: ", denum, de.ext_l, de.ext_h, de.user); print_cpm_filename(fileinfo[fnum].fname, fileinfo[fnum].fext);
 	putchar('\n');
 
-	lseek(fd, -DIRENTRYSIZE, SEEK_CUR);
-	retval = write(fd, &de, DIRENTRYSIZE);
-	if (retval != DIRENTRYSIZE)
+	if (alm_file_writede(disk, denum, &de) < 0)
 		return -6;		// Error writing
 
 	return denum;
@@ -1034,11 +1533,9 @@ int alm_alloc_dentry(int disk, int usrcode, int fnum, struct cpm_fcb_t *fcb) {
 int alm_file_rewrite_extents(int fnum) {
 
 	int extnum;
-	int de0pos;
 	int fd;
 	int disk;
 	int blk;
-	int retval;
 	struct ext_ll_t *ext;
 	struct cpm_direntry_t de;
 
@@ -1051,8 +1548,6 @@ int alm_file_rewrite_extents(int fnum) {
 	if (fd < 0)
 		return -2;		// Disk not open
 
-	de0pos = drvparam[disk].dir_rec_min * RECSIZE;
-
 	ext = fileinfo[fnum].extent;
 	extnum = 0;
 
@@ -1087,11 +1582,7 @@ int alm_file_rewrite_extents(int fnum) {
 
 		//printf("(b)Writing extent (num %d) %d, s2 %d, uc %d, filename ", ext->denum, de.ext_l, de.ext_h, de.user); print_cpm_filename(fileinfo[fnum].fname, fileinfo[fnum].fext);
 		//putchar('\n');
-		retval = lseek(fd, de0pos + (ext->denum)*DIRENTRYSIZE, SEEK_SET);
-		if (retval < 0)
-			return -4;		// Error writing an entry
-		retval = write(fd, &de, DIRENTRYSIZE);
-		if (retval < 0)
+		if (alm_file_writede(disk, ext->denum, &de) < 0)
 			return -4;		// Error writing an entry
 
 		ext = ext->next;
@@ -1118,7 +1609,7 @@ int alm_same_file(const struct cpm_fcb_t *fcb, const uint8_t *fname, const uint8
 }
 
 
-int alm_modify_dir(int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
+int alm_modify_dir(int portnum, int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp) {
 
 	int fd, fnum, rec;
 	struct cpm_fcb_rename_t *fcbren = (struct cpm_fcb_rename_t *)fcb;
@@ -1139,10 +1630,11 @@ int alm_modify_dir(int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct t
 		goto modifydir_error;
 	}
 
-	// Make sure file isn't open first
+	// Make sure no other port holds the file exclusively or has records of it locked
 	for (fnum=1; fnum<MAXFILES; fnum++) {
-		if (fileinfo[fnum].used && fileinfo[fnum].drivenum == disk &&
-			uc == fileinfo[fnum].usrcode && alm_same_file(fcb, fileinfo[fnum].fname, fileinfo[fnum].fext)) {
+		if (fileinfo[fnum].used && fileinfo[fnum].drivenum == disk && !fileinfo[fnum].trap &&
+			uc == fileinfo[fnum].usrcode && alm_same_file(fcb, fileinfo[fnum].fname, fileinfo[fnum].fext) &&
+			alm_file_share_conflict(fnum, portnum)) {
 			resp->err = MMMERR_OK;
 			resp->retcode = RETCODE_MISCERR;
 			goto modifydir_error;
@@ -1164,9 +1656,13 @@ int alm_modify_dir(int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct t
 			goto modifydir_error;
 		}
 	}
-			
 
-	
+	// Get blocks open copies have added onto the disk, so a delete frees them too
+	for (fnum=1; fnum<MAXFILES; fnum++)
+		if (fileinfo[fnum].used && fileinfo[fnum].drivenum == disk && !fileinfo[fnum].trap &&
+			uc == fileinfo[fnum].usrcode && alm_same_file(fcb, fileinfo[fnum].fname, fileinfo[fnum].fext))
+			alm_file_rewrite_extents(fnum);
+
 
 	// Read in all the directory sectors, and modify them. 
 	
@@ -1183,6 +1679,12 @@ int alm_modify_dir(int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct t
 		if (modified)
 			alm_img_writerec(disk, 0, rec, des);
 	}
+
+	// Bring open copies in line, so closing them doesn't put the old entries back
+	for (fnum=1; fnum<MAXFILES; fnum++)
+		if (fileinfo[fnum].used && fileinfo[fnum].drivenum == disk && !fileinfo[fnum].trap &&
+			uc == fileinfo[fnum].usrcode && alm_same_file(fcb, fileinfo[fnum].fname, fileinfo[fnum].fext))
+			alm_file_modify_open(fileop, fnum, fcbren);
 	
 	// We were successful
 
@@ -1244,6 +1746,43 @@ int alm_file_modify_thisde(int fileop, int disk, struct cpm_direntry_t *de, stru
 
 }
 
+// Make the same change to an open copy of a file as alm_modify_dir made on disk
+int alm_file_modify_open(int fileop, int fnum, struct cpm_fcb_rename_t *fcbren) {
+
+	struct ext_ll_t *extptr, *nextextptr;
+	int i;
+
+	switch (fileop) {
+
+		case TVSP_FILE_DELETE:
+			// Its directory entries and blocks are gone, forget it without writing anything back.
+			// The client gets a bad file error if it carries on using it.
+			extptr = fileinfo[fnum].extent;
+			while (extptr) {
+				nextextptr = extptr->next;
+				free(extptr);
+				extptr = nextextptr;
+			}
+			alm_file_share_close(fnum);
+			memset(&fileinfo[fnum], 0, sizeof(struct file_status_t));
+			break;
+
+		case TVSP_FILE_RENAME:
+			memcpy(fileinfo[fnum].fname, fcbren->dfname, 8);
+			memcpy(fileinfo[fnum].fext, fcbren->dfext, 3);
+			break;
+
+		case TVSP_FILE_SETATTR:
+			for (i=0; i<8; i++)
+				fileinfo[fnum].fname[i] = (fileinfo[fnum].fname[i] & 0x7F) | (fcbren->sfname[i] & 0x80);
+			for (i=0; i<3; i++)
+				fileinfo[fnum].fext[i] = (fileinfo[fnum].fext[i] & 0x7F) | (fcbren->sfext[i] & 0x80);
+			break;
+	}
+
+	return 0;
+}
+
 int alm_file_blks2fcb(int disk, struct ext_ll_t *ext, struct cpm_fcb_t *fcb) {
 
 	int i;
@@ -1270,11 +1809,15 @@ int alm_file_sync() {
 
 	int fnum;
 
+	if (alm_cluster_role == CLUSTER_NODE)
+		return alm_cluster_notify(CLUSTER_SYNC, 0);
+
 	for (fnum=1; fnum<MAXFILES; fnum++) {
 		if (fileinfo[fnum].used && !fileinfo[fnum].trap) {
 			alm_file_rewrite_extents(fnum);
 		}
 	}
+	alm_cache_flush(-1, -1);
 
 	return 0;
 }
@@ -1347,3 +1890,348 @@ afgf_exit:
 
 
 }
+
+/* Lock manager.
+ * Every fileinfo[] entry for an open public file points to one file_share_t
+ * for that file, which holds the open counts and the record locks. Ports
+ * that share a file also keep their extent lists identical, so blocks one
+ * port allocates are seen by the others before they write.
+ */
+
+// Attach fnum to its file's shared state, refusing the open if the mode conflicts
+int alm_file_share_open(int fnum, int mode) {
+
+	struct file_status_t *file = &fileinfo[fnum];
+	struct file_share_t *share;
+	int i;
+
+	if (!file->extent)
+		return 0;
+
+	for (share = alm_file_shares; share; share = share->next)
+		if (share->drivenum == file->drivenum && share->denum == file->extent->denum)
+			break;
+
+	if (share) {
+		if (share->excl_port >= 0 && share->excl_port != file->port)
+			return -1;
+		// Exclusive needs every other opener to be this port
+		if (mode == FILE_MODE_EXCL) {
+			for (i=1; i<MAXFILES; i++)
+				if (fileinfo[i].share == share && fileinfo[i].port != file->port)
+					return -1;
+		}
+		// Pick up blocks the other openers have added but not written to the directory yet
+		for (i=1; i<MAXFILES; i++) {
+			if (fileinfo[i].share == share) {
+				alm_file_copy_extents(fnum, i);
+				break;
+			}
+		}
+	} else {
+		share = calloc(sizeof(struct file_share_t), 1);
+		if (!share)
+			return -2;
+		share->drivenum = file->drivenum;
+		share->denum = file->extent->denum;
+		share->excl_port = -1;
+		share->next = alm_file_shares;
+		alm_file_shares = share;
+	}
+
+	if (mode == FILE_MODE_EXCL)
+		share->excl_port = file->port;
+	file->mode = mode;
+	file->is_ro = (mode == FILE_MODE_RO);
+	file->share = share;
+	share->opens++;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+// Detach fnum from its shared state, dropping its locks
+int alm_file_share_close(int fnum) {
+
+	struct file_share_t *share = fileinfo[fnum].share;
+	struct file_share_t **shareptr;
+	struct file_reclock_t *lock, **lockptr;
+
+	if (!share)
+		return 0;
+	fileinfo[fnum].share = NULL;
+
+	lockptr = &share->locks;
+	while (*lockptr) {
+		lock = *lockptr;
+		if (lock->fnum == fnum) {
+			*lockptr = lock->next;
+			free(lock);
+		} else {
+			lockptr = &lock->next;
+		}
+	}
+	if (fileinfo[fnum].mode == FILE_MODE_EXCL)
+		share->excl_port = -1;
+
+	if (--share->opens > 0)
+		return 0;
+
+	for (shareptr = &alm_file_shares; *shareptr; shareptr = &((*shareptr)->next)) {
+		if (*shareptr == share) {
+			*shareptr = share->next;
+			break;
+		}
+	}
+	free(share);
+
+	return 0;
+}
+
+// Drop every record lock portnum holds (reboot)
+int alm_file_clear_locks(int portnum) {
+
+	struct file_share_t *share;
+	struct file_reclock_t *lock, **lockptr;
+
+	for (share = alm_file_shares; share; share = share->next) {
+		lockptr = &share->locks;
+		while (*lockptr) {
+			lock = *lockptr;
+			if (lock->port == portnum) {
+				*lockptr = lock->next;
+				free(lock);
+			} else {
+				lockptr = &lock->next;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Is record rec of fnum locked by some other port?
+int alm_file_reclocked(int fnum, int rec) {
+
+	struct file_reclock_t *lock;
+
+	if (!fileinfo[fnum].share)
+		return 0;
+	for (lock = fileinfo[fnum].share->locks; lock; lock = lock->next)
+		if (lock->rec == rec && lock->port != fileinfo[fnum].port)
+			return 1;
+
+	return 0;
+}
+
+// Does another port than portnum hold fnum's file exclusively or have records of it locked?
+int alm_file_share_conflict(int fnum, int portnum) {
+
+	struct file_share_t *share = fileinfo[fnum].share;
+	struct file_reclock_t *lock;
+
+	if (!share)
+		return 0;
+	if (share->excl_port >= 0 && share->excl_port != portnum)
+		return 1;
+	for (lock = share->locks; lock; lock = lock->next)
+		if (lock->port != portnum)
+			return 1;
+
+	return 0;
+}
+
+// Copy fnum's extents to every other entry sharing the file
+int alm_file_share_extents(int fnum) {
+
+	int i;
+
+	for (i=1; i<MAXFILES; i++)
+		if (i != fnum && fileinfo[i].share == fileinfo[fnum].share)
+			alm_file_copy_extents(i, fnum);
+
+	return 0;
+}
+
+// Make dst's extent list and size the same as src's
+int alm_file_copy_extents(int dst, int src) {
+
+	struct ext_ll_t *sext, *dext, **dextptr;
+
+	dextptr = &fileinfo[dst].extent;
+	for (sext = fileinfo[src].extent; sext; sext = sext->next) {
+		if (!*dextptr) {
+			*dextptr = calloc(sizeof(struct ext_ll_t), 1);
+			if (!*dextptr)
+				return -1;
+		}
+		(*dextptr)->denum = sext->denum;
+		(*dextptr)->extsize = sext->extsize;
+		memcpy((*dextptr)->blocks, sext->blocks, sizeof(sext->blocks));
+		dextptr = &((*dextptr)->next);
+	}
+	// Drop any extents dst has past src's last one
+	sext = *dextptr;
+	*dextptr = NULL;
+	while (sext) {
+		dext = sext->next;
+		free(sext);
+		sext = dext;
+	}
+	fileinfo[dst].size = fileinfo[src].size;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_file_printlocks() {
+
+	struct file_share_t *share;
+	struct file_reclock_t *lock;
+	int fnum, printedany = 0;
+	char drivestr[3] = {' ', ':', 0};
+	char filename[13];
+
+	for (share = alm_file_shares; share; share = share->next) {
+		if (!share->locks && share->excl_port < 0)
+			continue;
+		for (fnum=1; fnum<MAXFILES; fnum++)
+			if (fileinfo[fnum].share == share)
+				break;
+		if (fnum == MAXFILES)
+			continue;
+		printedany = 1;
+		drivestr[0] = 'A' + share->drivenum;
+		safe_print(drivestr);
+		get_pretty_filename(filename, fileinfo[fnum].fname, fileinfo[fnum].fext);
+		safe_print(filename);
+		safe_print(": open ");
+		safe_print_num(share->opens);
+		if (share->excl_port >= 0) {
+			safe_print(", exclusive to port ");
+			safe_print_num(share->excl_port);
+		}
+		safe_print("\n");
+		for (lock = share->locks; lock; lock = lock->next) {
+			safe_print("  record ");
+			safe_print_num(lock->rec);
+			safe_print(" locked by port ");
+			safe_print_num(lock->port);
+			safe_print("\n");
+		}
+	}
+
+	if (!printedany)
+		safe_print("No locks held\n");
+
+	return 0;
+}
+
+// Read directory entry denum of disk, through the cache
+int alm_file_readde(int disk, int denum, struct cpm_direntry_t *de) {
+
+	struct cpm_direntry_t des[4];
+
+	if (alm_cache_readrec(disk, 0, drvparam[disk].dir_rec_min + (denum >> 2), des) < RECSIZE)
+		return -1;
+	memcpy(de, &des[denum & 3], DIRENTRYSIZE);
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+// Write directory entry denum of disk, through the cache
+int alm_file_writede(int disk, int denum, const struct cpm_direntry_t *de) {
+
+	struct cpm_direntry_t des[4];
+	int rec = drvparam[disk].dir_rec_min + (denum >> 2);
+
+	if (alm_cache_readrec(disk, 0, rec, des) < RECSIZE)
+		return -1;
+	memcpy(&des[denum & 3], de, DIRENTRYSIZE);
+	if (alm_cache_writerec(disk, 0, rec, des) < 0)
+		return -2;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+// Write the file's data blocks and directory entries out of the cache
+int alm_file_flushcache(int fnum) {
+
+	int disk = fileinfo[fnum].drivenum;
+	int blk;
+	struct ext_ll_t *ext;
+
+	if (!alm_cache_dirtyents)
+		return 0;
+	for (ext = fileinfo[fnum].extent; ext; ext = ext->next) {
+		for (blk=0; blk<16; blk++)
+			if (ext->blocks[blk])
+				alm_cache_flush_blk(disk, 0, ext->blocks[blk]);
+		alm_cache_flush_rec(disk, 0, drvparam[disk].dir_rec_min + (ext->denum >> 2));
+	}
+
+	return 0;
+}
+
+/* Per-file block tracking on top of the cache.
+ * Each open file works in one allocation block at a time. Reads load the
+ * whole block into the cache on the first miss, and writes collect there
+ * until the file moves to another block, is closed or synced, or the cache
+ * flush delay runs out, so a block is written back in one go.
+ */
+
+// Move the file to block, writing out what it wrote to the old one
+int alm_file_blkbuf_target(int fnum, uint16_t block) {
+
+	struct file_status_t *file = &fileinfo[fnum];
+	int disk = file->drivenum;
+
+	if (block == 0 || block > drvparam[disk].DBM)
+		return -1;
+	if (file->blkbuf_blk == block)
+		return 0;
+
+	if (file->blkbuf_dirty && alm_cache_flush_blk(disk, 0, file->blkbuf_blk) < 0)
+		return -3;
+	file->blkbuf_blk = block;
+	file->blkbuf_dirty = 0;
+
+	return 0;
+}
+
+// Read record rec of block, returns RECSIZE or less on error
+int alm_file_blkbuf_read(int fnum, uint16_t block, int rec, uint8_t *buf) {
+
+	int disk = fileinfo[fnum].drivenum;
+	int retval;
+
+	retval = alm_file_blkbuf_target(fnum, block);
+	if (retval < 0)
+		return retval;
+
+	return alm_cache_readrec(disk, 0, (block << drvparam[disk].BSF) + rec + drvparam[disk].dir_rec_min, buf);
+}
+
+// Write record rec of block. If zeroblk is set, the rest of the block is
+// zeroed (WRITERANDZ)
+int alm_file_blkbuf_write(int fnum, uint16_t block, int rec, const uint8_t *buf, int zeroblk) {
+
+	int disk = fileinfo[fnum].drivenum;
+	int recs = 1 << drvparam[disk].BSF;
+	int drec, retval;
+
+	retval = alm_file_blkbuf_target(fnum, block);
+	if (retval < 0)
+		return retval;
+
+	drec = (block << drvparam[disk].BSF) + drvparam[disk].dir_rec_min;
+	retval = alm_cache_writerec(disk, 0, drec + rec, buf);
+	if (retval > 0 && zeroblk)
+		retval = alm_cache_zerorecs(disk, 0, drec + rec + 1, recs - rec - 1);
+	if (retval > 0)
+		fileinfo[fnum].blkbuf_dirty = 1;
+
+	return retval;
+}
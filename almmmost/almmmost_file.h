@@ -33,6 +33,7 @@
 #define TVSP_FILE_OPEN (15)
 #define TVSP_FILE_CLOSE (16)
 #define TVSP_FILE_SEARCH1ST (17)
+#define TVSP_FILE_SEARCHNEXT (18)
 #define TVSP_FILE_DELETE (19)
 #define TVSP_FILE_READSEQ (20)
 #define TVSP_FILE_WRITESEQ (21)
@@ -44,6 +45,8 @@
 #define TVSP_FILE_GETSIZE (35)
 #define TVSP_FILE_SETRANDREC (36)
 #define TVSP_FILE_WRITERANDZ (40)
+#define TVSP_FILE_LOCKREC (42)
+#define TVSP_FILE_UNLOCKREC (43)
 
 #define LOG_EXT(ext,exm) (ext & exm)
 #define PHY_EXT(s2,ext,exm) (((s2 * 32) + (ext & 0x1F)) / (exm + 1))
@@ -92,11 +95,24 @@
 
 #define RETCODE_OK (0)
 #define RETCODE_UNWRITTEN_DATA (1)
+#define RETCODE_NOT_READY (2)		// Special file data not ready yet, read again
+#define RETCODE_HOLD (0xFE)		// Never sent: the response waits until the data's ready
 #define RETCODE_UNWRITTEN_EXTENT (4)
 #define RETCODE_DIRFULL (5)
 #define RETCODE_PAST_ENDOFDISK (6)
+#define RETCODE_LOCKED (8)		// Record locked by another port
 #define RETCODE_MISCERR (0xFF)
 
+/* alm_file_copy() errors */
+#define COPYERR_NAME (-1)	// Wildcards in a name
+#define COPYERR_DRIVE (-2)	// No such drive, or not public
+#define COPYERR_NOSRC (-3)	// Source doesn't exist
+#define COPYERR_INUSE (-4)	// Source or destination open elsewhere
+#define COPYERR_RO (-5)		// Destination drive or file is read only
+#define COPYERR_NOSPACE (-6)	// Destination disk or directory full
+#define COPYERR_SPECIAL (-7)	// Special files can't be copied
+#define COPYERR_IO (-8)		// Read or write failed
+
 struct ext_ll_t {
 	int denum;
 	struct ext_ll_t *next;
@@ -104,6 +120,45 @@ struct ext_ll_t {
 	uint16_t extsize;
 };
 
+/* Open modes, from the FCB interface attributes on OPEN/MAKE (MP/M style):
+ * f5' = unlocked (shared, coordinate with record locks), f6' = read-only,
+ * f8' = exclusive. No attribute keeps the old behaviour: shared, no checks.
+ */
+#define FILE_MODE_SHARED (0)
+#define FILE_MODE_UNLOCKED (1)
+#define FILE_MODE_RO (2)
+#define FILE_MODE_EXCL (3)
+
+/* f7' on OPEN/MAKE of a special file: the client reads a record again when it
+ * gets RETCODE_NOT_READY. Other clients have their read held until it's ready.
+ */
+#define FCB_NOTREADY(fcb) ((fcb)->fname[6] & 0x80)
+
+#define FCB_MODE_BITS(fcb) (((fcb)->fname[4] | (fcb)->fname[5] | (fcb)->fname[7]) & 0x80)
+#define FCB_MODE(fcb) (((fcb)->fname[7] & 0x80) ? FILE_MODE_EXCL : \
+		((fcb)->fname[5] & 0x80) ? FILE_MODE_RO : \
+		((fcb)->fname[4] & 0x80) ? FILE_MODE_UNLOCKED : FILE_MODE_SHARED)
+
+/* Record lock held by a port on a shared file */
+struct file_reclock_t {
+	int rec;
+	int fnum;
+	uint8_t port;
+	struct file_reclock_t *next;
+};
+
+/* One per public file that is open, shared by every fileinfo[] entry for it.
+ * A file is identified by its disk and the directory entry of its first extent.
+ */
+struct file_share_t {
+	uint8_t drivenum;
+	int denum;
+	int opens;	// Number of fileinfo[] entries pointing here
+	int excl_port;	// Port holding it exclusively, -1 if none
+	struct file_reclock_t *locks;
+	struct file_share_t *next;
+};
+
 struct special_file_t;
 struct special_data_t;
 
@@ -115,20 +170,69 @@ struct file_status_t {
 	uint8_t fname[8];
 	uint8_t fext[3];
 	uint8_t is_ro;
+	uint8_t mode;	// FILE_MODE_*
 	int size; // in records
 	struct ext_ll_t *extent;
+	// Allocation block the file is reading or writing, its records are in the cache
+	int blkbuf_blk;		// Disk block, 0 if none
+	uint8_t blkbuf_dirty;	// Written to since the file moved to blkbuf_blk
+	// Open file / lock state shared with other ports
+	struct file_share_t *share;
 	// Values used for special files
 	struct special_data_t *trap;
 	uint8_t *special_buf;
 };
 
+/* Per-port directory search cursor, set up by Search First and advanced by Search Next */
+struct file_search_t {
+	uint8_t active;
+	uint8_t drivenum;
+	uint8_t usrcode;
+	uint8_t allusers;	// Drive byte was '?': match every user code, including e5's
+	struct cpm_fcb_t fcb;	// Search pattern
+	int denum;		// Next directory entry to look at
+	int rec;		// Directory record held in des, -1 if none
+	struct cpm_direntry_t des[4];
+	struct special_file_t *sfp;	// Next special file to look at once the directory is done
+};
+
+/* A read of special file data that isn't there yet, from a client that
+ * doesn't know to read again. It's tried again until the data comes in.
+ */
+struct file_held_t {
+	uint8_t active;
+	long long retry;		// When to try it again, usec
+	struct tvsp_file_request freq;
+	struct cpm_fcb_t fcb;		// FCB as the client sent it
+};
+
+/* usec between tries at a held read */
+#define FILE_HOLD_RETRY (10000)
+
 extern struct file_status_t *fileinfo;
+extern struct file_search_t *alm_file_search;
+extern int alm_file_ports;
+extern struct file_share_t *alm_file_shares;
 	
 
 int alm_file_init();
 int alm_file_exit();
+/* Size the per-port search state, once the number of ports is known */
+int alm_file_setports(int ports);
 int alm_file_ini(struct INI *ini, const char *buf, size_t buflen);
 int alm_do_fileop(int portnum, void *reqbuf);
+/* Called from the main loop: answer held reads whose data has come in */
+int alm_file_poll();
+/* Port sent a new request, so it's stopped waiting for a held read */
+int alm_file_unhold(int portnum);
+/* Carry out a file request once the FCB and any write data are in */
+int alm_file_exec(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf);
+/* Send a file request to the cluster coordinator if there is one, otherwise carry it out */
+int alm_file_route(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *databuf);
+/* Does the client on portnum take Search First/Next directory records */
+int alm_file_searchdata(int portnum);
+/* Send the response to a file request, and the FCB and data that go with it */
+int alm_file_respond(int portnum, int fop, struct tvsp_file_response *resp, struct cpm_fcb_t *fcb, uint8_t *databuf);
 
 /* Functions corresponding to BDOS commands */
 /* Open / Make, BDOS 15, 22 */
@@ -146,18 +250,33 @@ int alm_file_doread(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_
 /* Write seq / Write rand / Write rand zero block, BDOS 21, 34, 40 */
 int alm_file_dowrite(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *writebuf);
 
-/* Search for First, BDOS 17 -- note drive = ? means search for any user #, including e5's */
-int alm_file_dosearch(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
+/* Search for First / Next, BDOS 17, 18 -- note drive = ? means search for any user #, including e5's */
+int alm_file_dosearch(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp, uint8_t *dirbuf);
+
+/* Search for First, BDOS 17, by open and close, for ports without Search Data */
+int alm_file_dosearch_open(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
 
 /* Delete file BDOS 19 / Rename file BDOS 23 / Set attributes BDOS 30 */
 int alm_file_domoddir(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
 
+/* Lock / unlock record, BDOS 42, 43 */
+int alm_file_dolock(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
+
 /* Get file size (set rrec to EOF), BDOS 35 */
 int alm_file_dogetsize(int portnum, struct tvsp_file_request *freq, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
 
+/* Copy a file on public drives for portnum, returns records copied or COPYERR_* */
+int alm_file_copy(int portnum, int uc, int curdisk, const struct cpm_fcb_t *src, const struct cpm_fcb_t *dst);
+
 /* Close all files opened by portnum */
 int alm_file_clearfiles(int portnum);
 
+/* Drop all record locks held by portnum */
+int alm_file_clear_locks(int portnum);
+
+/* Print all record locks */
+int alm_file_printlocks();
+
 /* Save all file state */
 int alm_file_sync();
 
@@ -169,6 +288,7 @@ int alm_file_closeallondisk(int disk);
 
 /* Internal functions */
 int alm_file_loadbam(int disk);
+int alm_file_scanbam(int disk);
 int alm_file_allocblk(int disk, int dentry);
 int alm_file_deallocblk(int disk, uint16_t block);
 int alm_file_finddentry(int port, int disk, int usrcode, struct cpm_fcb_t *fcb);
@@ -176,9 +296,23 @@ int alm_file_closeentry(int disk, int fnum);
 int alm_alloc_dentry(int disk, int usrcode, int fnum, struct cpm_fcb_t *fcb);
 int alm_file_rewrite_extents(int fnum);
 int alm_same_file(const struct cpm_fcb_t *fcb, const uint8_t *fname, const uint8_t *fext);
-int alm_modify_dir(int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
+int alm_modify_dir(int portnum, int fileop, int disk, int uc, struct cpm_fcb_t *fcb, struct tvsp_file_response *resp);
 int alm_file_modify_thisde(int fileop, int disk, struct cpm_direntry_t *de, struct cpm_fcb_rename_t *fcbren);
 int alm_file_blks2fcb(int disk, struct ext_ll_t *ext, struct cpm_fcb_t *fcb);
 int alm_file_getfnum(int freq_fnum, const struct cpm_fcb_t *fcb, int portnum, int disk, int uc);
+int alm_file_share_open(int fnum, int mode);
+int alm_file_share_close(int fnum);
+int alm_file_share_extents(int fnum);
+int alm_file_copy_extents(int dst, int src);
+int alm_file_share_conflict(int fnum, int portnum);
+int alm_file_modify_open(int fileop, int fnum, struct cpm_fcb_rename_t *fcbren);
+int alm_file_reclocked(int fnum, int rec);
+int alm_file_search_match(struct file_search_t *srch, const struct cpm_direntry_t *de, int disk);
+int alm_file_readde(int disk, int denum, struct cpm_direntry_t *de);
+int alm_file_writede(int disk, int denum, const struct cpm_direntry_t *de);
+int alm_file_flushcache(int fnum);
+int alm_file_blkbuf_target(int fnum, uint16_t block);
+int alm_file_blkbuf_read(int fnum, uint16_t block, int rec, uint8_t *buf);
+int alm_file_blkbuf_write(int fnum, uint16_t block, int rec, const uint8_t *buf, int zeroblk);
 
 #endif /* _ALMMMOST_FILE_H */
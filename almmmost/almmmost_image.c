@@ -43,23 +43,50 @@
 #include "almmmost_image.h"
 #include "almmmost_device.h"
 #include "almmmost_file.h"
+#include "almmmost_cache.h"
+#include "almmmost_cluster.h"
+#include "almmmost_repl.h"
+#include "almmmost_dirindex.h"
 
-struct drive_param_t  drvparam[MAXDISK];
+struct drive_param_t *drvparam = NULL;
 
 int mmm_pubdrv;
 
 char *disk_image_dir = NULL;
 
 int alm_img_init() {
-	int i,j;
 
 	// Default mmm_maxdirs
-	mmm_maxdirs = MAXDIRS;
+	mmm_maxdirs = DEFDIRS;
+	mmm_numdisks = 0;
+	drvparam = NULL;
+
+	return 0;
+}
+
+/* Size the drive tables from [Disks], all images closed */
+static int alm_img_alloc() {
+
+	int i,j;
 
-	memset(&drvparam, 0, sizeof(drvparam));
+	if (drvparam) {
+		printf("Disks already set up, ignoring another [Disks]\n");
+		return -1;
+	}
 
-	for (i=0;i<MAXDISK;i++) {
-		for (j=0;j<MAXDIRS;j++) {
+	drvparam = calloc(mmm_numdisks ? mmm_numdisks : 1, sizeof(struct drive_param_t));
+	if (!drvparam) {
+		perror("Allocating disks");
+		exit(1);
+	}
+	for (i=0; i<mmm_numdisks; i++) {
+		drvparam[i].image_fd = malloc(mmm_maxdirs * sizeof(int));
+		drvparam[i].is_ro = calloc(mmm_maxdirs, sizeof(int));
+		if (!drvparam[i].image_fd || !drvparam[i].is_ro) {
+			perror("Allocating disks");
+			exit(1);
+		}
+		for (j=0; j<mmm_maxdirs; j++) {
 			drvparam[i].image_fd[j] = -1;
 		}
 	}
@@ -70,19 +97,23 @@ int alm_img_init() {
 int alm_img_exit() {
 	int i,j;
 
-	for (i=0; i<MAXDISK; i++) {
-		for (j=0; j<MAXDIRS; j++) {
+	for (i=0; drvparam && i<mmm_numdisks; i++) {
+		for (j=0; j<mmm_maxdirs; j++) {
 			if (drvparam[i].image_fd[j] >= 0) {
 				close(drvparam[i].image_fd[j]);
 				drvparam[i].image_fd[j] = -1;
 			}
 		}
+		free(drvparam[i].image_fd);
+		free(drvparam[i].is_ro);
 		if (drvparam[i].bam) {
 			free(drvparam[i].bam);
 			drvparam[i].bam = NULL;
 		}
 
 	}
+	free(drvparam);
+	drvparam = NULL;
 
 	if (disk_image_dir) {
 		free(disk_image_dir);
@@ -124,6 +155,8 @@ int alm_img_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			} else if (!strncasecmp(kbuf, "Num Disks", 9)) {
 				// Max client #
 				mmm_numdisks = strtol(vbuf, NULL, 0);
+				if (mmm_numdisks < 0)
+					mmm_numdisks = 0;
 				if (mmm_numdisks > MAXDISK) {
 					printf("Config specified number of disks is greater than MAXDISK limit: %d\n", MAXDISK);
 					mmm_numdisks = MAXDISK;
@@ -132,6 +165,8 @@ int alm_img_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			} else if (!strncasecmp(kbuf, "Max Priv Dirs", 13)) {
 				// Max private dir #
 				mmm_maxdirs = strtol(vbuf, NULL, 0);
+				if (mmm_maxdirs < 1)
+					mmm_maxdirs = 1;
 				if (mmm_maxdirs > MAXDIRS) {
 					printf("Config specified number of private directories is greater than NUMDIRS limit: %d\n", MAXDIRS);
 					mmm_maxdirs = MAXDIRS;
@@ -140,11 +175,13 @@ int alm_img_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			}
 		} while (1);
 
+		alm_img_alloc();
+
 	} else if (!strncasecmp(section, "Disk ", 5)) {
 
 		int disk = strtol(section+5, NULL, 0);
-		if (disk > mmm_numdisks) {
-			printf("Disk %d > Num Disks specified %d, check config file.\n", disk, mmm_numdisks);
+		if (disk < 0 || disk >= mmm_numdisks || !drvparam) {
+			printf("Disk %d >= Num Disks specified %d, check config file.\n", disk, mmm_numdisks);
 			return 1;
 		}
 		do {
@@ -186,9 +223,9 @@ int alm_img_ini(struct INI *ini, const char *buf, size_t sectlen) {
 				string_copy(image_fname+path_len+1, vbuf, vallen);
 
 				if (isro)
-					image_fd = open(image_fname, O_RDONLY);
+					image_fd = open(image_fname, O_RDONLY | O_CLOEXEC);
 				else
-					image_fd = open(image_fname, O_RDWR);
+					image_fd = open(image_fname, O_RDWR | O_CLOEXEC);
 
 				if (image_fd < 0) {
 					perror(image_fname);
@@ -196,6 +233,8 @@ int alm_img_ini(struct INI *ini, const char *buf, size_t sectlen) {
 				}
 				drvparam[disk].image_fd[imgdirnum] = image_fd;
 				drvparam[disk].is_ro[imgdirnum] = isro;
+				if (!imgdirnum)
+					alm_dix_setimage(disk, image_fname);
 
 			} else if (!strncasecmp(kbuf, "Type", 4)) {
 				if (!strncasecmp(vbuf, "PRIVATE", 7)) {		// Private
@@ -236,7 +275,7 @@ int alm_img_reopen(int disk, int dir, char *filename) {
 	int newfd;
 
 	// Check that the numbers are in range, and that the image is already open (ie, parameters are set). Don't do this on public drives.
-	if (disk >= mmm_numdisks || dir >= MAXDIRS)
+	if (disk >= mmm_numdisks || dir < 0 || dir >= mmm_maxdirs)
 		return -3;
 	if (drvparam[disk].image_fd[dir] < 0)
 		return -5;
@@ -245,14 +284,16 @@ int alm_img_reopen(int disk, int dir, char *filename) {
 	if (!filename || !strlen(filename))
 		return -7;
 
-	newfd = open(filename, O_RDWR);
+	newfd = open(filename, O_RDWR | O_CLOEXEC);
 	if (newfd < 0) {
-		printf("Failed to open new image '%s' for disk %c[%d]\n", filename, 'A'+disk, dir);
+		alm_printf("Failed to open new image '%s' for disk %c[%d]\n", filename, 'A'+disk, dir);
 		return -7;
 	}
 	if (drvparam[disk].public_private == PUBLDIR) {
 		alm_file_closeallondisk(disk);
 	}
+	// Anything cached belongs to the old image
+	alm_cache_invalidate(disk, dir);
 	close(drvparam[disk].image_fd[dir]);
 	drvparam[disk].image_fd[dir] = newfd;
 	if (drvparam[disk].public_private == PUBLDIR) {
@@ -270,22 +311,29 @@ int alm_img_readrec(int disk, int user, int rec, void *buf) {
 
 	if (!buf)
 		return -2;
-	if (disk >= mmm_numdisks || user >= MAXUSER)
+	if (disk >= mmm_numdisks)
 		return -3;
 	if (rec > drvparam[disk].data_rec_max - drvparam[disk].dir_rec_min)
 		return -4;
 	
-	if (drvparam[disk].public_private == PRIVDIR)
+	if (drvparam[disk].public_private == PRIVDIR) {
+		if (user < 0 || user >= alm_dev_ports)
+			return -3;
 		dir = userinfo[user].drive_dir[disk];
-	else
+	} else if (alm_cluster_role == CLUSTER_NODE) {
+		// Shared drives live on the coordinator
+		return alm_cluster_readrec(disk, rec, buf);
+	} else {
 		dir = 0;
+	}
+	if (dir < 0 || dir >= mmm_maxdirs)
+		return -5;
 	fd = drvparam[disk].image_fd[dir];
 	
 	if (fd < 0)
 		return -5;
 
-	lseek(fd, rec*RECSIZE, SEEK_SET);
-	return read(fd, buf, RECSIZE);
+	return alm_cache_readrec(disk, dir, rec, buf);
 
 }
 
@@ -296,24 +344,34 @@ int alm_img_writerec(int disk, int user, int rec, void *buf) {
 
 	if (!buf)
 		return -2;
-	if (disk >= mmm_numdisks || user >= MAXUSER)
+	if (disk >= mmm_numdisks)
 		return -3;
 	if (rec > drvparam[disk].data_rec_max - drvparam[disk].dir_rec_min)
 		return -4;
 
-	if (drvparam[disk].public_private == PRIVDIR)
+	if (drvparam[disk].public_private == PRIVDIR) {
+		if (user < 0 || user >= alm_dev_ports)
+			return -3;
 		dir = userinfo[user].drive_dir[disk];
-	else
+	} else if (alm_cluster_role == CLUSTER_NODE) {
+		// Shared drives live on the coordinator
+		return alm_cluster_writerec(disk, rec, buf);
+	} else if (alm_repl_role == REPL_STANDBY) {
+		// Only the primary changes them until we're promoted
+		return -6;
+	} else {
 		dir = 0;
+	}
+	if (dir < 0 || dir >= mmm_maxdirs)
+		return -5;
 	fd = drvparam[disk].image_fd[dir];
 	
 	if (fd < 0)
 		return -5;
-	if (drvparam[disk].is_ro[userinfo[user].drive_dir[disk]])
+	if (drvparam[disk].is_ro[dir])
 		return -6;
 
-	lseek(fd, rec*RECSIZE, SEEK_SET);
-	return write(fd, buf, RECSIZE);
+	return alm_cache_writerec(disk, dir, rec, buf);
 
 }
 
@@ -324,17 +382,7 @@ int alm_generate_drv_param_hdrs(int ostype) {
 	if (ostype > max_ostype)
 		return -1;
 
-	uint8_t *osimg=bootinfo[ostype].os_image;
-	uint16_t base_addr = bootinfo[ostype].os_base;
-	uint16_t dph_addr = bootinfo[ostype].hpam_addr+8;
-	uint16_t dpb_addr = dph_addr + mmm_numdisks * DISK_PARAM_HDR_BYTES;
-	uint16_t dirbuf_addr = dpb_addr + mmm_numdisks * DISK_PARAM_BLK_BYTES;
-	uint16_t csv_addr = dirbuf_addr + DIRBUF_BYTES;
-	uint16_t alv_addr;
-	uint16_t dpbs[MAXDISK];
-
-
-	if (!osimg)
+	if (!bootinfo[ostype].os_image)
 		return -2;
 
 	/* Generate drvparam values */
@@ -352,8 +400,33 @@ int alm_generate_drv_param_hdrs(int ostype) {
 
 	}
 
+	return alm_write_drv_param_hdrs(ostype, bootinfo[ostype].os_image, mmm_numdisks);
+}
+
+/* Write the headers and blocks for the first numdisks drives into osimg,
+ * a copy of ostype's image. Needs the drvparam values generated first.
+ */
+int alm_write_drv_param_hdrs(int ostype, uint8_t *osimg, int numdisks) {
+
+	int disk;
+
+	if (ostype > max_ostype)
+		return -1;
+
+	uint16_t base_addr = bootinfo[ostype].os_base;
+	uint16_t dph_addr = bootinfo[ostype].hpam_addr+8;
+	uint16_t dpb_addr = dph_addr + numdisks * DISK_PARAM_HDR_BYTES;
+	uint16_t dirbuf_addr = dpb_addr + numdisks * DISK_PARAM_BLK_BYTES;
+	uint16_t csv_addr = dirbuf_addr + DIRBUF_BYTES;
+	uint16_t alv_addr;
+	uint16_t dpbs[MAXDISK];
+
+
+	if (!osimg)
+		return -2;
+
 	/* Add dph values first */
-	for (disk=0; disk<mmm_numdisks; disk++) {
+	for (disk=0; disk<numdisks; disk++) {
 		uint16_t dph_off = dph_addr - base_addr;
 
 		dpbs[disk] = dpb_addr - base_addr;
@@ -378,7 +451,7 @@ int alm_generate_drv_param_hdrs(int ostype) {
 	}
 
 	/* Now generate dpb values */
-	for (disk=0; disk<mmm_numdisks; disk++) {
+	for (disk=0; disk<numdisks; disk++) {
 		uint16_t dpb_off = dpbs[disk];
 		uint16_t dir_alloc_bits = 0xFFFF << (16 - drvparam[disk].dir_ALx);
 
@@ -458,7 +531,7 @@ int alm_do_read(int portnum, void *reqbuf) {
 	//printf("Read request, drive %c, track %d, sect %d: ", 
 	//		dreqbuf->ndisk + 'A', tracknum, sectnum);
 
-	if ((disknum >= MAXDISK) || (sectnum > drvparam[disknum].SPT) || (tracknum > drvparam[disknum].tracks))  {
+	if ((disknum >= mmm_numdisks) || (sectnum > drvparam[disknum].SPT) || (tracknum > drvparam[disknum].tracks))  {
 		ipc_resp.err = 1;
 		ipc_resp.errcode = ERR_BIOS_SELECT;
 		printf("Select ERR\n");
@@ -533,7 +606,7 @@ int alm_do_write(int portnum, void *reqbuf) {
 		printf("Protocol ERR %d: %d\n", retval, errno);
 	} else {
 
-		if ((disknum >= MAXDISK) || (sectnum > drvparam[disknum].SPT) || (tracknum > drvparam[disknum].tracks) )  {
+		if ((disknum >= mmm_numdisks) || (sectnum > drvparam[disknum].SPT) || (tracknum > drvparam[disknum].tracks) )  {
 			ipc_resp.err = 1;
 			ipc_resp.errcode = ERR_BIOS_SELECT;
 			printf("Select ERR\n");
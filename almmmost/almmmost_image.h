@@ -108,8 +108,8 @@ struct drive_param_t {
 	unsigned int dirs;		// Number of private directories
 	unsigned int dir_ALx;		// Number of blocks reserved for directories
 	unsigned int public_private;	// enum for private/public/pub. only
-		 int image_fd[MAXDIRS];	// fds for image file (one per directory)
-		 int is_ro[MAXDIRS];	// set to 1 if this dir's image is r/o
+		 int *image_fd;		// fds for image file (one per directory)
+		 int *is_ro;		// set to 1 if this dir's image is r/o
 	unsigned int is_floppy;		// true if is a floppy (removable)
 	unsigned int dir_rec_min;	// Minimum value for directory record
 	unsigned int dir_rec_max;	// Max value for usable directory record
@@ -125,14 +125,14 @@ struct drive_param_t {
 	uint16_t DBM;			// Max block # of data blocks
 	uint16_t DBL;		 	// Max directory block #
 	uint16_t res_tracks;		// Number of reserved tracks
-	int *bam;			// Block allocation map for public drives only
+	int *bam;			// Block allocation map for public drives only, owner dir entry + 1 or 0 if free
 };
 
 #define PRIVDIR (0)
 #define PUBLDIR (1)
 #define PUBLONLYDIR (2)
 
-extern struct drive_param_t drvparam[];
+extern struct drive_param_t *drvparam;
 extern int mmm_pubdrv;	// Public drives bitfield
 extern char *disk_image_dir;
 
@@ -154,6 +154,11 @@ int alm_img_writerec(int disk, int user, int rec, void *buf);
 /* Generate the drive parameter headers/blocks based on config file input */
 int alm_generate_drv_param_hdrs(int ostype);
 
+/* Write the headers and blocks for the first numdisks drives into a copy of
+ * ostype's image
+ */
+int alm_write_drv_param_hdrs(int ostype, uint8_t *osimg, int numdisks);
+
 /* Display drive parameter table for debugging */
 int alm_drv_disp_param_hdrs(int disk);
 
@@ -0,0 +1,382 @@
+/* almmmost_imgconv.c: The web image to TeleVideo graphics conversion module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <png.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_imgconv.h"
+
+/* This does what cgi/tvimg_pipeline.sh did with ImageMagick and pbm2bin,
+ * without the web server, Perl, or three extra processes per image:
+ *
+ *	convert - -colorspace Gray -ordered-dither o4x4 -scale 640x480
+ *		-scale 100%x50% -negate pbm:- | pbm2bin
+ *
+ * The image is decoded straight to grayscale, box filtered down (or up) to
+ * fit 640x480 and squashed to half height, then 4x4 Bayer dithered, inverted
+ * and packed 8 pixels to a byte into the interlaced field layout. Scaling
+ * comes before dithering here, so the dither pattern isn't smeared by the
+ * scale. The inner loops are kept simple so the compiler can vectorize them.
+ */
+
+/* 4x4 Bayer matrix, as thresholds in the middle of each of the 16 levels */
+static const uint8_t alm_imgconv_bayer[4][4] = {
+	{   8, 136,  40, 168 },
+	{ 200,  72, 232, 104 },
+	{  56, 184,  24, 152 },
+	{ 248, 120, 216,  88 },
+};
+
+/* Convert a JPEG, PNG or PNM file into the screen layout, in a new buffer */
+int alm_imgconv_tvi(const uint8_t *in, size_t inlen, uint8_t **out, size_t *outlen) {
+
+	struct imgconv_gray_t src, dst;
+	int width, height;
+
+	memset(&src, 0, sizeof(src));
+	memset(&dst, 0, sizeof(dst));
+
+	if (alm_imgconv_decode(in, inlen, &src) < 0)
+		return -1;
+
+	// Fit in 640x480 keeping the aspect ratio, then half the height
+	if ((long long)src.width * 480 >= (long long)src.height * IMGCONV_WIDTH) {
+		width = IMGCONV_WIDTH;
+		height = ((long long)src.height * IMGCONV_WIDTH + src.width/2) / src.width;
+	} else {
+		height = 480;
+		width = ((long long)src.width * 480 + src.height/2) / src.height;
+	}
+	height = (height + 1) / 2;
+	if (width < 1)
+		width = 1;
+	if (height < 1)
+		height = 1;
+
+	if (alm_imgconv_scale(&src, &dst, width, height) < 0) {
+		free(src.pix);
+		return -1;
+	}
+	free(src.pix);
+
+	*out = malloc(IMGCONV_OUTSIZE);
+	if (!*out) {
+		free(dst.pix);
+		return -1;
+	}
+	alm_imgconv_pack(&dst, *out);
+	*outlen = IMGCONV_OUTSIZE;
+	free(dst.pix);
+
+	return 0;
+}
+
+int alm_imgconv_decode(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img) {
+
+	if (inlen >= 3 && in[0] == 0xFF && in[1] == 0xD8 && in[2] == 0xFF)
+		return alm_imgconv_decode_jpeg(in, inlen, img);
+	if (inlen >= 8 && !png_sig_cmp((png_const_bytep)in, 0, 8))
+		return alm_imgconv_decode_png(in, inlen, img);
+	if (inlen >= 2 && in[0] == 'P' && in[1] >= '4' && in[1] <= '6')
+		return alm_imgconv_decode_pnm(in, inlen, img);
+
+	printf("alm_imgconv_decode: Unknown image format\n");
+	return -1;
+}
+
+int alm_imgconv_alloc(struct imgconv_gray_t *img, int width, int height) {
+
+	if (width < 1 || height < 1 || (long long)width * height > IMGCONV_MAXPIXELS) {
+		printf("alm_imgconv: Bad image size %dx%d\n", width, height);
+		return -1;
+	}
+	img->pix = malloc((size_t)width * height);
+	if (!img->pix)
+		return -1;
+	img->width = width;
+	img->height = height;
+
+	return 0;
+}
+
+struct imgconv_jpeg_err_t {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void alm_imgconv_jpeg_error(j_common_ptr cinfo) {
+
+	struct imgconv_jpeg_err_t *err = (struct imgconv_jpeg_err_t *)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, msg);
+	printf("alm_imgconv_decode_jpeg: %s\n", msg);
+	longjmp(err->jmp, 1);
+}
+
+int alm_imgconv_decode_jpeg(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img) {
+
+	struct jpeg_decompress_struct cinfo;
+	struct imgconv_jpeg_err_t jerr;
+	JSAMPROW row;
+
+	img->pix = NULL;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = alm_imgconv_jpeg_error;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(img->pix);
+		img->pix = NULL;
+		return -1;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *)in, inlen);
+	jpeg_read_header(&cinfo, TRUE);
+	// libjpeg does the color to gray conversion for us
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	jpeg_start_decompress(&cinfo);
+	if (alm_imgconv_alloc(img, cinfo.output_width, cinfo.output_height) < 0) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = img->pix + (size_t)cinfo.output_scanline * img->width;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	return 0;
+}
+
+int alm_imgconv_decode_png(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img) {
+
+	png_image pimg;
+	png_color white = { 255, 255, 255 };
+
+	memset(&pimg, 0, sizeof(pimg));
+	pimg.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&pimg, in, inlen)) {
+		printf("alm_imgconv_decode_png: %s\n", pimg.message);
+		return -1;
+	}
+	// Transparent parts end up white, like a web page background
+	pimg.format = PNG_FORMAT_GRAY;
+	if (alm_imgconv_alloc(img, pimg.width, pimg.height) < 0) {
+		png_image_free(&pimg);
+		return -1;
+	}
+	if (!png_image_finish_read(&pimg, &white, img->pix, 0, NULL)) {
+		printf("alm_imgconv_decode_png: %s\n", pimg.message);
+		free(img->pix);
+		img->pix = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Binary PBM, PGM and PPM (P4, P5, P6) */
+int alm_imgconv_decode_pnm(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img) {
+
+	int vals[3] = { 0, 0, 0 };	// width, height, maxval
+	int nvals = (in[1] == '4') ? 2 : 3;
+	int type = in[1];
+	size_t pos = 2, rowbytes, i;
+	int x, y, n;
+
+	// Header numbers, with # comments
+	for (n=0; n<nvals; n++) {
+		while (pos < inlen && (in[pos] == ' ' || in[pos] == '\t' || in[pos] == '\r' || in[pos] == '\n' || in[pos] == '#')) {
+			if (in[pos] == '#') {
+				while (pos < inlen && in[pos] != '\n')
+					pos++;
+			} else {
+				pos++;
+			}
+		}
+		if (pos >= inlen || in[pos] < '0' || in[pos] > '9')
+			break;
+		while (pos < inlen && in[pos] >= '0' && in[pos] <= '9' && vals[n] < 0x1000000)
+			vals[n] = vals[n] * 10 + (in[pos++] - '0');
+	}
+	// Exactly one whitespace character before the data
+	pos++;
+	if (type == '4')
+		vals[2] = 1;
+	if (n < nvals || vals[2] < 1 || vals[2] > 65535 || pos > inlen) {
+		printf("alm_imgconv_decode_pnm: Bad header\n");
+		return -1;
+	}
+	if (alm_imgconv_alloc(img, vals[0], vals[1]) < 0)
+		return -1;
+
+	if (type == '4')
+		rowbytes = (img->width + 7) / 8;
+	else
+		rowbytes = (size_t)img->width * ((type == '6') ? 3 : 1) * ((vals[2] > 255) ? 2 : 1);
+	if ((inlen - pos) / rowbytes < (size_t)img->height) {
+		printf("alm_imgconv_decode_pnm: Short file\n");
+		free(img->pix);
+		img->pix = NULL;
+		return -1;
+	}
+
+	for (y=0; y<img->height; y++) {
+		const uint8_t *src = in + pos + y * rowbytes;
+		uint8_t *dst = img->pix + (size_t)y * img->width;
+
+		if (type == '4') {
+			// 1 = black
+			for (x=0; x<img->width; x++)
+				dst[x] = (src[x >> 3] & (0x80 >> (x & 7))) ? 0 : 255;
+		} else if (vals[2] > 255) {
+			// 16 bit big endian samples
+			for (x=0; x<img->width; x++) {
+				if (type == '5') {
+					i = x * 2;
+					dst[x] = (((src[i] << 8) | src[i+1]) * 255) / vals[2];
+				} else {
+					i = x * 6;
+					dst[x] = ((77 * ((((src[i] << 8) | src[i+1]) * 255) / vals[2])
+						+ 150 * ((((src[i+2] << 8) | src[i+3]) * 255) / vals[2])
+						+ 29 * ((((src[i+4] << 8) | src[i+5]) * 255) / vals[2])) >> 8);
+				}
+			}
+		} else if (type == '5') {
+			for (x=0; x<img->width; x++)
+				dst[x] = (src[x] * 255) / vals[2];
+		} else {
+			// Same weights as libjpeg uses, in 8 bit fixed point
+			for (x=0; x<img->width; x++)
+				dst[x] = (((77 * src[x*3] + 150 * src[x*3+1] + 29 * src[x*3+2]) >> 8) * 255) / vals[2];
+		}
+	}
+
+	return 0;
+}
+
+/* Box filter src to width x height. Each output pixel averages the source
+ * pixels it covers, or repeats the nearest one when enlarging.
+ */
+int alm_imgconv_scale(const struct imgconv_gray_t *src, struct imgconv_gray_t *dst, int width, int height) {
+
+	int *x0, *x1, x, y, sy, sy0, sy1;
+	uint32_t *acc;
+	const uint8_t *srow;
+	uint8_t *drow;
+
+	if (alm_imgconv_alloc(dst, width, height) < 0)
+		return -1;
+	x0 = malloc(sizeof(int) * width);
+	x1 = malloc(sizeof(int) * width);
+	acc = malloc(sizeof(uint32_t) * width);
+	if (!x0 || !x1 || !acc) {
+		free(x0); free(x1); free(acc);
+		free(dst->pix);
+		dst->pix = NULL;
+		return -1;
+	}
+
+	// Source columns covered by each output column
+	for (x=0; x<width; x++) {
+		x0[x] = ((long long)x * src->width) / width;
+		x1[x] = ((long long)(x+1) * src->width) / width;
+		if (x1[x] <= x0[x])
+			x1[x] = x0[x] + 1;
+	}
+
+	for (y=0; y<height; y++) {
+		sy0 = ((long long)y * src->height) / height;
+		sy1 = ((long long)(y+1) * src->height) / height;
+		if (sy1 <= sy0)
+			sy1 = sy0 + 1;
+
+		memset(acc, 0, sizeof(uint32_t) * width);
+		for (sy=sy0; sy<sy1; sy++) {
+			srow = src->pix + (size_t)sy * src->width;
+			for (x=0; x<width; x++) {
+				int sx;
+				uint32_t sum = 0;
+				for (sx=x0[x]; sx<x1[x]; sx++)
+					sum += srow[sx];
+				acc[x] += sum;
+			}
+		}
+
+		drow = dst->pix + (size_t)y * width;
+		for (x=0; x<width; x++)
+			drow[x] = acc[x] / ((uint32_t)(x1[x] - x0[x]) * (sy1 - sy0));
+	}
+
+	free(x0);
+	free(x1);
+	free(acc);
+
+	return 0;
+}
+
+/* Dither, invert (lit pixel = 1) and pack into the interlaced fields */
+int alm_imgconv_pack(const struct imgconv_gray_t *img, uint8_t *out) {
+
+	uint8_t line[IMGCONV_WIDTH];
+	uint8_t *dst;
+	int x, y, b;
+
+	memset(out, 0, IMGCONV_OUTSIZE);
+
+	for (y=0; y<img->height && y<IMGCONV_HEIGHT; y++) {
+		const uint8_t *srow = img->pix + (size_t)y * img->width;
+		const uint8_t *thresh = alm_imgconv_bayer[y & 3];
+		int w = (img->width < IMGCONV_WIDTH) ? img->width : IMGCONV_WIDTH;
+
+		// One pixel per byte first, anything right of the image stays dark
+		memset(line, 0, sizeof(line));
+		for (x=0; x<w; x++)
+			line[x] = (srow[x] > thresh[x & 3]);
+
+		dst = out + IMGCONV_LINE_OFF(y);
+		for (x=0; x<IMGCONV_BYTESPERLINE; x++) {
+			uint8_t byte = 0;
+			for (b=0; b<8; b++)
+				byte |= line[x*8 + b] << (7 - b);
+			dst[x] = byte;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+/* almmmost_imgconv.h: The web image to TeleVideo graphics conversion module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_IMGCONV_H
+#define _ALMMMOST_IMGCONV_H
+
+/* Output is what pbm2bin makes for IMAGEGET.ZASM: a 640x240 1 bit per pixel
+ * screen, split into 4 interlaced fields of RECSPERFIELD records each. Line
+ * n of the screen is in field n%4, at line n/4 of that field.
+ */
+#define IMGCONV_WIDTH (640)
+#define IMGCONV_HEIGHT (240)
+#define IMGCONV_FIELDS (4)
+#define IMGCONV_RECSPERFIELD (38)
+#define IMGCONV_BYTESPERLINE (IMGCONV_WIDTH/8)
+#define IMGCONV_OUTSIZE (IMGCONV_FIELDS * IMGCONV_RECSPERFIELD * RECSIZE)
+#define IMGCONV_LINE_OFF(row) ((((row)/IMGCONV_FIELDS) * IMGCONV_BYTESPERLINE) + \
+		(((row)%IMGCONV_FIELDS) * IMGCONV_RECSPERFIELD * RECSIZE))
+
+#define IMGCONV_MAXPIXELS (32*1024*1024)	// Refuse to decode anything bigger
+
+/* 8 bit grayscale image, 0 = black */
+struct imgconv_gray_t {
+	int width;
+	int height;
+	uint8_t *pix;
+};
+
+/* Convert a JPEG, PNG or PNM file into the screen layout above, in a new
+ * buffer of IMGCONV_OUTSIZE bytes. Returns 0, or -1 if it can't be decoded.
+ */
+int alm_imgconv_tvi(const uint8_t *in, size_t inlen, uint8_t **out, size_t *outlen);
+
+/* Internal functions */
+int alm_imgconv_decode(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img);
+int alm_imgconv_decode_jpeg(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img);
+int alm_imgconv_decode_png(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img);
+int alm_imgconv_decode_pnm(const uint8_t *in, size_t inlen, struct imgconv_gray_t *img);
+int alm_imgconv_alloc(struct imgconv_gray_t *img, int width, int height);
+int alm_imgconv_scale(const struct imgconv_gray_t *src, struct imgconv_gray_t *dst, int width, int height);
+int alm_imgconv_pack(const struct imgconv_gray_t *img, uint8_t *out);
+
+#endif /* _ALMMMOST_IMGCONV_H */
@@ -43,12 +43,15 @@
 #include "almmmost_device.h"
 #include "almmmost_image.h"
 #include "almmmost_file.h"
+#include "almmmost_spool.h"
 
 
+/* The client's done with a print job, so print what spool.sys has so far.
+ * There's no response to this request.
+ */
 int alm_break_spool(int portnum, void *reqbuf) {
 
-	// FIXME maybe do something?
-	return 0;
+	return alm_spool_break(portnum);
 
 }
 
@@ -91,12 +94,12 @@ int alm_do_check(int portnum, void *reqbuf) {
 
 	switch (chkbuf->subreq) {
 		case TVSP_CHECK_SPOOLDRV:
-			ipc_resp.retcode = mmm_spooldrv;
+			ipc_resp.retcode = userinfo[portnum].spooldrv < 0 ? mmm_spooldrv : userinfo[portnum].spooldrv;
 			//printf("Check spool drive: %c\n", ipc_resp.retcode+'A');
 			break;
 
 		case TVSP_CHECK_AUTOLDPROC:
-			ipc_resp.retcode = (userinfo[portnum].autologon << 6 ) | (portnum & 0xF);
+			ipc_resp.retcode = (userinfo[portnum].autologon << 6 ) | (portnum & (MAXUSER-1));
 			//printf("Check proc id/autolog: %02x\n", ipc_resp.retcode);
 			break;
 
@@ -165,7 +168,7 @@ int alm_do_logon(int portnum, void *reqbuf){
 	if (retval > 0) {
 		char passwdtxt[9];
 		// Check drive #
-		if (drive > mmm_numdisks || drvparam[drive].public_private != PRIVDIR) {
+		if (drive >= mmm_numdisks || drvparam[drive].public_private != PRIVDIR) {
 			goto adl_exit;
 		}
 
@@ -179,7 +182,7 @@ int alm_do_logon(int portnum, void *reqbuf){
 			goto adl_exit;
 		}
 		int dest = strtol(passwdtxt+3,NULL,0);
-		if (dest > mmm_maxdirs) {
+		if (dest < 0 || dest >= mmm_maxdirs) {
 			goto adl_exit;
 		}
 		if (drvparam[drive].image_fd[dest] < 0) {
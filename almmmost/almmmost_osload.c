@@ -35,11 +35,13 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 
 #include <ini.h>
 
 #include "almmmost.h"
 #include "almmmost_image.h"
+#include "almmmost_file.h"
 #include "almmmost_osload.h"
 #include "almmmost_device.h"
 
@@ -52,9 +54,135 @@ struct host_boot_data_t bootinfo[MAXHOSTID+1];
 char *os_image_dir = NULL;
 int max_ostype;
 
+struct osl_xfer_t *alm_osl_xfers = NULL;
+struct osl_portimg_t *alm_osl_portimgs = NULL;
+int alm_osl_ports = 0;
+int alm_osl_sending = 0;	// Transfers active
+
+static struct host_boot_data_t alm_osl_oldinfo[MAXHOSTID+1];	// Images in use while a reload builds new ones
+static char *alm_osl_olddir = NULL;
+static int alm_osl_oldmax = -1;
+static int alm_osl_copies = 0;		// Transfers sending their own copy of an image
+
+static long long alm_osl_now() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Set a table of images to nothing loaded */
+static void alm_osl_clearinfo(struct host_boot_data_t *info) {
+	int i;
+
+	memset(info, 0, (MAXHOSTID+1) * sizeof(struct host_boot_data_t));
+	for (i=0; i<MAXHOSTID+1; i++) {
+		info[i].lz_sects_off = -1;
+		info[i].lz_scratch = OSL_LZ_SCRATCH;
+	}
+}
+
+/* Free the images in a table */
+static void alm_osl_freeinfo(struct host_boot_data_t *info) {
+	int i;
+
+	for (i=0; i<MAXHOSTID+1; i++) {
+		if (info[i].bootloader)
+			free(info[i].bootloader);
+		if (info[i].os_image)
+			free(info[i].os_image);
+		if (info[i].lz_bootloader)
+			free(info[i].lz_bootloader);
+		if (info[i].lz_image)
+			free(info[i].lz_image);
+		if (info[i].lz_map)
+			free(info[i].lz_map);
+	}
+	alm_osl_clearinfo(info);
+}
+
+/* Free a port's own image, it's built again on its next boot */
+static void alm_osl_freeportimg(struct osl_portimg_t *pi) {
+
+	free(pi->os.recnums);
+	free(pi->os.recs);
+	free(pi->lz.recnums);
+	free(pi->lz.recs);
+	memset(pi, 0, sizeof(struct osl_portimg_t));
+	pi->ostype = -1;
+}
+
+/* Note which of nrecs records in img differ from base, and keep a copy of them */
+static void alm_osl_patch(struct osl_patch_t *patch, const uint8_t *base, const uint8_t *img, int nrecs) {
+
+	int recnum, n;
+
+	n = 0;
+	for (recnum=0; recnum<nrecs; recnum++) {
+		if (memcmp(base + recnum*TVSP_DATA_SZ, img + recnum*TVSP_DATA_SZ, TVSP_DATA_SZ))
+			n++;
+	}
+	patch->nrecs = n;
+	patch->recnums = NULL;
+	patch->recs = NULL;
+	if (!n)
+		return;
+
+	patch->recnums = malloc(n * sizeof(int));
+	patch->recs = malloc(n * TVSP_DATA_SZ);
+	if (!patch->recnums || !patch->recs) {
+		perror("Allocating port OS image");
+		exit(1);
+	}
+	n = 0;
+	for (recnum=0; recnum<nrecs; recnum++) {
+		if (!memcmp(base + recnum*TVSP_DATA_SZ, img + recnum*TVSP_DATA_SZ, TVSP_DATA_SZ))
+			continue;
+		patch->recnums[n] = recnum;
+		memcpy(patch->recs + n*TVSP_DATA_SZ, img + recnum*TVSP_DATA_SZ, TVSP_DATA_SZ);
+		n++;
+	}
+}
+
+/* Record to send next, from the port's own records if it has one */
+static uint8_t *alm_osl_record(struct osl_xfer_t *xfer) {
+
+	struct osl_patch_t *patch = xfer->patch;
+	int i;
+
+	for (i=0; patch && i<patch->nrecs; i++) {
+		if (patch->recnums[i] == xfer->recnum)
+			return patch->recs + i*TVSP_DATA_SZ;
+	}
+	return xfer->image + xfer->recnum*TVSP_DATA_SZ;
+}
+
+/* Free copies of images that transfers have finished with */
+static void alm_osl_freecopies() {
+	int portnum;
+
+	for (portnum=0; portnum<alm_osl_ports && alm_osl_copies; portnum++) {
+		if (alm_osl_xfers[portnum].copy && !alm_osl_xfers[portnum].active) {
+			free(alm_osl_xfers[portnum].copy);
+			alm_osl_xfers[portnum].copy = NULL;
+			alm_osl_copies--;
+		}
+	}
+}
+
 /* Initialize variables */
 int alm_osl_init() {
-	memset(&bootinfo, 0, MAXHOSTID * sizeof(struct host_boot_data_t));
+
+	alm_osl_clearinfo(bootinfo);
+	alm_osl_clearinfo(alm_osl_oldinfo);
+	alm_osl_olddir = NULL;
+	alm_osl_oldmax = -1;
+	alm_osl_xfers = NULL;
+	alm_osl_portimgs = NULL;
+	alm_osl_ports = 0;
+	alm_osl_sending = 0;
+	alm_osl_copies = 0;
 	max_ostype = -1;
 
 	return 0;
@@ -62,22 +190,48 @@ int alm_osl_init() {
 
 /* Free allocated memory and clear variables */
 int alm_osl_exit() {
-	int i;
+	int portnum;
 
-	for (i=0; i<MAXHOSTID+1; i++) {
-		if (bootinfo[i].bootloader)
-			free(bootinfo[i].bootloader);
-		if (bootinfo[i].os_image)
-			free(bootinfo[i].os_image);
-	}
-
-	memset(&bootinfo, 0, MAXHOSTID * sizeof(struct host_boot_data_t));
+	alm_osl_freeinfo(bootinfo);
+	alm_osl_freeinfo(alm_osl_oldinfo);
 
 	if (os_image_dir)
 		free(os_image_dir);
 	os_image_dir = NULL;
+	free(alm_osl_olddir);
+	alm_osl_olddir = NULL;
 	max_ostype = -1;
 
+	for (portnum=0; portnum<alm_osl_ports; portnum++) {
+		free(alm_osl_xfers[portnum].copy);
+		alm_osl_freeportimg(&alm_osl_portimgs[portnum]);
+	}
+	free(alm_osl_xfers);
+	alm_osl_xfers = NULL;
+	free(alm_osl_portimgs);
+	alm_osl_portimgs = NULL;
+	alm_osl_ports = 0;
+	alm_osl_sending = 0;
+	alm_osl_copies = 0;
+
+	return 0;
+}
+
+/* Size the per-port OS image transfers */
+int alm_osl_setports(int ports) {
+
+	int portnum;
+
+	alm_osl_xfers = calloc(ports, sizeof(struct osl_xfer_t));
+	alm_osl_portimgs = calloc(ports, sizeof(struct osl_portimg_t));
+	if (!alm_osl_xfers || !alm_osl_portimgs) {
+		perror("Allocating OS transfers");
+		exit(1);
+	}
+	for (portnum=0; portnum<ports; portnum++)
+		alm_osl_portimgs[portnum].ostype = -1;
+	alm_osl_ports = ports;
+
 	return 0;
 }
 
@@ -149,7 +303,7 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 				string_copy(boot_fname+path_len+1, vbuf, vallen);
 
 				printf("OS %d reading bootloader %s\n", ostype, boot_fname);
-				boot_fd = open(boot_fname, O_RDONLY);
+				boot_fd = open(boot_fname, O_RDONLY | O_CLOEXEC);
 				if (boot_fd < 0) {
 					perror(boot_fname);
 					break;
@@ -166,6 +320,7 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 				// OS image filename
 				char *os_fname;
 				int os_fd;
+				ssize_t os_len;
 				int path_len = strlen(os_image_dir);
 
 				os_fname = alloca(vallen+2+path_len);
@@ -174,7 +329,7 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 				string_copy(os_fname+path_len+1, vbuf, vallen);
 
 				printf("OS %d reading OS %s\n", ostype, os_fname);
-				os_fd = open(os_fname, O_RDONLY);
+				os_fd = open(os_fname, O_RDONLY | O_CLOEXEC);
 				if (os_fd < 0) {
 					perror(os_fname);
 					break;
@@ -185,7 +340,8 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 					perror("Allocating OS IMAGE");
 					exit(1);
 				}
-				read(os_fd, bootinfo[ostype].os_image, OSIMAGE_SIZE);
+				os_len = read(os_fd, bootinfo[ostype].os_image, OSIMAGE_SIZE);
+				bootinfo[ostype].os_size = os_len > 0 ? os_len : 0;
 				close(os_fd);
 
 			} else if (!strncasecmp(kbuf, "Base", 4)) {
@@ -197,6 +353,15 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 			} else if (!strncasecmp(kbuf, "CONBUF", 6)) {
 				// Console buffer address
 				bootinfo[ostype].conbuf = strtol(vbuf, NULL,0);
+			} else if (!strncasecmp(kbuf, "LZ Sects", 8)) {
+				// Offset of the record count in the bootloader
+				bootinfo[ostype].lz_sects_off = strtol(vbuf, NULL,0);
+			} else if (!strncasecmp(kbuf, "LZ Entry", 8)) {
+				// Address the bootloader jumps to
+				bootinfo[ostype].lz_entry = strtol(vbuf, NULL,0);
+			} else if (!strncasecmp(kbuf, "LZ Scratch", 10)) {
+				// RAM the unpacker can use below the OS
+				bootinfo[ostype].lz_scratch = strtol(vbuf, NULL,0);
 			}
 		} while (1);
 
@@ -205,6 +370,383 @@ int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen) {
 	return 0;
 }
 
+/* Z80 unpacker, see z80/LZBOOT.ZASM. The zeros are filled in by
+ * alm_osl_lz_stub().
+ */
+static const uint8_t alm_osl_lz_stubcode[OSL_LZ_STUBLEN] = {
+	0x21, 0x00, 0x00,	// LD HL, ENTRY+HEADLEN
+	0x11, 0x00, 0x00,	// LD DE, SCRATCH
+	0x01, OSL_LZ_STUBLEN-OSL_LZ_HEADLEN, 0x00,	// LD BC, BODYLEN
+	0xED, 0xB0,		// LDIR
+	0xC3, 0x00, 0x00,	// JP SCRATCH
+	0x31, 0x00, 0x00,	// LD SP, SCRATCH
+	0x21, 0x00, 0x00,	// LD HL, BASE
+	0x11, 0x00, 0x00,	// LD DE, SCRATCH+DATAOFF
+	0x01, 0x00, 0x00,	// LD BC, PREFIX
+	0x78, 0xB1,		// LD A, B / OR C
+	0x28, 0x02,		// JR Z, $+4
+	0xED, 0xB0,		// LDIR
+	0x21, 0x00, 0x00,	// LD HL, ENTRY+STUBLEN
+	0x01, 0x00, 0x00,	// LD BC, REST
+	0x78, 0xB1,		// LD A, B / OR C
+	0x28, 0x02,		// JR Z, $+4
+	0xED, 0xB0,		// LDIR
+	0x21, 0x00, 0x00,	// LD HL, SCRATCH+DATAOFF
+	0x11, 0x00, 0x00,	// LD DE, BASE
+	0x7E,			// LOOP: LD A, (HL)
+	0x23,			// INC HL
+	0xB7,			// OR A
+	0xCA, 0x00, 0x00,	// JP Z, ENTRY
+	0xFA, 0x00, 0x00,	// JP M, MATCH
+	0x4F,			// LD C, A
+	0x06, 0x00,		// LD B, 0
+	0xED, 0xB0,		// LDIR
+	0x18, 0xF0,		// JR LOOP
+	0xE6, 0x7F,		// MATCH: AND 7Fh
+	0xC6, OSL_LZ_MINMATCH,	// ADD A, MINMATCH
+	0x4F,			// LD C, A
+	0x06, 0x00,		// LD B, 0
+	0x7E,			// LD A, (HL)
+	0x23,			// INC HL
+	0xE5,			// PUSH HL
+	0x66,			// LD H, (HL)
+	0x6F,			// LD L, A
+	0xD5,			// PUSH DE
+	0xEB,			// EX DE, HL
+	0xB7,			// OR A
+	0xED, 0x52,		// SBC HL, DE
+	0xD1,			// POP DE
+	0xED, 0xB0,		// LDIR
+	0xE1,			// POP HL
+	0x23,			// INC HL
+	0x18, 0xD8,		// JR LOOP
+};
+
+/* Fill in the unpacker's addresses */
+static void alm_osl_lz_stub(uint8_t *dest, const struct host_boot_data_t *bi, unsigned int prefix, unsigned int rest) {
+
+	unsigned int scratch = bi->lz_scratch;
+	uint8_t *body = dest + OSL_LZ_HEADLEN;
+
+	memcpy(dest, alm_osl_lz_stubcode, OSL_LZ_STUBLEN);
+	set_zint16(dest+0x01, bi->lz_entry + OSL_LZ_HEADLEN);
+	set_zint16(dest+0x04, scratch);
+	set_zint16(dest+0x0C, scratch);
+
+	// Offsets from here are from the part that runs at scratch
+	set_zint16(body+0x01, scratch);
+	set_zint16(body+0x04, bi->os_base);
+	set_zint16(body+0x07, scratch + OSL_LZ_DATAOFF);
+	set_zint16(body+0x0A, prefix);
+	set_zint16(body+0x13, bi->lz_entry + OSL_LZ_STUBLEN);
+	set_zint16(body+0x16, rest);
+	set_zint16(body+0x1F, scratch + OSL_LZ_DATAOFF);
+	set_zint16(body+0x22, bi->os_base);
+	set_zint16(body+0x28, bi->lz_entry);
+	set_zint16(body+0x2B, scratch + 0x34);
+}
+
+/* Write src bytes from up to to as literal runs at dest + outlen, noting
+ * where each one from volstart to volend lands in map. Returns the new outlen.
+ */
+static int alm_osl_lz_literals(const uint8_t *src, int from, int to, uint8_t *dest, int outlen,
+		int volstart, int volend, uint16_t *map) {
+
+	int run, i;
+
+	while (from < to) {
+		run = to - from;
+		if (run > OSL_LZ_MAXLIT)
+			run = OSL_LZ_MAXLIT;
+		dest[outlen++] = run;
+		for (i=0; i<run; i++)
+			if (from + i >= volstart && from + i < volend)
+				map[from + i - volstart] = outlen + i;
+		memcpy(dest+outlen, src+from, run);
+		outlen += run;
+		from += run;
+	}
+
+	return outlen;
+}
+
+/* Compress len bytes from src into dest, which must have room for
+ * len*2 + 1 bytes. The vollen bytes from volstart are left as literals and
+ * never copied from, and map gets where each is in dest. Returns the
+ * compressed length.
+ */
+static int alm_osl_lz_compress(const uint8_t *src, int len, uint8_t *dest,
+		int volstart, int vollen, uint16_t *map) {
+
+	int *head, *prev;
+	int pos, litstart, outlen, i;
+	int volend = volstart + vollen;
+
+	head = malloc((1<<OSL_LZ_HASHBITS) * sizeof(int));
+	prev = malloc((len ? len : 1) * sizeof(int));
+	if (!head || !prev) {
+		free(head);
+		free(prev);
+		return -1;
+	}
+	for (i=0; i<(1<<OSL_LZ_HASHBITS); i++)
+		head[i] = -1;
+
+	outlen = 0;
+	litstart = 0;
+	pos = 0;
+	while (pos < len) {
+		int bestlen = 0, bestpos = 0, chain = OSL_LZ_CHAIN;
+		int maxlen = len - pos;
+		unsigned int hash = 0;
+
+		if (maxlen > OSL_LZ_MAXMATCH)
+			maxlen = OSL_LZ_MAXMATCH;
+		if (pos >= volstart && pos < volend)
+			maxlen = 0;
+		else if (pos < volstart && maxlen > volstart - pos)
+			maxlen = volstart - pos;
+
+		if (maxlen >= OSL_LZ_MINMATCH) {
+			hash = ((src[pos] << 8) ^ (src[pos+1] << 4) ^ src[pos+2]) & ((1<<OSL_LZ_HASHBITS) - 1);
+			for (i=head[hash]; i>=0 && chain; i=prev[i], chain--) {
+				int mlen = 0, lim = maxlen;
+				if (i < volstart && lim > volstart - i)
+					lim = volstart - i;
+				while (mlen < lim && src[i+mlen] == src[pos+mlen])
+					mlen++;
+				if (mlen > bestlen) {
+					bestlen = mlen;
+					bestpos = i;
+					if (mlen == maxlen)
+						break;
+				}
+			}
+		}
+
+		if (bestlen < OSL_LZ_MINMATCH) {
+			bestlen = 1;
+		} else {
+			// Flush the literals before the match
+			outlen = alm_osl_lz_literals(src, litstart, pos, dest, outlen, volstart, volend, map);
+			dest[outlen++] = 0x80 | (bestlen - OSL_LZ_MINMATCH);
+			set_zint16(dest+outlen, pos - bestpos);
+			outlen += 2;
+			litstart = pos + bestlen;
+		}
+
+		// Index every byte covered, so runs find themselves at offset 1
+		for (i=0; i<bestlen; i++, pos++) {
+			if (pos + OSL_LZ_MINMATCH > len || (pos >= volstart && pos < volend))
+				continue;
+			hash = ((src[pos] << 8) ^ (src[pos+1] << 4) ^ src[pos+2]) & ((1<<OSL_LZ_HASHBITS) - 1);
+			prev[pos] = head[hash];
+			head[hash] = pos;
+		}
+	}
+
+	outlen = alm_osl_lz_literals(src, litstart, len, dest, outlen, volstart, volend, map);
+	dest[outlen++] = 0;
+
+	free(head);
+	free(prev);
+	return outlen;
+}
+
+/* Compress ostype's OS image into lzimage, which has OSIMAGE_SIZE zeroed
+ * bytes. The compressed stream goes around the unpacker, which has to sit
+ * where the bootloader jumps: the part before it is copied out first.
+ * lz_map is filled in with where the bytes ports change ended up. Returns
+ * the number of records, 0 if it doesn't compress or -1 if the LZ settings
+ * don't fit.
+ */
+static int alm_osl_lz_build(int ostype, uint8_t *lzimage) {
+
+	struct host_boot_data_t *bi = &bootinfo[ostype];
+	unsigned int size, entry_off, prefix, rest, i;
+	int clen, records, rawrecs;
+	uint8_t *packed;
+
+	size = bi->os_size;
+	if (bi->os_base + size > 0x10000)
+		size = 0x10000 - bi->os_base;
+	entry_off = bi->lz_entry - bi->os_base;
+
+	if (bi->lz_sects_off >= BOOTLOADER_SIZE) {
+		printf("OS %d LZ Sects 0x%x is past the bootloader\n", ostype, bi->lz_sects_off);
+		return -1;
+	} else if (bi->lz_entry < bi->os_base || entry_off + OSL_LZ_STUBLEN > size) {
+		printf("OS %d LZ Entry 0x%x is outside the OS image\n", ostype, bi->lz_entry);
+		return -1;
+	}
+
+	packed = malloc(size*2 + 1);
+	if (!packed) {
+		perror("Allocating LZ image");
+		exit(1);
+	}
+	clen = alm_osl_lz_compress(bi->os_image, size, packed, bi->lz_mapstart, bi->lz_maplen, bi->lz_map);
+	if (clen < 0) {
+		perror("Compressing OS image");
+		exit(1);
+	}
+
+	prefix = clen < entry_off ? clen : entry_off;
+	rest = clen - prefix;
+	records = (entry_off + OSL_LZ_STUBLEN + rest + TVSP_DATA_SZ - 1) / TVSP_DATA_SZ;
+	rawrecs = (size + TVSP_DATA_SZ - 1) / TVSP_DATA_SZ;
+
+	if (bi->lz_scratch < 0x100 || bi->lz_scratch + OSL_LZ_DATAOFF + clen > bi->os_base) {
+		printf("OS %d LZ Scratch 0x%x has no room for %d bytes below the OS\n", ostype, bi->lz_scratch, clen);
+		free(packed);
+		return -1;
+	} else if (records >= rawrecs || records - 2 > 0xFF) {
+		printf("OS %d doesn't compress, not using LZ boot\n", ostype);
+		free(packed);
+		return 0;
+	}
+
+	memcpy(lzimage, packed, prefix);
+	alm_osl_lz_stub(lzimage + entry_off, bi, prefix, rest);
+	memcpy(lzimage + entry_off + OSL_LZ_STUBLEN, packed + prefix, rest);
+	free(packed);
+
+	// Stream offsets to where they are with the unpacker in the way
+	for (i=0; i<bi->lz_maplen; i++)
+		if (bi->lz_map[i] >= prefix)
+			bi->lz_map[i] += entry_off + OSL_LZ_STUBLEN - prefix;
+
+	return records;
+}
+
+/* Build the LZ boot image and bootloader for ostype, if it's configured */
+int alm_osl_lz_pack(int ostype) {
+
+	struct host_boot_data_t *bi = &bootinfo[ostype];
+	int records;
+
+	if (bi->lz_bootloader)
+		free(bi->lz_bootloader);
+	if (bi->lz_image)
+		free(bi->lz_image);
+	if (bi->lz_map)
+		free(bi->lz_map);
+	bi->lz_bootloader = NULL;
+	bi->lz_image = NULL;
+	bi->lz_records = 0;
+	bi->lz_map = NULL;
+	bi->lz_maplen = 0;
+
+	if (bi->lz_sects_off < 0 || !bi->os_image || !bi->bootloader)
+		return 0;
+
+	// What ports change, as far as it's in the image
+	bi->lz_mapstart = bi->hpam_addr - bi->os_base;
+	if (bi->hpam_addr >= bi->os_base && bi->lz_mapstart < bi->os_size) {
+		bi->lz_maplen = OSL_LZ_VOLATILE(mmm_numdisks);
+		if (bi->lz_mapstart + bi->lz_maplen > bi->os_size)
+			bi->lz_maplen = bi->os_size - bi->lz_mapstart;
+	}
+
+	bi->lz_image = calloc(OSIMAGE_SIZE, 1);
+	bi->lz_map = calloc(bi->lz_maplen ? bi->lz_maplen : 1, sizeof(uint16_t));
+	if (!bi->lz_image || !bi->lz_map) {
+		perror("Allocating LZ image");
+		exit(1);
+	}
+	records = alm_osl_lz_build(ostype, bi->lz_image);
+	if (records <= 0) {
+		free(bi->lz_image);
+		free(bi->lz_map);
+		bi->lz_image = NULL;
+		bi->lz_map = NULL;
+		bi->lz_maplen = 0;
+		return records;
+	}
+
+	bi->lz_bootloader = malloc(BOOTLOADER_SIZE);
+	if (!bi->lz_bootloader) {
+		perror("Allocating LZ image");
+		exit(1);
+	}
+	// The server sends 2 more records than the bootloader asks for
+	memcpy(bi->lz_bootloader, bi->bootloader, BOOTLOADER_SIZE);
+	bi->lz_bootloader[bi->lz_sects_off] = records - 2;
+	bi->lz_records = records;
+
+	printf("OS %d LZ boot is %d records, down from %d\n", ostype, records, (bi->os_size + TVSP_DATA_SZ - 1) / TVSP_DATA_SZ);
+
+	return 0;
+}
+
+/* Build portnum's own image for ostype, if it hasn't got one. Only the
+ * records that differ from the OSTYPE's image are kept, the rest are sent
+ * from that.
+ */
+struct osl_portimg_t *alm_osl_portimg(int portnum, int ostype) {
+
+	struct osl_portimg_t *pi;
+	struct host_boot_data_t *bi;
+	struct user_port_data_t *ui;
+	unsigned int hpam_off;
+	uint8_t *img, *lzimg;
+	unsigned int i;
+
+	if (portnum < 0 || portnum >= alm_osl_ports || ostype < 0 || ostype > max_ostype)
+		return NULL;
+
+	pi = &alm_osl_portimgs[portnum];
+	if (pi->ostype == ostype)
+		return pi;
+
+	alm_osl_freeportimg(pi);
+	bi = &bootinfo[ostype];
+	if (!bi->os_image)
+		return NULL;
+	ui = &userinfo[portnum];
+	hpam_off = bi->hpam_addr - bi->os_base;
+
+	img = malloc(OSIMAGE_SIZE);
+	if (!img) {
+		perror("Allocating port OS image");
+		exit(1);
+	}
+	memcpy(img, bi->os_image, OSIMAGE_SIZE);
+	img[hpam_off+2] = (ui->autologon << 6) | (portnum & (MAXUSER-1));
+	if (ui->spooldrv >= 0)
+		img[hpam_off+3] = ui->spooldrv;
+	if (ui->numdisks && ui->numdisks < mmm_numdisks) {
+		img[hpam_off+7] = ui->numdisks;
+		alm_write_drv_param_hdrs(ostype, img, ui->numdisks);
+	}
+	alm_osl_patch(&pi->os, bi->os_image, img, OSL_IMGRECS);
+
+	// The LZ image has the bytes that changed as literals, so put them in
+	if (bi->lz_image) {
+		lzimg = malloc(OSIMAGE_SIZE);
+		if (!lzimg) {
+			perror("Allocating port OS image");
+			exit(1);
+		}
+		memcpy(lzimg, bi->lz_image, OSIMAGE_SIZE);
+		for (i=0; i<bi->lz_maplen; i++)
+			lzimg[bi->lz_map[i]] = img[bi->lz_mapstart + i];
+		alm_osl_patch(&pi->lz, bi->lz_image, lzimg, OSL_IMGRECS);
+		memcpy(pi->lz_bootloader, bi->lz_bootloader, BOOTLOADER_SIZE);
+		pi->lz_records = bi->lz_records;
+		free(lzimg);
+	}
+	free(img);
+
+	pi->ostype = ostype;
+	printf("Port %d OS %d image has %d records of its own", portnum, ostype, pi->os.nrecs);
+	if (pi->lz_records)
+		printf(", LZ image %d of %d", pi->lz.nrecs, pi->lz_records);
+	printf("\n");
+
+	return pi;
+}
+
 /* Add OS and drive parameters to the images */
 int alm_osl_tailor_images() {
 
@@ -223,6 +765,7 @@ int alm_osl_tailor_images() {
 			set_zint16(buf+hpam_off+5, mmm_pubdrv);
 			buf[hpam_off+7] = mmm_numdisks;
 			alm_generate_drv_param_hdrs(i);
+			alm_osl_lz_pack(i);
 		} else {
 			//printf("buffer unallocated.\n");
 		}
@@ -231,6 +774,88 @@ int alm_osl_tailor_images() {
 	return 0;
 }
 
+/* Move the images aside so alm_osl_ini() can load new ones */
+int alm_osl_reload_begin() {
+
+	memcpy(alm_osl_oldinfo, bootinfo, sizeof(alm_osl_oldinfo));
+	alm_osl_olddir = os_image_dir;
+	alm_osl_oldmax = max_ostype;
+
+	alm_osl_clearinfo(bootinfo);
+	os_image_dir = NULL;
+	max_ostype = -1;
+
+	return 0;
+}
+
+/* Check the new images, returns -1 if an OSTYPE that could boot before
+ * can't now, which is likely a missing or misspelled file
+ */
+int alm_osl_reload_check() {
+
+	int i, retval = 0;
+
+	for (i=0; i<=alm_osl_oldmax; i++) {
+		if (!alm_osl_oldinfo[i].os_image || !alm_osl_oldinfo[i].bootloader)
+			continue;
+		if (i > max_ostype || !bootinfo[i].os_image || !bootinfo[i].bootloader) {
+			printf("OS %d has no bootloader or OS image now\n", i);
+			retval = -1;
+		}
+	}
+
+	return retval;
+}
+
+/* Keep the new images, or go back to the old ones. Ports in the middle of
+ * booting finish with a copy of the image they started with.
+ */
+int alm_osl_reload_end(int keep) {
+
+	int portnum, i;
+	struct osl_xfer_t *xfer;
+
+	if (!keep) {
+		alm_osl_freeinfo(bootinfo);
+		free(os_image_dir);
+		memcpy(bootinfo, alm_osl_oldinfo, sizeof(alm_osl_oldinfo));
+		os_image_dir = alm_osl_olddir;
+		max_ostype = alm_osl_oldmax;
+		alm_osl_clearinfo(alm_osl_oldinfo);
+		alm_osl_olddir = NULL;
+		alm_osl_oldmax = -1;
+		return 0;
+	}
+
+	for (portnum=0; portnum<alm_osl_ports; portnum++) {
+		xfer = &alm_osl_xfers[portnum];
+		if (!xfer->active || xfer->copy)
+			continue;
+		xfer->copy = malloc(OSIMAGE_SIZE);
+		if (!xfer->copy) {
+			perror("Copying OS image");
+			exit(1);
+		}
+		memcpy(xfer->copy, xfer->image, OSIMAGE_SIZE);
+		for (i=0; xfer->patch && i<xfer->patch->nrecs; i++)
+			memcpy(xfer->copy + xfer->patch->recnums[i]*TVSP_DATA_SZ, xfer->patch->recs + i*TVSP_DATA_SZ, TVSP_DATA_SZ);
+		xfer->image = xfer->copy;
+		xfer->patch = NULL;
+		alm_osl_copies++;
+	}
+
+	// Port images are built on the old ones, and the port settings may change too
+	for (portnum=0; portnum<alm_osl_ports; portnum++)
+		alm_osl_freeportimg(&alm_osl_portimgs[portnum]);
+
+	alm_osl_freeinfo(alm_osl_oldinfo);
+	free(alm_osl_olddir);
+	alm_osl_olddir = NULL;
+	alm_osl_oldmax = -1;
+
+	return 0;
+}
+
 /* Can be called from signal handler */
 int alm_osl_print_imginfo() {
 	
@@ -255,6 +880,26 @@ int alm_osl_print_imginfo() {
 		}
 	}
 
+	for (i=0; i<alm_osl_ports; i++) {
+		struct osl_portimg_t *pi = &alm_osl_portimgs[i];
+		if (pi->ostype < 0)
+			continue;
+		safe_print("Port ");
+		safe_print_num(i);
+		safe_print(": OS ");
+		safe_print_num(pi->ostype);
+		safe_print(", ");
+		safe_print_num(pi->os.nrecs);
+		safe_print(" records of its own");
+		if (pi->lz_records) {
+			safe_print(", LZ ");
+			safe_print_num(pi->lz.nrecs);
+			safe_print(" of ");
+			safe_print_num(pi->lz_records);
+		}
+		safe_print("\n");
+	}
+
 	return 0;
 }
 
@@ -272,10 +917,19 @@ int alm_osl_send_bootloader(int portnum, void *reqbuf) {
 		printf("Bootloader not loaded for OSTYPE %d\n", ostype);
 		return -1;
 	} else {
+		uint8_t *bootloader = bootinfo[ostype].bootloader;
+		struct osl_portimg_t *pi = alm_osl_portimg(portnum, ostype);
+
+		// With LZ boot, the bootloader asks for the compressed image
+		if (pi && pi->lz_records)
+			bootloader = pi->lz_bootloader;
+		else if (!pi && bootinfo[ostype].lz_bootloader)
+			bootloader = bootinfo[ostype].lz_bootloader;
+
 		printf("Sending bootloader OSTYPE %d to port %d\n", ostype, portnum);
 
 		usleep(WRITEDELAY);
-		retval = alm_dev_write(bootinfo[ostype].bootloader, BOOTLOADER_SIZE, portnum);
+		retval = alm_dev_write(bootloader, BOOTLOADER_SIZE, portnum);
 
 		if (retval != BOOTLOADER_SIZE) {
 			printf("Failed to send data: %d\n", errno);
@@ -301,38 +955,131 @@ int alm_osl_savemodifiedos(int ostype, char *filename) {
 	return 0;
 }
 
-/* Send the os image out port portnum, and clear locks (locking not yet implemented) */
+/* Start sending the os image out port portnum, and clear its record locks.
+ * The records go out from alm_osl_send_pending().
+ */
 int alm_osl_send_os(int portnum, void *reqbuf) {
 	
-	int retval;
-	int recnum;
 	struct tvsp_boot_request *bootreq = reqbuf;
 	int numsects = bootreq->sects+2;
 	int ostype = bootreq->usr;
+	struct osl_xfer_t *xfer;
+	struct osl_portimg_t *pi;
 
-	if (ostype > max_ostype) {
+	if (portnum < 0 || portnum >= alm_osl_ports) {
+		return -1;
+	} else if (ostype > max_ostype) {
 		printf("OSTYPE out of range: %d\n", ostype);
 		return -1;
 	} else if (!bootinfo[ostype].os_image) {
 		printf("Bootloader not loaded for OSTYPE %d\n", ostype);
 		return -1;
-	} else {
-		uint8_t *osimg = bootinfo[ostype].os_image;
+	}
 
-		//FIXME: alm_file_clear_locks(portnum);
+	alm_file_clear_locks(portnum);
 
-		printf("Sending os image, machine ID %d, cboot=%d, start rec %d, length %d\n", 
-				ostype, bootreq->cboot, bootreq->recnum, bootreq->sects);
-		for (recnum = bootreq->recnum; recnum < (numsects + bootreq->recnum); recnum++) {
+	printf("Sending os image, machine ID %d, cboot=%d, start rec %d, length %d\n", 
+			ostype, bootreq->cboot, bootreq->recnum, bootreq->sects);
 
-			usleep(5000);
-			retval = alm_dev_write(osimg+(recnum*TVSP_DATA_SZ), TVSP_DATA_SZ, portnum);
+	// A port booting again starts over
+	alm_osl_stop(portnum);
+	alm_osl_freecopies();
+	pi = alm_osl_portimg(portnum, ostype);
+	xfer = &alm_osl_xfers[portnum];
+	xfer->ostype = ostype;
+	xfer->image = bootinfo[ostype].os_image;
+	xfer->patch = &pi->os;
+	xfer->lz = 0;
+	// Only the LZ bootloader's request is for exactly lz_records from 0
+	if (pi->lz_records && !bootreq->recnum && numsects == pi->lz_records) {
+		printf("Sending LZ image to port %d\n", portnum);
+		xfer->image = bootinfo[ostype].lz_image;
+		xfer->patch = &pi->lz;
+		xfer->lz = 1;
+	}
+	xfer->recnum = bootreq->recnum;
+	xfer->endrec = bootreq->recnum + numsects;
+	xfer->due = alm_osl_now() + OSL_RECDELAY;
+	xfer->active = 1;
+	alm_osl_sending++;
 
-			if (retval != TVSP_DATA_SZ) {
-				printf("Failed to send record %d: %d\n", recnum, errno);
-				return -1;
-			}
+	return 0;
+}
+
+/* Send the next record of each OS image transfer that's due, returns the
+ * number still going
+ */
+int alm_osl_send_pending() {
+
+	int portnum, retval;
+	long long now;
+	struct osl_xfer_t *xfer;
+
+	if (alm_osl_copies)
+		alm_osl_freecopies();
+	if (!alm_osl_sending)
+		return 0;
+
+	now = alm_osl_now();
+	for (portnum=0; portnum<alm_osl_ports; portnum++) {
+		xfer = &alm_osl_xfers[portnum];
+		if (!xfer->active || now < xfer->due)
+			continue;
+
+		retval = alm_dev_write(alm_osl_record(xfer), TVSP_DATA_SZ, portnum);
+		if (retval != TVSP_DATA_SZ) {
+			printf("Failed to send record %d to port %d: %d\n", xfer->recnum, portnum, errno);
+			alm_osl_stop(portnum);
+			continue;
+		}
+
+		xfer->recnum++;
+		if (xfer->recnum >= xfer->endrec) {
+			alm_osl_stop(portnum);
+			continue;
 		}
+		// Time from when it was sent, the client needs that long to take it
+		now = alm_osl_now();
+		xfer->due = now + OSL_RECDELAY;
+	}
+
+	return alm_osl_sending;
+}
+
+/* Stop sending the os image to portnum */
+/* Can be called from signal handler */
+int alm_osl_stop(int portnum) {
+
+	if (portnum < 0 || portnum >= alm_osl_ports || !alm_osl_xfers[portnum].active)
+		return 0;
+
+	alm_osl_xfers[portnum].active = 0;
+	alm_osl_sending--;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_osl_printxfers() {
+
+	int portnum;
+	struct osl_xfer_t *xfer;
+
+	for (portnum=0; portnum<alm_osl_ports; portnum++) {
+		xfer = &alm_osl_xfers[portnum];
+		if (!xfer->active)
+			continue;
+		safe_print("Port ");
+		safe_print_num(portnum);
+		safe_print(": OSTYPE ");
+		safe_print_num(xfer->ostype);
+		safe_print(", record ");
+		safe_print_num(xfer->recnum);
+		safe_print(" of ");
+		safe_print_num(xfer->endrec);
+		if (xfer->lz)
+			safe_print(", LZ");
+		safe_print("\n");
 	}
 
 	return 0;
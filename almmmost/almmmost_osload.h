@@ -53,6 +53,16 @@ struct host_boot_data_t {
 	unsigned int os_base;
 	unsigned int conbuf;
 	unsigned int hpam_addr;
+	unsigned int os_size;		// Bytes read from the OS image file
+	int lz_sects_off;		// Record count byte in the bootloader, -1 = no LZ boot
+	unsigned int lz_entry;		// Where the bootloader jumps once the OS is in
+	unsigned int lz_scratch;	// Free RAM for the unpacker and compressed OS
+	uint8_t *lz_bootloader;		// Bootloader patched to ask for lz_records
+	uint8_t *lz_image;		// Compressed OS with the unpacker at lz_entry
+	int lz_records;
+	uint16_t *lz_map;		// Where each byte from lz_mapstart is in lz_image
+	unsigned int lz_mapstart;	// The HPAM and drive tables, which ports change
+	unsigned int lz_maplen;
 };
 
 struct tvsp_boot_request {
@@ -67,12 +77,78 @@ struct tvsp_boot_request {
 	
 #define BOOTLOADER_SIZE (128)
 #define OSIMAGE_SIZE (64*1024)
+#define OSL_IMGRECS (OSIMAGE_SIZE/TVSP_DATA_SZ)
+#define OSL_RECDELAY (5000)	// us between OS image records to one port
+
+/* LZ boot: the OS image is sent as a stream of tokens, which a stub at the
+ * bootloader's entry address unpacks to the OS base before jumping back to it:
+ *	00h		End of the stream
+ *	01h-7Fh		That many literal bytes follow
+ *	80h-FFh LO HI	Copy (token & 7Fh) + 3 bytes from HI*256+LO bytes back
+ * See z80/LZBOOT.ZASM for the stub.
+ */
+#define OSL_LZ_SCRATCH (0x8000)	// Default stub address, data is 100h above
+#define OSL_LZ_DATAOFF (0x100)	// Compressed data offset from the stub
+#define OSL_LZ_HEADLEN (14)	// Stub part that copies the rest to scratch
+#define OSL_LZ_STUBLEN (90)
+#define OSL_LZ_MAXLIT (0x7F)
+#define OSL_LZ_MINMATCH (3)
+#define OSL_LZ_MAXMATCH (0x7F + OSL_LZ_MINMATCH)
+#define OSL_LZ_HASHBITS (12)
+#define OSL_LZ_CHAIN (256)	// Most earlier matches to try at each byte
+
+/* The part of the OS image each port has its own copy of: the HPAM, then
+ * the drive headers and blocks. It's only ever sent as literals, so a port's
+ * LZ image is the OSTYPE's with those bytes replaced. The map costs 2 bytes
+ * per byte of it, under 1K for each OSTYPE.
+ */
+#define OSL_HPAM_BYTES (8)
+#define OSL_LZ_VOLATILE(ndisks) (OSL_HPAM_BYTES + (ndisks) * (DISK_PARAM_HDR_BYTES + DISK_PARAM_BLK_BYTES))
+
+/* Records of a port's image that differ from the one for its OSTYPE. The
+ * rest are sent from the shared image.
+ */
+struct osl_patch_t {
+	int nrecs;
+	int *recnums;		// Which records, in order
+	uint8_t *recs;		// What this port has instead, nrecs*TVSP_DATA_SZ bytes
+};
+
+/* A port's own OS image, with its Processor ID, Autologon, Spool Drive and
+ * drive tables. Built the first time the port boots, and kept until a reload.
+ */
+struct osl_portimg_t {
+	int ostype;		// OSTYPE it was built from, -1 if not built
+	struct osl_patch_t os;	// Differences from the OS image
+	struct osl_patch_t lz;	// Differences from the LZ image
+	int lz_records;		// 0 if this port boots without LZ
+	uint8_t lz_bootloader[BOOTLOADER_SIZE];
+};
+
+/* OS image being sent to a port. Records go out one at a time from the
+ * main loop, so a room full of terminals booting at once doesn't have each
+ * wait for all the others, and other requests still get answered.
+ */
+struct osl_xfer_t {
+	int active;
+	int ostype;
+	int recnum;		// Next record to send
+	int endrec;		// One past the last record
+	long long due;		// When the next record can go, in us
+	uint8_t *image;		// OS image or LZ image being sent
+	struct osl_patch_t *patch;	// This port's records in it, or NULL
+	int lz;			// image is the LZ image
+	uint8_t *copy;		// Image kept for this transfer after a reload
+};
 
 extern int mmm_genrev;
 extern int mmm_spooldev;
 extern int max_ostype;
 
 extern struct host_boot_data_t bootinfo[];
+extern struct osl_xfer_t *alm_osl_xfers;
+extern struct osl_portimg_t *alm_osl_portimgs;
+extern int alm_osl_ports;
 
 /* Initialize variables */
 int alm_osl_init();
@@ -80,12 +156,32 @@ int alm_osl_init();
 /* Free allocated memory and clear variables */
 int alm_osl_exit();
 
+/* Size the per-port OS image transfers, once the number of ports is known */
+int alm_osl_setports(int ports);
+
 /* Parse the config file and read in os/bootloader images */
 int alm_osl_ini(struct INI *ini, const char *buf, size_t sectlen);
 
 /* Add OS and drive parameters to the images */
 int alm_osl_tailor_images();
 
+/* Move the images aside so alm_osl_ini() can load new ones */
+int alm_osl_reload_begin();
+
+/* Check the new images, returns -1 if an OSTYPE that could boot before
+ * can't now
+ */
+int alm_osl_reload_check();
+
+/* Keep the new images if keep is set, otherwise go back to the old ones */
+int alm_osl_reload_end(int keep);
+
+/* Build the compressed OS image and bootloader for LZ boot */
+int alm_osl_lz_pack(int ostype);
+
+/* Build portnum's own image for ostype, if it hasn't got one */
+struct osl_portimg_t *alm_osl_portimg(int portnum, int ostype);
+
 /* Print generated values */
 int alm_osl_print_imginfo();
 
@@ -95,7 +191,20 @@ int alm_osl_savemodifiedos(int ostype, char *filename);
 /* Send the bootloader out port portnum */
 int alm_osl_send_bootloader(int portnum, void *reqbuf);
 
-/* Send the os image out port portnum, and clear locks (locking not yet implemented) */
+/* Start sending the os image out port portnum, and clear its record locks */
 int alm_osl_send_os(int portnum, void *reqbuf);
 
+/* Send the next record of each OS image transfer that's due, returns the
+ * number still going
+ */
+int alm_osl_send_pending();
+
+/* Stop sending the os image to portnum */
+/* Can be called from signal handler */
+int alm_osl_stop(int portnum);
+
+/* Print OS image transfers in progress */
+/* Can be called from signal handler */
+int alm_osl_printxfers();
+
 #endif /* _ALMMMOST_OSLOAD_H */
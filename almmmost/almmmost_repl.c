@@ -0,0 +1,553 @@
+/* almmmost_repl.c: Module to copy public drive writes to a standby Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_image.h"
+#include "almmmost_file.h"
+#include "almmmost_cache.h"
+#include "almmmost_repl.h"
+
+int alm_repl_role = REPL_NONE;
+char alm_repl_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+struct repl_stats_t alm_repl_stats;
+
+int alm_repl_logsize = REPL_DEFAULT_LOG * 1024;
+int alm_repl_fd = -1;			// Primary: to the standby. Standby: from the primary
+int alm_repl_listenfd = -1;		// Standby
+volatile int alm_repl_do_promote = 0;
+
+// Primary's log. Counts are bytes since the standby connected.
+uint8_t *alm_repl_buf = NULL;
+unsigned long long alm_repl_head = 0;	// Logged
+unsigned long long alm_repl_sent = 0;	// Written to the socket
+uint32_t alm_repl_seq = 0;
+time_t alm_repl_retry = 0;
+struct repl_ack_t alm_repl_ack;
+int alm_repl_ackgot = 0;
+
+// Where the primary is in copying the public images to a new standby
+int alm_repl_copydisk = -1;		// -1 when not copying
+int alm_repl_copyrec = 0;
+int alm_repl_copyend = 0;
+
+// Standby's partly received entries
+uint8_t *alm_repl_rbuf = NULL;
+int alm_repl_rgot = 0;
+
+int alm_repl_init() {
+
+	alm_repl_role = REPL_NONE;
+	strcpy(alm_repl_socket, REPL_DEFAULT_SOCKET);
+	memset(&alm_repl_stats, 0, sizeof(alm_repl_stats));
+	alm_repl_logsize = REPL_DEFAULT_LOG * 1024;
+	alm_repl_fd = -1;
+	alm_repl_listenfd = -1;
+	alm_repl_do_promote = 0;
+	alm_repl_buf = NULL;
+	alm_repl_head = alm_repl_sent = 0;
+	alm_repl_seq = 0;
+	alm_repl_retry = 0;
+	alm_repl_ackgot = 0;
+	alm_repl_copydisk = -1;
+	alm_repl_rbuf = NULL;
+	alm_repl_rgot = 0;
+
+	return 0;
+}
+
+int alm_repl_exit() {
+
+	if (alm_repl_fd >= 0)
+		close(alm_repl_fd);
+	if (alm_repl_listenfd >= 0) {
+		close(alm_repl_listenfd);
+		unlink(alm_repl_socket);
+	}
+	free(alm_repl_buf);
+	free(alm_repl_rbuf);
+
+	return alm_repl_init();
+}
+
+int alm_repl_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Role", 4)) {
+			if (!strncasecmp(vbuf, "Primary", 7))
+				alm_repl_role = REPL_PRIMARY;
+			else if (!strncasecmp(vbuf, "Standby", 7))
+				alm_repl_role = REPL_STANDBY;
+			else if (!strncasecmp(vbuf, "None", 4))
+				alm_repl_role = REPL_NONE;
+			else
+				printf("Unknown replication role, should be Primary, Standby or None\n");
+		} else if (!strncasecmp(kbuf, "Socket", 6)) {
+			if (vallen >= sizeof(alm_repl_socket)) {
+				printf("Replication socket name too long\n");
+				continue;
+			}
+			string_copy(alm_repl_socket, vbuf, vallen);
+		} else if (!strncasecmp(kbuf, "Log Size", 8)) {
+			// Most the standby can be behind, in KB
+			alm_repl_logsize = strtol(vbuf, NULL, 0);
+			if (alm_repl_logsize < REPL_MIN_LOG)
+				alm_repl_logsize = REPL_MIN_LOG;
+			alm_repl_logsize *= 1024;
+		}
+	} while (1);
+
+	return 0;
+}
+
+int alm_repl_start() {
+
+	if (alm_repl_role == REPL_PRIMARY) {
+		alm_repl_buf = malloc(alm_repl_logsize);
+		if (!alm_repl_buf) {
+			perror("Allocating replication log");
+			exit(1);
+		}
+		printf("Replicating public drives to %s\n", alm_repl_socket);
+	} else if (alm_repl_role == REPL_STANDBY) {
+		alm_repl_rbuf = malloc(REPL_RECVBUF);
+		if (!alm_repl_rbuf) {
+			perror("Allocating replication buffer");
+			exit(1);
+		}
+
+		alm_repl_listenfd = alm_sock_listen(alm_repl_socket, 1);
+		if (alm_repl_listenfd < 0)
+			return -1;
+		printf("Standby for public drives on %s\n", alm_repl_socket);
+	}
+
+	return 0;
+}
+
+// Log bytes in use, which the standby hasn't applied yet
+static unsigned long long alm_repl_used() {
+
+	return alm_repl_head - alm_repl_stats.acked;
+}
+
+static void alm_repl_put(const void *data, int len) {
+
+	const uint8_t *p = data;
+	int off = alm_repl_head % alm_repl_logsize;
+	int n = alm_repl_logsize - off;
+
+	if (n > len)
+		n = len;
+	memcpy(alm_repl_buf + off, p, n);
+	memcpy(alm_repl_buf, p + n, len - n);
+	alm_repl_head += len;
+}
+
+static void alm_repl_drop(const char *why) {
+
+	printf("Replication to standby stopped: %s\n", why);
+	close(alm_repl_fd);
+	alm_repl_fd = -1;
+	alm_repl_copydisk = -1;
+	alm_repl_retry = time(NULL) + REPL_RETRY;
+}
+
+static int alm_repl_add(int disk, int rec, const void *buf, int nrecs) {
+
+	struct repl_hdr_t hdr;
+	int len = sizeof(hdr) + nrecs * RECSIZE;
+
+	if (alm_repl_used() + len > alm_repl_logsize) {
+		// Standby fell too far behind, it'll have to start over
+		alm_repl_stats.overflows++;
+		alm_repl_drop("log full");
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.seq = ++alm_repl_seq;
+	hdr.disk = disk;
+	hdr.nrecs = nrecs;
+	hdr.rec = rec;
+	alm_repl_put(&hdr, sizeof(hdr));
+	alm_repl_put(buf, nrecs * RECSIZE);
+	alm_repl_stats.entries++;
+	alm_repl_stats.recs += nrecs;
+
+	return 0;
+}
+
+int alm_repl_log(int disk, int rec, const void *buf, int nrecs) {
+
+	const uint8_t *p = buf;
+	int n;
+
+	// A standby that isn't connected gets everything when it is
+	if (alm_repl_role != REPL_PRIMARY || alm_repl_fd < 0)
+		return 0;
+	if (drvparam[disk].public_private != PUBLDIR)
+		return 0;
+
+	for (; nrecs > 0; nrecs -= n, rec += n, p += n * RECSIZE) {
+		n = nrecs > 0xFF ? 0xFF : nrecs;
+		if (alm_repl_add(disk, rec, p, n) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Find the next public disk at or after disk to copy, -1 if none
+static int alm_repl_copynext(int disk) {
+
+	struct stat st;
+
+	for (; disk < mmm_numdisks; disk++) {
+		if (drvparam[disk].public_private != PUBLDIR || drvparam[disk].image_fd[0] < 0)
+			continue;
+		if (fstat(drvparam[disk].image_fd[0], &st) < 0)
+			continue;
+		alm_repl_copyrec = 0;
+		alm_repl_copyend = st.st_size / RECSIZE;
+		return disk;
+	}
+
+	return -1;
+}
+
+// Add a few more records of the public images to the log
+static void alm_repl_copy() {
+
+	uint8_t recs[REPL_COPYRECS * RECSIZE];
+	int n, batch;
+
+	for (batch = 0; batch < REPL_COPYBATCH && alm_repl_copydisk >= 0; batch++) {
+		if (alm_repl_used() + sizeof(struct repl_hdr_t) + sizeof(recs) > alm_repl_logsize)
+			return;	// Wait for the standby to catch up
+
+		for (n = 0; n < REPL_COPYRECS && alm_repl_copyrec + n < alm_repl_copyend; n++)
+			if (alm_cache_readrec(alm_repl_copydisk, 0, alm_repl_copyrec + n, recs + n*RECSIZE) != RECSIZE)
+				break;
+		if (n)
+			alm_repl_add(alm_repl_copydisk, alm_repl_copyrec, recs, n);
+		alm_repl_copyrec += n;
+
+		if (n < REPL_COPYRECS || alm_repl_copyrec >= alm_repl_copyend) {
+			alm_repl_copydisk = alm_repl_copynext(alm_repl_copydisk + 1);
+			if (alm_repl_copydisk < 0)
+				printf("Standby has a full copy of the public drives\n");
+		}
+	}
+}
+
+static int alm_repl_connect() {
+
+	struct sockaddr_un addr;
+	int fd;
+
+	alm_repl_retry = time(NULL) + REPL_RETRY;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, alm_repl_socket);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (!alm_sock_peerok(fd)) {
+		printf("Standby at %s isn't root or our user\n", alm_repl_socket);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// Start the new standby off with everything
+	alm_repl_fd = fd;
+	alm_repl_head = alm_repl_sent = 0;
+	alm_repl_stats.bytes = alm_repl_stats.acked = 0;
+	alm_repl_ackgot = 0;
+	alm_repl_stats.resyncs++;
+	alm_repl_copydisk = alm_repl_copynext(0);
+	printf("Standby connected on %s, sending public drives\n", alm_repl_socket);
+
+	return 0;
+}
+
+static int alm_repl_poll_primary() {
+
+	ssize_t retval;
+	int off, len;
+
+	if (alm_repl_fd < 0) {
+		if (time(NULL) < alm_repl_retry || alm_repl_connect() < 0)
+			return 0;
+	}
+
+	if (alm_repl_copydisk >= 0)
+		alm_repl_copy();
+
+	// Send as much of the log as the socket will take
+	while (alm_repl_fd >= 0 && alm_repl_sent < alm_repl_head) {
+		off = alm_repl_sent % alm_repl_logsize;
+		len = alm_repl_logsize - off;
+		if (len > alm_repl_head - alm_repl_sent)
+			len = alm_repl_head - alm_repl_sent;
+		retval = send(alm_repl_fd, alm_repl_buf + off, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (retval < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		else if (retval <= 0) {
+			alm_repl_drop(strerror(errno));
+			return 0;
+		}
+		alm_repl_sent += retval;
+		alm_repl_stats.bytes += retval;
+	}
+
+	// See how far the standby has got
+	while (alm_repl_fd >= 0) {
+		retval = recv(alm_repl_fd, (uint8_t *)&alm_repl_ack + alm_repl_ackgot,
+				sizeof(alm_repl_ack) - alm_repl_ackgot, MSG_DONTWAIT);
+		if (retval < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		else if (retval <= 0) {
+			alm_repl_drop(retval ? strerror(errno) : "standby closed connection");
+			return 0;
+		}
+		alm_repl_ackgot += retval;
+		if (alm_repl_ackgot < sizeof(alm_repl_ack))
+			continue;
+		alm_repl_ackgot = 0;
+		alm_repl_stats.acked = alm_repl_ack.bytes;
+	}
+	if (alm_repl_fd >= 0 && alm_repl_stats.acked == alm_repl_head && alm_repl_copydisk < 0)
+		alm_repl_stats.caughtup = time(NULL);
+
+	return 0;
+}
+
+static int alm_repl_poll_standby() {
+
+	struct repl_hdr_t *hdr;
+	struct repl_ack_t ack;
+	ssize_t retval;
+	int fd, pos, len, applied = 0;
+
+	if ((fd = accept(alm_repl_listenfd, NULL, NULL)) >= 0 && !alm_sock_peerok(fd)) {
+		printf("Primary refused, not root or our user\n");
+		close(fd);
+		fd = -1;
+	}
+	if (fd >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		// A new primary, or the old one starting over
+		if (alm_repl_fd >= 0)
+			close(alm_repl_fd);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		alm_repl_fd = fd;
+		alm_repl_rgot = 0;
+		alm_repl_stats.bytes = 0;
+		alm_repl_stats.resyncs++;
+		printf("Primary connected, receiving public drives\n");
+	}
+	if (alm_repl_fd < 0)
+		return 0;
+
+	retval = recv(alm_repl_fd, alm_repl_rbuf + alm_repl_rgot, REPL_RECVBUF - alm_repl_rgot, MSG_DONTWAIT);
+	if (retval < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	} else if (retval <= 0) {
+		printf("Primary disconnected\n");
+		close(alm_repl_fd);
+		alm_repl_fd = -1;
+		return 0;
+	}
+	alm_repl_rgot += retval;
+
+	// Apply every whole entry that's in, in order
+	for (pos = 0; alm_repl_rgot - pos >= sizeof(struct repl_hdr_t); pos += len) {
+		hdr = (struct repl_hdr_t *)(alm_repl_rbuf + pos);
+		len = sizeof(struct repl_hdr_t) + hdr->nrecs * RECSIZE;
+		if (alm_repl_rgot - pos < len)
+			break;
+		if (hdr->disk >= mmm_numdisks || drvparam[hdr->disk].public_private != PUBLDIR || !hdr->nrecs) {
+			printf("Replicated write to disk %c isn't to a public drive, disconnecting\n", hdr->disk + 'A');
+			close(alm_repl_fd);
+			alm_repl_fd = -1;
+			return -1;
+		}
+		if (alm_cache_writerecs(hdr->disk, 0, hdr->rec, hdr + 1, hdr->nrecs) < 0)
+			printf("Replicated write to disk %c record %d failed\n", hdr->disk + 'A', hdr->rec);
+		alm_repl_stats.entries++;
+		alm_repl_stats.recs += hdr->nrecs;
+		alm_repl_stats.bytes += len;
+		ack.seq = hdr->seq;
+		applied = 1;
+	}
+	alm_repl_rgot -= pos;
+	memmove(alm_repl_rbuf, alm_repl_rbuf + pos, alm_repl_rgot);
+
+	if (applied) {
+		// Acks are small, so the socket always has room
+		ack.bytes = alm_repl_stats.bytes;
+		ack.x = 0;
+		send(alm_repl_fd, &ack, sizeof(ack), MSG_NOSIGNAL | MSG_DONTWAIT);
+		alm_repl_stats.acked = ack.bytes;
+		alm_repl_stats.caughtup = time(NULL);
+	}
+
+	return 0;
+}
+
+static void alm_repl_do_promotion() {
+
+	int disk;
+
+	alm_repl_do_promote = 0;
+	if (alm_repl_role != REPL_STANDBY)
+		return;
+
+	if (alm_repl_fd >= 0)
+		close(alm_repl_fd);
+	close(alm_repl_listenfd);
+	unlink(alm_repl_socket);
+	alm_repl_fd = alm_repl_listenfd = -1;
+
+	// Serve the drives as they are now
+	alm_repl_role = REPL_NONE;
+	alm_cache_flush(-1, -1);
+	for (disk = 0; disk < mmm_numdisks; disk++)
+		if (drvparam[disk].public_private == PUBLDIR)
+			alm_file_loadbam(disk);
+	printf("Promoted from standby, %lu records applied\n", alm_repl_stats.recs);
+}
+
+int alm_repl_poll() {
+
+	if (alm_repl_do_promote)
+		alm_repl_do_promotion();
+	if (alm_repl_role == REPL_PRIMARY)
+		return alm_repl_poll_primary();
+	else if (alm_repl_role == REPL_STANDBY && alm_repl_listenfd >= 0)
+		return alm_repl_poll_standby();
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+long long alm_repl_lag() {
+
+	if (alm_repl_role != REPL_PRIMARY || alm_repl_fd < 0)
+		return -1;
+	return alm_repl_used();
+}
+
+/* Can be called from signal handler */
+int alm_repl_promote() {
+
+	if (alm_repl_role != REPL_STANDBY) {
+		safe_print("Not a standby\n");
+		return -1;
+	}
+	alm_repl_do_promote = 1;
+	safe_print("Promoting once the current request is done\n");
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_repl_printstats() {
+
+	if (alm_repl_role == REPL_NONE) {
+		safe_print("Not replicating\n");
+		return 0;
+	}
+
+	safe_print(alm_repl_role == REPL_PRIMARY ? "Primary, standby on " : "Standby, listening on ");
+	safe_print(alm_repl_socket);
+	safe_print(alm_repl_fd >= 0 ? " (connected)\n" : " (not connected)\n");
+	safe_print("Entries: "); safe_print_num(alm_repl_stats.entries);
+	safe_print(" Records: "); safe_print_num(alm_repl_stats.recs);
+	safe_print(" Resyncs: "); safe_print_num(alm_repl_stats.resyncs);
+	if (alm_repl_role == REPL_STANDBY) {
+		safe_print("\nApplied: "); safe_print_num(alm_repl_stats.bytes / 1024);
+		safe_print("K\n");
+		return 0;
+	}
+
+	safe_print(" Log overflows: "); safe_print_num(alm_repl_stats.overflows);
+	safe_print("\nLag: "); safe_print_num(alm_repl_used() / 1024);
+	safe_print("K of "); safe_print_num(alm_repl_logsize / 1024);
+	safe_print("K log");
+	if (alm_repl_fd >= 0 && alm_repl_used() && alm_repl_stats.caughtup) {
+		safe_print(", ");
+		safe_print_num(time(NULL) - alm_repl_stats.caughtup);
+		safe_print(" s since caught up");
+	}
+	if (alm_repl_copydisk >= 0) {
+		safe_print(", copying disk ");
+		safe_print_num(alm_repl_copydisk);
+		safe_print(" record ");
+		safe_print_num(alm_repl_copyrec);
+		safe_print(" of ");
+		safe_print_num(alm_repl_copyend);
+	}
+	safe_print("\n");
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* almmmost_repl.h: Module to copy public drive writes to a standby Almmmost
+ * servers.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_REPL_H
+#define _ALMMMOST_REPL_H
+
+/* Every record written to a public drive is also added to a log in memory,
+ * which the main loop streams to a standby server as fast as it will take
+ * it. The standby writes the records to its own copy of the images, in the
+ * same order, and tells the primary how far it's got.
+ *
+ * A standby that connects (or reconnects) is first sent all of each public
+ * image, read through the cache, mixed in with the live writes. As both go
+ * through the one log, it ends up with what the primary has. If the log
+ * fills up, because the standby fell too far behind, it's started over.
+ */
+
+#define REPL_NONE (0)
+#define REPL_PRIMARY (1)
+#define REPL_STANDBY (2)
+
+#define REPL_DEFAULT_SOCKET RUNDIR "/repl.sock"
+#define REPL_DEFAULT_LOG (1024)	// KB
+#define REPL_MIN_LOG (64)	// KB, room for a few whole blocks
+#define REPL_RETRY (5)		// Seconds between tries to reach the standby
+#define REPL_COPYRECS (16)	// Image records copied per entry, when starting over
+#define REPL_COPYBATCH (8)	// Copy entries added per trip round the main loop
+#define REPL_RECVBUF (64*1024)
+
+/* Log entry, followed by nrecs records */
+struct repl_hdr_t {
+	uint32_t seq;
+	uint8_t disk;
+	uint8_t nrecs;
+	uint16_t x;
+	int32_t rec;
+};
+
+/* Standby to primary, after each batch it applies */
+struct repl_ack_t {
+	uint64_t bytes;		// Log bytes applied since it connected
+	uint32_t seq;		// Last entry applied
+	uint32_t x;
+};
+
+struct repl_stats_t {
+	unsigned long entries;		// Entries logged/applied
+	unsigned long recs;		// Records logged/applied
+	unsigned long long bytes;	// Log bytes written to the socket/applied
+	unsigned long long acked;	// Log bytes the standby has applied
+	unsigned long resyncs;		// Times the standby was sent everything
+	unsigned long overflows;	// Times the log filled up
+	time_t caughtup;		// Last time the standby had everything
+};
+
+extern int alm_repl_role;
+extern char alm_repl_socket[];
+extern struct repl_stats_t alm_repl_stats;
+
+/* Initialize variables */
+int alm_repl_init();
+
+/* Free the log and close the socket */
+int alm_repl_exit();
+
+/* Parse config file section */
+int alm_repl_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Once the config is read, set up the log or listen for the primary */
+int alm_repl_start();
+
+/* Primary: add records just written to public disk to the log */
+int alm_repl_log(int disk, int rec, const void *buf, int nrecs);
+
+/* From the main loop: send or apply what's waiting, and promote if asked */
+int alm_repl_poll();
+
+/* Primary: log bytes the standby hasn't applied yet, -1 if it isn't connected */
+/* Can be called from signal handler */
+long long alm_repl_lag();
+
+/* Standby: stop following the primary and serve the drives ourselves */
+/* Can be called from signal handler */
+int alm_repl_promote();
+
+/* Print replication state and lag */
+/* Can be called from signal handler */
+int alm_repl_printstats();
+
+#endif /* _ALMMMOST_REPL_H */
@@ -37,6 +37,10 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <fcntl.h>
 #include <curl/curl.h>
 
 #include <ini.h>
@@ -46,85 +50,383 @@
 #include "almmmost_file.h"
 #include "almmmost_special.h"
 #include "almmmost_device.h"
+#include "almmmost_fetch.h"
+#include "almmmost_imgconv.h"
+#include "almmmost_spool.h"
 
 struct special_file_t *special_files;
-static size_t alm_special_fillbuf(void *buf, size_t size, size_t nmemb, void *userp);
+struct special_file_t *special_hash[SPECIAL_HASHSIZE];
 
 char fileinsys_name[INPBUFSIZE];
 char fileoutsys_name[INPBUFSIZE];
 char imggetsys_url[INPBUFSIZE];
 char lynxgetsys_url[INPBUFSIZE];
+int imggetsys_native = 1;		// Convert images ourselves instead of with imggetsys_url
+char asmsys_cmd[INPBUFSIZE];
+char asmsys_dir[INPBUFSIZE];
+char asmsys_user[INPBUFSIZE];
+struct fetch_job_t **asmsys_last[2];	// Last asm.sys / asmlst.sys build for each port
 
+#define URLFNAME "urlget.sys"
 #define IMAGEFNAME "imgget.sys"
-#define IMAGEFNAME_MATCH (6)
 #define LYNXFNAME "lynxget.sys"
-#define LYNXFNAME_MATCH (7)
 
-int alm_special_init() {
+/* Handlers built in to Almmmost, and the files they're on by default */
+struct special_builtin_t {
+	const char *name;
+	const char *filename;
+	int (*callbk)(int fileno, int fop, int pos);
+};
+
+static const struct special_builtin_t alm_special_builtins[] = {
+	{ "chargen", "chargen.sys", alm_special_chargen },
+	{ "multi", "multi.sys", alm_special_multisys },
+	{ "filein", "filein.sys", alm_special_fileinsys },
+	{ "fileout", "fileout.sys", alm_special_fileoutsys },
+	{ "urlget", URLFNAME, alm_special_urlget },
+	{ "imgget", IMAGEFNAME, alm_special_cgiget },
+	{ "lynxget", LYNXFNAME, alm_special_cgiget },
+	{ "asm", "asm.sys", alm_special_asm },
+	{ "asmlst", "asmlst.sys", alm_special_asm },
+	{ "copy", "copy.sys", alm_special_copysys },
+	{ "spool", "spool.sys", alm_special_spoolsys },
+	{ NULL, NULL, NULL }
+};
+
+/* Settings saved while a reload reads new ones */
+static struct {
+	char filein[INPBUFSIZE], fileout[INPBUFSIZE];
+	char imgurl[INPBUFSIZE], lynxurl[INPBUFSIZE];
+	char asmcmd[INPBUFSIZE], asmdir[INPBUFSIZE], asmuser[INPBUFSIZE];
+	int imgnative;
+} special_saved;
+static int special_skipped;	// File lines left alone by a reload
+
+/* Paths and commands before the config file changes them */
+static void alm_special_defaults() {
 
 	strcpy(fileinsys_name, "/root/filein.sys");
 	strcpy(fileoutsys_name, "/root/fileout.sys");
 	strcpy(imggetsys_url, "http://localhost/cgi-bin/tvi-image.pl");
 	strcpy(lynxgetsys_url, "http://localhost/cgi-bin/tvi-lynx.pl");
+	strcpy(asmsys_cmd, "z80asm -o " ASM_OUTPUT " --list=" ASM_LISTING " " ASM_SOURCE);
+	strcpy(asmsys_dir, "/tmp");
+	strcpy(asmsys_user, "nobody");
+	imggetsys_native = 1;
+}
+
+int alm_special_init() {
+
+	const struct special_builtin_t *bp;
+	struct special_file_t *sf;
+
+	alm_special_defaults();
+	memset(special_hash, 0, sizeof(special_hash));
 	special_files = calloc(sizeof(struct special_file_t),1);
-	alm_special_add_sft(special_files, "chargen.sys", alm_special_chargen);
-	alm_special_add_sft(special_files, "multi.sys", alm_special_multisys);
-	alm_special_add_sft(special_files, "filein.sys", alm_special_fileinsys);
-	alm_special_add_sft(special_files, "fileout.sys", alm_special_fileoutsys);
-	alm_special_add_sft(special_files, "urlget.sys", alm_special_urlget);
-	alm_special_add_sft(special_files, IMAGEFNAME, alm_special_cgiget);
-	alm_special_add_sft(special_files, LYNXFNAME, alm_special_cgiget);
+	if (!special_files)
+		return -1;
+	for (bp = alm_special_builtins; bp->name; bp++) {
+		sf = alm_special_add_sft(special_files, bp->filename, bp->callbk);
+		if (sf)
+			sf->arg = strdup(bp->name);
+	}
 	return 0;
 }
 
 int alm_special_exit() {
 
+	// alm_fetch_exit() frees any builds still held
+	free(asmsys_last[0]);
+	free(asmsys_last[1]);
+	memset(asmsys_last, 0, sizeof(asmsys_last));
 	alm_special_free_sft(special_files);
 	special_files = NULL;
+	memset(special_hash, 0, sizeof(special_hash));
+
+	return 0;
+}
+
+/* Size the per-port tables */
+int alm_special_setports(int ports) {
+
+	free(asmsys_last[0]);
+	free(asmsys_last[1]);
+	asmsys_last[0] = calloc(ports, sizeof(struct fetch_job_t *));
+	asmsys_last[1] = calloc(ports, sizeof(struct fetch_job_t *));
+	if (!asmsys_last[0] || !asmsys_last[1]) {
+		perror("Allocating asm.sys builds");
+		exit(1);
+	}
 
 	return 0;
 }
 
 int alm_special_ini(struct INI *ini, const char *buf, size_t buflen) {
 
+	int retval;
+	char valbuf[INPBUFSIZE];
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (vallen >= INPBUFSIZE)
+			vallen = INPBUFSIZE - 1;
+
+		if (!strncasecmp(kbuf, "Image Convert", 13)) {
+			// Native, or CGI to post to Image CGI like before
+			imggetsys_native = ((vbuf[0] & 0x5F) == 'N');
+		} else if (!strncasecmp(kbuf, "Image CGI", 9)) {
+			memcpy(imggetsys_url, vbuf, vallen);
+			imggetsys_url[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Lynx CGI", 8)) {
+			memcpy(lynxgetsys_url, vbuf, vallen);
+			lynxgetsys_url[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "FileIn", 6)) {
+			memcpy(fileinsys_name, vbuf, vallen);
+			fileinsys_name[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "FileOut", 7)) {
+			memcpy(fileoutsys_name, vbuf, vallen);
+			fileoutsys_name[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Asm Command", 11)) {
+			memcpy(asmsys_cmd, vbuf, vallen);
+			asmsys_cmd[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Asm Dir", 7)) {
+			memcpy(asmsys_dir, vbuf, vallen);
+			asmsys_dir[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Asm User", 8)) {
+			memcpy(asmsys_user, vbuf, vallen);
+			asmsys_user[vallen] = 0;
+		} else if (keylen == 4 && !strncasecmp(kbuf, "File", 4) && alm_reloading) {
+			// Open files and searches point into the table
+			special_skipped++;
+		} else if (keylen == 4 && !strncasecmp(kbuf, "File", 4)) {
+			// name.ext, type, handler
+			memcpy(valbuf, vbuf, vallen);
+			valbuf[vallen] = 0;
+			alm_special_declare(valbuf);
+		}
+	} while (1);
+
+	return 0;
+}
+
+/* Save the paths and commands and go back to the defaults, for a reload */
+int alm_special_reload_begin() {
+
+	strcpy(special_saved.filein, fileinsys_name);
+	strcpy(special_saved.fileout, fileoutsys_name);
+	strcpy(special_saved.imgurl, imggetsys_url);
+	strcpy(special_saved.lynxurl, lynxgetsys_url);
+	strcpy(special_saved.asmcmd, asmsys_cmd);
+	strcpy(special_saved.asmdir, asmsys_dir);
+	strcpy(special_saved.asmuser, asmsys_user);
+	special_saved.imgnative = imggetsys_native;
+	special_skipped = 0;
+	alm_special_defaults();
+
+	return 0;
+}
+
+/* Keep the reloaded settings, or put the saved ones back */
+int alm_special_reload_end(int keep) {
+
+	if (special_skipped)
+		printf("Special file: File lines aren't re-read, restart to change them\n");
+	if (keep)
+		return 0;
+
+	strcpy(fileinsys_name, special_saved.filein);
+	strcpy(fileoutsys_name, special_saved.fileout);
+	strcpy(imggetsys_url, special_saved.imgurl);
+	strcpy(lynxgetsys_url, special_saved.lynxurl);
+	strcpy(asmsys_cmd, special_saved.asmcmd);
+	strcpy(asmsys_dir, special_saved.asmdir);
+	strcpy(asmsys_user, special_saved.asmuser);
+	imggetsys_native = special_saved.imgnative;
+
+	return 0;
+}
+
+/* Set up a special file from a "File =" line: name.ext, Builtin, handler name /
+ * name.ext, Exec, command / name.ext, Plugin, path.so[, symbol] / name.ext, Off
+ */
+int alm_special_declare(char *val) {
+
+	char *fields[4] = { NULL, NULL, NULL, NULL };
+	char *p = val, *end, *symbol;
+	const struct special_builtin_t *bp;
+	struct special_file_t *sf;
+	uint8_t fname[8], fext[3];
+	int nfields;
+
+	// Split on commas, except the command of an Exec keeps them
+	for (nfields=0; nfields<4 && p; nfields++) {
+		while (isspace(*p))
+			p++;
+		fields[nfields] = p;
+		if (nfields == 2 && fields[1] && !strncasecmp(fields[1], "Exec", 4))
+			p = NULL;
+		else if ((p = strchr(p, ',')))
+			*(p++) = 0;
+		end = fields[nfields] + strlen(fields[nfields]);
+		while (end > fields[nfields] && isspace(end[-1]))
+			*(--end) = 0;
+	}
+	if (nfields < 2 || !fields[0][0]) {
+		printf("Special file: Bad File line, need name.ext, type[, handler]\n");
+		return -1;
+	}
+
+	// A new declaration for a name replaces whatever was there
+	alm_special_name(fields[0], fname, fext);
+	sf = alm_special_lookup(fname, fext);
+	if (sf)
+		alm_special_remove_sft(special_files, sf);
+
+	if (!strncasecmp(fields[1], "Off", 3))
+		return 0;
+
+	if (nfields < 3 || !fields[2][0]) {
+		printf("Special file %s: %s needs a handler\n", fields[0], fields[1]);
+		return -1;
+	}
+
+	if (!strncasecmp(fields[1], "Builtin", 7)) {
+		for (bp = alm_special_builtins; bp->name; bp++)
+			if (!strcasecmp(bp->name, fields[2]))
+				break;
+		if (!bp->name) {
+			printf("Special file %s: No built in handler '%s'\n", fields[0], fields[2]);
+			return -1;
+		}
+		sf = alm_special_add_sft(special_files, fields[0], bp->callbk);
+		if (!sf)
+			return -1;
+		sf->arg = strdup(bp->name);
+	} else if (!strncasecmp(fields[1], "Exec", 4)) {
+		sf = alm_special_add_sft(special_files, fields[0], alm_special_exec);
+		if (!sf)
+			return -1;
+		sf->type = SPECIAL_EXEC;
+		sf->arg = strdup(fields[2]);
+	} else if (!strncasecmp(fields[1], "Plugin", 6)) {
+		void *dlh;
+		special_plugin_t fn;
+
+		symbol = (nfields > 3 && fields[3][0]) ? fields[3] : SPECIAL_PLUGIN_SYMBOL;
+		dlh = dlopen(fields[2], RTLD_NOW | RTLD_LOCAL);
+		if (!dlh) {
+			printf("Special file %s: %s\n", fields[0], dlerror());
+			return -1;
+		}
+		fn = (special_plugin_t)dlsym(dlh, symbol);
+		if (!fn) {
+			printf("Special file %s: No %s in %s\n", fields[0], symbol, fields[2]);
+			dlclose(dlh);
+			return -1;
+		}
+		sf = alm_special_add_sft(special_files, fields[0], alm_special_plugin);
+		if (!sf) {
+			dlclose(dlh);
+			return -1;
+		}
+		sf->type = SPECIAL_PLUGIN;
+		sf->arg = strdup(fields[2]);
+		sf->dlhandle = dlh;
+		sf->plugfn = fn;
+	} else {
+		printf("Special file %s: Unknown type '%s'\n", fields[0], fields[1]);
+		return -1;
+	}
+
 	return 0;
 }
 
+/* Hash of an 8.3 name, attribute bits don't count */
+unsigned int alm_special_hash(const uint8_t *fname, const uint8_t *fext) {
+
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i=0; i<8; i++)
+		hash = (hash ^ (fname[i] & 0x7F)) * 16777619u;
+	for (i=0; i<3; i++)
+		hash = (hash ^ (fext[i] & 0x7F)) * 16777619u;
+
+	return (hash ^ (hash >> 16)) & (SPECIAL_HASHSIZE - 1);
+}
+
+/* Find the special file for an 8.3 name, NULL if it's a normal file */
+struct special_file_t *alm_special_lookup(const uint8_t *fname, const uint8_t *fext) {
+
+	struct special_file_t *sf;
+	int i;
+
+	for (sf = special_hash[alm_special_hash(fname, fext)]; sf; sf = sf->hnext) {
+		for (i=0; i<8; i++)
+			if ((fname[i] & 0x7F) != sf->fname[i])
+				break;
+		if (i < 8)
+			continue;
+		for (i=0; i<3; i++)
+			if ((fext[i] & 0x7F) != sf->fext[i])
+				break;
+		if (i == 3)
+			return sf;
+	}
+
+	return NULL;
+}
+
 /* Trap for file open */
 int alm_special_trapopen(int fileno, struct cpm_fcb_t *fcb) {
 
 	struct special_file_t *sf;
 	struct file_status_t *file = &(fileinfo[fileno]);
 
-	sf = special_files;
-
 	// Default to no trap
 	file->trap = NULL;
-	// Check if fcb points to a special file, and if so, fill in fileinfo struct.
-	do {
-		if (alm_same_file(fcb, sf->fname, sf->fext)) {
-			// Allocate buffer
-			file->special_buf = calloc(RECSIZE, 1);
-			if (!file->special_buf)
+
+	// Normal names take one hash probe, wildcards have to try every entry
+	if (memchr(fcb->fname, '?', 8) || memchr(fcb->fext, '?', 3)) {
+		for (sf = special_files->next; sf; sf = sf->next)
+			if (alm_same_file(fcb, sf->fname, sf->fext))
 				break;
-			// Allocate space for internal data
-			file->trap = calloc(sizeof(struct special_data_t), 1);
-			if (!file->trap) {
-				free(file->special_buf);
-				file->special_buf = NULL;
-				break;	// We check for null return below
-			}
-			// Set callback function pointer
-			file->trap->sfp = sf;
-			// Handle open callback
-			sf->callbk(fileno, TVSP_FILE_OPEN, 0);
-			// Save name into fileinfo record
-			memcpy(file->fname, sf->fname, 8);
-			memcpy(file->fext, sf->fext, 8);
-			break;
-		}
-		sf = sf->next;
-	} while (sf != NULL);
+	} else {
+		sf = alm_special_lookup(fcb->fname, fcb->fext);
+	}
+
+	if (!sf)
+		return 0;
+
+	// Allocate buffer
+	file->special_buf = calloc(RECSIZE, 1);
+	if (!file->special_buf)
+		return 0;
+	// Allocate space for internal data
+	file->trap = calloc(sizeof(struct special_data_t), 1);
+	if (!file->trap) {
+		free(file->special_buf);
+		file->special_buf = NULL;
+		return 0;
+	}
+	// Set callback function pointer
+	file->trap->sfp = sf;
+	file->trap->notready = FCB_NOTREADY(fcb) ? 1 : 0;
+	// Handle open callback
+	sf->callbk(fileno, TVSP_FILE_OPEN, 0);
+	// Save name into fileinfo record
+	memcpy(file->fname, sf->fname, 8);
+	memcpy(file->fext, sf->fext, 3);
 
 	return (file->trap != NULL) ;
 }
@@ -140,7 +442,13 @@ int alm_special_printlist() {
 		safe_print("Special file: '");
 		get_pretty_filename(filename, sfp->fname, sfp->fext);
 		safe_print(filename);
-		safe_print("'\n");
+		safe_print("'");
+		if (sfp->arg) {
+			safe_print((sfp->type == SPECIAL_EXEC) ? " exec: " :
+					(sfp->type == SPECIAL_PLUGIN) ? " plugin: " : " builtin: ");
+			safe_print(sfp->arg);
+		}
+		safe_print("\n");
 
 		sfp=sfp->next;
 	}
@@ -181,50 +489,91 @@ int alm_special_trapfileop(int fileno, int fileop, int pos) {
 /* Free the data structure on exit */
 int alm_special_free_sft(struct special_file_t *sf) {
 
-	// Walk the tree, and delete the last entry
-	if (sf != NULL) {
-		alm_special_free_sft(sf);
-		sf->next = NULL;
+	struct special_file_t *next;
+
+	while (sf != NULL) {
+		next = sf->next;
+		if (sf->dlhandle)
+			dlclose(sf->dlhandle);
+		free(sf->arg);
 		free(sf);
+		sf = next;
 	}
 	return 0;
 }
 
-/* Add an entry to the data structure */
-int alm_special_add_sft(struct special_file_t *sf, const char *filename, int (*fp)(int, int, int)) {
+/* Turn name.ext into a blank padded, upper case 8.3 name */
+int alm_special_name(const char *filename, uint8_t *fname, uint8_t *fext) {
 
 	int i,j;
 
-	// Find the last entry
-	while (sf->next)
-		sf = sf->next;
-	// Allocate space and clear it
-	sf->next = calloc(sizeof(struct special_file_t),1);
-	if (!sf->next)
-		return -1;
-	sf = sf->next;
-	memset(sf->fname, ' ', 8);
-	memset(sf->fext, ' ', 3);
+	memset(fname, ' ', 8);
+	memset(fext, ' ', 3);
 	// Copy the filename
-	for (i=0; i<8; i++) {
-		if (filename[i] == '.' || filename[i] == 0)
-			break;
-		sf->fname[i] = filename[i] & 0xDF; // convert to uppercase as necessary, perserve bits
-	}
+	for (i=0; filename[i] && filename[i] != '.'; i++)
+		if (i < 8)
+			fname[i] = toupper(filename[i]);
 	// Skip over the .
 	if (filename[i] == '.')
 		i++;
 	// Copy extension
 	for (j=0; j<3; j++) {
-		if (filename[i] == 0)
+		if (filename[i+j] == 0)
 			break;
-		sf->fext[j] = filename[i+j] & 0xDF;
+		fext[j] = toupper(filename[i+j]);
 	}
-	// Set the callback function
-	sf->callbk = fp;
 
 	return 0;
-	
+}
+
+/* Add an entry to the end of the list, and to the hash table */
+struct special_file_t *alm_special_add_sft(struct special_file_t *sf, const char *filename, int (*fp)(int, int, int)) {
+
+	struct special_file_t *newsf;
+	unsigned int bucket;
+
+	// Find the last entry
+	while (sf->next)
+		sf = sf->next;
+	// Allocate space and clear it
+	newsf = calloc(sizeof(struct special_file_t),1);
+	if (!newsf)
+		return NULL;
+	alm_special_name(filename, newsf->fname, newsf->fext);
+	// Set the callback function
+	newsf->callbk = fp;
+	newsf->type = SPECIAL_BUILTIN;
+
+	sf->next = newsf;
+	bucket = alm_special_hash(newsf->fname, newsf->fext);
+	newsf->hnext = special_hash[bucket];
+	special_hash[bucket] = newsf;
+
+	return newsf;
+}
+
+/* Take an entry out of the list and hash table, and free it. Only done while
+ * reading the config, before any client can have it open.
+ */
+int alm_special_remove_sft(struct special_file_t *sf, struct special_file_t *old) {
+
+	struct special_file_t **sfpp;
+
+	for (sfpp = &(sf->next); *sfpp; sfpp = &((*sfpp)->next)) {
+		if (*sfpp == old) {
+			*sfpp = old->next;
+			break;
+		}
+	}
+	for (sfpp = &special_hash[alm_special_hash(old->fname, old->fext)]; *sfpp; sfpp = &((*sfpp)->hnext)) {
+		if (*sfpp == old) {
+			*sfpp = old->hnext;
+			break;
+		}
+	}
+	old->next = NULL;
+
+	return alm_special_free_sft(old);
 }
 
 /* chargen.sys */
@@ -313,229 +662,324 @@ int alm_special_multisys(int fileno, int fop, int pos) {
 
 /* filein.sys */
 int alm_special_fileinsys(int fileno, int fop, int pos) {
-	int i, retval;
 	int fd;
-	int fsize;
-	int nrecs;
+	struct stat st;
+	off_t fsize;
+	ssize_t len;
 
 	struct file_status_t *file = &(fileinfo[fileno]);
 
 	if (fop == TVSP_FILE_OPEN) {
-		// Open file, get size
-		fd = open(fileinsys_name, O_RDONLY);
+		// Keep the file open and read each record as the client asks for it
+		file->trap->infd = -1;
+		fd = open(fileinsys_name, O_RDONLY | O_CLOEXEC);
 		if (fd < 0)
 			return 0;
-		fsize = lseek(fd, 0, SEEK_END);
-		if (fsize > CPMMAXSIZE)
-			fsize = CPMMAXSIZE;
-		lseek(fd, 0, SEEK_SET);
-		// Allocate buffer to next RECSIZE size
-		nrecs = ((fsize - 1)/RECSIZE + 1);
-		file->trap->readbuf = malloc(nrecs*RECSIZE);
-		if (!file->trap->readbuf)
+		if (fstat(fd, &st) < 0) {
+			close(fd);
 			return 0;
-		memset(file->trap->readbuf, 0x1A, nrecs * RECSIZE);
-		for (i=0; i<nrecs; i++) {
-			retval = read(fd, file->trap->readbuf + (i*RECSIZE), RECSIZE);
-			if (retval < 1) {
-				// Nothing read, don't increment i
-				break;
-			} else if (retval < RECSIZE) {
-				// Short read, increment i to count this
-				i++;
-				break;
-			}
 		}
-		close(fd);
-		// Set size based on records read
-		file->trap->readbufsize = i;
+		fsize = st.st_size;
+		if (fsize > CPMMAXSIZE)
+			fsize = CPMMAXSIZE;
+		file->trap->infd = fd;
+		file->trap->readbufsize = (fsize + RECSIZE - 1)/RECSIZE;
 	} else if (fop == TVSP_FILE_CLOSE) {
-		if (file->trap->readbuf)
-			free(file->trap->readbuf);
-		file->trap->readbuf = NULL;
+		/* Can be called from signal handler */
+		if (file->trap->infd >= 0)
+			close(file->trap->infd);
+		file->trap->infd = -1;
 		file->trap->readbufsize = 0;
-		if (file->trap->writebuf)
-			free(file->trap->writebuf);
-		file->trap->writebuf = NULL;
-		file->trap->writebufsize = 0;
 	} else if (FOP_IS_READ(fop)) {
 		// Check for null pointers
-		if (!file->trap || !file->trap->readbuf || !file->special_buf)
+		if (!file->trap || file->trap->infd < 0 || !file->special_buf)
 			return -1;
 		if (pos >= file->trap->readbufsize)
 			return -1;
+		// The file may have been cut short since it was opened, that's the end of it
+		len = pread(file->trap->infd, file->special_buf, RECSIZE, (off_t)pos * RECSIZE);
+		if (len <= 0)
+			return -1;
 		if (pos > file->trap->readbufmax)
 			file->trap->readbufmax = pos;
-		memcpy(file->special_buf, file->trap->readbuf + (pos * RECSIZE), RECSIZE);
+		// Pad the last record out with ^Z
+		if (len < RECSIZE)
+			memset(file->special_buf + len, 0x1A, RECSIZE - len);
 	}
 	return 0;
 
 }
 
+/* Write out the records held back in fileout.sys's buffer */
+/* Can be called from signal handler */
+int alm_special_fileoutflush(struct special_data_t *trap) {
+
+	ssize_t len = trap->writebufrecs * RECSIZE;
+
+	if (!len)
+		return 0;
+	trap->writebufrecs = 0;
+	if (pwrite(trap->outfd, trap->writebuf, len, (off_t)trap->writebufstart * RECSIZE) != len)
+		return -1;
+
+	return 0;
+}
+
 /* fileout.sys */
 int alm_special_fileoutsys(int fileno, int fop, int pos) {
 	int fd;
+	size_t namelen;
 
 	struct file_status_t *file = &(fileinfo[fileno]);
+	struct special_data_t *trap = file->trap;
 
 	if (fop == TVSP_FILE_OPEN) {
-		// Allocate inital buffer for writing
-		file->trap->writebuf = malloc(1);
-		if (!file->trap->writebuf)
+		// Records go to a temp file next to fileoutsys_name as they arrive,
+		// which is renamed over it at close
+		trap->outfd = -1;
+		namelen = strlen(fileoutsys_name);
+		trap->outname = malloc(namelen + 8);
+		trap->writebuf = malloc(FILEOUT_BUFRECS * RECSIZE);
+		if (!trap->outname || !trap->writebuf)
+			return -1;
+		memcpy(trap->outname, fileoutsys_name, namelen);
+		strcpy(trap->outname + namelen, ".XXXXXX");
+		fd = mkstemp(trap->outname);
+		if (fd < 0) {
+			printf("fileout.sys: Can't create temp file for '%s': %s\n", fileoutsys_name, strerror(errno));
+			free(trap->outname);
+			trap->outname = NULL;
 			return -1;
+		}
+		// mkstemp() makes it 0600, but it replaces a file others can read
+		fchmod(fd, 0644);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		trap->outfd = fd;
 	} else if (fop == TVSP_FILE_CLOSE) {
 		/* Can be called from signal handler */
-		if (file->trap->writebufsize < 1) 
-			return 0; 	// Nothing to write to file
-		// Open file
-		fd = open(fileoutsys_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
-		if (fd < 0)
-			return 0;
-		// Write contents & close
-		write(fd, file->trap->writebuf, file->trap->writebufsize * RECSIZE);
-		close(fd);
+		if (trap->outfd >= 0) {
+			alm_special_fileoutflush(trap);
+			close(trap->outfd);
+			trap->outfd = -1;
+			// Nothing written leaves the old file alone
+			if (trap->writebufsize < 1)
+				unlink(trap->outname);
+			else
+				rename(trap->outname, fileoutsys_name);
+		}
 		// free buffers
-		if (file->trap->readbuf)
-			free(file->trap->readbuf);
-		file->trap->readbuf = NULL;
-		file->trap->readbufsize = 0;
-		if (file->trap->writebuf)
-			free(file->trap->writebuf);
-		file->trap->writebuf = NULL;
-		file->trap->writebufsize = 0;
+		if (trap->outname)
+			free(trap->outname);
+		trap->outname = NULL;
+		if (trap->writebuf)
+			free(trap->writebuf);
+		trap->writebuf = NULL;
+		trap->writebufsize = 0;
 	} else if (FOP_IS_WRITE(fop)) {
 
-		// find new size, realloc if bigger than old size
-		int newsize = pos+1;
+		if (trap->outfd < 0 || !file->special_buf)
+			return -1;
 
-		if (newsize > file->trap->writebufsize) {
-			uint8_t *newptr = realloc(file->trap->writebuf, newsize * RECSIZE);
-			if (!newptr)
+		// Keep runs of records together, anything else writes out what we have
+		if (trap->writebufrecs && (pos != trap->writebufstart + trap->writebufrecs ||
+				trap->writebufrecs >= FILEOUT_BUFRECS)) {
+			if (alm_special_fileoutflush(trap) < 0)
 				return -1;
-			file->trap->writebuf = newptr;
-			file->trap->writebufsize = newsize;
 		}
-		// Copy data to buffer
-		memcpy(file->trap->writebuf + (RECSIZE*pos), file->special_buf, RECSIZE);
+		if (!trap->writebufrecs)
+			trap->writebufstart = pos;
+		memcpy(trap->writebuf + (RECSIZE * trap->writebufrecs), file->special_buf, RECSIZE);
+		trap->writebufrecs++;
+
+		if (pos + 1 > trap->writebufsize)
+			trap->writebufsize = pos + 1;
 
 	} else if (FOP_IS_READ(fop)) {
 		// Check for null pointers
-		if (!file->trap || !file->trap->readbuf || !file->special_buf)
+		if (trap->outfd < 0 || !file->special_buf)
 			return -1;
-		if (pos >= file->trap->writebufsize)
+		if (pos >= trap->writebufsize)
 			return -1;
-		if (pos > file->trap->writebufmax)
-			file->trap->readbufmax = pos;
+		if (pos > trap->writebufmax)
+			trap->writebufmax = pos;
 		// Read what we wrote to the file
-		memcpy(file->special_buf, file->trap->writebuf + (pos * RECSIZE), RECSIZE);
+		if (pos >= trap->writebufstart && pos < trap->writebufstart + trap->writebufrecs) {
+			memcpy(file->special_buf, trap->writebuf + (RECSIZE * (pos - trap->writebufstart)), RECSIZE);
+		} else {
+			// Records never written read back as zeros
+			memset(file->special_buf, 0, RECSIZE);
+			if (pread(trap->outfd, file->special_buf, RECSIZE, (off_t)pos * RECSIZE) < 0)
+				return -1;
+		}
 	}
 	return 0;
 
 }
 
-// Callback for libcurl to write data recieved to buffer
-static size_t alm_special_fillbuf(void *buf, size_t size, size_t nmemb, void *userp) {
-	size_t bytes=size*nmemb, newsize, rounduprecs;
-	struct special_data_t *sdp = (struct special_data_t *)userp;
+/* spool.sys: what a port writes is printed when it closes the file */
+int alm_special_spoolsys(int fileno, int fop, int pos) {
 
-	// Fail if we've read more than CP/M can handle
-	if (sdp->readbufsize >= 65536)
-		return 0;
-	newsize = sdp->tmp + bytes;
-
-	// Allocate full records so it's easier to read later
-	rounduprecs = (newsize - 1)/RECSIZE + 1;
-	if (rounduprecs > sdp->readbufsize) {
-		uint8_t *rdbufnew = realloc(sdp->readbuf, rounduprecs * RECSIZE);
-		if (!rdbufnew) {
-			printf("Failed realloc in alm_special_fillbuf!\n");
-			return 0;
-		}
-		sdp->readbuf = rdbufnew;
+	struct file_status_t *file = &(fileinfo[fileno]);
+
+	if (fop == TVSP_FILE_OPEN) {
+		if (alm_spool_open(file->port) < 0)
+			printf("spool.sys: port %d: no Spool Dir, nothing will print\n", file->port);
+	} else if (fop == TVSP_FILE_CLOSE) {
+		/* Can be called from signal handler */
+		alm_spool_close(file->port);
+	} else if (FOP_IS_WRITE(fop)) {
+		if (!file->special_buf)
+			return -1;
+		return alm_spool_write(file->port, pos, file->special_buf);
+	} else if (FOP_IS_READ(fop)) {
+		// Nothing to read back, it's on its way to the printer
+		return -1;
 	}
-	memcpy(sdp->readbuf + sdp->tmp, buf, bytes);
-	sdp->tmp = newsize;
-	sdp->readbufsize = sdp->readbufmax = (newsize-1)/RECSIZE + 1;
-	
-	return bytes;
+	return 0;
+
 }
 
-/* urlget.sys */
-int alm_special_urlget(int fileno, int fop, int pos) {
+/* Why alm_file_copy() failed, by -COPYERR_* */
+static const char *alm_special_copyerrs[] = {
+	"", "Wildcards not allowed", "Drive not public", "No source file", "File in use",
+	"Destination read only", "Disk full", "Can't copy special files", "Read/write error"
+};
+
+/* copy.sys: the client writes a record starting with the source and
+ * destination FCBs as the CCP leaves them at 5Ch and 6Ch, and the file is
+ * copied here instead of through the client. Reading it back gives a line
+ * saying how it went.
+ */
+int alm_special_copysys(int fileno, int fop, int pos) {
 
 	struct file_status_t *file = &(fileinfo[fileno]);
+	struct cpm_fcb_t src, dst;
+	char msg[RECSIZE];
+	int recs;
 
 	if (fop == TVSP_FILE_OPEN) {
-		file->trap->writebuf = malloc(1);
-		if (!file->trap->writebuf)
-			return -1;
-		file->trap->readbuf = malloc(1);
+		file->trap->readbuf = malloc(RECSIZE);
 		if (!file->trap->readbuf)
 			return -1;
+		file->trap->readbufsize = 0;
 	} else if (fop == TVSP_FILE_CLOSE) {
 		/* Can be called from signal handler */
 		if (file->trap->readbuf)
 			free(file->trap->readbuf);
 		file->trap->readbuf = NULL;
-		file->trap->readbufsize = 0;
+	} else if (FOP_IS_WRITE(fop)) {
+		if (!file->trap->readbuf || !file->special_buf)
+			return -1;
+		memset(&src, 0, sizeof(src));
+		memset(&dst, 0, sizeof(dst));
+		memcpy(&src, file->special_buf, 12);
+		memcpy(&dst, file->special_buf + 16, 12);
+
+		recs = alm_file_copy(file->port, file->usrcode, file->drivenum, &src, &dst);
+		if (recs < 0)
+			snprintf(msg, RECSIZE, "Copy failed: %s\r\n", alm_special_copyerrs[-recs]);
+		else
+			snprintf(msg, RECSIZE, "%d records copied\r\n", recs);
+		printf("copy.sys: port %d: %s", file->port, msg);
+		// Text file for the client, ending in ^Z
+		memset(file->trap->readbuf, 0x1a, RECSIZE);
+		memcpy(file->trap->readbuf, msg, strlen(msg));
+		file->trap->readbufsize = 1;
+	} else if (FOP_IS_READ(fop)) {
+		if (!file->trap->readbuf || !file->special_buf || pos >= file->trap->readbufsize)
+			return -1;
+		memcpy(file->special_buf, file->trap->readbuf, RECSIZE);
+	}
+	return 0;
+}
+
+/* Read a record from a fetch started by urlget.sys / imgget.sys / lynxget.sys */
+int alm_special_fetchread(int fileno, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+	struct fetch_job_t *job = file->trap->fetch;
+
+	// Check for null pointers
+	if (!job || !file->special_buf)
+		return -1;
+	switch (alm_fetch_readrec(job, pos, file->special_buf)) {
+		case RECSIZE:
+			break;
+		case 0:
+			// Let the client know to try again, the record is still on its way
+			return SPECIAL_NOTREADY;
+		default:
+			return -1;
+	}
+	if (pos > file->trap->readbufmax)
+		file->trap->readbufmax = pos;
+
+	return 0;
+}
+
+/* Collect the URL written by the client, returns it as a string once the ^Z
+ * ending it has been written, or NULL if there's more to come.
+ */
+char *alm_special_geturl(int fileno, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+	// find new size, realloc if bigger than old size
+	int newsize = pos+1;
+	uint8_t *eofpos;
+
+	if (newsize > file->trap->writebufsize) {
+		uint8_t *newptr = realloc(file->trap->writebuf, newsize * RECSIZE);
+		if (!newptr)
+			return NULL;
+		file->trap->writebuf = newptr;
+		file->trap->writebufsize = newsize;
+	}
+	// Copy data to buffer
+	memcpy(file->trap->writebuf + (RECSIZE*pos), file->special_buf, RECSIZE);
+
+	// find ^Z, exit if not found
+	eofpos = memchr(file->trap->writebuf, 0x1a, file->trap->writebufsize * RECSIZE);
+	if (!eofpos)
+		return NULL;
+	// null terminate instead of ^Z
+	*eofpos = 0;
+
+	return (char *)file->trap->writebuf;
+}
+
+/* urlget.sys */
+int alm_special_urlget(int fileno, int fop, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+
+	if (fop == TVSP_FILE_OPEN) {
+		file->trap->writebuf = malloc(1);
+		if (!file->trap->writebuf)
+			return -1;
+	} else if (fop == TVSP_FILE_CLOSE) {
+		/* Can be called from signal handler */
+		alm_fetch_release(file->trap->fetch);
+		file->trap->fetch = NULL;
 		if (file->trap->writebuf)
 			free(file->trap->writebuf);
 		file->trap->writebuf = NULL;
 		file->trap->writebufsize = 0;
 	} else if (FOP_IS_WRITE(fop)) {
-		// find new size, realloc if bigger than old size
-		int newsize = pos+1;
-		uint8_t *eofpos;
+		char *url;
 
-		if (file->trap->tmp > 0)		// If we've already done got a file, don't do it again.
+		if (file->trap->fetch)		// If we've already done got a file, don't do it again.
 			return -1;
 
-		if (newsize > file->trap->writebufsize) {
-			uint8_t *newptr = realloc(file->trap->writebuf, newsize * RECSIZE);
-			if (!newptr)
-				return -1;
-			file->trap->writebuf = newptr;
-			file->trap->writebufsize = newsize;
-		}
-		// Copy data to buffer
-		memcpy(file->trap->writebuf + (RECSIZE*pos), file->special_buf, RECSIZE);
-
-		// find ^Z, exit if not found
-		eofpos = memchr(file->trap->writebuf, 0x1a, file->trap->writebufsize * RECSIZE);
-		// turn into a ASCIIZ string, and pass to libcurl
-		if (eofpos) {
-			CURL *curlp;
-
-			// Init libcurl
-			curlp = curl_easy_init();
-			if (!curlp)
+		url = alm_special_geturl(fileno, pos);
+		// Start the fetch in the background, reads poll for it
+		if (url) {
+			file->trap->fetch = alm_fetch_start(URLFNAME, url, NULL, NULL);
+			if (!file->trap->fetch)
 				return -1;
-			// null terminate instead of ^Z
-			*eofpos = 0;
-			// Set up and do read
-			curl_easy_setopt(curlp, CURLOPT_URL, file->trap->writebuf);
-			curl_easy_setopt(curlp, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
-			curl_easy_setopt(curlp, CURLOPT_WRITEFUNCTION, alm_special_fillbuf);
-			curl_easy_setopt(curlp, CURLOPT_WRITEDATA, (void *)file->trap);
-			curl_easy_setopt(curlp, CURLOPT_USERAGENT, "almmmost/0.1 (CP/M; 2.2)");
-			curl_easy_perform(curlp);
-			curl_easy_cleanup(curlp);
-			// If not a full last record, fill remainder with EOF ^Z's
-			if (file->trap->tmp % RECSIZE)
-				memset(file->trap->readbuf + file->trap->tmp, 0x1a, RECSIZE - (file->trap->tmp % RECSIZE));
-
 		}
 		
 	} else if (FOP_IS_READ(fop)) {
-		// Check for null pointers
-		if (!file->trap || !file->trap->readbuf || !file->special_buf || !file->trap->tmp)
-			return -1;
-		if (pos >= file->trap->readbufsize)
-			return -1;
-		if (pos > file->trap->readbufmax)
-			file->trap->readbufmax = pos;
-		// If we're good, read the record
-		memcpy(file->special_buf, file->trap->readbuf + (pos * RECSIZE), RECSIZE);
+		return alm_special_fetchread(fileno, pos);
 	}
 	return 0;
 }
@@ -549,97 +993,329 @@ int alm_special_cgiget(int fileno, int fop, int pos) {
 		file->trap->writebuf = malloc(1);
 		if (!file->trap->writebuf)
 			return -1;
-		file->trap->readbuf = malloc(1);
-		if (!file->trap->readbuf)
-			return -1;
 	} else if (fop == TVSP_FILE_CLOSE) {
 		/* Can be called from signal handler */
-		if (file->trap->readbuf)
-			free(file->trap->readbuf);
-		file->trap->readbuf = NULL;
-		file->trap->readbufsize = 0;
+		alm_fetch_release(file->trap->fetch);
+		file->trap->fetch = NULL;
 		if (file->trap->writebuf)
 			free(file->trap->writebuf);
 		file->trap->writebuf = NULL;
 		file->trap->writebufsize = 0;
 	} else if (FOP_IS_WRITE(fop)) {
-		// find new size, realloc if bigger than old size
-		int newsize = pos+1;
-		uint8_t *eofpos;
+		char *urlarg;
 
-		if (file->trap->tmp > 0)		// If we've already done got a file, don't do it again.
+		if (file->trap->fetch)		// If we've already done got a file, don't do it again.
 			return -1;
 
-		if (newsize > file->trap->writebufsize) {
-			uint8_t *newptr = realloc(file->trap->writebuf, newsize * RECSIZE);
-			if (!newptr)
-				return -1;
-			file->trap->writebuf = newptr;
-			file->trap->writebufsize = newsize;
-		}
-		// Copy data to buffer
-		memcpy(file->trap->writebuf + (RECSIZE*pos), file->special_buf, RECSIZE);
-
-		// find ^Z, exit if not found
-		eofpos = memchr(file->trap->writebuf, 0x1a, file->trap->writebufsize * RECSIZE);
-		// turn into a ASCIIZ string, and pass to libcurl
-		if (eofpos) {
-			CURL *curlp;
+		urlarg = alm_special_geturl(fileno, pos);
+		// url encode, and post to the CGI script in the background
+		if (urlarg) {
 			char postoption[INPBUFSIZE];
 			char *urlenc_data;
-			char *url;
+			char *url, *handler;
 
 			// URL determined by what special file we're using
-			if (!(strncasecmp((char *)file->trap->sfp->fname, IMAGEFNAME, IMAGEFNAME_MATCH)))
+			if (!strcmp(file->trap->sfp->arg, "imgget")) {
+				if (imggetsys_native) {
+					// Fetch the image itself, and convert it on the fetch thread
+					file->trap->fetch = alm_fetch_start(IMAGEFNAME, urlarg, NULL, alm_imgconv_tvi);
+					return file->trap->fetch ? 0 : -1;
+				}
 				url = imggetsys_url;
-			else if (!(strncasecmp((char *)file->trap->sfp->fname, LYNXFNAME, LYNXFNAME_MATCH)))
+				handler = IMAGEFNAME;
+			} else if (!strcmp(file->trap->sfp->arg, "lynxget")) {
 				url = lynxgetsys_url;
-			else {
+				handler = LYNXFNAME;
+			} else {
 				printf("alm_special_cgigetsys: I don't know what handler I'm for: ");
 				print_cpm_filename(file->trap->sfp->fname, file->trap->sfp->fext);
 				return -1;
 			}
-			// Init libcurl
-			curlp = curl_easy_init();
-			if (!curlp)
+			urlenc_data = curl_easy_escape(NULL, urlarg, 0);
+			if (!urlenc_data)
 				return -1;
-			// null terminate instead of ^Z, and url encode
-			*eofpos = 0;
-			urlenc_data = curl_easy_escape(curlp, (char *)file->trap->writebuf, 0);
 			
-			// Set up and do read
 			strcpy(postoption, "url=");
 			strncat(postoption, urlenc_data, INPBUFSIZE);
 			postoption[INPBUFSIZE-1] = 0;
 			curl_free(urlenc_data);
-				
-			curl_easy_setopt(curlp, CURLOPT_URL, url);
-			curl_easy_setopt(curlp, CURLOPT_POST, 1L);
-			curl_easy_setopt(curlp, CURLOPT_POSTFIELDSIZE, strlen(postoption));
-			curl_easy_setopt(curlp, CURLOPT_POSTFIELDS, postoption);
-			curl_easy_setopt(curlp, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
-			curl_easy_setopt(curlp, CURLOPT_WRITEFUNCTION, alm_special_fillbuf);
-			curl_easy_setopt(curlp, CURLOPT_WRITEDATA, (void *)file->trap);
-			curl_easy_setopt(curlp, CURLOPT_USERAGENT, "almmmost/0.1 (CP/M; 2.2)");
-			curl_easy_perform(curlp);
-			curl_easy_cleanup(curlp);
-			// If not a full last record, fill remainder with EOF ^Z's
-			if (file->trap->tmp % RECSIZE)
-				memset(file->trap->readbuf + file->trap->tmp, 0x1a, RECSIZE - (file->trap->tmp % RECSIZE));
 
+			file->trap->fetch = alm_fetch_start(handler, url, postoption, NULL);
+			if (!file->trap->fetch)
+				return -1;
 		}
 		
 	} else if (FOP_IS_READ(fop)) {
-		// Check for null pointers
-		if (!file->trap || !file->trap->readbuf || !file->special_buf || !file->trap->tmp)
+		return alm_special_fetchread(fileno, pos);
+	}
+	return 0;
+}
+
+/* Special file declared as Exec: the client writes what goes to the command's
+ * stdin (optional, ending in ^Z), and reads back its output.
+ */
+int alm_special_exec(int fileno, int fop, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+	char filename[16];
+
+	if (fop == TVSP_FILE_OPEN) {
+		file->trap->writebuf = malloc(1);
+		if (!file->trap->writebuf)
 			return -1;
-		if (pos >= file->trap->readbufsize)
+	} else if (fop == TVSP_FILE_CLOSE) {
+		/* Can be called from signal handler */
+		alm_fetch_release(file->trap->fetch);
+		file->trap->fetch = NULL;
+		if (file->trap->writebuf)
+			free(file->trap->writebuf);
+		file->trap->writebuf = NULL;
+		file->trap->writebufsize = 0;
+	} else if (FOP_IS_WRITE(fop)) {
+		char *input;
+
+		if (file->trap->fetch)		// Already running, input is done
 			return -1;
-		if (pos > file->trap->readbufmax)
-			file->trap->readbufmax = pos;
-		// If we're good, read the record
-		memcpy(file->special_buf, file->trap->readbuf + (pos * RECSIZE), RECSIZE);
+
+		input = alm_special_geturl(fileno, pos);
+		if (input) {
+			get_pretty_filename(filename, file->trap->sfp->fname, file->trap->sfp->fext);
+			file->trap->fetch = alm_fetch_exec(filename, file->trap->sfp->arg, input);
+			if (!file->trap->fetch)
+				return -1;
+		}
+	} else if (FOP_IS_READ(fop)) {
+		// Reading without writing anything first runs it with no input
+		if (!file->trap->fetch) {
+			get_pretty_filename(filename, file->trap->sfp->fname, file->trap->sfp->fext);
+			file->trap->fetch = alm_fetch_exec(filename, file->trap->sfp->arg, NULL);
+			if (!file->trap->fetch)
+				return -1;
+		}
+		return alm_special_fetchread(fileno, pos);
+	}
+	return 0;
+}
+
+/* Includes have to name files in the scratch directory, so no absolute
+ * paths or ".." in include or incbin. Returns -1 if the source has one.
+ */
+int alm_special_asmpaths(const char *source) {
+
+	const char *p, *name;
+	size_t len, i;
+	int comment = 0, up;
+
+	for (p = source; *p; p++) {
+		if (*p == '\n')
+			comment = 0;
+		else if (*p == ';')
+			comment = 1;
+		if (comment || (p > source && (isalnum((uint8_t)p[-1]) || p[-1] == '_')))
+			continue;
+		if (!strncasecmp(p, "include", 7))
+			len = 7;
+		else if (!strncasecmp(p, "incbin", 6))
+			len = 6;
+		else
+			continue;
+		if (isalnum((uint8_t)p[len]) || p[len] == '_')
+			continue;
+
+		// Quoted names run to the quote, others to a space or comment
+		for (name = p + len; *name == ' ' || *name == '\t'; name++);
+		if (*name == '"')
+			len = strcspn(++name, "\"\n");
+		else if (*name == '\'')
+			len = strcspn(++name, "'\n");
+		else if (*name == '<')
+			len = strcspn(++name, ">\n");
+		else
+			len = strcspn(name, " \t,;\n");
+		for (i = 1, up = 0; i < len; i++)
+			if (name[i - 1] == '.' && name[i] == '.')
+				up = 1;
+		if (*name == '/' || *name == '\\' || *name == '~' || up) {
+			printf("asm.sys: Include of %.*s refused\n", (int)len, name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write a file for the build into the scratch directory, owned by whoever
+ * the build runs as.
+ */
+static int alm_special_asmfile(const char *dir, const char *fname, const char *data, size_t len,
+		uid_t uid, gid_t gid) {
+
+	char path[INPBUFSIZE + 32];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, fname);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, data, len) != (ssize_t)len || fchown(fd, uid, gid)) {
+		printf("asm.sys: Can't write %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
+	close(fd);
 	return 0;
 }
 
+/* Start building source for asm.sys / asmlst.sys: write it to a scratch
+ * directory, and run Asm Command there in the background. The tool is shut
+ * in the directory as Asm User, and ASM_SCRIPT sends back the output file,
+ * or the listing and messages. The directory goes when the build does.
+ */
+struct fetch_job_t *alm_special_asmstart(struct special_data_t *trap, char *source) {
+
+	char dir[INPBUFSIZE + 16], path[INPBUFSIZE + 32], userspec[32], groups[32], filename[16];
+	char *script = NULL, *in, *out;
+	char *argv[12];
+	size_t scriptlen, len;
+	int listing, isroot, argc = 0;
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	struct passwd *pw;
+	struct fetch_job_t *job = NULL;
+
+	if (alm_special_asmpaths(source))
+		return NULL;
+
+	// Only root can switch users, anyone else stays themselves
+	isroot = (geteuid() == 0);
+	if (isroot) {
+		pw = getpwnam(asmsys_user);
+		if (!pw || !pw->pw_uid) {
+			printf("asm.sys: Asm User %s isn't an unprivileged user\n", asmsys_user);
+			return NULL;
+		}
+		uid = pw->pw_uid;
+		gid = pw->pw_gid;
+		snprintf(userspec, sizeof(userspec), "--userspec=%u:%u", (unsigned)uid, (unsigned)gid);
+		snprintf(groups, sizeof(groups), "--groups=%u", (unsigned)gid);
+	}
+
+	snprintf(dir, sizeof(dir), "%s/almasm.XXXXXX", asmsys_dir);
+	if (!mkdtemp(dir)) {
+		printf("asm.sys: Can't make %s: %s\n", dir, strerror(errno));
+		return NULL;
+	}
+
+	// CP/M text lines end in CR LF, host tools want LF
+	for (in = out = source; *in; in++)
+		if (*in != '\r')
+			*(out++) = *in;
+	len = out - source;
+
+	listing = !strcmp(trap->sfp->arg, "asmlst");
+	scriptlen = strlen(ASM_BUILD) + strlen(ASM_SENDLST) + strlen(asmsys_cmd) + 64;
+	script = malloc(scriptlen);
+	if (!script)
+		goto done;
+	snprintf(script, scriptlen, ASM_BUILD "%s\n", ASM_CPU_LIMIT, ASM_FILE_LIMIT, asmsys_cmd,
+			listing ? ASM_SENDLST : ASM_SENDCOM);
+
+	// Asm Dir and the user go in as arguments, never into the shell text
+	argv[argc++] = "unshare";
+	if (!isroot)
+		argv[argc++] = ASM_MAPROOT;
+	argv[argc++] = "--mount";
+	argv[argc++] = "--propagation";
+	argv[argc++] = "private";
+	argv[argc++] = "sh";
+	argv[argc++] = "-c";
+	argv[argc++] = ASM_MOUNT;
+	argv[argc++] = dir;
+	if (isroot) {
+		argv[argc++] = userspec;
+		argv[argc++] = groups;
+	}
+	argv[argc] = NULL;
+
+	if (alm_special_asmfile(dir, ASM_SOURCE, source, len, uid, gid) ||
+			alm_special_asmfile(dir, ASM_SCRIPT, script, strlen(script), uid, gid))
+		goto done;
+	if (chown(dir, uid, gid)) {
+		printf("asm.sys: Can't give %s to Asm User: %s\n", dir, strerror(errno));
+		goto done;
+	}
+
+	get_pretty_filename(filename, trap->sfp->fname, trap->sfp->fext);
+	job = alm_fetch_execv(filename, argv, NULL, dir);
+
+done:
+	if (!job) {
+		snprintf(path, sizeof(path), "%s/" ASM_SOURCE, dir);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/" ASM_SCRIPT, dir);
+		unlink(path);
+		rmdir(dir);
+	}
+	free(script);
+	return job;
+}
+
+/* asm.sys / asmlst.sys: the client writes Z80 source, ending in ^Z, and reads
+ * back the .COM file (or the error messages if it didn't build) from asm.sys,
+ * or the listing and messages from asmlst.sys. The result stays around for
+ * the port after close, so it can be written and read with two PIPs.
+ */
+int alm_special_asm(int fileno, int fop, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+	struct fetch_job_t **last = &(asmsys_last[!strcmp(file->trap->sfp->arg, "asmlst")][file->port]);
+
+	if (fop == TVSP_FILE_OPEN) {
+		file->trap->writebuf = malloc(1);
+		if (!file->trap->writebuf)
+			return -1;
+		file->trap->fetch = *last;
+		*last = NULL;
+	} else if (fop == TVSP_FILE_CLOSE) {
+		/* Can be called from signal handler */
+		alm_fetch_release(*last);
+		*last = file->trap->fetch;
+		file->trap->fetch = NULL;
+		if (file->trap->writebuf)
+			free(file->trap->writebuf);
+		file->trap->writebuf = NULL;
+		file->trap->writebufsize = 0;
+	} else if (FOP_IS_WRITE(fop)) {
+		char *source;
+
+		// New source replaces the last build
+		if (file->trap->fetch && !file->trap->writebufsize) {
+			alm_fetch_release(file->trap->fetch);
+			file->trap->fetch = NULL;
+		}
+		if (file->trap->fetch)		// Already building, source is done
+			return -1;
+
+		source = alm_special_geturl(fileno, pos);
+		if (source) {
+			file->trap->fetch = alm_special_asmstart(file->trap, source);
+			if (!file->trap->fetch)
+				return -1;
+		}
+	} else if (FOP_IS_READ(fop)) {
+		// Nothing to read until some source has been written
+		if (!file->trap->fetch)
+			return -1;
+		return alm_special_fetchread(fileno, pos);
+	}
+	return 0;
+}
+
+/* Special file declared as Plugin */
+int alm_special_plugin(int fileno, int fop, int pos) {
+
+	struct file_status_t *file = &(fileinfo[fileno]);
+
+	if (!file->trap || !file->special_buf)
+		return -1;
+
+	return file->trap->sfp->plugfn(fop, pos, file->special_buf, &(file->trap->plugdata));
+}
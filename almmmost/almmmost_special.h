@@ -28,14 +28,38 @@
 #ifndef _ALMMMOST_SPECIAL_H
 #define _ALMMMOST_SPECIAL_H
 
+/* Entry point of a special file plugin: fop is the TVSP_FILE_* operation,
+ * pos the record, and buf the 128 byte record to fill on a read or that was
+ * written. *data starts NULL at open, and is the plugin's to use until close.
+ * Return 0 if OK, -1 for an error / EOF, or SPECIAL_NOTREADY. Close can
+ * happen from a signal handler.
+ */
+typedef int (*special_plugin_t)(int fop, int pos, uint8_t *buf, void **data);
+
+#define SPECIAL_PLUGIN_SYMBOL "almmmost_special"
+
+/* Kinds of handler */
+#define SPECIAL_BUILTIN (0)
+#define SPECIAL_EXEC (1)
+#define SPECIAL_PLUGIN (2)
+
+#define SPECIAL_HASHSIZE (64)	// Power of 2
+
 struct special_file_t {
 	uint8_t fname[8];
 	uint8_t fext[3];
 	uint8_t is_ro;
 	int (*callbk)(int fileno, int fop, int pos); // Pointer to function called when client does something to fileno
+	int type;		// SPECIAL_*
+	char *arg;		// Builtin name, command line, or plugin path
+	void *dlhandle;		// Plugin, from dlopen()
+	special_plugin_t plugfn;
 	struct special_file_t *next;
+	struct special_file_t *hnext;	// Next in the same hash bucket
 };
 
+struct fetch_job_t;
+
 struct special_data_t {
 	uint8_t *readbuf;
 	int readbufsize;
@@ -43,14 +67,63 @@ struct special_data_t {
 	uint8_t *writebuf;
 	int writebufsize;
 	int writebufmax;
+	int writebufstart;	// fileout.sys: first record held in writebuf
+	int writebufrecs;	// fileout.sys: records held in writebuf
+	int infd;		// filein.sys: file being read
+	int outfd;		// fileout.sys: temp file being written
+	char *outname;		// fileout.sys: name of the temp file
 	struct special_file_t *sfp;
-	size_t tmp;
+	struct fetch_job_t *fetch;	// URL being fetched for the client
+	int notready;			// Client reads again on RETCODE_NOT_READY, f7' on open
+	void *plugdata;			// Plugin's own state for this open
 };
 
 extern struct special_file_t *special_files;
+extern struct special_file_t *special_hash[SPECIAL_HASHSIZE];
 extern char fileinsys_name[], fileoutsys_name[];
 extern char imggetsys_url[];
 extern char lynxgetsys_url[];
+extern int imggetsys_native;
+extern char asmsys_cmd[], asmsys_dir[], asmsys_user[];
+
+/* Records fileout.sys holds before writing them out */
+#define FILEOUT_BUFRECS (32)
+
+/* asm.sys: names in the scratch directory Asm Command works in */
+#define ASM_SOURCE "SOURCE.Z80"
+#define ASM_OUTPUT "SOURCE.COM"
+#define ASM_LISTING "SOURCE.LST"
+#define ASM_MESSAGES "SOURCE.ERR"
+#define ASM_SCRIPT "BUILD.SH"
+#define ASM_CPU_LIMIT (30)		// CPU seconds Asm Command gets
+#define ASM_FILE_LIMIT (8192)		// Largest file it can write, in ulimit -f blocks
+#define ASM_BINDS "/bin /lib /lib64 /usr"	// Mounted read-only so it can run
+
+/* The build runs under unshare in a private mount namespace, where
+ * ASM_MOUNT mounts ASM_BINDS inside the scratch directory ($0), which
+ * becomes the root for ASM_SCRIPT, run by chroot as Asm User (the chroot
+ * options are "$@"). When the server isn't root it's a user namespace
+ * instead, and the script runs as the server's user, but it still can't
+ * see anything outside the directory. The fetch thread removes the
+ * directory once the build's gone.
+ */
+#define ASM_MOUNT "for p in " ASM_BINDS "; do if [ -d \"$p\" ]; then " \
+	"mkdir -p \"$0$p\" && mount -o bind,ro \"$p\" \"$0$p\" || exit 1; fi; done; " \
+	"exec chroot \"$@\" \"$0\" /bin/sh /" ASM_SCRIPT
+#define ASM_MAPROOT "--map-root-user"
+
+/* ASM_SCRIPT runs Asm Command with limits on CPU time and file size. Then
+ * one of the ASM_SEND* commands picks what the client gets. Text has its
+ * lines ended in CR LF for CP/M.
+ */
+#define ASM_BUILD "cd / || exit 1; (ulimit -t %d; ulimit -f %d; %s) >" ASM_MESSAGES " 2>&1; "
+#define ASM_CRLF "sed 's/$/\\r/' "	// awk can be a link through /etc, which isn't there
+#define ASM_SENDCOM "if [ $? -eq 0 ] && [ -s " ASM_OUTPUT " ]; then cat " ASM_OUTPUT "; " \
+	"else " ASM_CRLF ASM_MESSAGES "; fi"
+#define ASM_SENDLST "touch " ASM_LISTING "; " ASM_CRLF ASM_LISTING " " ASM_MESSAGES
+
+/* Returned by a read callback when the data is still on its way */
+#define SPECIAL_NOTREADY (-2)
 
 #define FOP_IS_READ(fop) ((fop == TVSP_FILE_READSEQ) || (fop == TVSP_FILE_READRAND))
 #define FOP_IS_WRITE(fop) ((fop == TVSP_FILE_WRITESEQ) || (fop == TVSP_FILE_WRITERAND) || (fop == TVSP_FILE_WRITERANDZ))
@@ -58,8 +131,16 @@ extern char lynxgetsys_url[];
 /* Public functions */
 int alm_special_init();
 int alm_special_exit();
+/* Size the per-port tables, once the number of ports is known */
+int alm_special_setports(int ports);
 int alm_special_ini(struct INI *ini, const char *buf, size_t buflen);
 
+/* Save the paths and commands and go back to the defaults, for a reload */
+int alm_special_reload_begin();
+
+/* Keep the reloaded settings if keep is set, or put the saved ones back */
+int alm_special_reload_end(int keep);
+
 /* Trap for file open */
 int alm_special_trapopen(int fileno, struct cpm_fcb_t *fcb);
 
@@ -72,9 +153,23 @@ int alm_special_trapfileop(int fileno, int fileop, int pos);
 /* Print list of special files */
 int alm_special_printlist();
 
+/* Find the special file for an 8.3 name, NULL if it's a normal file */
+struct special_file_t *alm_special_lookup(const uint8_t *fname, const uint8_t *fext);
+
 /* Private functions */
 int alm_special_free_sft(struct special_file_t *sf);
-int alm_special_add_sft(struct special_file_t *sf, const char *filename, int (*fp)(int, int, int));
+struct special_file_t *alm_special_add_sft(struct special_file_t *sf, const char *filename, int (*fp)(int, int, int));
+int alm_special_remove_sft(struct special_file_t *sf, struct special_file_t *old);
+unsigned int alm_special_hash(const uint8_t *fname, const uint8_t *fext);
+int alm_special_name(const char *filename, uint8_t *fname, uint8_t *fext);
+int alm_special_declare(char *val);
+int alm_special_fetchread(int fileno, int pos);
+int alm_special_fileoutflush(struct special_data_t *trap);
+char *alm_special_geturl(int fileno, int pos);
+/* Check that source only includes files from its own directory */
+int alm_special_asmpaths(const char *source);
+
+struct fetch_job_t *alm_special_asmstart(struct special_data_t *trap, char *source);
 
 /* chargen.sys */
 int alm_special_chargen(int fileno, int fop, int pos);
@@ -88,6 +183,16 @@ int alm_special_fileoutsys(int fileno, int fop, int pos);
 int alm_special_urlget(int fileno, int fop, int pos);
 /* imgget.sys / lynxget.sys */
 int alm_special_cgiget(int fileno, int fop, int pos);
+/* asm.sys / asmlst.sys */
+int alm_special_asm(int fileno, int fop, int pos);
+/* copy.sys */
+int alm_special_copysys(int fileno, int fop, int pos);
+/* spool.sys */
+int alm_special_spoolsys(int fileno, int fop, int pos);
+/* Declared in the config as Exec */
+int alm_special_exec(int fileno, int fop, int pos);
+/* Declared in the config as Plugin */
+int alm_special_plugin(int fileno, int fop, int pos);
 
 
 #endif /* _ALMMMOST_SPECIAL_H */
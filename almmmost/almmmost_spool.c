@@ -0,0 +1,705 @@
+/* almmmost_spool.c: Print spooler for Almmmost
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE		// posix_spawn_file_actions_addclosefrom_np
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_spool.h"
+
+/* Clients print by writing to spool.sys. Each port's output goes to a file
+ * in Spool Dir as it arrives, and when the port closes spool.sys, or sends
+ * a break spool request, the file is renamed to a job and its name goes
+ * down a pipe to the spool thread. The client has its answer by then. The
+ * thread hands each job to the backend: leave it as a text file, pipe it
+ * into a command like lpr, or lay it out as a PDF.
+ */
+
+extern char **environ;
+
+int alm_spool_backend = SPOOL_FILE;
+char alm_spool_dir[INPBUFSIZE];
+char alm_spool_outdir[INPBUFSIZE];
+char alm_spool_cmd[INPBUFSIZE];
+int alm_spool_keep = 0;
+
+static struct spool_port_t *alm_spool_ports = NULL;
+static int alm_spool_nports = 0;
+
+pthread_t alm_spool_tid;
+int alm_spool_running = 0;
+int alm_spool_pipe[2] = { -1, -1 };
+unsigned long alm_spool_seq = 0;
+volatile unsigned long alm_spool_queued = 0;	// Main loop only
+volatile unsigned long alm_spool_printed = 0;	// Spool thread only
+volatile unsigned long alm_spool_failed = 0;	// Spool thread only
+volatile unsigned long alm_spool_dropped = 0;	// Pipe full, left in Spool Dir
+
+static const char *alm_spool_backends[] = { "file", "command", "pdf" };
+
+static void *alm_spool_thread(void *arg);
+
+int alm_spool_init() {
+
+	alm_spool_ports = NULL;
+	alm_spool_nports = 0;
+	alm_spool_backend = SPOOL_FILE;
+	alm_spool_dir[0] = 0;
+	alm_spool_outdir[0] = 0;
+	strcpy(alm_spool_cmd, "lpr");
+	alm_spool_keep = 0;
+	alm_spool_running = 0;
+	alm_spool_pipe[0] = alm_spool_pipe[1] = -1;
+	alm_spool_seq = 0;
+	alm_spool_queued = 0;
+	alm_spool_printed = 0;
+	alm_spool_failed = 0;
+	alm_spool_dropped = 0;
+
+	return 0;
+}
+
+int alm_spool_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval, i;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (vallen >= INPBUFSIZE)
+			vallen = INPBUFSIZE - 1;
+
+		if (!strncasecmp(kbuf, "Spool Dir", 9)) {
+			memcpy(alm_spool_dir, vbuf, vallen);
+			alm_spool_dir[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Output Dir", 10)) {
+			memcpy(alm_spool_outdir, vbuf, vallen);
+			alm_spool_outdir[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Command", 7)) {
+			memcpy(alm_spool_cmd, vbuf, vallen);
+			alm_spool_cmd[vallen] = 0;
+		} else if (!strncasecmp(kbuf, "Keep", 4)) {
+			alm_spool_keep = ((vbuf[0] & 0x5F) == 'Y');
+		} else if (!strncasecmp(kbuf, "Backend", 7)) {
+			for (i=0; i<3; i++)
+				if (!strncasecmp(vbuf, alm_spool_backends[i], strlen(alm_spool_backends[i])))
+					break;
+			if (i < 3)
+				alm_spool_backend = i;
+			else
+				printf("Unknown spool Backend, use file, command or pdf\n");
+		}
+	} while (1);
+
+	return 0;
+}
+
+int alm_spool_start() {
+
+	sigset_t allsigs, oldsigs;
+
+	if (!alm_spool_dir[0] || alm_spool_running)
+		return 0;
+	if (!alm_spool_outdir[0])
+		strcpy(alm_spool_outdir, alm_spool_dir);
+
+	if (pipe(alm_spool_pipe) < 0) {
+		perror("alm_spool_start: pipe");
+		return -1;
+	}
+	fcntl(alm_spool_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(alm_spool_pipe[1], F_SETFD, FD_CLOEXEC);
+	// A full queue mustn't hold up the clients
+	fcntl(alm_spool_pipe[1], F_SETFL, O_NONBLOCK);
+
+	// Keep signals on the main thread
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+	if (pthread_create(&alm_spool_tid, NULL, alm_spool_thread, NULL)) {
+		printf("alm_spool_start: Couldn't start spool thread\n");
+		close(alm_spool_pipe[0]);
+		close(alm_spool_pipe[1]);
+		alm_spool_pipe[0] = alm_spool_pipe[1] = -1;
+	} else {
+		alm_spool_running = 1;
+		printf("Spooling to %s, %s backend\n", alm_spool_dir, alm_spool_backends[alm_spool_backend]);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	return alm_spool_running ? 0 : -1;
+}
+
+/* Size the per-port jobs, once the number of ports is known */
+int alm_spool_setports(int ports) {
+
+	int port;
+
+	free(alm_spool_ports);
+	alm_spool_ports = calloc(ports ? ports : 1, sizeof(struct spool_port_t));
+	if (!alm_spool_ports) {
+		perror("Allocating spool ports");
+		exit(1);
+	}
+	for (port=0; port<ports; port++)
+		alm_spool_ports[port].fd = -1;
+	alm_spool_nports = ports;
+
+	return 0;
+}
+
+/* Start a job for port, named now so queueing it is only a rename */
+static int alm_spool_newjob(int port) {
+
+	struct spool_port_t *sp = &alm_spool_ports[port];
+	int fd;
+
+	snprintf(sp->tmpname, SPOOL_NAMELEN, "%s/.P%02d.XXXXXX", alm_spool_dir, port);
+	fd = mkstemp(sp->tmpname);
+	if (fd < 0) {
+		printf("spool.sys: Can't create a job in '%s': %s\n", alm_spool_dir, strerror(errno));
+		return -1;
+	}
+	// mkstemp() makes it 0600, the print command may run as someone else
+	fchmod(fd, 0644);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	snprintf(sp->jobname, SPOOL_NAMELEN, "%s/P%02d-%ld-%lu" SPOOL_SUFFIX, alm_spool_dir,
+			port, (long)time(NULL), ++alm_spool_seq);
+	sp->fd = fd;
+	sp->recs = 0;
+
+	return 0;
+}
+
+/* Cut the job off at the ^Z that ends CP/M text */
+/* Can be called from signal handler */
+static void alm_spool_trim(struct spool_port_t *sp) {
+
+	uint8_t rec[RECSIZE];
+	uint8_t *eof;
+
+	if (pread(sp->fd, rec, RECSIZE, (off_t)(sp->recs - 1) * RECSIZE) != RECSIZE)
+		return;
+	eof = memchr(rec, 0x1A, RECSIZE);
+	if (eof)
+		ftruncate(sp->fd, (off_t)(sp->recs - 1) * RECSIZE + (eof - rec));
+}
+
+/* Hand port's job to the spool thread */
+/* Can be called from signal handler */
+static int alm_spool_queue(int port) {
+
+	struct spool_port_t *sp = &alm_spool_ports[port];
+	struct spool_msg_t msg;
+
+	if (sp->fd < 0)
+		return 0;
+
+	if (sp->recs)
+		alm_spool_trim(sp);
+	close(sp->fd);
+	sp->fd = -1;
+	if (!sp->recs) {
+		unlink(sp->tmpname);
+		return 0;
+	}
+	if (rename(sp->tmpname, sp->jobname) < 0) {
+		unlink(sp->tmpname);
+		return -1;
+	}
+
+	// Under PIPE_BUF, so it goes in one piece
+	memset(&msg, 0, sizeof(msg));
+	msg.port = port;
+	memcpy(msg.name, sp->jobname, SPOOL_NAMELEN);
+	if (write(alm_spool_pipe[1], &msg, sizeof(msg)) != sizeof(msg)) {
+		alm_spool_dropped++;
+		return -1;
+	}
+	alm_spool_queued++;
+
+	return 0;
+}
+
+int alm_spool_open(int port) {
+
+	if (port < 0 || port >= alm_spool_nports || !alm_spool_running)
+		return -1;
+	alm_spool_ports[port].opens++;
+
+	return 0;
+}
+
+int alm_spool_write(int port, int pos, const uint8_t *buf) {
+
+	struct spool_port_t *sp;
+
+	if (port < 0 || port >= alm_spool_nports || !alm_spool_running)
+		return -1;
+	sp = &alm_spool_ports[port];
+
+	if (sp->fd < 0) {
+		if (alm_spool_newjob(port) < 0)
+			return -1;
+		sp->base = pos;
+	}
+	if (pos < sp->base)
+		return -1;
+	if (pwrite(sp->fd, buf, RECSIZE, (off_t)(pos - sp->base) * RECSIZE) != RECSIZE)
+		return -1;
+	if (pos - sp->base + 1 > sp->recs)
+		sp->recs = pos - sp->base + 1;
+
+	return 0;
+}
+
+/* Can be called from signal handler */
+int alm_spool_close(int port) {
+
+	struct spool_port_t *sp;
+
+	if (port < 0 || port >= alm_spool_nports || !alm_spool_running)
+		return -1;
+	sp = &alm_spool_ports[port];
+
+	if (sp->opens > 0)
+		sp->opens--;
+	if (sp->opens)
+		return 0;
+
+	return alm_spool_queue(port);
+}
+
+/* Can be called from signal handler */
+int alm_spool_break(int port) {
+
+	if (port < 0 || port >= alm_spool_nports || !alm_spool_running)
+		return 0;
+
+	return alm_spool_queue(port);
+}
+
+/* Pipe a job into the spool command, with its name as $1 */
+static int alm_spool_runcmd(const char *name) {
+
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t nosigs, defsigs;
+	char *argv[] = { "sh", "-c", alm_spool_cmd, "sh", (char *)name, NULL };
+	pid_t pid;
+	int fd, retval, status;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("Spool: %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fd, 0);
+	// Nothing else of ours, whatever a thread opened without close-on-exec
+	posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+	// This thread blocks every signal, don't pass that on
+	posix_spawnattr_init(&attr);
+	sigemptyset(&nosigs);
+	sigemptyset(&defsigs);
+	sigaddset(&defsigs, SIGPIPE);
+	posix_spawnattr_setsigmask(&attr, &nosigs);
+	posix_spawnattr_setsigdefault(&attr, &defsigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	retval = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	close(fd);
+	if (retval) {
+		printf("Spool: running '%s': %s\n", alm_spool_cmd, strerror(retval));
+		return -1;
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("Spool: '%s' failed on %s\n", alm_spool_cmd, name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* PDF being written, and the page being laid out */
+struct spool_pdf_t {
+	FILE *fp;		// NULL while measuring
+	long *offs;		// Where each object starts
+	int nobjs;
+	int pages;
+	int maxcols;		// Widest line, from measuring
+	double size;		// Font size
+	int line, col;
+	int used[SPOOL_PDF_LINES];
+	char grid[SPOOL_PDF_LINES][SPOOL_PDF_MAXCOLS];
+};
+
+/* Objects 1-3 are the catalog, page tree and font, then each page's
+ * contents and page object
+ */
+static void alm_spool_pdfobj(struct spool_pdf_t *pdf, int num) {
+
+	if (num >= pdf->nobjs) {
+		pdf->nobjs = num + 64;
+		pdf->offs = realloc(pdf->offs, pdf->nobjs * sizeof(long));
+		if (!pdf->offs) {
+			perror("Allocating PDF");
+			exit(1);
+		}
+	}
+	pdf->offs[num] = ftell(pdf->fp);
+	fprintf(pdf->fp, "%d 0 obj\n", num);
+}
+
+/* Write out the page laid out so far */
+static void alm_spool_pdfpage(struct spool_pdf_t *pdf) {
+
+	char *content;
+	size_t clen;
+	FILE *cfp;
+	int line, col, num;
+
+	if (pdf->fp) {
+		cfp = open_memstream(&content, &clen);
+		if (!cfp) {
+			perror("Allocating PDF page");
+			exit(1);
+		}
+		fprintf(cfp, "BT\n/F1 %.2f Tf\n", pdf->size);
+		for (line=0; line<SPOOL_PDF_LINES; line++) {
+			if (!pdf->used[line])
+				continue;
+			fprintf(cfp, "1 0 0 1 %d %d Tm (", SPOOL_PDF_MARGIN,
+					SPOOL_PDF_HEIGHT - (line + 1) * SPOOL_PDF_LEADING + 3);
+			for (col=0; col<pdf->used[line]; col++) {
+				char c = pdf->grid[line][col];
+				if (c == '(' || c == ')' || c == '\\')
+					fputc('\\', cfp);
+				fputc(c, cfp);
+			}
+			fprintf(cfp, ") Tj\n");
+		}
+		fprintf(cfp, "ET\n");
+		fclose(cfp);
+
+		num = 4 + pdf->pages * 2;
+		alm_spool_pdfobj(pdf, num);
+		fprintf(pdf->fp, "<< /Length %zu >>\nstream\n", clen);
+		fwrite(content, 1, clen, pdf->fp);
+		fprintf(pdf->fp, "endstream\nendobj\n");
+		free(content);
+
+		alm_spool_pdfobj(pdf, num + 1);
+		fprintf(pdf->fp, "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %d %d] "
+				"/Resources << /Font << /F1 3 0 R >> >> /Contents %d 0 R >>\nendobj\n",
+				SPOOL_PDF_WIDTH, SPOOL_PDF_HEIGHT, num);
+	}
+
+	pdf->pages++;
+	pdf->line = 0;
+	pdf->col = 0;
+	memset(pdf->used, 0, sizeof(pdf->used));
+	memset(pdf->grid, ' ', sizeof(pdf->grid));
+}
+
+/* Run the text through the page layout, like a printer would */
+static void alm_spool_pdftext(struct spool_pdf_t *pdf, const uint8_t *text, size_t len) {
+
+	size_t i;
+	uint8_t c;
+
+	pdf->pages = 0;
+	pdf->line = 0;
+	pdf->col = 0;
+	memset(pdf->used, 0, sizeof(pdf->used));
+	memset(pdf->grid, ' ', sizeof(pdf->grid));
+
+	for (i=0; i<len; i++) {
+		c = text[i] & 0x7F;
+		if (c == '\r') {
+			// Overstrikes land on top of what's there
+			pdf->col = 0;
+		} else if (c == '\n') {
+			pdf->col = 0;
+			if (++pdf->line >= SPOOL_PDF_LINES)
+				alm_spool_pdfpage(pdf);
+		} else if (c == '\f') {
+			alm_spool_pdfpage(pdf);
+		} else if (c == '\t') {
+			pdf->col = (pdf->col / SPOOL_PDF_TAB + 1) * SPOOL_PDF_TAB;
+		} else if (c == '\b') {
+			if (pdf->col)
+				pdf->col--;
+		} else if (c >= ' ' && c < 0x7F) {
+			if (pdf->col < SPOOL_PDF_MAXCOLS) {
+				pdf->grid[pdf->line][pdf->col] = c;
+				if (pdf->col >= pdf->used[pdf->line])
+					pdf->used[pdf->line] = pdf->col + 1;
+			}
+			pdf->col++;
+			// What's past the grid is cut off, so doesn't shrink the font
+			if (pdf->col > pdf->maxcols && pdf->col <= SPOOL_PDF_MAXCOLS)
+				pdf->maxcols = pdf->col;
+		}
+	}
+
+	// The last page, unless the job ended on a page break
+	for (i=0; i<SPOOL_PDF_LINES && !pdf->used[i]; i++)
+		;
+	if (i < SPOOL_PDF_LINES || !pdf->pages)
+		alm_spool_pdfpage(pdf);
+}
+
+/* Lay out a job as a PDF in outname */
+static int alm_spool_pdf(const char *name, const char *outname) {
+
+	struct spool_pdf_t *pdf;
+	struct stat st;
+	uint8_t *text;
+	long xref;
+	int fd, i, width;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Spool: %s: %s\n", name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	text = malloc(st.st_size ? st.st_size : 1);
+	pdf = calloc(1, sizeof(struct spool_pdf_t));
+	if (!text || !pdf) {
+		perror("Allocating PDF");
+		exit(1);
+	}
+	if (read(fd, text, st.st_size) != st.st_size) {
+		printf("Spool: %s: %s\n", name, strerror(errno));
+		close(fd);
+		free(text);
+		free(pdf);
+		return -1;
+	}
+	close(fd);
+
+	// Measure first, so the widest line sets the font size
+	alm_spool_pdftext(pdf, text, st.st_size);
+	width = SPOOL_PDF_WIDTH - 2 * SPOOL_PDF_MARGIN;
+	pdf->size = SPOOL_PDF_FONTSIZE;
+	if (pdf->maxcols * 0.6 * pdf->size > width)
+		pdf->size = width / (pdf->maxcols * 0.6);
+
+	pdf->fp = fopen(outname, "we");
+	if (!pdf->fp) {
+		printf("Spool: %s: %s\n", outname, strerror(errno));
+		free(text);
+		free(pdf);
+		return -1;
+	}
+	fprintf(pdf->fp, "%%PDF-1.4\n");
+	alm_spool_pdftext(pdf, text, st.st_size);
+	free(text);
+
+	alm_spool_pdfobj(pdf, 1);
+	fprintf(pdf->fp, "<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+	alm_spool_pdfobj(pdf, 2);
+	fprintf(pdf->fp, "<< /Type /Pages /Count %d /Kids [", pdf->pages);
+	for (i=0; i<pdf->pages; i++)
+		fprintf(pdf->fp, " %d 0 R", 5 + i * 2);
+	fprintf(pdf->fp, " ] >>\nendobj\n");
+	alm_spool_pdfobj(pdf, 3);
+	fprintf(pdf->fp, "<< /Type /Font /Subtype /Type1 /BaseFont /Courier >>\nendobj\n");
+
+	xref = ftell(pdf->fp);
+	fprintf(pdf->fp, "xref\n0 %d\n0000000000 65535 f \n", 4 + pdf->pages * 2);
+	for (i=1; i<4 + pdf->pages * 2; i++)
+		fprintf(pdf->fp, "%010ld 00000 n \n", pdf->offs[i]);
+	fprintf(pdf->fp, "trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%ld\n%%%%EOF\n",
+			4 + pdf->pages * 2, xref);
+
+	i = ferror(pdf->fp);
+	if (fclose(pdf->fp) || i) {
+		printf("Spool: writing %s failed\n", outname);
+		i = -1;
+	}
+	free(pdf->offs);
+	free(pdf);
+
+	return i ? -1 : 0;
+}
+
+/* Name for a job's output in Output Dir, with a new suffix */
+static void alm_spool_outname(char *buf, const char *name, const char *suffix) {
+
+	const char *base = strrchr(name, '/');
+	size_t len;
+
+	base = base ? base + 1 : name;
+	len = strlen(base) - strlen(SPOOL_SUFFIX);
+	snprintf(buf, SPOOL_NAMELEN, "%s/%.*s%s", alm_spool_outdir, (int)len, base, suffix);
+}
+
+/* Print one job */
+static int alm_spool_print(struct spool_msg_t *msg) {
+
+	char outname[SPOOL_NAMELEN];
+	int retval = 0;
+
+	if (alm_spool_backend == SPOOL_FILE) {
+		alm_spool_outname(outname, msg->name, SPOOL_SUFFIX);
+		if (strcmp(outname, msg->name) && rename(msg->name, outname) < 0) {
+			printf("Spool: moving %s to %s: %s\n", msg->name, alm_spool_outdir, strerror(errno));
+			retval = -1;
+		}
+	} else if (alm_spool_backend == SPOOL_COMMAND) {
+		retval = alm_spool_runcmd(msg->name);
+	} else {
+		alm_spool_outname(outname, msg->name, ".pdf");
+		retval = alm_spool_pdf(msg->name, outname);
+	}
+
+	if (retval < 0) {
+		alm_spool_failed++;
+		return -1;
+	}
+	if (alm_spool_backend != SPOOL_FILE && !alm_spool_keep)
+		unlink(msg->name);
+	alm_spool_printed++;
+	if (alm_spool_backend == SPOOL_COMMAND)
+		printf("Port %d print job %s printed\n", msg->port, msg->name);
+	else
+		printf("Port %d print job in %s\n", msg->port, outname);
+
+	return 0;
+}
+
+/* Print jobs as they come down the pipe, until it's closed */
+static void *alm_spool_thread(void *arg) {
+
+	struct spool_msg_t msg;
+	ssize_t len;
+
+	do {
+		len = read(alm_spool_pipe[0], &msg, sizeof(msg));
+		if (len == sizeof(msg)) {
+			msg.name[SPOOL_NAMELEN-1] = 0;
+			alm_spool_print(&msg);
+		}
+	} while (len > 0 || (len < 0 && errno == EINTR));
+
+	return NULL;
+}
+
+int alm_spool_exit() {
+
+	int port;
+
+	if (alm_spool_running) {
+		// What's been printed so far still goes out
+		for (port=0; port<alm_spool_nports; port++) {
+			alm_spool_ports[port].opens = 0;
+			alm_spool_queue(port);
+		}
+		close(alm_spool_pipe[1]);
+		pthread_join(alm_spool_tid, NULL);
+		close(alm_spool_pipe[0]);
+	}
+
+	free(alm_spool_ports);
+
+	return alm_spool_init();
+}
+
+/* Can be called from signal handler */
+int alm_spool_printstats() {
+
+	struct spool_port_t *sp;
+	int port;
+
+	safe_print("Spooling: ");
+	if (!alm_spool_running) {
+		safe_print("off\n");
+		return 0;
+	}
+	safe_print((char *)alm_spool_backends[alm_spool_backend]);
+	safe_print(" backend, ");
+	safe_print_num((int)alm_spool_queued);
+	safe_print(" queued, ");
+	safe_print_num((int)alm_spool_printed);
+	safe_print(" printed, ");
+	safe_print_num((int)alm_spool_failed);
+	safe_print(" failed, ");
+	safe_print_num((int)alm_spool_dropped);
+	safe_print(" left in spool dir\n");
+
+	for (port=0; port<alm_spool_nports; port++) {
+		sp = &alm_spool_ports[port];
+		if (sp->fd < 0 && !sp->opens)
+			continue;
+		safe_print("Port ");
+		safe_print_num(port);
+		safe_print(": ");
+		safe_print_num(sp->opens);
+		safe_print(" open, ");
+		safe_print_num(sp->fd < 0 ? 0 : sp->recs);
+		safe_print(" records\n");
+	}
+
+	return 0;
+}
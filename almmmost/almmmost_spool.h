@@ -0,0 +1,106 @@
+/* almmmost_spool.h: Print spooler for Almmmost
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_SPOOL_H
+#define _ALMMMOST_SPOOL_H
+
+/* What happens to a finished job */
+#define SPOOL_FILE (0)		// Left as a text file in Output Dir
+#define SPOOL_COMMAND (1)	// Piped into Command
+#define SPOOL_PDF (2)		// Turned into a PDF in Output Dir
+
+#define SPOOL_NAMELEN (INPBUFSIZE + 64)
+#define SPOOL_SUFFIX ".txt"
+
+/* PDF pages are US letter, 66 lines of 6 per inch like a printer's form.
+ * The font shrinks so the longest line in the job fits between the margins.
+ */
+#define SPOOL_PDF_WIDTH (612)
+#define SPOOL_PDF_HEIGHT (792)
+#define SPOOL_PDF_MARGIN (18)
+#define SPOOL_PDF_LINES (66)
+#define SPOOL_PDF_LEADING (12)
+#define SPOOL_PDF_FONTSIZE (12)
+#define SPOOL_PDF_MAXCOLS (255)
+#define SPOOL_PDF_TAB (8)
+
+/* Print output a port is writing to spool.sys */
+struct spool_port_t {
+	int fd;			// Job being written, -1 if none
+	int opens;		// spool.sys opens on the port
+	int base;		// Record of spool.sys the job starts at
+	int recs;		// Records in the job
+	char tmpname[SPOOL_NAMELEN];	// Where it's written
+	char jobname[SPOOL_NAMELEN];	// Renamed to this when it's queued
+};
+
+/* A finished job, through the pipe to the spool thread */
+struct spool_msg_t {
+	int port;
+	char name[SPOOL_NAMELEN];
+};
+
+extern int alm_spool_backend;
+extern char alm_spool_dir[];
+extern char alm_spool_outdir[];
+extern char alm_spool_cmd[];
+extern int alm_spool_keep;
+
+/* Initialize variables */
+int alm_spool_init();
+
+/* Queue what ports have written, print everything queued and stop the thread */
+int alm_spool_exit();
+
+/* Size the per-port tables, once the number of ports is known */
+int alm_spool_setports(int ports);
+
+/* Process config file */
+int alm_spool_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Start the thread that prints jobs, if there's a Spool Dir */
+int alm_spool_start();
+
+/* spool.sys opened on port */
+int alm_spool_open(int port);
+
+/* Record pos of spool.sys written on port, starting a job if there isn't one */
+int alm_spool_write(int port, int pos, const uint8_t *buf);
+
+/* spool.sys closed on port, the job's queued once nothing has it open */
+/* Can be called from signal handler */
+int alm_spool_close(int port);
+
+/* End port's job and queue it, the next write starts another */
+/* Can be called from signal handler */
+int alm_spool_break(int port);
+
+/* Print jobs being written and how many have been printed */
+/* Can be called from signal handler */
+int alm_spool_printstats();
+
+#endif /* _ALMMMOST_SPOOL_H */
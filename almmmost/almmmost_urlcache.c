@@ -0,0 +1,506 @@
+/* almmmost_urlcache.c: The fetched URL content cache module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ini.h>
+
+#include "almmmost.h"
+#include "almmmost_urlcache.h"
+
+/* Every open of imgget.sys or lynxget.sys runs the whole CGI pipeline, and
+ * in a classroom a dozen terminals ask for the same page at once. Finished
+ * responses are kept here so repeats are served straight from memory.
+ *
+ * Entries live for alm_urlcache_ttl seconds, and the least recently used
+ * ones are thrown out to stay within alm_urlcache_size. With a Directory
+ * configured, each stored response is also written to disk, named by the
+ * FNV-1a hash of its key, so it survives eviction and restarts.
+ *
+ * Only GETs are kept. A POST can change things on the server, so it always
+ * goes to the network.
+ *
+ * The fetch thread stores responses while the main loop looks them up, so
+ * the table, LRU list and counts are only touched holding alm_urlcache_lock.
+ * Disk copies are read and written without it, so a slow disk never holds up
+ * the other thread; an entry being written out has a reference held.
+ */
+
+int alm_urlcache_size = URLCACHE_DEFAULT_SIZE * 1024;
+int alm_urlcache_ttl = URLCACHE_DEFAULT_TTL;
+char alm_urlcache_dir[INPBUFSIZE];
+struct urlcache_stats_t alm_urlcache_stats;
+
+pthread_mutex_t alm_urlcache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct urlcache_ent_t *alm_urlcache_hashtbl[URLCACHE_HASHSIZE];
+struct urlcache_ent_t *alm_urlcache_lru_head = NULL, *alm_urlcache_lru_tail = NULL;
+size_t alm_urlcache_used = 0;		// Bytes of keys and data linked in
+int alm_urlcache_nents = 0;
+
+int alm_urlcache_init() {
+
+	memset(alm_urlcache_hashtbl, 0, sizeof(alm_urlcache_hashtbl));
+	memset(&alm_urlcache_stats, 0, sizeof(alm_urlcache_stats));
+	alm_urlcache_lru_head = alm_urlcache_lru_tail = NULL;
+	alm_urlcache_used = 0;
+	alm_urlcache_nents = 0;
+	alm_urlcache_dir[0] = 0;
+
+	return 0;
+}
+
+int alm_urlcache_exit() {
+
+	pthread_mutex_lock(&alm_urlcache_lock);
+	while (alm_urlcache_lru_head) {
+		struct urlcache_ent_t *ent = alm_urlcache_lru_head;
+		alm_urlcache_unlink(ent);
+		if (!ent->refs)
+			alm_urlcache_free(ent);
+	}
+	pthread_mutex_unlock(&alm_urlcache_lock);
+
+	return 0;
+}
+
+int alm_urlcache_ini(struct INI *ini, const char *buf, size_t sectlen) {
+
+	int retval;
+
+	do {
+		const char *kbuf, *vbuf;
+		size_t keylen, vallen;
+
+		retval = ini_read_pair(ini, &kbuf, &keylen, &vbuf, &vallen);
+		if (!retval) {
+			break; /* End of section */
+		} else if (retval<0) {
+			printf("Error reading from INI: %d\n", retval);
+			break;
+		}
+
+		if (!strncasecmp(kbuf, "Size", 4)) {
+			// Memory budget in KB, 0 turns the cache off
+			alm_urlcache_size = strtol(vbuf, NULL, 0) * 1024;
+			if (alm_urlcache_size < 0)
+				alm_urlcache_size = 0;
+		} else if (!strncasecmp(kbuf, "TTL", 3)) {
+			alm_urlcache_ttl = strtol(vbuf, NULL, 0);
+		} else if (!strncasecmp(kbuf, "Directory", 9)) {
+			if (vallen >= INPBUFSIZE)
+				vallen = INPBUFSIZE - 1;
+			memcpy(alm_urlcache_dir, vbuf, vallen);
+			alm_urlcache_dir[vallen] = 0;
+		}
+	} while (1);
+
+	return 0;
+}
+
+/* Largest response worth holding on to, 0 if caching is off */
+size_t alm_urlcache_maxent() {
+
+	// Don't let one page push out everything else
+	return alm_urlcache_size / 4;
+}
+
+/* Key is handler and url, each with its terminating null */
+char *alm_urlcache_makekey(const char *handler, const char *url, size_t *keylen) {
+
+	size_t hlen = strlen(handler) + 1, ulen = strlen(url) + 1;
+	char *key;
+
+	key = malloc(hlen + ulen);
+	if (!key)
+		return NULL;
+	memcpy(key, handler, hlen);
+	memcpy(key + hlen, url, ulen);
+	*keylen = hlen + ulen;
+
+	return key;
+}
+
+/* 64 bit FNV-1a */
+uint64_t alm_urlcache_hash(const char *key, size_t keylen) {
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i=0; i<keylen; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+struct urlcache_ent_t *alm_urlcache_lookup(const char *key, size_t keylen, uint64_t hash) {
+
+	struct urlcache_ent_t *ent;
+
+	for (ent = alm_urlcache_hashtbl[hash % URLCACHE_HASHSIZE]; ent; ent = ent->hnext) {
+		if (ent->hash == hash && ent->keylen == keylen && !memcmp(ent->key, key, keylen))
+			return ent;
+	}
+
+	return NULL;
+}
+
+/* Add to the hash table and the front of the LRU list */
+int alm_urlcache_link(struct urlcache_ent_t *ent) {
+
+	int h = ent->hash % URLCACHE_HASHSIZE;
+
+	ent->hnext = alm_urlcache_hashtbl[h];
+	alm_urlcache_hashtbl[h] = ent;
+	ent->lru_prev = NULL;
+	ent->lru_next = alm_urlcache_lru_head;
+	if (alm_urlcache_lru_head)
+		alm_urlcache_lru_head->lru_prev = ent;
+	alm_urlcache_lru_head = ent;
+	if (!alm_urlcache_lru_tail)
+		alm_urlcache_lru_tail = ent;
+	ent->linked = 1;
+	alm_urlcache_used += ent->len + ent->keylen;
+	alm_urlcache_nents++;
+
+	return 0;
+}
+
+/* Take out of the hash table and LRU list, caller frees it if unreferenced */
+int alm_urlcache_unlink(struct urlcache_ent_t *ent) {
+
+	struct urlcache_ent_t **epp;
+
+	if (!ent->linked)
+		return 0;
+
+	for (epp = &alm_urlcache_hashtbl[ent->hash % URLCACHE_HASHSIZE]; *epp; epp = &((*epp)->hnext)) {
+		if (*epp == ent) {
+			*epp = ent->hnext;
+			break;
+		}
+	}
+	if (ent->lru_prev)
+		ent->lru_prev->lru_next = ent->lru_next;
+	else
+		alm_urlcache_lru_head = ent->lru_next;
+	if (ent->lru_next)
+		ent->lru_next->lru_prev = ent->lru_prev;
+	else
+		alm_urlcache_lru_tail = ent->lru_prev;
+	ent->hnext = ent->lru_prev = ent->lru_next = NULL;
+	ent->linked = 0;
+	alm_urlcache_used -= ent->len + ent->keylen;
+	alm_urlcache_nents--;
+
+	return 0;
+}
+
+/* Evict least recently used entries until need more bytes fit */
+int alm_urlcache_trim(size_t need) {
+
+	struct urlcache_ent_t *ent;
+
+	while (alm_urlcache_lru_tail && alm_urlcache_used + need > (size_t)alm_urlcache_size) {
+		ent = alm_urlcache_lru_tail;
+		alm_urlcache_unlink(ent);
+		if (!ent->refs)
+			alm_urlcache_free(ent);
+		alm_urlcache_stats.evictions++;
+	}
+
+	return 0;
+}
+
+int alm_urlcache_free(struct urlcache_ent_t *ent) {
+
+	free(ent->key);
+	free(ent->data);
+	free(ent);
+
+	return 0;
+}
+
+int alm_urlcache_filename(char *buf, size_t buflen, uint64_t hash) {
+
+	return snprintf(buf, buflen, "%s/%016llx.url", alm_urlcache_dir, (unsigned long long)hash);
+}
+
+/* Look up a fresh response, returns it with a reference held, or NULL */
+struct urlcache_ent_t *alm_urlcache_get(const char *handler, const char *url) {
+
+	struct urlcache_ent_t *ent, *old;
+	size_t keylen;
+	uint64_t hash;
+	char *key;
+
+	if (!alm_urlcache_maxent())
+		return NULL;
+
+	key = alm_urlcache_makekey(handler, url, &keylen);
+	if (!key)
+		return NULL;
+	hash = alm_urlcache_hash(key, keylen);
+
+	pthread_mutex_lock(&alm_urlcache_lock);
+	ent = alm_urlcache_lookup(key, keylen, hash);
+	if (ent && alm_urlcache_ttl > 0 && time(NULL) - ent->fetched >= alm_urlcache_ttl) {
+		// Stale, fetch it again
+		alm_urlcache_unlink(ent);
+		if (!ent->refs)
+			alm_urlcache_free(ent);
+		ent = NULL;
+		alm_urlcache_stats.expired++;
+	} else if (ent) {
+		// Move to the front of the LRU list
+		alm_urlcache_unlink(ent);
+		alm_urlcache_link(ent);
+		alm_urlcache_stats.hits++;
+	}
+	if (ent)
+		ent->refs++;
+	pthread_mutex_unlock(&alm_urlcache_lock);
+
+	if (!ent && alm_urlcache_dir[0]) {
+		// Try the disk copy, without holding the lock while reading it
+		ent = alm_urlcache_loadfile(key, keylen, hash);
+		pthread_mutex_lock(&alm_urlcache_lock);
+		if (ent) {
+			old = alm_urlcache_lookup(key, keylen, hash);
+			if (old) {
+				// Stored while we were reading, use that one
+				alm_urlcache_free(ent);
+				ent = old;
+				alm_urlcache_unlink(ent);
+			} else {
+				alm_urlcache_trim(ent->len + ent->keylen);
+				alm_urlcache_stats.diskhits++;
+			}
+			alm_urlcache_link(ent);
+			ent->refs++;
+		}
+		pthread_mutex_unlock(&alm_urlcache_lock);
+	}
+	if (!ent) {
+		pthread_mutex_lock(&alm_urlcache_lock);
+		alm_urlcache_stats.misses++;
+		pthread_mutex_unlock(&alm_urlcache_lock);
+	}
+
+	free(key);
+
+	return ent;
+}
+
+/* Store a response. Takes over data, which must come from malloc(). */
+int alm_urlcache_put(const char *handler, const char *url, uint8_t *data, size_t len) {
+
+	struct urlcache_ent_t *ent, *old;
+
+	if (len > alm_urlcache_maxent()) {
+		free(data);
+		return -1;
+	}
+
+	ent = calloc(sizeof(struct urlcache_ent_t), 1);
+	if (!ent) {
+		free(data);
+		return -1;
+	}
+	ent->key = alm_urlcache_makekey(handler, url, &ent->keylen);
+	if (!ent->key) {
+		free(data);
+		free(ent);
+		return -1;
+	}
+	ent->hash = alm_urlcache_hash(ent->key, ent->keylen);
+	ent->data = data;
+	ent->len = len;
+	ent->fetched = time(NULL);
+
+	pthread_mutex_lock(&alm_urlcache_lock);
+	// Replace any older copy
+	old = alm_urlcache_lookup(ent->key, ent->keylen, ent->hash);
+	if (old) {
+		alm_urlcache_unlink(old);
+		if (!old->refs)
+			alm_urlcache_free(old);
+	}
+	alm_urlcache_trim(ent->len + ent->keylen);
+	alm_urlcache_link(ent);
+	alm_urlcache_stats.stored++;
+	if (alm_urlcache_dir[0])
+		ent->refs++;
+	pthread_mutex_unlock(&alm_urlcache_lock);
+
+	// Write the disk copy without the lock, the reference keeps ent around
+	if (alm_urlcache_dir[0]) {
+		alm_urlcache_savefile(ent);
+		alm_urlcache_release(ent);
+	}
+
+	return 0;
+}
+
+/* Drop a reference from alm_urlcache_get() */
+int alm_urlcache_release(struct urlcache_ent_t *ent) {
+
+	if (!ent)
+		return 0;
+
+	pthread_mutex_lock(&alm_urlcache_lock);
+	ent->refs--;
+	if (!ent->refs && !ent->linked)
+		alm_urlcache_free(ent);
+	pthread_mutex_unlock(&alm_urlcache_lock);
+
+	return 0;
+}
+
+/* Read the disk copy of a response, if it's there and still fresh */
+struct urlcache_ent_t *alm_urlcache_loadfile(const char *key, size_t keylen, uint64_t hash) {
+
+	char fname[INPBUFSIZE+32];
+	struct urlcache_hdr_t hdr;
+	struct urlcache_ent_t *ent;
+	int fd;
+
+	alm_urlcache_filename(fname, sizeof(fname), hash);
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, URLCACHE_MAGIC, URLCACHE_MAGICLEN)
+			|| hdr.keylen != keylen || hdr.len > alm_urlcache_maxent()) {
+		close(fd);
+		return NULL;
+	}
+	if (alm_urlcache_ttl > 0 && time(NULL) - (time_t)hdr.fetched >= alm_urlcache_ttl) {
+		close(fd);
+		unlink(fname);
+		pthread_mutex_lock(&alm_urlcache_lock);
+		alm_urlcache_stats.expired++;
+		pthread_mutex_unlock(&alm_urlcache_lock);
+		return NULL;
+	}
+
+	ent = calloc(sizeof(struct urlcache_ent_t), 1);
+	if (!ent) {
+		close(fd);
+		return NULL;
+	}
+	ent->key = malloc(keylen);
+	ent->data = malloc(hdr.len ? hdr.len : 1);
+	if (!ent->key || !ent->data
+			|| read(fd, ent->key, keylen) != keylen
+			|| memcmp(ent->key, key, keylen)	// Hash collision
+			|| read(fd, ent->data, hdr.len) != hdr.len) {
+		close(fd);
+		alm_urlcache_free(ent);
+		return NULL;
+	}
+	close(fd);
+
+	ent->keylen = keylen;
+	ent->hash = hash;
+	ent->len = hdr.len;
+	ent->fetched = hdr.fetched;
+
+	return ent;
+}
+
+/* Write a response to disk, via a temporary file so readers never see half of one */
+int alm_urlcache_savefile(struct urlcache_ent_t *ent) {
+
+	char fname[INPBUFSIZE+32], tmpname[INPBUFSIZE+40];
+	struct urlcache_hdr_t hdr;
+	int fd, ok;
+
+	alm_urlcache_filename(fname, sizeof(fname), ent->hash);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		printf("Couldn't write URL cache file %s: %d\n", tmpname, errno);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, URLCACHE_MAGIC, URLCACHE_MAGICLEN);
+	hdr.fetched = ent->fetched;
+	hdr.keylen = ent->keylen;
+	hdr.len = ent->len;
+	ok = (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr))
+		&& (write(fd, ent->key, ent->keylen) == ent->keylen)
+		&& (write(fd, ent->data, ent->len) == ent->len);
+	close(fd);
+
+	if (!ok || rename(tmpname, fname) < 0) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Print cache statistics */
+/* Can be called from signal handler */
+int alm_urlcache_printstats() {
+
+	safe_print("URL cache: ");
+	safe_print_num(alm_urlcache_used / 1024);
+	safe_print("K used of ");
+	safe_print_num(alm_urlcache_size / 1024);
+	safe_print("K, ");
+	safe_print_num(alm_urlcache_nents);
+	safe_print(" entries, TTL ");
+	safe_print_num(alm_urlcache_ttl);
+	safe_print("s\nHits: "); safe_print_num(alm_urlcache_stats.hits);
+	safe_print(" Disk hits: "); safe_print_num(alm_urlcache_stats.diskhits);
+	safe_print(" Misses: "); safe_print_num(alm_urlcache_stats.misses);
+	safe_print(" Expired: "); safe_print_num(alm_urlcache_stats.expired);
+	safe_print("\nStored: "); safe_print_num(alm_urlcache_stats.stored);
+	safe_print(" Evictions: "); safe_print_num(alm_urlcache_stats.evictions);
+	if (alm_urlcache_dir[0]) {
+		safe_print("\nDirectory: ");
+		safe_print(alm_urlcache_dir);
+	}
+	safe_print("\n");
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/* almmmost_urlcache.h: The fetched URL content cache module for Almmmost.
+ *
+ * Almmmost is a modern replacement for the TeleVideo MmmOST network 
+ * operating system used on the TeleVideo TS-8xx Zilog Z80-based computers 
+ * from the early 1980s.
+ *
+ * This software uses the tvi_sdlc kernel module to interface with a
+ * Zilog Z85C30 chip for the hardware interface to the TeleVideo Z-80
+ * computers over an 800K baud RS-422 SDLC interface.
+ *
+ * Copyright (C) 2019 Patrick Finnegan <pat@vax11.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALMMMOST_URLCACHE_H
+#define _ALMMMOST_URLCACHE_H
+
+#define URLCACHE_HASHSIZE (256)
+#define URLCACHE_DEFAULT_SIZE (1024)	// KB
+#define URLCACHE_DEFAULT_TTL (300)	// Seconds
+#define URLCACHE_MAGIC "ALMURLC1"
+#define URLCACHE_MAGICLEN (8)
+
+/* A finished GET response, keyed by the special file that asked for it and
+ * the URL fetched. Entries are handed out with a reference held;
+ * an entry that's replaced or evicted while in use is freed on the last
+ * alm_urlcache_release().
+ */
+struct urlcache_ent_t {
+	char *key;
+	size_t keylen;
+	uint64_t hash;
+	uint8_t *data;
+	size_t len;
+	time_t fetched;
+	int refs;
+	int linked;			// Still in the hash table / LRU list
+	struct urlcache_ent_t *hnext;
+	struct urlcache_ent_t *lru_prev, *lru_next;	// Most recently used first
+};
+
+/* On disk copy, in <Directory>/<hash>.url: */
+struct urlcache_hdr_t {
+	char magic[URLCACHE_MAGICLEN];
+	uint64_t fetched;
+	uint32_t keylen;
+	uint32_t len;
+};
+
+struct urlcache_stats_t {
+	unsigned long hits;		// Served from memory
+	unsigned long diskhits;		// Loaded from the disk copy
+	unsigned long misses;
+	unsigned long expired;
+	unsigned long stored;
+	unsigned long evictions;
+};
+
+extern int alm_urlcache_size;		// Memory budget in bytes
+extern int alm_urlcache_ttl;		// Seconds
+extern char alm_urlcache_dir[];		// Disk copies go here, "" = memory only
+extern struct urlcache_stats_t alm_urlcache_stats;
+
+/* Initialize variables */
+int alm_urlcache_init();
+
+/* Free everything */
+int alm_urlcache_exit();
+
+/* Process config file */
+int alm_urlcache_ini(struct INI *ini, const char *buf, size_t sectlen);
+
+/* Largest response worth holding on to, 0 if caching is off */
+size_t alm_urlcache_maxent();
+
+/* Look up a fresh response, returns it with a reference held, or NULL */
+struct urlcache_ent_t *alm_urlcache_get(const char *handler, const char *url);
+
+/* Store a response. Takes over data, which must come from malloc(). */
+int alm_urlcache_put(const char *handler, const char *url, uint8_t *data, size_t len);
+
+/* Drop a reference from alm_urlcache_get() */
+int alm_urlcache_release(struct urlcache_ent_t *ent);
+
+/* Print cache statistics */
+/* Can be called from signal handler */
+int alm_urlcache_printstats();
+
+/* Internal functions */
+char *alm_urlcache_makekey(const char *handler, const char *url, size_t *keylen);
+uint64_t alm_urlcache_hash(const char *key, size_t keylen);
+struct urlcache_ent_t *alm_urlcache_lookup(const char *key, size_t keylen, uint64_t hash);
+int alm_urlcache_link(struct urlcache_ent_t *ent);
+int alm_urlcache_unlink(struct urlcache_ent_t *ent);
+int alm_urlcache_trim(size_t need);
+int alm_urlcache_free(struct urlcache_ent_t *ent);
+struct urlcache_ent_t *alm_urlcache_loadfile(const char *key, size_t keylen, uint64_t hash);
+int alm_urlcache_savefile(struct urlcache_ent_t *ent);
+int alm_urlcache_filename(char *buf, size_t buflen, uint64_t hash);
+
+#endif /* _ALMMMOST_URLCACHE_H */
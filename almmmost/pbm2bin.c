@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <alloca.h>
 
 #define BUFLEN (1024)
 char buffer[BUFLEN];
@@ -40,17 +41,54 @@ int height=0;
 #define RECSPERFIELD (38)
 #define RECSIZE (128)
 #define BYTESPERLINE (640/8)
+#define FIELDSIZE (RECSPERFIELD*RECSIZE)
+#define IMGSIZE (FIELDSIZE*4)
 
 #define LINE_OFF(row,field) ((row/4)*(BYTESPERLINE) + (field)*RECSPERFIELD*RECSIZE)
 
-void binary_pbm() {
+/* Delta stream (-d), played by GFXANIM.ZASM. Each frame is a list of
+ * commands against the previous frame (the first against a cleared screen):
+ *
+ *	HI LO N data[N]	Copy N bytes to video offset HI*256+LO
+ *	HI|80h LO N V	Fill N bytes at video offset HI*256+LO with V
+ *	FFh		End of frame, the rest of the record is padding
+ *
+ * N is 1-255. Video offsets are from the start of graphics RAM, where each
+ * field starts 2000h bytes after the last. Every frame starts on a record
+ * boundary, so the client can show it as soon as its last record arrives.
+ */
+#define FIELDBYTES ((240/4)*BYTESPERLINE)	// Bytes of each field on screen
+#define FIELDSTRIDE (0x2000)
+#define DELTA_RUN (0x80)
+#define DELTA_EOF (0xFF)
+#define DELTA_MAXLEN (255)
+#define DELTA_MINRUN (5)	// Shorter runs are cheaper as part of a copy
+#define DELTA_MAXGAP (3)	// Unchanged bytes cost less than a new command
+
+unsigned char *outbuf;
+int outlen;
+
+/* Read one binary PBM frame into imgbuf. Returns 1 if one was read, 0 at
+ * the end of the input, -1 on error.
+ */
+int binary_pbm(char *imgbuf) {
+
+	if (!fgets(buffer, BUFLEN, stdin))
+		return 0;
+	if (strncmp("P4", buffer, 2)) {
+		fprintf(stderr, "Not PBM file\n");
+		return -1;
+	}
+
+	width = 0;
+	height = 0;
 
 	/* Assume line 2 has width/height */
 	do {
 		char *nextptr=0;
 		if (!fgets(buffer, BUFLEN, stdin)) {
 			fprintf(stderr, "Failed to read width/height");
-			return;
+			return -1;
 		}
 		int tmp = strtoul(buffer, &nextptr, 10);
 		if (tmp > 0) {
@@ -69,59 +107,171 @@ void binary_pbm() {
 
 	int row;
 	char *rowbuf;
-	char *imgbuf;
 	int cwidth = (width+7)/8;
+	int copylen = (cwidth < BYTESPERLINE) ? cwidth : BYTESPERLINE;
 
-	imgbuf = alloca(RECSPERFIELD*RECSIZE*4);
 	rowbuf = alloca(cwidth);
 
-	if (!imgbuf || !rowbuf) {
+	if (!rowbuf) {
 		fprintf(stderr, "Could not allocate memory.\n");
-		return;
+		return -1;
 	}
 
-	memset(imgbuf, 0, RECSPERFIELD*RECSIZE*4);
+	memset(imgbuf, 0, IMGSIZE);
 
 	fprintf(stderr, "Width = %d, chars = %d, height = %d\n", width, cwidth, height);
 
-	if (height > 240)
-		height = 240;
-
-	for (row = 0; row < height; row+=4) {
+	/* Read every row, so the next frame starts in the right place, but
+	 * only keep the ones that fit on the screen.
+	 */
+	for (row = 0; row < height; row++) {
 		/* Debugging */
-		/* fprintf(stderr, "row %d: offset F1: %04x, F2: %04x, F3: %04x, F4: %04x\n", row, LINE_OFF(row,0), LINE_OFF(row,1), LINE_OFF(row,2), LINE_OFF(row,3)); */
-		fread(rowbuf, cwidth, 1, stdin);
-		memcpy(imgbuf + LINE_OFF(row,0), rowbuf, BYTESPERLINE);
-		if (fread(rowbuf, cwidth, 1, stdin))
-			memcpy(imgbuf + LINE_OFF(row,1), rowbuf, BYTESPERLINE);
-		else
-			break;
-		if (fread(rowbuf, cwidth, 1, stdin))
-			memcpy(imgbuf + LINE_OFF(row,2), rowbuf, BYTESPERLINE);
-		else
-			break;
-		if (fread(rowbuf, cwidth, 1, stdin))
-			memcpy(imgbuf + LINE_OFF(row,3), rowbuf, BYTESPERLINE);
-		else
+		/* fprintf(stderr, "row %d: offset %04x\n", row, LINE_OFF(row,row%4)); */
+		if (!fread(rowbuf, cwidth, 1, stdin))
 			break;
+		if (row < 240)
+			memcpy(imgbuf + LINE_OFF(row,row%4), rowbuf, copylen);
 	}
 
-	/* Write the whole buffer at once */
-	fwrite(imgbuf, RECSPERFIELD*RECSIZE*4, 1, stdout);
+	return 1;
 
-	return;
+}
 
+void delta_put(int c) {
+	outbuf[outlen++] = c;
+}
+
+/* Write a span of changed bytes, as fill commands for runs and copy commands
+ * for everything else.
+ */
+void delta_span(int off, const unsigned char *data, int len) {
+
+	int i = 0, lit = 0, run, n;
+
+	while (i <= len) {
+		run = 0;
+		if (i < len)
+			for (run = 1; i+run < len && data[i+run] == data[i]; run++)
+				;
+
+		if (i == len || run >= DELTA_MINRUN) {
+			/* Flush the bytes since the last run */
+			while (lit < i) {
+				n = (i - lit > DELTA_MAXLEN) ? DELTA_MAXLEN : i - lit;
+				delta_put((off + lit) >> 8);
+				delta_put((off + lit) & 0xFF);
+				delta_put(n);
+				memcpy(outbuf + outlen, data + lit, n);
+				outlen += n;
+				lit += n;
+			}
+			while (run > 0) {
+				n = (run > DELTA_MAXLEN) ? DELTA_MAXLEN : run;
+				delta_put(((off + i) >> 8) | DELTA_RUN);
+				delta_put((off + i) & 0xFF);
+				delta_put(n);
+				delta_put(data[i]);
+				i += n;
+				run -= n;
+			}
+			lit = i;
+			if (i == len)
+				break;
+		} else {
+			i++;
+		}
+	}
+}
+
+/* Write one frame of the delta stream, changing prev into cur */
+void delta_frame(const char *prev, const char *cur) {
+
+	const unsigned char *p, *c;
+	int field, a, b;
+
+	outlen = 0;
+
+	for (field = 0; field < 4; field++) {
+		p = (const unsigned char *)prev + field*FIELDSIZE;
+		c = (const unsigned char *)cur + field*FIELDSIZE;
+
+		for (a = 0; a < FIELDBYTES; a++) {
+			if (p[a] == c[a])
+				continue;
+
+			/* Take in any more changes close enough to be worth it */
+			b = a + 1;
+			while (b < FIELDBYTES) {
+				int next = b;
+				while (next < FIELDBYTES && next - b <= DELTA_MAXGAP && p[next] == c[next])
+					next++;
+				if (next >= FIELDBYTES || next - b > DELTA_MAXGAP)
+					break;
+				b = next + 1;
+			}
+
+			delta_span(field*FIELDSTRIDE + a, c + a, b - a);
+			a = b;
+		}
+	}
+
+	/* End the frame, and pad it out to a whole record */
+	delta_put(DELTA_EOF);
+	while (outlen % RECSIZE)
+		delta_put(DELTA_EOF);
+
+	fwrite(outbuf, outlen, 1, stdout);
+	fflush(stdout);
 }
 
 
 int main (int argc, char **argv) {
 
+	char *imgbuf, *prevbuf;
+	int frames = 0, retval;
+	size_t total = 0;
 
-	if (!fgets(buffer, BUFLEN, stdin) || strncmp("P4", buffer, 2)) {
-		fprintf(stderr, "Not PBM file\n");
+	imgbuf = malloc(IMGSIZE);
+	prevbuf = malloc(IMGSIZE);
+	if (!imgbuf || !prevbuf) {
+		fprintf(stderr, "Could not allocate memory.\n");
 		return 1;
 	}
 
-	binary_pbm();
+	if (argc < 2 || strcmp(argv[1], "-d")) {
+		retval = binary_pbm(imgbuf);
+		if (retval <= 0) {
+			if (!retval)
+				fprintf(stderr, "Not PBM file\n");
+			return 1;
+		}
+
+		/* Write the whole buffer at once */
+		fwrite(imgbuf, IMGSIZE, 1, stdout);
+		return 0;
+	}
+
+	/* Delta stream: any number of frames, each sent as changes to the
+	 * last one. The client clears the screen first.
+	 */
+	outbuf = malloc(IMGSIZE * 2);
+	if (!outbuf) {
+		fprintf(stderr, "Could not allocate memory.\n");
+		return 1;
+	}
+	memset(prevbuf, 0, IMGSIZE);
+
+	while ((retval = binary_pbm(imgbuf)) > 0) {
+		delta_frame(prevbuf, imgbuf);
+		memcpy(prevbuf, imgbuf, IMGSIZE);
+		frames++;
+		total += outlen;
+		fprintf(stderr, "Frame %d: %d bytes\n", frames, outlen);
+	}
+
+	if (retval < 0 || !frames)
+		return 1;
+
+	fprintf(stderr, "%d frames, %lu bytes\n", frames, (unsigned long)total);
 	return 0;
 }